@@ -38,7 +38,7 @@ function AddGLFW()
 end
 
 function AddSTB(isTarget)  
-    defines { "MODULE_STB", "STB_IMAGE_IMPLEMENTATION" }
+    defines { "MODULE_STB", "STB_IMAGE_IMPLEMENTATION", "STB_IMAGE_WRITE_IMPLEMENTATION" }
     includedirs {
         "$(SolutionDir)/ThirdParty/stb/include/",
     } 
@@ -35,14 +35,14 @@ workspace (ProjectName)
 	
 	filter { "configurations:Debug" }
 		runtime "Debug"
-		defines { "_DEBUG" }
+		defines { "_DEBUG", "TRACK_HEAP_ALLOCATIONS" }
 		symbols "On"
 		optimize "Off"
 		debugdir "$(SolutionDir)"
 
 	filter { "configurations:ReleaseWithDebugInfo" }
 		runtime "Release"
-		defines { "_RELEASE", "NDEBUG" }
+		defines { "_RELEASE", "NDEBUG", "TRACK_HEAP_ALLOCATIONS" }
 		symbols "On"
 		optimize "Full"
 		debugdir "$(SolutionDir)"
@@ -61,7 +61,7 @@ project (ProjectName)
 
 	AddSourceFiles(ProjectName)
 	includedirs { "$(ProjectDir)" }
-	IncludeModule {"Core"}
+	IncludeModule {"Core", "Renderer"}
 	
 	pchheader ("Core.h")
 	pchsource ("../" .. ProjectName .. "/Source/Core/Private/Core.cpp")
@@ -0,0 +1,235 @@
+#include "FrameLatencyTrace.h"
+
+#include <iomanip>
+
+namespace
+{
+    const char* MARKER_NAMES[] =
+    {
+        "poll_events", "simulation_start", "simulation_end", "frame_wait_start", "frame_wait_end", "acquire_start", "acquire_end",
+        "record_start", "record_end", "submit_start", "submit_end", "present_start", "present_end", "gpu_start", "gpu_end"
+    };
+    static_assert(std::size(MARKER_NAMES) == static_cast<size_t>(FrameMarker::Count), "Every frame marker needs a name");
+
+    // Phases of a frame, each between two markers. These are the spans in the Chrome trace and the averages of the summary.
+    struct Phase
+    {
+        const char* name;
+        FrameMarker start;
+        FrameMarker end;
+        uint32_t thread_id;     // Track in the Chrome trace
+    };
+
+    const uint32_t MAIN_THREAD_ID = 0;
+    const uint32_t RENDER_THREAD_ID = 1;
+    const uint32_t GPU_THREAD_ID = 2;
+
+    const Phase PHASES[] =
+    {
+        { "Simulate", FrameMarker::SimulationStart, FrameMarker::SimulationEnd, MAIN_THREAD_ID },
+        { "Wait for frame", FrameMarker::FrameWaitStart, FrameMarker::FrameWaitEnd, RENDER_THREAD_ID },
+        { "Acquire", FrameMarker::AcquireStart, FrameMarker::AcquireEnd, RENDER_THREAD_ID },
+        { "Record", FrameMarker::RecordStart, FrameMarker::RecordEnd, RENDER_THREAD_ID },
+        { "Submit", FrameMarker::SubmitStart, FrameMarker::SubmitEnd, RENDER_THREAD_ID },
+        { "Present", FrameMarker::PresentStart, FrameMarker::PresentEnd, RENDER_THREAD_ID },
+        { "GPU", FrameMarker::GpuStart, FrameMarker::GpuEnd, GPU_THREAD_ID },
+        { "Input to present", FrameMarker::PollEvents, FrameMarker::PresentEnd, MAIN_THREAD_ID },
+    };
+
+    bool IsGpuMarker(FrameMarker marker)
+    {
+        return marker == FrameMarker::GpuStart || marker == FrameMarker::GpuEnd;
+    }
+
+    double ToMs(uint64_t ns)
+    {
+        return static_cast<double>(ns) / 1000000.0;
+    }
+}
+
+void FrameLatencyTrace::Init(uint32_t capacity, std::chrono::steady_clock::time_point start_time)
+{
+    records_.resize(capacity);
+    num_frames_ = 0;
+    start_time_ = start_time;
+}
+
+void FrameLatencyTrace::BeginFrame(uint64_t frame_number)
+{
+    if (IsEnabled() == false)
+    {
+        return;
+    }
+
+    FrameRecord& record = records_[num_frames_ % records_.size()];
+    record.frame_number = frame_number;
+    record.times_ns.fill(NOT_RECORDED);
+    num_frames_++;
+}
+
+void FrameLatencyTrace::Mark(FrameMarker marker, std::chrono::steady_clock::time_point time)
+{
+    if (IsEnabled() == false || num_frames_ == 0)
+    {
+        return;
+    }
+
+    // Clamped, the main thread may have sampled the input of the first frame right before the trace started.
+    int64_t time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time - start_time_).count();
+    records_[(num_frames_ - 1) % records_.size()].times_ns[static_cast<size_t>(marker)] = static_cast<uint64_t>(std::max<int64_t>(time_ns, 0));
+}
+
+void FrameLatencyTrace::SetGpuTimestamps(uint64_t frame_number, uint64_t gpu_start_ns, uint64_t gpu_end_ns)
+{
+    if (IsEnabled() == false)
+    {
+        return;
+    }
+
+    // Usually the frame is only a few records back, one per frame in flight.
+    uint64_t num_records = std::min<uint64_t>(num_frames_, records_.size());
+    for (uint64_t i = 1; i <= num_records; i++)
+    {
+        FrameRecord& record = records_[(num_frames_ - i) % records_.size()];
+        if (record.frame_number == frame_number)
+        {
+            record.times_ns[static_cast<size_t>(FrameMarker::GpuStart)] = gpu_start_ns;
+            record.times_ns[static_cast<size_t>(FrameMarker::GpuEnd)] = gpu_end_ns;
+            return;
+        }
+    }
+}
+
+uint64_t FrameLatencyTrace::GetTime(const FrameRecord& record, FrameMarker marker, int64_t gpu_clock_offset_ns) const
+{
+    uint64_t time_ns = record.times_ns[static_cast<size_t>(marker)];
+    if (time_ns == NOT_RECORDED || IsGpuMarker(marker) == false)
+    {
+        return time_ns;
+    }
+
+    // Without a single frame to estimate the offset from, the GPU times can't be placed on the CPU timeline.
+    if (gpu_clock_offset_ns == INT64_MIN)
+    {
+        return NOT_RECORDED;
+    }
+
+    return static_cast<uint64_t>(std::max<int64_t>(static_cast<int64_t>(time_ns) + gpu_clock_offset_ns, 0));
+}
+
+int64_t FrameLatencyTrace::EstimateGpuClockOffset() const
+{
+    int64_t offset_ns = INT64_MIN;
+    ForEachRecord([&offset_ns](const FrameRecord& record)
+    {
+        uint64_t submit_ns = record.times_ns[static_cast<size_t>(FrameMarker::SubmitStart)];
+        uint64_t gpu_start_ns = record.times_ns[static_cast<size_t>(FrameMarker::GpuStart)];
+        if (submit_ns != NOT_RECORDED && gpu_start_ns != NOT_RECORDED)
+        {
+            offset_ns = std::max(offset_ns, static_cast<int64_t>(submit_ns) - static_cast<int64_t>(gpu_start_ns));
+        }
+    });
+
+    return offset_ns;
+}
+
+void FrameLatencyTrace::WriteCsv(const std::string& path) const
+{
+    std::ofstream file(path);
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Failed to open file: " + path);
+    }
+
+    // The default format only keeps 6 significant digits, which isn't even a ms after a few minutes. -> Fixed point with us resolution.
+    file << std::fixed << std::setprecision(3);
+
+    file << "frame";
+    for (const char* marker_name : MARKER_NAMES)
+    {
+        file << "," << marker_name << "_ms";
+    }
+    file << "\n";
+
+    int64_t gpu_clock_offset_ns = EstimateGpuClockOffset();
+    ForEachRecord([this, &file, gpu_clock_offset_ns](const FrameRecord& record)
+    {
+        file << record.frame_number;
+        for (size_t i = 0; i < static_cast<size_t>(FrameMarker::Count); i++)
+        {
+            file << ",";
+            uint64_t time_ns = GetTime(record, static_cast<FrameMarker>(i), gpu_clock_offset_ns);
+            if (time_ns != NOT_RECORDED)
+            {
+                file << ToMs(time_ns);
+            }
+        }
+        file << "\n";
+    });
+}
+
+void FrameLatencyTrace::WriteChromeTrace(const std::string& path) const
+{
+    std::ofstream file(path);
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Failed to open file: " + path);
+    }
+
+    // Complete events ("ph": "X") with start and duration in microseconds. "Input to present" overlaps everything else, so it gets a track of its own.
+    // Fixed point with ns resolution, the default format would round long traces to whole ms.
+    file << std::fixed << std::setprecision(3);
+    file << "{\n  \"displayTimeUnit\": \"ms\",\n  \"traceEvents\": [\n";
+    file << "    { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << MAIN_THREAD_ID << ", \"args\": { \"name\": \"Main thread\" } },\n";
+    file << "    { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << RENDER_THREAD_ID << ", \"args\": { \"name\": \"Render thread\" } },\n";
+    file << "    { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << GPU_THREAD_ID << ", \"args\": { \"name\": \"GPU\" } },\n";
+    file << "    { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << GPU_THREAD_ID + 1 << ", \"args\": { \"name\": \"Latency\" } }";
+
+    int64_t gpu_clock_offset_ns = EstimateGpuClockOffset();
+    ForEachRecord([this, &file, gpu_clock_offset_ns](const FrameRecord& record)
+    {
+        for (const Phase& phase : PHASES)
+        {
+            uint64_t start_ns = GetTime(record, phase.start, gpu_clock_offset_ns);
+            uint64_t end_ns = GetTime(record, phase.end, gpu_clock_offset_ns);
+            if (start_ns == NOT_RECORDED || end_ns == NOT_RECORDED || end_ns < start_ns)
+            {
+                continue;
+            }
+
+            uint32_t thread_id = phase.start == FrameMarker::PollEvents ? GPU_THREAD_ID + 1 : phase.thread_id;
+            file << ",\n    { \"name\": \"" << phase.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << thread_id
+                << ", \"ts\": " << static_cast<double>(start_ns) / 1000.0 << ", \"dur\": " << static_cast<double>(end_ns - start_ns) / 1000.0
+                << ", \"args\": { \"frame\": " << record.frame_number << " } }";
+        }
+    });
+
+    file << "\n  ]\n}\n";
+}
+
+void FrameLatencyTrace::PrintSummary(std::ostream& stream) const
+{
+    stream << "Frame latency (mean of the last " << std::min<uint64_t>(num_frames_, records_.size()) << " frames):";
+    for (const Phase& phase : PHASES)
+    {
+        uint64_t total_ns = 0;
+        uint64_t num_samples = 0;
+        ForEachRecord([&phase, &total_ns, &num_samples](const FrameRecord& record)
+        {
+            // Durations don't depend on the clock offset, so the GPU phase is available even if we couldn't estimate it.
+            uint64_t start_ns = record.times_ns[static_cast<size_t>(phase.start)];
+            uint64_t end_ns = record.times_ns[static_cast<size_t>(phase.end)];
+            if (start_ns != NOT_RECORDED && end_ns != NOT_RECORDED && end_ns >= start_ns)
+            {
+                total_ns += end_ns - start_ns;
+                num_samples++;
+            }
+        });
+
+        if (num_samples > 0)
+        {
+            stream << " | " << phase.name << " " << ToMs(total_ns / num_samples) << " ms";
+        }
+    }
+    stream << std::endl;
+}
@@ -0,0 +1,46 @@
+#include "FrameTimeStats.h"
+
+#include <cmath>
+
+namespace
+{
+    // Nearest rank method: The smallest sample that is greater than or equal to the given fraction of all samples.
+    double GetPercentile(const std::vector<double>& sorted_samples, double fraction)
+    {
+        size_t rank = static_cast<size_t>(std::ceil(fraction * sorted_samples.size()));
+        return sorted_samples[std::clamp<size_t>(rank, 1, sorted_samples.size()) - 1];
+    }
+}
+
+FrameTimeSummary FrameTimeStats::Summarize() const
+{
+    FrameTimeSummary summary;
+    if (samples_ms_.empty())
+    {
+        return summary;
+    }
+
+    std::vector<double> sorted_samples = samples_ms_;
+    std::sort(sorted_samples.begin(), sorted_samples.end());
+
+    double total_ms = 0.0;
+    for (double sample : sorted_samples)
+    {
+        total_ms += sample;
+    }
+
+    summary.num_samples = sorted_samples.size();
+    summary.mean_ms = total_ms / sorted_samples.size();
+    summary.p50_ms = GetPercentile(sorted_samples, 0.50);
+    summary.p95_ms = GetPercentile(sorted_samples, 0.95);
+    summary.p99_ms = GetPercentile(sorted_samples, 0.99);
+    summary.max_ms = sorted_samples.back();
+    return summary;
+}
+
+void FrameTimeStats::WriteJson(std::ostream& stream) const
+{
+    FrameTimeSummary summary = Summarize();
+    stream << "{ \"frames\": " << summary.num_samples << ", \"mean_ms\": " << summary.mean_ms << ", \"p50_ms\": " << summary.p50_ms
+        << ", \"p95_ms\": " << summary.p95_ms << ", \"p99_ms\": " << summary.p99_ms << ", \"max_ms\": " << summary.max_ms << " }";
+}
@@ -0,0 +1,58 @@
+#include "HeapAllocationCounter.h"
+
+#include <atomic>
+#include <new>
+
+namespace
+{
+    std::atomic<uint64_t> num_allocations = 0;
+    std::atomic<uint64_t> num_allocated_bytes = 0;
+}
+
+#ifdef TRACK_HEAP_ALLOCATIONS
+// Replacements of the global operator new / delete.
+// The default implementations of the array and nothrow versions forward to these, so they are counted as well.
+void* operator new(size_t size)
+{
+    num_allocations.fetch_add(1, std::memory_order_relaxed);
+    num_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+
+    // new with size 0 has to return a unique pointer
+    void* memory = std::malloc(size > 0 ? size : 1);
+    if (memory == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    return memory;
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept   // Sized version, we don't need the size to free
+{
+    std::free(memory);
+}
+#endif
+
+bool HeapAllocationCounter::IsEnabled()
+{
+#ifdef TRACK_HEAP_ALLOCATIONS
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint64_t HeapAllocationCounter::GetNumAllocations()
+{
+    return num_allocations.load(std::memory_order_relaxed);
+}
+
+uint64_t HeapAllocationCounter::GetNumAllocatedBytes()
+{
+    return num_allocated_bytes.load(std::memory_order_relaxed);
+}
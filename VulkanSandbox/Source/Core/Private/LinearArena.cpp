@@ -0,0 +1,62 @@
+#include "LinearArena.h"
+
+LinearArena::LinearArena(size_t capacity)
+    : capacity_(capacity)
+{
+    // We go through operator new on purpose, so growing the arena shows up in the HeapAllocationCounter.
+    buffer_ = static_cast<std::byte*>(::operator new(capacity_));
+}
+
+LinearArena::~LinearArena()
+{
+    for (void* chunk : overflow_chunks_)
+    {
+        ::operator delete(chunk);
+    }
+
+    ::operator delete(buffer_);
+}
+
+void* LinearArena::Allocate(size_t size, size_t alignment)
+{
+    // Alignments are always powers of two
+    size_t aligned_offset = (offset_ + alignment - 1) & ~(alignment - 1);
+    if (aligned_offset + size <= capacity_)
+    {
+        offset_ = aligned_offset + size;
+        peak_bytes_ = std::max(peak_bytes_, GetUsedBytes());
+        return buffer_ + aligned_offset;
+    }
+
+    // Doesn't fit anymore. Serve the allocation from the heap for now and remember that we need more space.
+    // operator new guarantees alignof(std::max_align_t), for anything above that we over-allocate and align ourselves.
+    size_t chunk_size = size + (alignment > alignof(std::max_align_t) ? alignment : 0);
+    void* chunk = ::operator new(chunk_size);
+    overflow_chunks_.push_back(chunk);
+    overflow_bytes_ += chunk_size;
+    peak_bytes_ = std::max(peak_bytes_, GetUsedBytes());
+
+    uintptr_t aligned_address = (reinterpret_cast<uintptr_t>(chunk) + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1);
+    return reinterpret_cast<void*>(aligned_address);
+}
+
+void LinearArena::Reset()
+{
+    for (void* chunk : overflow_chunks_)
+    {
+        ::operator delete(chunk);
+    }
+
+    bool has_overflowed = overflow_chunks_.empty() == false;
+    overflow_chunks_.clear();
+    overflow_bytes_ = 0;
+    offset_ = 0;
+
+    if (has_overflowed)
+    {
+        // Grow to the peak plus some headroom, so the next frames fit without any overflow.
+        ::operator delete(buffer_);
+        capacity_ = peak_bytes_ + peak_bytes_ / 2;
+        buffer_ = static_cast<std::byte*>(::operator new(capacity_));
+    }
+}
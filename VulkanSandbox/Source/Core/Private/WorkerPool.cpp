@@ -0,0 +1,138 @@
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(uint32_t num_workers)
+{
+    workers_.reserve(num_workers);
+    for (uint32_t i = 0; i < num_workers; i++)
+    {
+        workers_.emplace_back([this]() { WorkerLoop(); });
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        is_shutting_down_ = true;
+    }
+    job_available_.notify_all();
+
+    for (std::thread& worker : workers_)
+    {
+        worker.join();
+    }
+}
+
+void WorkerPool::RunTasks(uint32_t num_tasks, TaskFunction function, void* context)
+{
+    if (num_tasks == 0)
+    {
+        return;
+    }
+
+    Job job;
+    job.function = function;
+    job.context = context;
+    job.num_tasks = num_tasks;
+
+    // Without workers (or with a single task) there's no point in waking anybody up.
+    if (workers_.empty() || num_tasks == 1)
+    {
+        for (uint32_t task_index = 0; task_index < num_tasks; task_index++)
+        {
+            function(context, task_index);
+        }
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        // A worker that woke up late for the previous job may still hold on to it. It won't find any task left, but it must not
+        // grab tasks of the new job with the old function either.
+        job_done_.wait(lock, [this]() { return num_active_workers_ == 0; });
+
+        job_ = job;
+        next_task_.store(0);
+        num_completed_tasks_.store(0);
+        job_generation_++;
+    }
+    job_available_.notify_all();
+
+    // Help out instead of just waiting.
+    ExecuteTasks(job);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_done_.wait(lock, [this, num_tasks]() { return num_completed_tasks_.load() == num_tasks; });
+
+    if (task_exception_)
+    {
+        std::exception_ptr exception = task_exception_;
+        task_exception_ = nullptr;
+        lock.unlock();
+        std::rethrow_exception(exception);
+    }
+}
+
+void WorkerPool::WorkerLoop()
+{
+    uint64_t last_generation = 0;
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            job_available_.wait(lock, [this, last_generation]() { return is_shutting_down_ || job_generation_ != last_generation; });
+
+            if (is_shutting_down_)
+            {
+                return;
+            }
+
+            last_generation = job_generation_;
+            job = job_;
+            num_active_workers_++;
+        }
+
+        ExecuteTasks(job);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            num_active_workers_--;
+        }
+        job_done_.notify_all();
+    }
+}
+
+void WorkerPool::ExecuteTasks(const Job& job)
+{
+    while (true)
+    {
+        uint32_t task_index = next_task_.fetch_add(1);
+        if (task_index >= job.num_tasks)
+        {
+            return;
+        }
+
+        try
+        {
+            job.function(job.context, task_index);
+        }
+        catch (...)
+        {
+            // Still counts as completed below, otherwise RunTasks() would wait forever.
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!task_exception_)
+            {
+                task_exception_ = std::current_exception();
+            }
+        }
+
+        if (num_completed_tasks_.fetch_add(1) + 1 == job.num_tasks)
+        {
+            // Lock before notifying, otherwise the caller could check the condition right before we increment and miss the notification.
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_done_.notify_all();
+        }
+    }
+}
@@ -1,8 +1,12 @@
 #include <algorithm>
 #include <array>
+#include <bit>
+#include <climits>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <optional>
 #include <set>
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+// Points in time of a frame's life, from sampling the input on the main thread until the GPU is done with it.
+enum class FrameMarker : uint8_t
+{
+    PollEvents,         // Main thread: Input has been sampled
+    SimulationStart,    // Main thread: Start building the frame packet
+    SimulationEnd,
+    FrameWaitStart,     // Render thread: Waiting for the frame in flight that used the same slot
+    FrameWaitEnd,
+    AcquireStart,       // Waiting for a swap chain image
+    AcquireEnd,
+    RecordStart,
+    RecordEnd,
+    SubmitStart,        // vkQueueSubmit2
+    SubmitEnd,
+    PresentStart,       // vkQueuePresentKHR
+    PresentEnd,
+    GpuStart,           // Timestamp queries, converted to the CPU clock when exporting
+    GpuEnd,
+    Count
+};
+
+// Records per frame timestamps in a fixed size ring, so we can see where the time of a frame goes: Is it CPU bound, GPU bound,
+// or throttled by waiting for a frame in flight or a swap chain image? The last frames can be exported as CSV or as a Chrome trace (chrome://tracing, Perfetto).
+//
+// Only the render thread may call Begin/Mark/SetGpuTimestamps. Times of the main thread travel in the frame packet and are passed in explicitly.
+// Recording never allocates.
+//
+// The GPU timestamps use their own clock. To put them onto the CPU timeline we use that the GPU can't start a frame before it has been submitted:
+// gpu_start + offset >= submit_start for every frame. The largest of these lower bounds is our offset. It's exact for frames the GPU started right away,
+// i.e. whenever the GPU has been idle, which happens often enough unless we're GPU bound all the time.
+class FrameLatencyTrace
+{
+public:
+    // capacity == 0 disables the trace.
+    void Init(uint32_t capacity, std::chrono::steady_clock::time_point start_time);
+
+    bool IsEnabled() const { return records_.empty() == false; }
+
+    // Starts the record of a new frame. Overwrites the oldest one once the ring is full.
+    void BeginFrame(uint64_t frame_number);
+
+    // Takes the current time. Doesn't even read the clock if the trace is disabled.
+    void Mark(FrameMarker marker)
+    {
+        if (IsEnabled())
+        {
+            Mark(marker, std::chrono::steady_clock::now());
+        }
+    }
+    void Mark(FrameMarker marker, std::chrono::steady_clock::time_point time);
+
+    // GPU results arrive a few frames later, once the frame is complete. Ignored if the frame has been overwritten already.
+    void SetGpuTimestamps(uint64_t frame_number, uint64_t gpu_start_ns, uint64_t gpu_end_ns);
+
+    // One row per frame, times in ms since the start of the trace. Empty cells for markers a frame didn't reach, e.g. because the swap chain was out of date.
+    void WriteCsv(const std::string& path) const;
+
+    // Chrome trace event format. One track per thread plus one for the GPU.
+    void WriteChromeTrace(const std::string& path) const;
+
+    // Average durations of the phases, to tell at a glance where the time goes.
+    void PrintSummary(std::ostream& stream) const;
+
+private:
+    static constexpr uint64_t NOT_RECORDED = UINT64_MAX;
+
+    struct FrameRecord
+    {
+        uint64_t frame_number = 0;
+        std::array<uint64_t, static_cast<size_t>(FrameMarker::Count)> times_ns;    // CPU markers relative to the start time, GPU markers in the GPU's clock
+    };
+
+    // Oldest first
+    template<typename Function>
+    void ForEachRecord(Function&& function) const
+    {
+        uint64_t num_records = std::min<uint64_t>(num_frames_, records_.size());
+        for (uint64_t i = num_frames_ - num_records; i < num_frames_; i++)
+        {
+            function(records_[i % records_.size()]);
+        }
+    }
+
+    // Time of the marker in ns since the start time, with the GPU markers moved to the CPU clock. NOT_RECORDED if the frame doesn't have it.
+    uint64_t GetTime(const FrameRecord& record, FrameMarker marker, int64_t gpu_clock_offset_ns) const;
+    int64_t EstimateGpuClockOffset() const;
+
+    std::vector<FrameRecord> records_;
+    uint64_t num_frames_ = 0;   // Frames begun in total, the newest record is at (num_frames_ - 1) % capacity
+    std::chrono::steady_clock::time_point start_time_;
+};
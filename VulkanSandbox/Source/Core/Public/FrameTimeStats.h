@@ -0,0 +1,34 @@
+#pragma once
+
+struct FrameTimeSummary
+{
+    uint64_t num_samples = 0;
+    double mean_ms = 0.0;
+    double p50_ms = 0.0;
+    double p95_ms = 0.0;
+    double p99_ms = 0.0;
+    double max_ms = 0.0;
+};
+
+// Collects one time per frame and summarizes them for benchmark reports.
+// Averages hide stutter, so we also report percentiles: p99 is the time 99% of all frames stay below.
+class FrameTimeStats
+{
+public:
+    // Reserve space for the expected number of frames up front, so adding samples doesn't allocate while we measure.
+    void Reserve(size_t num_samples) { samples_ms_.reserve(num_samples); }
+
+    void Add(double ms) { samples_ms_.push_back(ms); }
+    void Clear() { samples_ms_.clear(); }
+
+    bool IsEmpty() const { return samples_ms_.empty(); }
+
+    // Sorts a copy of the samples, so only call this once the measurement is done.
+    FrameTimeSummary Summarize() const;
+
+    // Writes the summary as a JSON object, e.g. { "frames": 1000, "mean_ms": 16.6, ... }
+    void WriteJson(std::ostream& stream) const;
+
+private:
+    std::vector<double> samples_ms_;
+};
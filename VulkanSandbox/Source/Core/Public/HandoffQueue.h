@@ -0,0 +1,109 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+
+// Bounded queue to hand data from one producer thread to one consumer thread, e.g. frame packets from the main thread to the render thread.
+// The slots are created once in Init() and reused: The producer fills a slot in place and the consumer reads it in place.
+// With types that keep their capacity (like a std::vector after clear()) nothing is allocated anymore once every slot has been used.
+//
+// If all slots are taken, the producer blocks until the consumer releases one. That bounds how far the producer can run ahead,
+// so every slot adds to the latency between producing and consuming.
+// The slot the consumer is currently reading still counts as taken -> With a capacity of 2 the producer fills slot N+1 while slot N is consumed.
+template<typename T>
+class HandoffQueue
+{
+public:
+    void Init(uint32_t capacity)
+    {
+        slots_.resize(capacity);
+        read_index_ = 0;
+        num_filled_slots_ = 0;
+        is_closed_ = false;
+    }
+
+    // Returns the next free slot. Blocks while all slots are taken. Returns nullptr once the queue has been closed.
+    T* BeginWrite()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (num_filled_slots_ == slots_.size() && is_closed_ == false)
+        {
+            num_producer_waits_++;
+            slot_released_.wait(lock, [this]() { return is_closed_ || num_filled_slots_ < slots_.size(); });
+        }
+
+        if (is_closed_)
+        {
+            return nullptr;
+        }
+
+        return &slots_[(read_index_ + num_filled_slots_) % slots_.size()];
+    }
+
+    // Hands the slot returned by BeginWrite() over to the consumer.
+    void EndWrite()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            num_filled_slots_++;
+        }
+        slot_filled_.notify_one();
+    }
+
+    // Returns the oldest filled slot. Blocks while there is none. Returns nullptr once the queue has been closed and all filled slots have been read.
+    T* BeginRead()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (num_filled_slots_ == 0 && is_closed_ == false)
+        {
+            num_consumer_waits_++;
+            slot_filled_.wait(lock, [this]() { return is_closed_ || num_filled_slots_ > 0; });
+        }
+
+        if (num_filled_slots_ == 0)
+        {
+            return nullptr;
+        }
+
+        return &slots_[read_index_];
+    }
+
+    // Gives the slot returned by BeginRead() back to the producer.
+    void EndRead()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            read_index_ = (read_index_ + 1) % slots_.size();
+            num_filled_slots_--;
+        }
+        slot_released_.notify_one();
+    }
+
+    // Wakes up both sides. The producer can't write anymore, but the consumer still gets the slots that have been filled already.
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            is_closed_ = true;
+        }
+        slot_filled_.notify_all();
+        slot_released_.notify_all();
+    }
+
+    // How often one side had to wait for the other. Tells us which of the two threads is the bottleneck.
+    uint64_t GetNumProducerWaits() const { return num_producer_waits_; }
+    uint64_t GetNumConsumerWaits() const { return num_consumer_waits_; }
+
+private:
+    std::vector<T> slots_;
+    size_t read_index_ = 0;
+    size_t num_filled_slots_ = 0;   // Includes the slot that is being read, but not the one that is being written
+    bool is_closed_ = false;
+
+    std::mutex mutex_;
+    std::condition_variable slot_filled_;
+    std::condition_variable slot_released_;
+
+    uint64_t num_producer_waits_ = 0;
+    uint64_t num_consumer_waits_ = 0;
+};
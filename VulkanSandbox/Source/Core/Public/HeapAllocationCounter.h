@@ -0,0 +1,13 @@
+#pragma once
+
+// Counts calls to the global operator new, so we can verify that hot code paths like the frame loop don't touch the general purpose heap.
+// Replacing the global operator new affects the whole program, so counting is only compiled in if TRACK_HEAP_ALLOCATIONS is defined.
+// Otherwise all counters stay 0.
+// NOTE: Direct calls to malloc (e.g. from C libraries or our driver host allocation callbacks) and over-aligned new are not counted.
+class HeapAllocationCounter
+{
+public:
+    static bool IsEnabled();
+    static uint64_t GetNumAllocations();
+    static uint64_t GetNumAllocatedBytes();
+};
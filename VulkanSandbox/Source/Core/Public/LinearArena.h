@@ -0,0 +1,80 @@
+#pragma once
+
+// Bump allocator for temporary data with a well defined lifetime, e.g. everything that's only needed while recording a single frame.
+// Allocating is just moving an offset forward, freeing single allocations is not possible. Instead the whole arena is reset at once.
+//
+// If an allocation doesn't fit anymore, it's served from an overflow chunk from the general purpose heap.
+// On the next Reset() the arena grows to the peak usage, so after a few warm-up frames we don't touch the heap anymore.
+class LinearArena
+{
+public:
+    explicit LinearArena(size_t capacity = DEFAULT_CAPACITY);
+    ~LinearArena();
+
+    LinearArena(const LinearArena&) = delete;
+    LinearArena& operator=(const LinearArena&) = delete;
+
+    // Returns memory that stays valid until the next Reset(). Never returns nullptr.
+    void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+    template<typename T>
+    T* AllocateArray(size_t count)
+    {
+        return static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    // Invalidates all allocations. Destructors are NOT called, so only put trivially destructible data
+    // or containers that are destroyed before the reset into the arena.
+    void Reset();
+
+    size_t GetCapacity() const { return capacity_; }
+    size_t GetUsedBytes() const { return offset_ + overflow_bytes_; }
+    size_t GetPeakBytes() const { return peak_bytes_; }
+
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+private:
+    std::byte* buffer_ = nullptr;
+    size_t capacity_ = 0;
+    size_t offset_ = 0;
+    size_t peak_bytes_ = 0;
+
+    std::vector<void*> overflow_chunks_;
+    size_t overflow_bytes_ = 0;
+};
+
+// Allocator for STL containers which takes its memory from a LinearArena.
+// deallocate() is a no-op, the memory is reclaimed when the arena is reset. Keep in mind that a growing vector leaves its old
+// storage behind in the arena, so reserve() the expected size if possible.
+template<typename T>
+class ArenaAllocator
+{
+public:
+    using value_type = T;
+
+    ArenaAllocator(LinearArena& arena) noexcept : arena_(&arena) {}
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena_(other.GetArena()) {}
+
+    T* allocate(size_t count)
+    {
+        return arena_->AllocateArray<T>(count);
+    }
+
+    void deallocate(T* memory, size_t count) noexcept
+    {
+    }
+
+    LinearArena* GetArena() const { return arena_; }
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena_ == other.GetArena(); }
+
+private:
+    LinearArena* arena_;
+};
+
+// Vector which lives in a LinearArena. Has to be destroyed (or at least not used anymore) before the arena is reset.
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
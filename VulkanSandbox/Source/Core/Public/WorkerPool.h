@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+// A fixed set of worker threads which execute a batch of tasks in parallel, e.g. recording chunks of the draw list.
+// Run() blocks until all tasks are done. The calling thread works on the tasks as well, so a pool with N workers uses up to N + 1 threads.
+//
+// Tasks are identified by their index. Every task index is executed exactly once and only by a single thread,
+// so per-task resources like command pools can simply be indexed by it.
+// Running a batch doesn't allocate: the function object stays on the caller's stack and is called through a plain function pointer.
+class WorkerPool
+{
+public:
+    explicit WorkerPool(uint32_t num_workers);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    uint32_t GetNumThreads() const { return static_cast<uint32_t>(workers_.size()) + 1; }
+
+    // Calls function(task_index) for every task_index in [0, num_tasks).
+    // If a task throws, the first exception is rethrown on the calling thread once no task is running anymore. The remaining tasks may or may not have run.
+    template<typename Function>
+    void Run(uint32_t num_tasks, Function&& function)
+    {
+        using FunctionType = std::remove_reference_t<Function>;
+        RunTasks(num_tasks, [](void* context, uint32_t task_index) { (*static_cast<FunctionType*>(context))(task_index); }, &function);
+    }
+
+private:
+    using TaskFunction = void(*)(void* context, uint32_t task_index);
+
+    struct Job
+    {
+        TaskFunction function = nullptr;
+        void* context = nullptr;
+        uint32_t num_tasks = 0;
+    };
+
+    void RunTasks(uint32_t num_tasks, TaskFunction function, void* context);
+    void WorkerLoop();
+    void ExecuteTasks(const Job& job);
+
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable job_available_;
+    std::condition_variable job_done_;
+    Job job_;
+    uint64_t job_generation_ = 0;   // Incremented for every batch, so sleeping workers know there is something new
+    uint32_t num_active_workers_ = 0;   // Workers that have picked up the current job and still might execute one of its tasks
+    bool is_shutting_down_ = false;
+    std::exception_ptr task_exception_;    // First exception thrown by a task of the current job. An exception must not escape a worker thread, that would terminate.
+
+    std::atomic<uint32_t> next_task_ = 0;
+    std::atomic<uint32_t> num_completed_tasks_ = 0;
+};
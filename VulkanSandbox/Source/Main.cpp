@@ -2,7 +2,10 @@
 #define GLM_FORCE_RADIANS   // Ensure that matrix functions use radians as units
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE // GLM perspective projection matrix will use depth range of -1.0 to 1.0 by default. We need range of 0.0 to 1.0 for Vulkan.
 #define GLM_ENABLE_EXPERIMENTAL // Needed so we can use the hash functions of GLM types
+#include <atomic>
 #include <chrono>
+#include <exception>
+#include <thread>
 
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -11,6 +14,27 @@
 #include <stb/stb_image.h>
 #include <tiny_obj_loader.h>
 
+#include "BarrierBatcher.h"
+#include "DeletionQueue.h"
+#include "DeviceMemoryAllocator.h"
+#include "DeviceMemoryDefragmenter.h"
+#include "FrameCommandPools.h"
+#include "FrameLatencyTrace.h"
+#include "FrameReadback.h"
+#include "FrameTimeStats.h"
+#include "GpuFrameTimer.h"
+#include "GpuTimeline.h"
+#include "HandoffQueue.h"
+#include "HeapAllocationCounter.h"
+#include "HostAllocationTracker.h"
+#include "LinearArena.h"
+#include "MemoryTypeSelector.h"
+#include "PresentPolicy.h"
+#include "ResolutionScaler.h"
+#include "ResourceStateTracker.h"
+#include "UploadContext.h"
+#include "WorkerPool.h"
+
 struct Vertex 
 {
     glm::vec3 pos_;
@@ -163,6 +187,7 @@ struct QueueFamilyIndices
 {
     std::optional<uint32_t> graphics_family; // Every value could be potentially valid, so we have to rely on optional.
     std::optional<uint32_t> present_family; // Could be the case that the graphics queue family does not support presenting to a surface...
+    std::optional<uint32_t> transfer_family; // Optional. A family without graphics support, which is typically backed by the DMA engines of the GPU.
 
     bool HasFoundQueueFamily()
     {
@@ -170,6 +195,117 @@ struct QueueFamilyIndices
     }
 };
 
+// A range of the shared vertex and index buffer that makes up one model.
+struct Mesh
+{
+    uint32_t index_count = 0;
+    uint32_t first_index = 0;
+    int32_t vertex_offset = 0;
+};
+
+// Something in the scene that may be drawn. Objects can be added, removed or hidden at any time,
+// because the draw list is built from the scene every frame.
+struct SceneObject
+{
+    uint32_t mesh_index = 0;
+    bool is_visible = true;
+};
+
+// A single indexed draw out of the shared vertex and index buffer.
+struct DrawCall
+{
+    uint32_t index_count = 0;
+    uint32_t first_index = 0;
+    int32_t vertex_offset = 0;
+};
+
+// Everything the render thread needs to know about a frame, built by the main thread one frame ahead.
+// Once handed over, the packet is read-only, so the render thread never touches state the main thread is simulating.
+struct FramePacket
+{
+    uint64_t frame_number = 0;
+    bool is_measured = false;               // Benchmark is past its warm-up
+    VkExtent2D framebuffer_extent = {};     // Size of the window's frame buffer in pixels when the packet was built
+    PresentPolicy present_policy = PresentPolicy::LowLatency;  // Can be switched at runtime, the render thread recreates the swap chain then
+
+    // When the main thread sampled the input and built the packet, for the FrameLatencyTrace
+    std::chrono::steady_clock::time_point poll_events_time;
+    std::chrono::steady_clock::time_point simulation_start_time;
+    std::chrono::steady_clock::time_point simulation_end_time;
+
+    // Camera. The projection is built by the render thread, because only it knows the aspect ratio of the swap chain.
+    glm::mat4 view = glm::mat4(1.0f);
+    float fov_y = 0.0f;     // Radians
+    float near_plane = 0.0f;
+    float far_plane = 0.0f;
+
+    glm::mat4 model = glm::mat4(1.0f);      // All objects share the same transform for now
+
+    std::vector<DrawCall> draw_calls;       // Keeps its capacity, so the packets stop allocating once they've been filled a few times
+};
+
+// Settings passed on the command line.
+struct LaunchOptions
+{
+    bool benchmark_command_recording = false;   // --benchmark-recording: Measure how draw recording scales with the number of threads instead of rendering
+    uint32_t num_scene_objects = 1;             // --scene-objects <n>: Number of objects in the scene, to put some load on command recording
+    bool headless = false;                      // --headless: Render into offscreen images instead of a window. Doesn't need a display.
+    uint32_t num_frames = 0;                    // --frames <n>: Stop after rendering this many frames. 0 -> Until the window is closed.
+    bool benchmark = false;                     // --benchmark: Animate with a fixed timestep and write frame time statistics to a JSON report
+    double duration_seconds = 0.0;              // --duration <s>: Stop after measuring this long. Can be combined with --frames, whichever comes first.
+    uint32_t num_warmup_frames = 60;            // --warmup-frames <n>: Frames rendered before a benchmark starts measuring
+    std::string benchmark_report_path = "benchmark_report.json";    // --benchmark-report <path>
+    std::string capture_directory;              // --capture <dir>: Write rendered frames to this directory. Empty -> No capture.
+    CaptureFormat capture_format = CaptureFormat::Png;  // --capture-raw: Write the raw texels instead of PNGs
+    uint32_t capture_interval = 1;              // --capture-interval <n>: Only capture every n-th frame
+    PresentPolicy present_policy = PresentPolicy::LowLatency;  // --present-policy <low-latency|max-throughput|vsync|power-saving>
+    std::string latency_trace_path;             // --latency-trace <path>: Write the timings of the last frames to this file. CSV if it ends with .csv, otherwise a Chrome trace.
+    bool render_on_demand = false;              // --on-demand: Only render a frame if something has changed, sleep otherwise. Ignored by headless runs and benchmarks.
+    bool use_render_thread = true;              // --no-render-thread: Simulate and render on the main thread, one after the other
+    double gpu_budget_ms = 0.0;                 // --gpu-budget <ms>: Lower the render resolution whenever the GPU needs longer than this for a frame. 0 -> Always full resolution.
+    float min_resolution_scale = 0.5f;          // --min-resolution-scale <s>: Lower limit of the render resolution, relative to the window
+    uint32_t num_frames_in_flight = 2;          // --frames-in-flight <n>: How many frames the CPU may record ahead of the GPU, 1 to MAX_FRAMES_IN_FLIGHT.
+                                                // More frames smooth out hitches, fewer frames reduce the input latency.
+};
+
+// CPU time spent on building the draw list and recording the command buffers of a frame.
+struct RecordingStats
+{
+    static constexpr double BUDGET_MS_PER_10K_DRAWS = 1.0;
+
+    uint64_t num_frames = 0;
+    uint64_t num_draw_calls = 0;
+    double total_ms = 0.0;
+    double max_ms = 0.0;
+
+    void Add(double ms, uint32_t num_frame_draw_calls)
+    {
+        num_frames++;
+        num_draw_calls += num_frame_draw_calls;
+        total_ms += ms;
+        max_ms = std::max(max_ms, ms);
+    }
+
+    void Print(std::ostream& out) const
+    {
+        if (num_frames == 0)
+        {
+            return;
+        }
+
+        double average_ms = total_ms / num_frames;
+        double average_draw_calls = static_cast<double>(num_draw_calls) / num_frames;
+        out << "Command recording: " << average_ms << " ms average, " << max_ms << " ms max for " << average_draw_calls << " draws per frame" << std::endl;
+
+        // Small draw lists are dominated by fixed costs, so we only compare bigger ones against the budget.
+        double budget_ms = BUDGET_MS_PER_10K_DRAWS * std::max(average_draw_calls, 10000.0) / 10000.0;
+        if (average_ms > budget_ms)
+        {
+            out << "Command recording exceeds its budget of " << budget_ms << " ms!" << std::endl;
+        }
+    }
+};
+
 struct SwapChainSupportDetails
 {
     VkSurfaceCapabilitiesKHR capabilities;  // min/max number of images in swap chain, min/max width and height of images
@@ -180,15 +316,94 @@ struct SwapChainSupportDetails
 class HelloTriangleApplication
 {
 public:
+    static constexpr uint32_t MAX_FRAMES_IN_FLIGHT = 4;    // Upper bound for --frames-in-flight. Sizes the per frame arrays, GetNumFramesInFlight() tells how many are used.
+
+    explicit HelloTriangleApplication(const LaunchOptions& launch_options)
+        : launch_options_(launch_options)
+    {
+    }
+
     void Run()
     {
-        InitWindow();
+        requested_present_policy_ = launch_options_.present_policy;
+        present_policy_ = launch_options_.present_policy;
+
+        if (IsHeadless() == false)
+        {
+            InitWindow();
+        }
+
+        // Every driver allocation made until the first frame counts as startup cost.
+        host_allocations_.SetTag(HostAllocationTag::Startup);
         InitVulkan();
-        MainLoop();
+
+        if (enable_host_allocation_tracking_)
+        {
+            host_allocations_.PrintReport(std::cout, HostAllocationTag::Startup);
+        }
+
+        // Everything is loaded now, which makes this the snapshot to compare between two versions of our assets.
+        WriteDeviceMemoryStats(DEVICE_MEMORY_STATS_STARTUP_PATH);
+
+        // In an ideal world the driver doesn't allocate anything at all while we're just rendering frames.
+        // Anything that shows up under this tag is churn we'd like to get rid of.
+        host_allocations_.SetTag(HostAllocationTag::SteadyState);
+        if (launch_options_.benchmark_command_recording)
+        {
+            BenchmarkCommandRecording();
+        }
+        else
+        {
+            MainLoop();
+        }
+
+        WriteDeviceMemoryStats(DEVICE_MEMORY_STATS_SHUTDOWN_PATH);
+
+        host_allocations_.SetTag(HostAllocationTag::Shutdown);
         Cleanup();
+
+        if (enable_host_allocation_tracking_)
+        {
+            // After everything has been destroyed, live bytes of all tags should be 0. Otherwise we (or the driver) leaked something.
+            host_allocations_.PrintReport(std::cout);
+        }
+    }
+
+    // Makes sure the next frame is rendered, even if nothing else has changed. Only needed when rendering on demand.
+    // Can be called from any thread, e.g. the render thread or a thread that loads assets in the background.
+    void RequestRedraw()
+    {
+        is_redraw_requested_.store(true);
+
+        // Wakes up the main thread if it's waiting for events. Thread safe, unlike most GLFW functions.
+        if (IsRenderingOnDemand())
+        {
+            glfwPostEmptyEvent();
+        }
     }
 
 private:
+    // Without a window there is no surface and no swap chain. We render into offscreen images that stand in for the swap chain images,
+    // so everything else, e.g. frames in flight, framebuffers and per image resources, works exactly the same.
+    bool IsHeadless() const { return launch_options_.headless; }
+    uint32_t GetNumFramesInFlight() const { return launch_options_.num_frames_in_flight; }
+
+    void WriteDeviceMemoryStats(const std::string& path)
+    {
+        if (enable_device_memory_stats_ == false)
+        {
+            return;
+        }
+
+        std::ofstream file(path);
+        if (!file.is_open())
+        {
+            throw std::runtime_error("Failed to open file: " + path);
+        }
+
+        device_memory_.WriteStatsJson(file);
+    }
+
     void InitWindow()
     {
         glfwInit();
@@ -196,17 +411,91 @@ private:
         glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);   // Prevent creation of OpenGL context
 
         window_ = glfwCreateWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "Vulkan Sandbox", nullptr, nullptr);
-        glfwSetWindowUserPointer(window_, this);    // Save pointer to app, so we can access it on frame buffer resize
+        glfwSetWindowUserPointer(window_, this);    // Save pointer to app, so we can access it in the callbacks
+
+        // Everything that changes what we'd see on screen requests a redraw. That's only relevant when rendering on demand.
+        // Mouse input doesn't change the scene (yet), so we don't listen to it. Otherwise moving the mouse over the window would render at full rate.
         glfwSetFramebufferSizeCallback(window_, FramebufferResizeCallback);
+        glfwSetWindowRefreshCallback(window_, WindowRefreshCallback);
+        glfwSetKeyCallback(window_, KeyCallback);
+
+        // The resize callback doesn't tell the render thread about the new size, the callback runs on the main thread but the swap chain belongs to the render thread.
+        // Instead, the main thread puts the current size into every FramePacket and the render thread compares it to the size it knows.
+        // The initial swap chain is created before the render thread starts, so we query the size once here.
+        int width = 0;
+        int height = 0;
+        glfwGetFramebufferSize(window_, &width, &height);
+        framebuffer_extent_ = { static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+    }
+
+    // Have to use static functions here, because GLFW doesn't pass the pointer to our application.
+    // However, glfw allows us to store our pointer with glfwSetWindowUserPointer. :) Yay.
+    static HelloTriangleApplication* GetApplication(GLFWwindow* window)
+    {
+        return reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
     }
 
     static void FramebufferResizeCallback(GLFWwindow* window, int width, int height)
     {
-        // Have to use a static function here, because GLFW doesn't pass the pointer to our application.
-        // However, glfw allows us to store our pointer with glfwSetWindowUserPointer. :) Yay.
-        
-        auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
-        app->was_frame_buffer_resized_ = true;
+        GetApplication(window)->RequestRedraw();
+    }
+
+    // The window system lost the contents of the window, e.g. because it has been uncovered.
+    static void WindowRefreshCallback(GLFWwindow* window)
+    {
+        GetApplication(window)->RequestRedraw();
+    }
+
+    // Only keys that change something request a redraw. Releases and repeats don't.
+    static void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+    {
+        if (action != GLFW_PRESS)
+        {
+            return;
+        }
+
+        HelloTriangleApplication* app = GetApplication(window);
+        if (key == GLFW_KEY_SPACE)
+        {
+            app->ToggleAnimation();
+            app->RequestRedraw();
+        }
+        else if (key == GLFW_KEY_P)
+        {
+            app->CyclePresentPolicy();
+            app->RequestRedraw();   // The render thread only picks the new policy up with the next packet
+        }
+    }
+
+    // Without a window there's nothing that could wait for changes. Benchmarks have to render continuously to measure anything.
+    bool IsRenderingOnDemand() const { return launch_options_.render_on_demand && IsHeadless() == false && launch_options_.benchmark == false; }
+
+    // A running animation changes the scene every frame.
+    bool IsRedrawNeeded() const { return is_redraw_requested_.load() || is_animation_paused_ == false; }
+
+    // Advances the animation by the wall clock time since the last call, unless it's paused.
+    void UpdateAnimationTime()
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (is_animation_paused_ == false)
+        {
+            animation_time_ += std::chrono::duration<double>(now - last_animation_update_time_).count();
+        }
+        last_animation_update_time_ = now;
+    }
+
+    void ToggleAnimation()
+    {
+        // Account for the time until now with the old state, otherwise resuming would jump ahead by the time we've been paused.
+        UpdateAnimationTime();
+        is_animation_paused_ = !is_animation_paused_;
+    }
+
+    // Main thread only. The render thread picks the new policy up with the next packet.
+    void CyclePresentPolicy()
+    {
+        requested_present_policy_ = GetNextPresentPolicy(requested_present_policy_);
+        std::cout << "Present policy: " << GetPresentPolicyName(requested_present_policy_) << std::endl;
     }
 
     void InitVulkan()
@@ -220,7 +509,10 @@ private:
 
         // A surface represents an abstract type to present rendered images to. The surface in our program will be backed by the window that we've already opened with GLFW.
         // We have to create a surface before we select the physical device to ensure that the device meets our requirements.
-        CreateSurface(); 
+        if (IsHeadless() == false)
+        {
+            CreateSurface();
+        }
 
         // Get handle to the physical GPU which meets our requirements.
         SelectPhysicalDevice();
@@ -229,13 +521,19 @@ private:
         // Here we specify which features are required, check which queue families are available and retrieve corresponding queue handles.
         CreateLogicalDevice();
 
+        // Every queue gets a timeline semaphore, which tracks the progress of everything we submit to it: frames, uploads, defragmentation,...
+        CreateGpuTimelines();
+
+        // Timestamp queries that tell us how long the GPU takes for each frame.
+        CreateGpuFrameTimer();
+
+        // Resources are sub-allocated from a few large memory blocks instead of one vkAllocateMemory per resource.
+        CreateDeviceMemoryAllocator();
+
         // Set up infrastructure that will own the frame buffers we render to before transferring them to the screen.
         // Essentially this is a queue of images waiting to be shown on the display. 
         CreateSwapChain();
 
-        // We have to manually retrieve the handles to the images in the swap chain.
-        CreateImageViews();
-
         // Tell Vulkan about the framebuffer attachments that will be used while rendering
         // e.g. how many color and depth buffers there will be, how many samples to use for each of them,
         // how their contents should be handled throughout the rendering, operations,...
@@ -249,8 +547,12 @@ private:
 
         // Drawing operations and memory transfers are stored in command buffers. These are retrieved from command pools.
         // We can fill these buffers in multiple threads and then execute them all at once on the main thread.
+        // Each frame in flight gets its own pools, which are reset as a whole once the frame is done.
         CreateCommandPool();
 
+        // All uploads and layout transitions during loading are batched into as few submissions as possible.
+        CreateUploadContext();
+
         // Init resources for MSAA
         CreateColorResources();
 
@@ -263,6 +565,9 @@ private:
         // That means that we have to create a framebuffer for all of the images in the swap chain and use the one that corresponds to the retrieved image at drawing time.
         CreateFramebuffers();
 
+        // Copies rendered frames back to the CPU, if requested.
+        CreateFrameReadback();
+
         // Load an image and upload it into a Vulkan image object
         CreateTextureImage();
         CreateTextureImageView();
@@ -271,6 +576,9 @@ private:
         // Populate vertices and indices
         LoadModel();
 
+        // The whole model is a single mesh. The scene consists of instances of it.
+        CreateScene();
+
         // Create and allocate buffers for our model we want to render
         // We can further optimize this by storing both vertex and index buffer in a single vkBuffer to make it more cache friendly
         // See: https://developer.nvidia.com/vulkan-memory-management
@@ -282,65 +590,472 @@ private:
         CreateDescriptorPool();
         CreateDescriptorSets();
 
-        // Create command buffers for each image in the swap chain.
-        CreateCommandBuffers();
+        // Command buffers are recorded every frame, see DrawFrame().
 
         CreateSyncObjects();
+
+        // Everything we've uploaded so far goes to the GPU in a single submission.
+        // Rendering reads the data right away, so we have to wait here once - instead of once for every single copy and transition.
+        upload_context_.Flush();
+
+#ifndef NDEBUG
+        std::cout << "Resource state tracker: " << resource_states_.GetNumBarriers() << " barriers, "
+            << resource_states_.GetNumAccessesWithoutBarrier() << " accesses without barrier" << std::endl;
+#endif
     }
 
+    // The frame loop is split into two stages, which run on two threads:
+    //  * The main thread handles the window, advances the simulation and builds a FramePacket for each frame.
+    //  * The render thread takes the packets and records and submits the frames, see RenderLoop().
+    // While the render thread works on frame N, the main thread already builds frame N+1, so the CPU work of both stages overlaps.
+    // The packets are handed over through a queue with room for two of them, which bounds how far the main thread can run ahead.
     void MainLoop()
     {
-        while (!glfwWindowShouldClose(window_))
+        // Without a window nobody can close it, so headless runs always stop after a fixed number of frames or a fixed duration.
+        // The same goes for benchmarks, which should be comparable between runs.
+        // Benchmarks don't count their warm-up frames, the caches, the driver and the GPU clocks need some time to settle.
+        uint64_t max_frames = launch_options_.num_frames;
+        double max_seconds = launch_options_.duration_seconds;
+        if ((IsHeadless() || launch_options_.benchmark) && max_frames == 0 && max_seconds <= 0.0)
+        {
+            max_frames = DEFAULT_NUM_FRAMES;
+        }
+
+        uint64_t num_warmup_frames = launch_options_.benchmark ? launch_options_.num_warmup_frames : 0;
+        if (launch_options_.benchmark)
+        {
+            cpu_frame_times_.Reserve(max_frames > 0 ? max_frames : DEFAULT_NUM_FRAMES);
+            gpu_frame_times_.Reserve(max_frames > 0 ? max_frames : DEFAULT_NUM_FRAMES);
+        }
+
+        auto loop_start_time = std::chrono::steady_clock::now();
+        auto measurement_start_time = loop_start_time;
+        last_frame_end_time_ = loop_start_time;
+        last_animation_update_time_ = loop_start_time;
+
+        // Rendering on demand starts with a static scene. Space toggles the animation.
+        is_animation_paused_ = IsRenderingOnDemand();
+        is_redraw_requested_.store(true);   // The first frame
+        uint64_t num_idle_wakeups = 0;
+
+        latency_trace_.Init(launch_options_.latency_trace_path.empty() ? 0 : LATENCY_TRACE_CAPACITY, loop_start_time);
+
+        frame_packets_.Init(NUM_FRAME_PACKETS);
+        std::thread render_thread;
+        if (launch_options_.use_render_thread)
+        {
+            render_thread = std::thread([this]() { RenderLoop(); });
+        }
+
+        uint64_t num_frames = 0;
+        while (true)
+        {
+            uint64_t num_measured_frames = num_frames - std::min(num_frames, num_warmup_frames);
+            double measured_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - measurement_start_time).count();
+            if ((max_frames > 0 && num_measured_frames >= max_frames) || (max_seconds > 0.0 && num_measured_frames > 0 && measured_seconds >= max_seconds))
+            {
+                break;
+            }
+
+            // GLFW may only be used from the main thread. The render thread learns about the window through the packets.
+            VkExtent2D framebuffer_extent = {};
+            auto poll_events_time = std::chrono::steady_clock::now();
+            if (IsHeadless() == false)
+            {
+                if (glfwWindowShouldClose(window_))
+                {
+                    break;
+                }
+
+                // When rendering on demand and nothing has changed, there's nothing to do until the next event. -> Sleep instead of polling.
+                // Events that change anything request a redraw. The timeout is only a safety net, glfwPostEmptyEvent() in RequestRedraw() wakes us up right away.
+                if (IsRenderingOnDemand() && IsRedrawNeeded() == false)
+                {
+                    glfwWaitEventsTimeout(ON_DEMAND_WAIT_TIMEOUT_SECONDS);
+                }
+                else
+                {
+                    glfwPollEvents();
+                }
+
+                // Input that arrives after this point has to wait for the next frame. That's where the latency of a frame starts.
+                poll_events_time = std::chrono::steady_clock::now();
+
+                int width = 0;
+                int height = 0;
+                glfwGetFramebufferSize(window_, &width, &height);
+
+                // In case we minimize the frame buffer will have size 0.
+                // -> We don't build any frames until it has a valid size again. The render thread simply waits for the next packet meanwhile.
+                if (width == 0 || height == 0)
+                {
+                    glfwWaitEvents();
+                    continue;
+                }
+
+                framebuffer_extent = { static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+
+                // The last frame we've rendered is still up to date, so we neither render nor present anything.
+                if (IsRenderingOnDemand())
+                {
+                    if (IsRedrawNeeded() == false)
+                    {
+                        num_idle_wakeups++;
+                        continue;
+                    }
+                    is_redraw_requested_.store(false);  // Requests from now on need another frame
+                }
+            }
+
+            if (num_frames == num_warmup_frames)
+            {
+                measurement_start_time = std::chrono::steady_clock::now();
+            }
+
+            // Benchmarks animate with a fixed timestep instead of the wall clock, so every run renders exactly the same frames.
+            double simulation_time = 0.0;
+            if (launch_options_.benchmark)
+            {
+                simulation_time = num_frames * FIXED_TIMESTEP_SECONDS;
+            }
+            else
+            {
+                UpdateAnimationTime();
+                simulation_time = animation_time_;
+            }
+
+            // Blocks while the render thread is still busy with the packets before. Returns nullptr if the render thread has stopped because of an error.
+            FramePacket* packet = frame_packets_.BeginWrite();
+            if (packet == nullptr)
+            {
+                break;
+            }
+
+            packet->frame_number = num_frames;
+            packet->is_measured = launch_options_.benchmark && num_frames >= num_warmup_frames;
+            packet->framebuffer_extent = framebuffer_extent;
+            packet->present_policy = requested_present_policy_;
+            packet->poll_events_time = poll_events_time;
+            packet->simulation_start_time = std::chrono::steady_clock::now();
+            Simulate(simulation_time, *packet);
+            packet->simulation_end_time = std::chrono::steady_clock::now();
+            frame_packets_.EndWrite();
+
+            // Without a render thread we render the packet right away, on this thread.
+            if (launch_options_.use_render_thread == false)
+            {
+                RenderFrame(*frame_packets_.BeginRead());
+                frame_packets_.EndRead();
+            }
+
+            num_frames++;
+        }
+
+        // The render thread finishes the packets that are already in the queue and stops afterwards.
+        frame_packets_.Close();
+        if (render_thread.joinable())
+        {
+            render_thread.join();
+        }
+
+        if (render_thread_exception_)
         {
-            glfwPollEvents();
-            DrawFrame();
+            std::rethrow_exception(render_thread_exception_);
+        }
+
+        recording_stats_.Print(std::cout);
+
+        // The loop only waits for the GPU if it falls behind by more than GetNumFramesInFlight() frames, so this is the throughput of CPU and GPU together.
+        double loop_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - loop_start_time).count();
+        std::cout << "Rendered " << num_frames << " frames in " << loop_seconds << " s (" << num_frames / loop_seconds << " fps)" << std::endl;
+
+#ifndef NDEBUG
+        // If the main thread waits a lot, rendering is the bottleneck. If the render thread waits a lot, it's the simulation.
+        std::cout << "Frame packets: Main thread waited " << frame_packets_.GetNumProducerWaits() << " times for the render thread, render thread waited "
+            << frame_packets_.GetNumConsumerWaits() << " times for the main thread" << std::endl;
+        std::cout << "Graphics queue: " << graphics_timeline_.GetNumSubmissions() << " submissions in " << graphics_timeline_.GetNumQueueSubmits()
+            << " calls to vkQueueSubmit2" << std::endl;
+#endif
+
+        if (HeapAllocationCounter::IsEnabled())
+        {
+            std::cout << "Heap allocations in steady state: " << num_steady_state_heap_allocations_ << " in " << num_frames_with_heap_allocations_
+                << " of " << num_steady_state_frames_ << " frames" << std::endl;
         }
 
         // operations in drawFrame are asynchronous -> When we exit the loop there may still be some ongoing operations and we shouldn't destroy the resources until we are done using those.
-        // => Wait for the logical device to finish operations before exiting mainLoop and destroying the window.
-        vkDeviceWaitIdle(logical_device_);
+        // => Wait until everything we've submitted is done before exiting mainLoop and destroying the window.
+        // The timelines cover all of our submissions. Presentation isn't tracked by them, so we wait for the present queue as well.
+        graphics_timeline_.WaitIdle();
+        if (transfer_queue_ != graphics_queue_)
+        {
+            transfer_timeline_.WaitIdle();
+        }
+        vkQueueWaitIdle(present_queue_);
+
+        if (IsRenderingOnDemand())
+        {
+            std::cout << "Rendering on demand: Woke up " << num_idle_wakeups << " times without anything to render" << std::endl;
+        }
+
+        if (resolution_scaler_.IsEnabled())
+        {
+            std::cout << "Dynamic resolution: " << resolution_scaler_.GetNumScaleChanges() << " scale changes, final scale " << resolution_scaler_.GetScale()
+                << " (" << render_extent_.width << "x" << render_extent_.height << ")" << std::endl;
+        }
+
+        if (frame_readback_.IsEnabled())
+        {
+            std::cout << "Frame capture: " << frame_readback_.GetNumCapturedFrames() << " frames captured, " << frame_readback_.GetNumDroppedFrames()
+                << " dropped because the encoder couldn't keep up" << std::endl;
+        }
+
+        // The last frames have only finished now.
+        for (uint32_t frame_index = 0; frame_index < GetNumFramesInFlight(); frame_index++)
+        {
+            CollectGpuFrameTime(frame_index);
+        }
+        is_measuring_frames_ = false;
+
+        if (latency_trace_.IsEnabled())
+        {
+            const std::string& path = launch_options_.latency_trace_path;
+            bool is_csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+            if (is_csv)
+            {
+                latency_trace_.WriteCsv(path);
+            }
+            else
+            {
+                latency_trace_.WriteChromeTrace(path);
+            }
+            latency_trace_.PrintSummary(std::cout);
+        }
+
+        if (launch_options_.benchmark)
+        {
+            double measured_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - measurement_start_time).count();
+            WriteBenchmarkReport(launch_options_.benchmark_report_path, num_warmup_frames, measured_seconds);
+        }
+    }
+
+    // Runs on the render thread until the main thread closes the packet queue.
+    void RenderLoop()
+    {
+        try
+        {
+            while (FramePacket* packet = frame_packets_.BeginRead())
+            {
+                RenderFrame(*packet);
+                frame_packets_.EndRead();
+            }
+        }
+        catch (...)
+        {
+            // Exceptions can't cross threads on their own. The main thread rethrows it once it has joined us.
+            render_thread_exception_ = std::current_exception();
+            frame_packets_.Close();
+        }
+    }
+
+    // The render stage of a frame. All Vulkan calls of the frame loop happen in here, so only a single thread ever uses the queues.
+    void RenderFrame(const FramePacket& packet)
+    {
+        is_measuring_frames_ = packet.is_measured;
+
+        // The swap chain is recreated after the next present. See PresentImage().
+        if (IsHeadless() == false && (packet.framebuffer_extent.width != framebuffer_extent_.width || packet.framebuffer_extent.height != framebuffer_extent_.height))
+        {
+            framebuffer_extent_ = packet.framebuffer_extent;
+            was_frame_buffer_resized_ = true;
+        }
+
+        // Same for a new present policy. We keep presenting with the old one until then.
+        if (IsHeadless() == false && packet.present_policy != present_policy_)
+        {
+            present_policy_ = packet.present_policy;
+            num_present_policy_changes_ += packet.is_measured ? 1 : 0;
+        }
+
+        uint64_t num_heap_allocations_before = HeapAllocationCounter::GetNumAllocations();
+        uint32_t num_swap_chain_recreations_before = num_swap_chain_recreations_;
+
+        DrawFrame(packet);
+
+        // CPU time of the whole frame, i.e. the time since the previous frame was done. This includes waiting for the GPU and for the main thread.
+        auto frame_end_time = std::chrono::steady_clock::now();
+        if (is_measuring_frames_)
+        {
+            cpu_frame_times_.Add(std::chrono::duration<double, std::milli>(frame_end_time - last_frame_end_time_).count());
+        }
+        last_frame_end_time_ = frame_end_time;
+
+        // The first frames may still grow the frame arenas and the packets. Swap chain recreation allocates anyway, so we don't count those frames either.
+        // The counter is global, so this includes the allocations of the main thread while it built the next packet.
+        if (packet.frame_number >= NUM_WARMUP_FRAMES && num_swap_chain_recreations_ == num_swap_chain_recreations_before)
+        {
+            uint64_t num_heap_allocations = HeapAllocationCounter::GetNumAllocations() - num_heap_allocations_before;
+            num_steady_state_frames_++;
+            num_steady_state_heap_allocations_ += num_heap_allocations;
+            num_frames_with_heap_allocations_ += num_heap_allocations > 0 ? 1 : 0;
+        }
+    }
+
+    // Reads the GPU time of the frame's last submission. The frame has to be complete.
+    void CollectGpuFrameTime(uint32_t frame_index)
+    {
+        uint64_t gpu_start_ns = 0;
+        uint64_t gpu_end_ns = 0;
+        if (gpu_frame_timer_.ReadFrameTimestamps(frame_index, gpu_start_ns, gpu_end_ns) == false)
+        {
+            return;
+        }
+
+        latency_trace_.SetGpuTimestamps(frame_numbers_[frame_index], gpu_start_ns, gpu_end_ns);
+
+        double gpu_ms = static_cast<double>(gpu_end_ns - gpu_start_ns) / 1000000.0;
+
+        if (is_frame_measured_[frame_index])
+        {
+            gpu_frame_times_.Add(gpu_ms);
+        }
+
+        resolution_scaler_.AddGpuFrameTime(gpu_ms);
+    }
+
+    void WriteBenchmarkReport(const std::string& path, uint64_t num_warmup_frames, double measured_seconds)
+    {
+        std::ofstream file(path);
+        if (!file.is_open())
+        {
+            throw std::runtime_error("Failed to open file: " + path);
+        }
+
+        file << "{\n";
+        file << "  \"frames\": " << cpu_frame_times_.Summarize().num_samples << ",\n";
+        file << "  \"warmup_frames\": " << num_warmup_frames << ",\n";
+        file << "  \"duration_s\": " << measured_seconds << ",\n";
+        file << "  \"fixed_timestep_s\": " << FIXED_TIMESTEP_SECONDS << ",\n";
+        file << "  \"headless\": " << (IsHeadless() ? "true" : "false") << ",\n";
+        file << "  \"resolution\": [" << swap_chain_extent_.width << ", " << swap_chain_extent_.height << "],\n";
+        file << "  \"scene_objects\": " << launch_options_.num_scene_objects << ",\n";
+
+        // The present mode limits the frame rate, e.g. FIFO caps it at the refresh rate of the display. Headless runs don't present at all.
+        // If the policy has been switched while measuring, the frame times are a mix and these are only the values at the end.
+        file << "  \"present_policy\": ";
+        if (IsHeadless())
+        {
+            file << "null,\n";
+            file << "  \"present_mode\": null,\n";
+        }
+        else
+        {
+            file << "\"" << GetPresentPolicyName(swap_chain_present_policy_) << "\",\n";
+            file << "  \"present_mode\": \"" << GetPresentModeName(swap_chain_present_mode_) << "\",\n";
+        }
+        file << "  \"swap_chain_images\": " << swap_chain_images_.size() << ",\n";
+        file << "  \"present_policy_changes\": " << num_present_policy_changes_ << ",\n";
+        file << "  \"cpu\": ";
+        cpu_frame_times_.WriteJson(file);
+        file << ",\n";
+
+        // Without timestamp support there is nothing to report for the GPU.
+        file << "  \"gpu\": ";
+        if (gpu_frame_timer_.IsSupported())
+        {
+            gpu_frame_times_.WriteJson(file);
+        }
+        else
+        {
+            file << "null";
+        }
+        file << "\n}\n";
+
+        FrameTimeSummary cpu_summary = cpu_frame_times_.Summarize();
+        FrameTimeSummary gpu_summary = gpu_frame_times_.Summarize();
+        std::cout << "Benchmark: CPU " << cpu_summary.mean_ms << " ms mean, " << cpu_summary.p99_ms << " ms p99 | GPU " << gpu_summary.mean_ms << " ms mean, "
+            << gpu_summary.p99_ms << " ms p99 -> " << path << std::endl;
     }
 
     void Cleanup()
     {
+        // Throws away a defragmentation step that's still in flight. Nothing is moved anymore after this.
+        defragmenter_.Shutdown();
+
+        // Writes the frames that have been captured but not written yet.
+        frame_readback_.Shutdown();
+
+        // Releases the staging buffers of uploads that are still in flight.
+        upload_context_.Shutdown();
+
         CleanUpSwapChain();
+        CleanUpRenderPipeline();
+        CleanUpPerFrameResources();
+
+        // The GPU is idle, so everything that has been retired can be destroyed right away.
+        deletion_queue_.Shutdown();
 
-        vkDestroySampler(logical_device_, texture_sampler_, nullptr);
-        vkDestroyImageView(logical_device_, texture_image_view_, nullptr);
+        vkDestroySampler(logical_device_, texture_sampler_, allocator_);
+        vkDestroyImageView(logical_device_, texture_image_view_, allocator_);
 
-        vkDestroyImage(logical_device_, texture_image_, nullptr);
-        vkFreeMemory(logical_device_, texture_image_memory_, nullptr);
+        resource_states_.Unregister(texture_image_);
+        device_memory_.Destroy(texture_image_allocation_);
 
-        vkDestroyDescriptorSetLayout(logical_device_, descriptor_set_layout_, nullptr);
+        vkDestroyDescriptorSetLayout(logical_device_, descriptor_set_layout_, allocator_);
 
         // Destroy buffers and corresponding memory
-        vkDestroyBuffer(logical_device_, index_buffer_, nullptr);
-        vkFreeMemory(logical_device_, index_buffer_memory_, nullptr);
-        vkDestroyBuffer(logical_device_, vertex_buffer_, nullptr);
-        vkFreeMemory(logical_device_, vertex_buffer_memory_, nullptr);
+        resource_states_.Unregister(index_buffer_);
+        resource_states_.Unregister(vertex_buffer_);
+        device_memory_.Destroy(index_buffer_allocation_);
+        device_memory_.Destroy(vertex_buffer_allocation_);
+
+        for(size_t i = 0; i < GetNumFramesInFlight(); i++)
+        {
+            vkDestroySemaphore(logical_device_, render_finished_semaphores_[i], allocator_);
+            vkDestroySemaphore(logical_device_, image_available_semaphores_[i], allocator_);
+        }
 
-        for(size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+        // The last present fence of the swap chain has been destroyed by the deletion queue together with the swap chain.
+        for (VkFence fence : pending_present_fences_)
         {
-            vkDestroySemaphore(logical_device_, render_finished_semaphores_[i], nullptr);
-            vkDestroySemaphore(logical_device_, image_available_semaphores_[i], nullptr);
-            vkDestroyFence(logical_device_, inflight_frame_fences_[i], nullptr);
+            vkDestroyFence(logical_device_, fence, allocator_);
         }
+        for (VkFence fence : free_present_fences_)
+        {
+            vkDestroyFence(logical_device_, fence, allocator_);
+        }
+
+        graphics_timeline_.Shutdown();
+        if (transfer_queue_ != graphics_queue_)
+        {
+            transfer_timeline_.Shutdown();
+        }
+
+        frame_command_pools_.Shutdown();  // Also destroys any command buffers we retrieved from the pools
+        gpu_frame_timer_.Shutdown();
 
-        vkDestroyCommandPool(logical_device_, command_pool_, nullptr);  // Also destroys any command buffers we retrieved from the pool
+        // All resources are gone, so this releases all memory blocks.
+        device_memory_.Shutdown();
 
-        vkDestroyDevice(logical_device_, nullptr);
+        vkDestroyDevice(logical_device_, allocator_);
 
         if(enable_validation_layers_)
         {
-            DestroyDebugUtilsMessengerEXT(instance_, debug_messenger_, nullptr);
+            DestroyDebugUtilsMessengerEXT(instance_, debug_messenger_, allocator_);
         }
 
-        vkDestroySurfaceKHR(instance_, surface_, nullptr);
-        vkDestroyInstance(instance_, nullptr);
+        if (IsHeadless() == false)
+        {
+            vkDestroySurfaceKHR(instance_, surface_, allocator_);
+        }
+        vkDestroyInstance(instance_, allocator_);
 
         // Clean up glfw
-        glfwDestroyWindow(window_);
-        glfwTerminate();
+        if (IsHeadless() == false)
+        {
+            glfwDestroyWindow(window_);
+            glfwTerminate();
+        }
     }
 
     void CreateVulkanInstance()
@@ -358,7 +1073,7 @@ private:
         app_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
         app_info.pEngineName = "No Engine";
         app_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-        app_info.apiVersion = VK_API_VERSION_1_0;
+        app_info.apiVersion = VK_API_VERSION_1_3;  // Timeline semaphores are core since Vulkan 1.2, synchronization2 since Vulkan 1.3
 
         VkInstanceCreateInfo create_info{};
         create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -386,6 +1101,15 @@ private:
         std::vector<const char*> extensions = GetRequiredExtensions();
         if(CheckInstanceExtensionSupport(extensions))
         {
+            // Optional: VK_EXT_swapchain_maintenance1 builds on these, see IsSwapchainMaintenance1Supported().
+            is_surface_maintenance1_enabled_ = IsHeadless() == false && IsInstanceExtensionSupported(VK_KHR_GET_SURFACE_CAPABILITIES_2_EXTENSION_NAME)
+                && IsInstanceExtensionSupported(VK_EXT_SURFACE_MAINTENANCE_1_EXTENSION_NAME);
+            if (is_surface_maintenance1_enabled_)
+            {
+                extensions.push_back(VK_KHR_GET_SURFACE_CAPABILITIES_2_EXTENSION_NAME);
+                extensions.push_back(VK_EXT_SURFACE_MAINTENANCE_1_EXTENSION_NAME);
+            }
+
             create_info.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
             create_info.ppEnabledExtensionNames = extensions.data();
         }
@@ -394,7 +1118,7 @@ private:
             throw std::runtime_error("Required extension not supported!");
         }
 
-        if(vkCreateInstance(&create_info, nullptr, &instance_) != VK_SUCCESS)
+        if(vkCreateInstance(&create_info, allocator_, &instance_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create Vulkan instance!");
         }
@@ -404,10 +1128,15 @@ private:
     {
         // glfw extensions already include the platform specific extensions which are required
         // e.g. VK_KHR_win32_surface
-        uint32_t glfw_extension_count;
-        const char** glfw_extensions;
-        glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
-        std::vector<const char*> extensions(glfw_extensions, glfw_extensions + glfw_extension_count);
+        // Headless we don't present anything, so we don't need any surface extensions at all.
+        std::vector<const char*> extensions;
+        if (IsHeadless() == false)
+        {
+            uint32_t glfw_extension_count;
+            const char** glfw_extensions;
+            glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+            extensions.assign(glfw_extensions, glfw_extensions + glfw_extension_count);
+        }
 
         if (enable_validation_layers_)
         {
@@ -458,6 +1187,17 @@ private:
         return true;
     }
 
+    bool IsInstanceExtensionSupported(const char* extension_name)
+    {
+        uint32_t supported_extensions_count = 0;
+        vkEnumerateInstanceExtensionProperties(nullptr, &supported_extensions_count, nullptr);
+        std::vector<VkExtensionProperties> supported_extension_properties(supported_extensions_count);
+        vkEnumerateInstanceExtensionProperties(nullptr, &supported_extensions_count, supported_extension_properties.data());
+
+        return std::any_of(supported_extension_properties.begin(), supported_extension_properties.end(),
+            [extension_name](const VkExtensionProperties& properties) { return strcmp(extension_name, properties.extensionName) == 0; });
+    }
+
     void SetupDebugManager()
     {
         // Tell Vulkan about our debug callback function in case we use a validation layer.
@@ -466,7 +1206,7 @@ private:
             VkDebugUtilsMessengerCreateInfoEXT create_info{};
             PopulateDebugMessengerCreateInfo(create_info);
 
-            if (CreateDebugUtilsMessengerEXT(instance_, &create_info, nullptr, &debug_messenger_) != VK_SUCCESS)
+            if (CreateDebugUtilsMessengerEXT(instance_, &create_info, allocator_, &debug_messenger_) != VK_SUCCESS)
             {
                 throw std::runtime_error("Failed to set up debug messenger!");
             }
@@ -488,7 +1228,7 @@ private:
         // glfw offers a handy abstraction for surface creation.
         // It automatically fills a VkWin32SurfaceCreateInfoKHR struct with the platform specific window and process handles
         // and then calls the platform specific function to create the surface, e.g. vkCreateWin32SurfaceKHR
-        if (glfwCreateWindowSurface(instance_, window_, nullptr, &surface_) != VK_SUCCESS)
+        if (glfwCreateWindowSurface(instance_, window_, allocator_, &surface_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create window surface!");
         }
@@ -521,6 +1261,14 @@ private:
         {
             throw std::runtime_error("Failed to find a GPU that meets requirements!");
         }
+
+        // Memory properties never change for a physical device, so we query them only once.
+        // This also tells us if we can skip staging buffers because the CPU can write to device local memory directly.
+        memory_types_.Init(physical_device_);
+
+#ifndef NDEBUG
+        std::cout << "Memory model: " << memory_types_.GetMemoryModelName() << '\n';
+#endif
     }
 
     bool CheckDeviceRequirements(VkPhysicalDevice device)
@@ -542,8 +1290,8 @@ private:
 
         bool are_extensions_supported = CheckDeviceExtensionSupport(device);
 
-        bool does_swap_chain_meet_reqs = false;
-        if (are_extensions_supported)   // Important: Only try to query for swap chain support after verifying that the swap chain extension is available. 
+        bool does_swap_chain_meet_reqs = IsHeadless();  // Offscreen images don't need any swap chain support
+        if (are_extensions_supported && IsHeadless() == false)   // Important: Only try to query for swap chain support after verifying that the swap chain extension is available. 
         {
             SwapChainSupportDetails details = QuerySwapChainSupport(device);
 
@@ -555,6 +1303,30 @@ private:
         vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
         bool are_features_supported = supportedFeatures.samplerAnisotropy;
 
+        // We track all GPU work with timeline semaphores and record barriers with synchronization2. Newer features have to be queried via a pNext chain.
+        VkPhysicalDeviceProperties device_properties;
+        vkGetPhysicalDeviceProperties(device, &device_properties);
+        if (device_properties.apiVersion >= VK_API_VERSION_1_3)
+        {
+            VkPhysicalDeviceVulkan13Features vulkan_13_features{};
+            vulkan_13_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+
+            VkPhysicalDeviceVulkan12Features vulkan_12_features{};
+            vulkan_12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+            vulkan_12_features.pNext = &vulkan_13_features;
+
+            VkPhysicalDeviceFeatures2 features{};
+            features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+            features.pNext = &vulkan_12_features;
+            vkGetPhysicalDeviceFeatures2(device, &features);
+
+            are_features_supported = are_features_supported && vulkan_12_features.timelineSemaphore && vulkan_13_features.synchronization2;
+        }
+        else
+        {
+            are_features_supported = false;
+        }
+
         are_requirements_met = indices.HasFoundQueueFamily() && are_extensions_supported && does_swap_chain_meet_reqs && are_features_supported;
 
         return are_requirements_met;
@@ -571,7 +1343,8 @@ private:
         std::vector<VkExtensionProperties> available_extensions(extension_count);
         vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count, available_extensions.data());
 
-        std::set<std::string> required_extensions(device_extensions_.begin(), device_extensions_.end());
+        const std::vector<const char*>& device_extensions = GetRequiredDeviceExtensions();
+        std::set<std::string> required_extensions(device_extensions.begin(), device_extensions.end());
 
         for (const auto& extension : available_extensions)
         {
@@ -581,6 +1354,45 @@ private:
         return required_extensions.empty();
     }
 
+    // VK_EXT_swapchain_maintenance1 lets presents signal a fence, so we know when the presentation engine is done with a swap chain.
+    // Without it, retiring a swap chain has to wait for the present queue, see CleanUpSwapChain().
+    bool IsSwapchainMaintenance1Supported(VkPhysicalDevice device)
+    {
+        if (is_surface_maintenance1_enabled_ == false)
+        {
+            return false;
+        }
+
+        uint32_t extension_count;
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count, nullptr);
+        std::vector<VkExtensionProperties> available_extensions(extension_count);
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count, available_extensions.data());
+
+        bool is_extension_supported = std::any_of(available_extensions.begin(), available_extensions.end(),
+            [](const VkExtensionProperties& properties) { return strcmp(VK_EXT_SWAPCHAIN_MAINTENANCE_1_EXTENSION_NAME, properties.extensionName) == 0; });
+        if (is_extension_supported == false)
+        {
+            return false;
+        }
+
+        VkPhysicalDeviceSwapchainMaintenance1FeaturesEXT swapchain_maintenance1_features{};
+        swapchain_maintenance1_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SWAPCHAIN_MAINTENANCE_1_FEATURES_EXT;
+
+        VkPhysicalDeviceFeatures2 features{};
+        features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features.pNext = &swapchain_maintenance1_features;
+        vkGetPhysicalDeviceFeatures2(device, &features);
+
+        return swapchain_maintenance1_features.swapchainMaintenance1 == VK_TRUE;
+    }
+
+    // VK_KHR_swapchain is the only device extension we need, and only if we present to a window.
+    const std::vector<const char*>& GetRequiredDeviceExtensions() const
+    {
+        static const std::vector<const char*> NO_EXTENSIONS;
+        return IsHeadless() ? NO_EXTENSIONS : device_extensions_;
+    }
+
     QueueFamilyIndices FindQueueFamilies(VkPhysicalDevice device)
     {
         QueueFamilyIndices indices;
@@ -605,8 +1417,16 @@ private:
             // -> We have to add an additional check and remember the queue family that supports it.
             // This COULD be the same queue family as the graphics family, though.
             // To maximize performance we could even try to find a family that is required to support both graphics and presenting here.
+            // Headless nothing is presented, so we simply use the graphics queue for the (unused) present queue.
             VkBool32 is_present_supported = false;
-            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface_, &is_present_supported);
+            if (IsHeadless())
+            {
+                is_present_supported = (queue_family.queueFlags & VK_QUEUE_GRAPHICS_BIT) ? VK_TRUE : VK_FALSE;
+            }
+            else
+            {
+                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface_, &is_present_supported);
+            }
 
             if (is_present_supported)
             {
@@ -621,6 +1441,20 @@ private:
             i++;
         }
 
+        // Many GPUs expose queue families that only support transfers. Copies on such a queue can run in parallel to the rendering
+        // instead of competing with it for the graphics queue. We prefer a pure transfer family over one that also supports compute.
+        for (uint32_t family_index = 0; family_index < queue_family_count; family_index++)
+        {
+            VkQueueFlags flags = queue_families[family_index].queueFlags;
+            bool is_transfer_only = (flags & VK_QUEUE_TRANSFER_BIT) && (flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) == 0;
+            bool is_non_graphics_transfer = (flags & VK_QUEUE_TRANSFER_BIT) && (flags & VK_QUEUE_GRAPHICS_BIT) == 0;
+
+            if (is_transfer_only || (is_non_graphics_transfer && indices.transfer_family.has_value() == false))
+            {
+                indices.transfer_family = family_index;
+            }
+        }
+
         return indices;
     }
 
@@ -655,6 +1489,10 @@ private:
         // We have to create multiple VkDeviceQueueCreateInfo structs to create a queue for all required families.
         std::vector<VkDeviceQueueCreateInfo> queue_create_infos;
         std::set<uint32_t> unique_queue_families = { indices.graphics_family.value(), indices.present_family.value() };
+        if (indices.transfer_family.has_value())
+        {
+            unique_queue_families.insert(indices.transfer_family.value());
+        }
 
         float queue_priority = 1.0f;    // Queue priorities [0.0f, 1.0f] influence the scheduling of command buffer execution.
                                         // Required even for a single queue!
@@ -663,7 +1501,7 @@ private:
         {
             VkDeviceQueueCreateInfo queue_create_info{};
             queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-            queue_create_info.queueFamilyIndex = indices.graphics_family.value();
+            queue_create_info.queueFamilyIndex = queue_family;
             queue_create_info.queueCount = 1;   // We only need one queue, because we can create command buffers on multiple threads and submit them all at once.
             queue_create_info.pQueuePriorities = &queue_priority;
             queue_create_infos.push_back(queue_create_info);
@@ -674,18 +1512,41 @@ private:
         VkPhysicalDeviceFeatures device_features{};
         device_features.samplerAnisotropy = VK_TRUE;
 
+        // Features of Vulkan 1.1+ are enabled via the pNext chain
+        VkPhysicalDeviceVulkan13Features vulkan_13_features{};
+        vulkan_13_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+        vulkan_13_features.synchronization2 = VK_TRUE;
+
+        VkPhysicalDeviceVulkan12Features vulkan_12_features{};
+        vulkan_12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        vulkan_12_features.timelineSemaphore = VK_TRUE;
+        vulkan_12_features.pNext = &vulkan_13_features;
+
+        // Optional: Present fences, so the old swap chain of a resize can be destroyed without waiting for the present queue.
+        std::vector<const char*> device_extensions = GetRequiredDeviceExtensions();
+        VkPhysicalDeviceSwapchainMaintenance1FeaturesEXT swapchain_maintenance1_features{};
+        swapchain_maintenance1_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SWAPCHAIN_MAINTENANCE_1_FEATURES_EXT;
+        is_swapchain_maintenance1_enabled_ = IsSwapchainMaintenance1Supported(physical_device_);
+        if (is_swapchain_maintenance1_enabled_)
+        {
+            device_extensions.push_back(VK_EXT_SWAPCHAIN_MAINTENANCE_1_EXTENSION_NAME);
+            swapchain_maintenance1_features.swapchainMaintenance1 = VK_TRUE;
+            vulkan_13_features.pNext = &swapchain_maintenance1_features;
+        }
+
         // Create logical device
         VkDeviceCreateInfo create_info{};
         create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
         create_info.queueCreateInfoCount = static_cast<uint32_t>(queue_create_infos.size());
         create_info.pQueueCreateInfos = queue_create_infos.data();
         create_info.pEnabledFeatures = &device_features;
+        create_info.pNext = &vulkan_12_features;
 
         // specify device specific extensions
         // For example VK_KHR_swapchain allows the presentation of rendered images from the device to the OS.
         // It could be the case that we use a GPU without this feature, for example if we only rely on compute operations.
-        create_info.enabledExtensionCount = static_cast<uint32_t>(device_extensions_.size());
-        create_info.ppEnabledExtensionNames = device_extensions_.data();
+        create_info.enabledExtensionCount = static_cast<uint32_t>(device_extensions.size());
+        create_info.ppEnabledExtensionNames = device_extensions.data();
 
         // Specify device specific validation layers
         // Previous implementations of Vulkan made a distinction between instance and device specific validation layers, but this is no longer the case
@@ -697,36 +1558,109 @@ private:
         }
         else
         {
-            create_info.enabledLayerCount = 0;
+            create_info.enabledLayerCount = 0;
+        }
+
+        if (vkCreateDevice(physical_device_, &create_info, allocator_, &logical_device_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create logical device!");
+        }
+
+        vkGetDeviceQueue(logical_device_, indices.graphics_family.value(), 0, &graphics_queue_);
+        vkGetDeviceQueue(logical_device_, indices.present_family.value(), 0, &present_queue_);
+
+        // Without a dedicated transfer family, uploads simply go through the graphics queue.
+        if (indices.transfer_family.has_value())
+        {
+            vkGetDeviceQueue(logical_device_, indices.transfer_family.value(), 0, &transfer_queue_);
+        }
+        else
+        {
+            transfer_queue_ = graphics_queue_;
+        }
+    }
+
+    void CreateGpuTimelines()
+    {
+        graphics_timeline_.Init(logical_device_, allocator_, graphics_queue_);
+
+        if (transfer_queue_ != graphics_queue_)
+        {
+            transfer_timeline_.Init(logical_device_, allocator_, transfer_queue_);
+
+            // Uploads on the graphics queue wait for their copies on the transfer queue, so those have to reach the GPU first.
+            graphics_timeline_.SetUpstream(&transfer_timeline_);
+        }
+    }
+
+    void CreateGpuFrameTimer()
+    {
+        // Timestamps are optional per queue family. Without valid bits, the graphics queue can't write any.
+        QueueFamilyIndices indices = FindQueueFamilies(physical_device_);
+        uint32_t queue_family_count = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physical_device_, &queue_family_count, nullptr);
+        std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
+        vkGetPhysicalDeviceQueueFamilyProperties(physical_device_, &queue_family_count, queue_families.data());
+        bool are_timestamps_supported = queue_families[indices.graphics_family.value()].timestampValidBits > 0;
+
+        VkPhysicalDeviceProperties device_properties;
+        vkGetPhysicalDeviceProperties(physical_device_, &device_properties);
+        gpu_frame_timer_.Init(logical_device_, allocator_, are_timestamps_supported, device_properties.limits.timestampPeriod, GetNumFramesInFlight());
+
+        // The resolution scaler is driven by the measured GPU time, so it can't do anything without timestamps.
+        if (launch_options_.gpu_budget_ms > 0.0 && gpu_frame_timer_.IsSupported() == false)
+        {
+            std::cerr << "Timestamps are not supported by the graphics queue, rendering at full resolution." << std::endl;
         }
 
-        if (vkCreateDevice(physical_device_, &create_info, nullptr, &logical_device_) != VK_SUCCESS)
+        // A new scale shows up in the measurements once all frames in flight that still use the old one are done.
+        resolution_scaler_.Init(gpu_frame_timer_.IsSupported() ? launch_options_.gpu_budget_ms : 0.0, launch_options_.min_resolution_scale, GetNumFramesInFlight());
+    }
+
+    // Without a dedicated transfer queue, uploads are submitted to the graphics queue and therefore have to advance the graphics timeline.
+    GpuTimeline& GetTransferTimeline()
+    {
+        return (transfer_queue_ != graphics_queue_) ? transfer_timeline_ : graphics_timeline_;
+    }
+
+    void CreateDeviceMemoryAllocator()
+    {
+        device_memory_.Init(logical_device_, allocator_, &memory_types_);
+
+        // Objects we're done with on the CPU side may still be used by frames in flight. They're destroyed once the graphics timeline passed them.
+        deletion_queue_.Init(logical_device_, allocator_, &device_memory_, &graphics_timeline_);
+
+        if (enable_validation_layers_)
         {
-            throw std::runtime_error("Failed to create logical device!");
+            // VK_EXT_debug_utils is enabled together with the validation layers. Naming our resources makes validation messages a lot more readable.
+            auto set_debug_name = (PFN_vkSetDebugUtilsObjectNameEXT)vkGetInstanceProcAddr(instance_, "vkSetDebugUtilsObjectNameEXT");
+            device_memory_.SetDebugNameFunction(set_debug_name);
         }
 
-        vkGetDeviceQueue(logical_device_, indices.graphics_family.value(), 0, &graphics_queue_);
-        vkGetDeviceQueue(logical_device_, indices.present_family.value(), 0, &present_queue_);
+        // The defragmenter copies resources around with its own command buffers. Unlike uploads, these go to the graphics queue even if there is
+        // a dedicated transfer queue: The copies are implicitly ordered with our frames and we don't need any ownership transfers for resources in use.
+        QueueFamilyIndices indices = FindQueueFamilies(physical_device_);
+        defragmenter_.Init(logical_device_, allocator_, &device_memory_, indices.graphics_family.value(), &graphics_timeline_, &deletion_queue_);
     }
 
-    void CreateSwapChain()
+    void CreateSwapChain(VkSwapchainKHR old_swap_chain = VK_NULL_HANDLE)
     {
+        if (IsHeadless())
+        {
+            CreateOffscreenImages();
+            return;
+        }
+
         SwapChainSupportDetails swap_chain_support = QuerySwapChainSupport(physical_device_);
 
         // Choose preferred swap chain properties
         VkSurfaceFormatKHR surface_format = ChooseSwapSurfaceFormat(swap_chain_support.surface_formats);
-        VkPresentModeKHR present_mode = ChooseSwapPresentMode(swap_chain_support.present_modes);
         VkExtent2D extent = ChooseSwapExtent(swap_chain_support.capabilities);
 
-        // Specify the minimum num images we would like to have in the swap chain
-        uint32_t image_count = swap_chain_support.capabilities.minImageCount + 1;   // Minimum + 1 is recommended to avoid GPU stalls.
-
-        // Ensure we don't exceed the supported max image count in the swap chain. 
-        bool is_max_image_count_specified = swap_chain_support.capabilities.maxImageCount > 0;  //maxImageCount == 0 means that there is no maximum set by the device!
-        if (is_max_image_count_specified && image_count > swap_chain_support.capabilities.maxImageCount)
-        {
-            image_count = swap_chain_support.capabilities.maxImageCount;
-        }
+        // Present mode and the minimum num images we would like to have in the swap chain depend on what we optimize for, see PresentPolicy.
+        SwapChainConfig config = ChooseSwapChainConfig(present_policy_, swap_chain_support.capabilities, swap_chain_support.present_modes, GetNumFramesInFlight());
+        VkPresentModeKHR present_mode = config.present_mode;
+        uint32_t image_count = config.min_image_count;
 
         VkSwapchainCreateInfoKHR create_info{};
         create_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
@@ -736,10 +1670,25 @@ private:
         create_info.imageColorSpace = surface_format.colorSpace;
         create_info.imageExtent = extent;
         create_info.imageArrayLayers = 1;   // Amount of layers each image consists of. 1 unless developing a stereoscopic 3D application.
-        create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;   // What kind of operations images in the swap chain are used for. We'll render directly to them -> Color attachment.
-                                                                        // We could also first render to a separate image and then do some post-processing operations.
-                                                                        // In that case we may use a value like VK_IMAGE_USAGE_TRANSFER_DST_BIT to use a memory operation to transfer the
-                                                                        // rendered image to a swap chain image.
+        create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;   // What kind of operations images in the swap chain are used for. Color attachment is always supported.
+
+        // We don't render into the swap chain images directly. The scene is rendered into a separate image at a possibly lower resolution
+        // and then blitted to the swap chain image, see RecordUpscale().
+        if ((swap_chain_support.capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT) == 0)
+        {
+            throw std::runtime_error("Swap chain images can't be blitted to!");
+        }
+        create_info.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+
+        // Frame capture copies from the swap chain images.
+        if (launch_options_.capture_directory.empty() == false)
+        {
+            if ((swap_chain_support.capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT) == 0)
+            {
+                throw std::runtime_error("Swap chain images can't be copied from, frame capture is not supported!");
+            }
+            create_info.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        }
 
         // Save for later use...
         swap_chain_image_format_ = surface_format.format;
@@ -782,9 +1731,11 @@ private:
 
         // With Vulkan it's possible that the swap chain becomes invalid or unoptimized while the application is running (e.g. due to window resize).
         // => We may have to recreate swap chain from scratch. If so we have to provide a handle to the old swap chain here.
-        create_info.oldSwapchain = VK_NULL_HANDLE;  // For now assume that we will only ever create one swap chain.
+        // The old swap chain is retired by then, but frames in flight may still present to it. Passing it lets the implementation hand over
+        // its resources and keep those presents going while we already render to the new one.
+        create_info.oldSwapchain = old_swap_chain;
 
-        if (vkCreateSwapchainKHR(logical_device_, &create_info, nullptr, &swap_chain_) != VK_SUCCESS)
+        if (vkCreateSwapchainKHR(logical_device_, &create_info, allocator_, &swap_chain_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create swap chain!");
         }
@@ -793,92 +1744,201 @@ private:
         vkGetSwapchainImagesKHR(logical_device_, swap_chain_, &image_count, nullptr);
         swap_chain_images_.resize(image_count); // We only specified the minimum num of images, so the swap chain could potentially contain more -> We have to resize!
         vkGetSwapchainImagesKHR(logical_device_, swap_chain_, &image_count, swap_chain_images_.data());
+
+        swap_chain_present_policy_ = present_policy_;
+        swap_chain_present_mode_ = present_mode;
+
+#ifndef NDEBUG
+        std::cout << "Swap chain: " << GetPresentPolicyName(present_policy_) << " -> " << GetPresentModeName(present_mode) << ", "
+            << image_count << " images" << std::endl;
+#endif
+    }
+
+    // Headless stand-in for the swap chain: A few color images we render into round robin, as if they had been acquired from a swap chain.
+    // Besides being rendered to, they can be copied from, e.g. to read back the results.
+    void CreateOffscreenImages()
+    {
+        swap_chain_image_format_ = OFFSCREEN_IMAGE_FORMAT;
+        swap_chain_extent_ = { SCREEN_WIDTH, SCREEN_HEIGHT };
+
+        // One image more than frames in flight, like a triple buffered swap chain with two frames in flight.
+        // That way the CPU can start the next frame while the GPU still renders into all other images.
+        uint32_t num_images = GetNumFramesInFlight() + 1;
+        swap_chain_images_.resize(num_images);
+        offscreen_image_allocations_.resize(num_images);
+        for (uint32_t i = 0; i < num_images; i++)
+        {
+            CreateImage(swap_chain_extent_.width, swap_chain_extent_.height, 1, VK_SAMPLE_COUNT_1_BIT, swap_chain_image_format_, VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, DEVICE_LOCAL_MEMORY,
+                DeviceMemoryCategory::RenderTarget, "Offscreen color target", swap_chain_images_[i], offscreen_image_allocations_[i]);
+        }
+
+        next_offscreen_image_ = 0;
     }
 
+    // Retires the swap chain and everything that depends on its size. Frames in flight may still use them, so they're destroyed later by the deletion queue.
     void CleanUpSwapChain()
     {
+        // Every frame that could have used the objects has been submitted to the graphics queue already.
+        uint64_t last_use = graphics_timeline_.GetLastSubmittedValue();
+
         // multisampled color buffer (MSAA)
-        vkDestroyImageView(logical_device_, color_image_view_, nullptr);
-        vkDestroyImage(logical_device_, color_image_, nullptr);
-        vkFreeMemory(logical_device_, color_image_memory_, nullptr);
+        deletion_queue_.RetireImageView(color_image_view_, last_use);
+        deletion_queue_.RetireAllocation(color_image_allocation_, last_use);
 
         // depth buffer
-        vkDestroyImageView(logical_device_, depth_image_view_, nullptr);
-        vkDestroyImage(logical_device_, depth_image_, nullptr);
-        vkFreeMemory(logical_device_, depth_image_memory_, nullptr);
+        deletion_queue_.RetireImageView(depth_image_view_, last_use);
+        resource_states_.Unregister(depth_image_);
+        deletion_queue_.RetireAllocation(depth_image_allocation_, last_use);
+
+        // scene color target, which is upscaled to the swap chain images
+        deletion_queue_.RetireImageView(scene_color_image_view_, last_use);
+        deletion_queue_.RetireAllocation(scene_color_image_allocation_, last_use);
+
+        deletion_queue_.RetireFramebuffer(scene_framebuffer_, last_use);
+
+        if (IsHeadless())
+        {
+            // Offscreen images are ours, so the timeline tells us exactly when they aren't used anymore.
+            for (DeviceAllocationHandle allocation : offscreen_image_allocations_)
+            {
+                deletion_queue_.RetireAllocation(allocation, last_use);
+            }
+            return;
+        }
 
-        for (auto framebuffer : swap_chain_framebuffers_)
+        // The timeline only tells us when rendering is done, not when the presentation engine is done with the images. Its values count submissions
+        // (uploads and defragmentation steps as well), not presents, so no value guarantees that the last present of the old swap chain is complete.
+        // vkDestroySwapchainKHR requires exactly that.
+        // The new swap chain is created with the old one as oldSwapchain, so it still goes through the deletion queue instead of being destroyed here.
+        if (is_swapchain_maintenance1_enabled_)
         {
-            vkDestroyFramebuffer(logical_device_, framebuffer, nullptr);
+            // Every present signals a fence. Once the last one of the old swap chain is signaled, the presentation engine is done with it.
+            // The deletion queue takes over that fence. Nothing has been presented yet -> Only rendering may still use the swap chain.
+            if (last_present_fence_ != VK_NULL_HANDLE)
+            {
+                pending_present_fences_.erase(std::find(pending_present_fences_.begin(), pending_present_fences_.end(), last_present_fence_));
+                deletion_queue_.RetireSwapchain(swap_chain_, last_present_fence_);
+                last_present_fence_ = VK_NULL_HANDLE;
+            }
+            else
+            {
+                deletion_queue_.RetireSwapchain(swap_chain_, last_use);
+            }
+            return;
         }
 
-        // We don't have to recreate the whole command pool.
-        vkFreeCommandBuffers(logical_device_, command_pool_, static_cast<uint32_t>(command_buffers_.size()), command_buffers_.data());
+        // Fallback without present fences: Wait for the present queue. The presents wait for the frames' semaphores,
+        // so this includes the rendering of the frames in flight.
+        vkQueueWaitIdle(present_queue_);
+        deletion_queue_.RetireSwapchain(swap_chain_, last_use);
+    }
 
-        vkDestroyPipeline(logical_device_, graphics_pipeline_, nullptr);
-        vkDestroyPipelineLayout(logical_device_, pipeline_layout_, nullptr);
+    // The render pass and the pipeline only depend on the format of the swap chain, not on its size.
+    void CleanUpRenderPipeline()
+    {
+        uint64_t last_use = graphics_timeline_.GetLastSubmittedValue();
 
-        vkDestroyRenderPass(logical_device_, render_pass_, nullptr);
+        deletion_queue_.RetirePipeline(graphics_pipeline_, last_use);
+        deletion_queue_.RetirePipelineLayout(pipeline_layout_, last_use);
 
-        for (auto image_view : swap_chain_image_views_)
-        {
-            vkDestroyImageView(logical_device_, image_view, nullptr);
-        }
+        deletion_queue_.RetireRenderPass(render_pass_, last_use);
+    }
 
-        vkDestroySwapchainKHR(logical_device_, swap_chain_, nullptr);
+    // Uniform buffers and descriptor sets exist once per frame in flight. They are independent of the swap chain.
+    void CleanUpPerFrameResources()
+    {
+        uint64_t last_use = graphics_timeline_.GetLastSubmittedValue();
 
-        // Clean up uniform buffer here, as it depends on the number of images in the swap chain.
-        for (size_t i = 0; i < swap_chain_images_.size(); i++)
+        for (size_t i = 0; i < uniform_buffer_allocations_.size(); i++)
         {
-            vkDestroyBuffer(logical_device_, uniform_buffers_[i], nullptr);
-            vkFreeMemory(logical_device_, uniform_buffers_memory_[i], nullptr);
+            deletion_queue_.RetireAllocation(uniform_buffer_allocations_[i], last_use);
         }
 
-        // The descriptor pool also depends on the number of swap chain images
-        vkDestroyDescriptorPool(logical_device_, descriptor_pool_, nullptr);
+        // Destroying the pool frees the descriptor sets as well
+        deletion_queue_.RetireDescriptorPool(descriptor_pool_, last_use);
     }
 
     // Recreate SwapChain and all things depending on it.
     void RecreateSwapChain()
     {
-        int width = 0;
-        int height = 0;
-        glfwGetFramebufferSize(window_, &width, &height);
-
-        // In case we minimize the frame buffer will have size 0.
-        // -> We pause the application until it has a frame buffer with a valid size again.
-        while (width == 0 || height == 0)
+        // In case we minimize the frame buffer will have size 0. The main thread doesn't build any packets then,
+        // but the window may have been minimized after the packet of this frame was built. A swap chain can't have a size of 0.
+        // -> Keep the old swap chain and try again after the next frame.
+        VkSurfaceCapabilitiesKHR capabilities;
+        vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device_, surface_, &capabilities);
+        if (capabilities.currentExtent.width == 0 || capabilities.currentExtent.height == 0)
         {
-            glfwGetFramebufferSize(window_, &width, &height);
-            glfwWaitEvents();
+            was_frame_buffer_resized_ = true;
+            RequestRedraw();
+            return;
         }
 
-        // Wait until resources aren't used anymore
-        vkDeviceWaitIdle(logical_device_);  
+        // The frame which ran into the outdated swap chain hasn't been presented. When rendering on demand, nobody else would ask for another one.
+        RequestRedraw();
+
+        // We don't wait for the whole device here. The old objects are retired and destroyed by the deletion queue once the frames in flight are done with them.
+        // The swap chain itself needs its presents to be complete. With VK_EXT_swapchain_maintenance1 that's tracked by present fences, so a resize
+        // doesn't wait for anything. Without it, CleanUpSwapChain() still has to wait for the present queue, i.e. for the frames in flight.
+
+        num_swap_chain_recreations_++;
+
+#ifndef NDEBUG
+        auto recreation_start_time = std::chrono::steady_clock::now();
+#endif
 
-        // ^^^ This kinda sucks, because we have to stop rendering in order to recreate the swap chain.
-        // We could pass the old swap chain object to the vkSwapchainCreateInfoKHR struct and then destroy the old swap chain
-        // as soon as we're finished with it.
+        // Attribute the destruction and recreation of all swap chain dependent objects to an own tag,
+        // so that resizing the window doesn't pollute the steady state statistics.
+        host_allocations_.SetTag(HostAllocationTag::SwapChainRecreation);
 
-        // Clean up old objects
+        // Retire old objects. Only the swap chain and the attachments depend on the size of the window.
+        VkSwapchainKHR old_swap_chain = swap_chain_;
+        VkFormat old_format = swap_chain_image_format_;
         CleanUpSwapChain();
 
         // Then recreate swap chain itself, and subsequently everything that depends on it
-        CreateSwapChain();  
-        CreateImageViews(); // -> Are based directly on the swap chain images
-        CreateRenderPass(); // -> Depends on the format of the swap chain (format probably won't change, but it doesn't hurt to handle this case)
-        CreateGraphicsPipeline();   // -> Viewport and scissor rectangle size is specified here.
-                                    // We could skip this by using a dynamic state for the viewport / scissor rects
-         
+        CreateSwapChain(old_swap_chain);
+
+        // The render pass depends on the format of the swap chain. It probably won't change, but it doesn't hurt to handle this case.
+        // Viewport and scissor are dynamic states, so a new size alone doesn't require a new pipeline.
+        if (swap_chain_image_format_ != old_format)
+        {
+            CleanUpRenderPipeline();
+            CreateRenderPass();
+            CreateGraphicsPipeline();
+        }
+
         CreateColorResources();
         CreateDepthResources();
 
         // These directly depend on the swap chain images
         CreateFramebuffers();
-        CreateUniformBuffers();
-        CreateDescriptorPool();
-        CreateDescriptorSets();
-        CreateCommandBuffers();
+
+        // The readback buffers have the size of the swap chain images. They're only replaced if size or format have changed, e.g. not for a new present policy.
+        // Captures in flight still finish with the old buffers, we don't wait for them.
+        frame_readback_.Resize(swap_chain_extent_, swap_chain_image_format_);
+
+        // Uniform buffers and descriptor sets belong to the frames in flight, so they survive the recreation.
+        // No frame has rendered to the new swap chain images yet. The old ones are handled by the deletion queue.
+        image_timeline_values_.assign(swap_chain_images_.size(), 0);
+
+        // Submit the layout transition of the new depth image. It's executed before the next frame, because both go to the same queue.
+        upload_context_.Submit();
+
+        host_allocations_.SetTag(HostAllocationTag::SteadyState);
+
+#ifndef NDEBUG
+        auto recreation_end_time = std::chrono::steady_clock::now();
+        std::cout << "Recreated swap chain (" << swap_chain_extent_.width << "x" << swap_chain_extent_.height << ") in "
+            << std::chrono::duration<double, std::milli>(recreation_end_time - recreation_start_time).count() << " ms"
+            << (is_swapchain_maintenance1_enabled_ ? "" : ", including the wait for the present queue") << std::endl;
+#endif
+
+        if (enable_host_allocation_tracking_)
+        {
+            // Numbers are accumulated over all recreations so far
+            host_allocations_.PrintReport(std::cout, HostAllocationTag::SwapChainRecreation);
+        }
     }
 
     VkSurfaceFormatKHR ChooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& available_formats)
@@ -897,24 +1957,6 @@ private:
         return available_formats[0];
     }
 
-    VkPresentModeKHR ChooseSwapPresentMode(const std::vector<VkPresentModeKHR>& available_present_modes)
-    {
-        // VK_PRESENT_MODE_IMMEDIATE_KHR - Submitted images are transferred to screen right away => Possible tearing. Guaranteed to be available.
-        // VK_PRESENT_MODE_FIFO_KHR - Swap chain is fifo queue. Images are taken from queue on display refresh. If queue is full the program has to wait -> Similar to vsync!
-        // VK_PRESENT_MODE_FIFO_RELAXED_KHR - Similar to VK_PRESENT_MODE_FIFO_KHR, but if swap chain is empty the next rendered image will be shown instantly -> Possible tearing.
-        // VK_PRESENT_MODE_MAILBOX_KHR - Similar to VK_PRESENT_MODE_FIFO_KHR, but if queue is full the application just replaces the already queued images. Can be used for triple buffering.
-
-        for (const auto& available_present_mode : available_present_modes)
-        {
-            if (available_present_mode == VK_PRESENT_MODE_MAILBOX_KHR)
-            {
-                return available_present_mode;
-            }
-        }
-
-        return VK_PRESENT_MODE_FIFO_KHR;
-    }
-
     VkExtent2D ChooseSwapExtent(const VkSurfaceCapabilitiesKHR& capabilities)
     {
         // Swap extent is the resolution of the swap chain images in PIXELS! We have to keep that in mind for high DPI screens, e.g. Retina displays.
@@ -929,14 +1971,9 @@ private:
             // Some window managers allow extends that differ from window resolution, as indicated by setting the width and height in currentExtent to max of uint32_t.
             // In that case, pick the resolution that best matches the window within the minImageExtent and maxImageExtent bounds.
 
-            // Important: We have to query the frame buffer size from glfw to get the window extents in PIXELS instead of screen coordinates.
-            int width, height;
-            glfwGetFramebufferSize(window_, &width, &height);   
-
-            VkExtent2D actual_extent = {
-                static_cast<uint32_t>(width),
-                static_cast<uint32_t>(height)
-            };
+            // Important: We have to use the frame buffer size from glfw to get the window extents in PIXELS instead of screen coordinates.
+            // The swap chain is recreated on the render thread, which can't call glfw. -> Use the size the main thread has put into the last packet.
+            VkExtent2D actual_extent = framebuffer_extent_;
 
             // Clamp to range [minImageExtent, maxImageExtent]
             actual_extent.width = std::max(capabilities.minImageExtent.width, std::min(capabilities.maxImageExtent.width, actual_extent.width));
@@ -960,7 +1997,7 @@ private:
         view_info.subresourceRange.layerCount = 1;
 
         VkImageView image_view;
-        if (vkCreateImageView(logical_device_, &view_info, nullptr, &image_view) != VK_SUCCESS)
+        if (vkCreateImageView(logical_device_, &view_info, allocator_, &image_view) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create image view!");
         }
@@ -968,20 +2005,6 @@ private:
         return image_view;
     }
 
-    void CreateImageViews()
-    {
-        // To use any VkImage (e.g. those in the swap chain) in the render pipeline we have to create a VkImageView object.
-        // An image view describes how to access the image and which part of the image to access,
-        // e.g. if it should be treated as a 2D depth texture without any mipmapping levels.
-
-        swap_chain_image_views_.resize(swap_chain_images_.size());
-
-        for (size_t i = 0; i < swap_chain_images_.size(); ++i)
-        {
-            swap_chain_image_views_[i] = CreateImageView(swap_chain_images_[i], swap_chain_image_format_, VK_IMAGE_ASPECT_COLOR_BIT, 1);
-        }
-    }
-
     bool CheckValidationLayerSupport()
     {
         uint32_t layer_count;
@@ -1062,7 +2085,7 @@ private:
         color_attachment_resolve.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         color_attachment_resolve.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
         color_attachment_resolve.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        color_attachment_resolve.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        color_attachment_resolve.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;   // We resolve into the scene color target, which is blitted to the swap chain image afterwards
 
         VkAttachmentDescription depth_attachment{};
         depth_attachment.format = FindDepthFormat();
@@ -1124,9 +2147,10 @@ private:
 
         // Specify the operations to wait on and the stages in which these operations occur
 
-        dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;    
+        dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
         // ^^^ We need to wait for the swap chain to finish reading from the image before we can access it
         // The depth image is first accessed in the early fragment test pipeline 
+        // The blit of the previous frame has to be done reading the scene color target before the resolve overwrites it
         dependency.srcAccessMask = 0;
 
         // Prevent the transition from happening until it's actually necessary (and allowed): when we want to start writing colors to it.
@@ -1145,10 +2169,20 @@ private:
         render_pass_info.pAttachments = attachments.data();
         render_pass_info.subpassCount = 1;
         render_pass_info.pSubpasses = &subpass;
-        render_pass_info.dependencyCount = 1;
-        render_pass_info.pDependencies = &dependency;
-
-        if (vkCreateRenderPass(logical_device_, &render_pass_info, nullptr, &render_pass_) != VK_SUCCESS)
+        // The blit after the render pass reads what the resolve has written. The built-in dependency at the end of the render pass doesn't cover that.
+        VkSubpassDependency upscale_dependency{};
+        upscale_dependency.srcSubpass = 0;
+        upscale_dependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+        upscale_dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;   // The resolve happens in this stage
+        upscale_dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        upscale_dependency.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        upscale_dependency.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+        std::array<VkSubpassDependency, 2> dependencies = { dependency, upscale_dependency };
+        render_pass_info.dependencyCount = static_cast<uint32_t>(dependencies.size());
+        render_pass_info.pDependencies = dependencies.data();
+
+        if (vkCreateRenderPass(logical_device_, &render_pass_info, allocator_, &render_pass_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create render pass!");
         }
@@ -1180,7 +2214,7 @@ private:
         layout_info.bindingCount = static_cast<uint32_t>(bindings.size()); // Accepts array of bindings -> We have to specify the count
         layout_info.pBindings = bindings.data();
 
-        if (vkCreateDescriptorSetLayout(logical_device_, &layout_info, nullptr, &descriptor_set_layout_) != VK_SUCCESS)
+        if (vkCreateDescriptorSetLayout(logical_device_, &layout_info, allocator_, &descriptor_set_layout_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create descriptor set layout!");
         }
@@ -1240,27 +2274,16 @@ private:
 
         // Viewports and scissors
         // Viewport describes the region of the framebuffer that output will be rendered to (almost always (0, 0) to (width, height))
-        VkViewport viewport{};
-        viewport.x = 0.0f;
-        viewport.y = 0.0f;
-        viewport.width = static_cast<float>(swap_chain_extent_.width);  // We'll use the swap chain images as frame buffers, so we use their corresponding extent
-        viewport.height = static_cast<float>(swap_chain_extent_.height);
-        viewport.minDepth = 0.0f;   // must be in range [0.0, 1.0]
-        viewport.maxDepth = 1.0f;   // must be in range [0.0, 1.0]
-
         // Scissor rectangles define in which regions pixels will actually be stored.
         // Any pixels outside the scissor rectangles will be discarded by the rasterizer.
-        VkRect2D scissor{};
-        scissor.offset = { 0, 0 };
-        scissor.extent = swap_chain_extent_;
-
-        // Combine both viewport and scissor rect into a viewport state
+        // Both are dynamic states (see below) and set while recording, so the pipeline doesn't depend on the size of the swap chain.
+        // Only the number of viewports and scissors is part of the pipeline.
         VkPipelineViewportStateCreateInfo viewport_state_info{};
         viewport_state_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
         viewport_state_info.viewportCount = 1;  // Some GPUs support multiple
-        viewport_state_info.pViewports = &viewport;
+        viewport_state_info.pViewports = nullptr;   // Ignored, because the viewport is dynamic
         viewport_state_info.scissorCount = 1;   // Some GPUs support multiple
-        viewport_state_info.pScissors = &scissor;
+        viewport_state_info.pScissors = nullptr;    // Ignored, because the scissor is dynamic
 
         // Rasterizer: takes the geometry that is shaped by the vertices from the vertex shader and turns it into fragments to be colored by the fragment shader.
         // Also performs depth testing, face culling and the scissor test, can be configured to output fragments that fill entire polygons or just the edges (wireframe rendering). 
@@ -1339,16 +2362,16 @@ private:
         // e.g. size of the viewport, line width and blend constants.
         // Specifying this will cause the configuration of these values to be ignored and we will be required to specify the data at drawing time.
         // Can be nullptr if we don't use dynamic states.
-         
-        //VkDynamicState dynamic_states[] = {
-        //    VK_DYNAMIC_STATE_VIEWPORT,
-        //    VK_DYNAMIC_STATE_LINE_WIDTH
-        //};
+        // We make viewport and scissor dynamic, so resizing the window doesn't require us to recreate the pipeline.
+        VkDynamicState dynamic_states[] = {
+            VK_DYNAMIC_STATE_VIEWPORT,
+            VK_DYNAMIC_STATE_SCISSOR
+        };
 
-        //VkPipelineDynamicStateCreateInfo dynamic_state_info{};
-        //dynamic_state_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-        //dynamic_state_info.dynamicStateCount = 2;
-        //dynamic_state_info.pDynamicStates = dynamic_states;
+        VkPipelineDynamicStateCreateInfo dynamic_state_info{};
+        dynamic_state_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+        dynamic_state_info.dynamicStateCount = 2;
+        dynamic_state_info.pDynamicStates = dynamic_states;
 
         // Pipeline layout - Describes the usage of uniforms.
         // Uniform values are globals similar to dynamic state variables that can be changed at drawing time to alter the behavior of your shaders 
@@ -1363,7 +2386,7 @@ private:
         pipeline_layout_info.pushConstantRangeCount = 0; // Optional, push constants are another way of passing dynamic values to shaders 
         pipeline_layout_info.pPushConstantRanges = nullptr; // Optional
 
-        if (vkCreatePipelineLayout(logical_device_, &pipeline_layout_info, nullptr, &pipeline_layout_) != VK_SUCCESS)
+        if (vkCreatePipelineLayout(logical_device_, &pipeline_layout_info, allocator_, &pipeline_layout_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create pipeline layout!");
         }
@@ -1379,7 +2402,7 @@ private:
         pipeline_create_info.pMultisampleState = &multisampling_info;
         pipeline_create_info.pDepthStencilState = &depth_stencil_info; // Have to add this if we use a depth attachment
         pipeline_create_info.pColorBlendState = &color_blending_info;
-        pipeline_create_info.pDynamicState = nullptr; // Optional
+        pipeline_create_info.pDynamicState = &dynamic_state_info;
         pipeline_create_info.layout = pipeline_layout_;
         pipeline_create_info.renderPass = render_pass_;
         pipeline_create_info.subpass = 0;   // index of the sub pass where this graphics pipeline will be used
@@ -1392,14 +2415,14 @@ private:
         uint32_t create_info_count = 1; // We could create multiple render pipelines at once.
         VkPipelineCache pipeline_cache = VK_NULL_HANDLE;    // can be used to store and reuse data relevant to pipeline creation across multiple calls to vkCreateGraphicsPipelines
                                                             // and even across program executions if the cache is stored to a file. 
-        if (vkCreateGraphicsPipelines(logical_device_, pipeline_cache, create_info_count, &pipeline_create_info, nullptr, &graphics_pipeline_) != VK_SUCCESS)
+        if (vkCreateGraphicsPipelines(logical_device_, pipeline_cache, create_info_count, &pipeline_create_info, allocator_, &graphics_pipeline_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create graphics pipeline!");
         }
 
         // Finally clean up the shader modules
-        vkDestroyShaderModule(logical_device_, frag_shader_module, nullptr);
-        vkDestroyShaderModule(logical_device_, vert_shader_module, nullptr);
+        vkDestroyShaderModule(logical_device_, frag_shader_module, allocator_);
+        vkDestroyShaderModule(logical_device_, vert_shader_module, allocator_);
     }
 
     VkShaderModule CreateShaderModule(const std::vector<char>& code)
@@ -1410,7 +2433,7 @@ private:
         create_info.pCode = reinterpret_cast<const uint32_t*>(code.data()); // Have to reinterpret cast here because we got char* but uint32_t* is expected.
 
         VkShaderModule shader_module;
-        if (vkCreateShaderModule(logical_device_, &create_info, nullptr, &shader_module) != VK_SUCCESS)
+        if (vkCreateShaderModule(logical_device_, &create_info, allocator_, &shader_module) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create shader module!");
         }
@@ -1420,436 +2443,413 @@ private:
 
     void CreateFramebuffers()
     {
-        // Create frame buffer for each image view in our swap chain
-        swap_chain_framebuffers_.resize(swap_chain_image_views_.size());
-        for (size_t i=0; i < swap_chain_image_views_.size(); i++)
+        // The attachments are the same for every swap chain image, so a single frame buffer is enough.
+        // This has to be in the correct order, as specified in the render pass!
+        std::array<VkImageView, 3> attachments = 
         {
-            // This has to be in the correct order, as specified in the render pass!
-            std::array<VkImageView, 3> attachments = 
-            {
-                color_image_view_,
-                depth_image_view_,  // depth buffer can be used by all of the swap chain images, because only a single subpass is running at the same time
-                swap_chain_image_views_[i] // Color attachment differs for every swap chain image
-            };
-
-            VkFramebufferCreateInfo frambuffer_info{};
-            frambuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-            frambuffer_info.renderPass = render_pass_;  // Framebuffer needs to be compatible with this render pass -> Use same number and types of attachments
-            frambuffer_info.attachmentCount = static_cast<uint32_t>(attachments.size());
-            frambuffer_info.pAttachments = attachments.data(); // Specify the VkImageView objects that should be bound to the respective attachment descriptions
-                                                               // in the render pass pAttachment array.
-            frambuffer_info.width = swap_chain_extent_.width;
-            frambuffer_info.height = swap_chain_extent_.height;
-            frambuffer_info.layers = 1; // swap chain images are single images -> 1 layer.
-
-            if (vkCreateFramebuffer(logical_device_, &frambuffer_info, nullptr, &swap_chain_framebuffers_[i]) != VK_SUCCESS)
-            {
-                throw std::runtime_error("Failed to create framebuffer!");
-            }
-        }
+            color_image_view_,
+            depth_image_view_,  // depth buffer can be used by all frames, because only a single subpass is running at the same time
+            scene_color_image_view_
+        };
 
+        VkFramebufferCreateInfo frambuffer_info{};
+        frambuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        frambuffer_info.renderPass = render_pass_;  // Framebuffer needs to be compatible with this render pass -> Use same number and types of attachments
+        frambuffer_info.attachmentCount = static_cast<uint32_t>(attachments.size());
+        frambuffer_info.pAttachments = attachments.data(); // Specify the VkImageView objects that should be bound to the respective attachment descriptions
+                                                           // in the render pass pAttachment array.
+        frambuffer_info.width = swap_chain_extent_.width;   // The full size. With a lower resolution scale we only render into a part of it.
+        frambuffer_info.height = swap_chain_extent_.height;
+        frambuffer_info.layers = 1; // swap chain images are single images -> 1 layer.
+
+        if (vkCreateFramebuffer(logical_device_, &frambuffer_info, allocator_, &scene_framebuffer_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create framebuffer!");
+        }
     }
 
-    void CreateCommandPool()
+    void CreateFrameReadback()
     {
-
-        // Command buffers are executed by submitting them on one of the device queues, like the graphics and presentation queues we retrieved. 
-        // Each command pool can only allocate command buffers that are submitted on a single type of queue. 
-        QueueFamilyIndices queue_family_indices = FindQueueFamilies(physical_device_);
-        VkCommandPoolCreateInfo pool_info{};
-        pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-        pool_info.queueFamilyIndex = queue_family_indices.graphics_family.value();   // We only use drawing commands, so we stick to the graphics queue family.
-        pool_info.flags = 0;    // Optional.
-                                // VK_COMMAND_POOL_CREATE_TRANSIENT_BIT: Hint that command buffers are rerecorded with new commands very often (may change memory allocation behavior)
-                                // VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT: Allow command buffers to be rerecorded individually.
-                                // Without this flag they all have to be reset together.
-                                // For now we will only fill the command buffer once at the beginning of the program, so we don't use on any of the flags.
-                           
-        if (vkCreateCommandPool(logical_device_, &pool_info, nullptr, &command_pool_) != VK_SUCCESS)
+        if (launch_options_.capture_directory.empty())
         {
-            throw std::runtime_error("failed to create command pool!");
+            return;
         }
+
+        // Each buffer is busy from the copy until the worker thread has written the frame. A few extra buffers let encoding lag behind a little
+        // before we have to drop frames.
+        uint32_t num_readback_buffers = GetNumFramesInFlight() + 2;
+        frame_readback_.Init(&device_memory_, &graphics_timeline_, swap_chain_extent_, swap_chain_image_format_, num_readback_buffers,
+            launch_options_.capture_directory, launch_options_.capture_format);
     }
 
-    VkCommandBuffer BeginSingleTimeCommands()
+    void CreateCommandPool()
     {
-        VkCommandBufferAllocateInfo alloc_info{};
-        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        alloc_info.commandPool = command_pool_;
-        alloc_info.commandBufferCount = 1;
-
-        VkCommandBuffer command_buffer;
-        vkAllocateCommandBuffers(logical_device_, &alloc_info, &command_buffer);
-
-        VkCommandBufferBeginInfo begin_info{};
-        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        // Command buffers are executed by submitting them on one of the device queues, like the graphics and presentation queues we retrieved. 
+        // Each command pool can only allocate command buffers that are submitted on a single type of queue. 
+        // We only use drawing commands, so we stick to the graphics queue family.
+        QueueFamilyIndices queue_family_indices = FindQueueFamilies(physical_device_);
 
-        vkBeginCommandBuffer(command_buffer, &begin_info);
+        // Instead of one pool we create one per frame in flight and recording thread:
+        //  * Command pools are not thread safe, so each thread that records commands needs an own pool.
+        //  * A pool can be reset as a whole once the GPU is done with the frame that used it. That's a lot cheaper than freeing every command buffer individually.
+        // The pools are created with VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, as we rerecord the command buffers every frame.
+        // We create pools for MAX_RECORDING_THREADS chunks regardless of the number of cores. Unused pools are cheap.
+        frame_command_pools_.Init(logical_device_, allocator_, queue_family_indices.graphics_family.value(), GetNumFramesInFlight(), MAX_RECORDING_THREADS);
 
-        return command_buffer;
+#ifndef NDEBUG
+        std::cout << "Recording draws with up to " << recording_workers_.GetNumThreads() << " threads" << std::endl;
+#endif
     }
 
-    void EndSingleTimeCommands(VkCommandBuffer command_buffer)
+    void CreateUploadContext()
     {
-        vkEndCommandBuffer(command_buffer);
-
-        // Submit the command buffer to complete the operations
-        VkSubmitInfo submit_info{};
-        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submit_info.commandBufferCount = 1;
-        submit_info.pCommandBuffers = &command_buffer;
-
-        vkQueueSubmit(graphics_queue_, 1, &submit_info, VK_NULL_HANDLE);
-
-        // Execute transfer immediately. We could use a fence to wait for this to be executed
-        // or we simply wait for the transfer queue to be idle.
-        // -> A fence would allow us to schedule multiple transfers at the same time instead of doing one transfer at a time.
-        // -> There's more room for performance optimizations
-        vkQueueWaitIdle(graphics_queue_);
-
-        // TODO: 
-        // Combine these operations in a single command buffer and execute them asynchronously for higher throughput, especially the transitions and copy in the createTextureImage function.
-        // Try to experiment with this by creating a setupCommandBuffer that the helper functions record commands into, and add a flushSetupCommands to execute the commands that have 
-        // been recorded so far. It's best to do this after the texture mapping works to check if the texture resources are still set up correctly.
+        // Copies and layout transitions used to be submitted one at a time, each followed by vkQueueWaitIdle.
+        // Instead the helper functions below record into the command buffer of the upload context, which we can track with the timelines.
+        // If there is a dedicated transfer queue, the copies are executed there and handed over to the graphics queue afterwards.
+        QueueFamilyIndices queue_family_indices = FindQueueFamilies(physical_device_);
+        uint32_t graphics_family = queue_family_indices.graphics_family.value();
+        uint32_t transfer_family = queue_family_indices.transfer_family.value_or(graphics_family);
+        upload_context_.Init(logical_device_, allocator_, transfer_family, &GetTransferTimeline(), graphics_family, &graphics_timeline_);
 
-        // Once the transfer is done we can clean up.
-        vkFreeCommandBuffers(logical_device_, command_pool_, 1, &command_buffer);
+#ifndef NDEBUG
+        std::cout << "Uploads use " << (upload_context_.HasDedicatedTransferQueue() ? "a dedicated transfer queue" : "the graphics queue") << std::endl;
+#endif
     }
 
-    void CreateCommandBuffers()
+    // Records the commands to render a frame into the given swap chain image.
+    // The scene is rendered into the scene color target at the current render resolution, which is then upscaled to the swap chain image.
+    //
+    // The draws themselves are recorded into secondary command buffers by multiple threads, see RecordDrawChunks().
+    // The primary command buffer only begins the render pass, executes the secondaries and ends the pass again.
+    void RecordCommandBuffer(VkCommandBuffer command_buffer, uint32_t image_index, const DrawCall* draw_calls, uint32_t num_draw_calls)
     {
-        // Because one of the drawing commands involves binding the right VkFramebuffer, we have to record a command buffer for every image in the swap chain.
-        command_buffers_.resize(swap_chain_framebuffers_.size());
+        std::array<VkCommandBuffer, MAX_RECORDING_THREADS> secondary_command_buffers;
+        uint32_t num_secondary_command_buffers = RecordDrawChunks(draw_calls, num_draw_calls, MAX_RECORDING_THREADS, secondary_command_buffers.data());
 
-        VkCommandBufferAllocateInfo alloc_info{};
-        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        alloc_info.commandPool = command_pool_;
-        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY; // Specifies if the allocated command buffers are primary or secondary command buffers
-                                                            // VK_COMMAND_BUFFER_LEVEL_PRIMARY -> Can be submitted to a queue for execution, but cannot be called from other command buffers
-                                                            // VK_COMMAND_BUFFER_LEVEL_SECONDARY -> Cannot be submitted directly, but can be called from primary command buffers.
-        alloc_info.commandBufferCount = static_cast<uint32_t>(command_buffers_.size());
-
-        if (vkAllocateCommandBuffers(logical_device_, &alloc_info, command_buffers_.data()) != VK_SUCCESS)
+        VkCommandBufferBeginInfo begin_info{};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;   // We record the command buffer anew every frame.
+                                                                          // VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT: The command buffer will be rerecorded right after executing it once.
+                                                                          // VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT: This is a secondary command buffer that will be entirely within a single render pass.
+                                                                          // VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT: The command buffer can be resubmitted while it is also already pending execution.
+        begin_info.pInheritanceInfo = nullptr;  // Optional. Specifies which state to inherit from the calling primary command buffers.
+                                                // Only relevant for secondary command buffers.
+
+        if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS)
         {
-            throw std::runtime_error("Failed to allocate command buffers!");
+            throw std::runtime_error("Failed to begin recording command buffer!");
         }
 
-        // For now also record the command buffer since we want to show a static triangle
-        for (size_t i = 0; i < command_buffers_.size(); ++i)
-        {
-            VkCommandBufferBeginInfo begin_info{};
-            begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            begin_info.flags = 0;   // Optional.
-                                    // VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT: The command buffer will be rerecorded right after executing it once.
-                                    // VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT: This is a secondary command buffer that will be entirely within a single render pass.
-                                    // VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT: The command buffer can be resubmitted while it is also already pending execution.
-            begin_info.pInheritanceInfo = nullptr;  // Optional. Specifies which state to inherit from the calling primary command buffers.
-                                                    // Only relevant for secondary command buffers.
-
-            if (vkBeginCommandBuffer(command_buffers_[i], &begin_info) != VK_SUCCESS)
-            {
-                throw std::runtime_error("Failed to begin recording command buffer!");
-            }
-
-            VkRenderPassBeginInfo render_pass_info{};
-            render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-            render_pass_info.renderPass = render_pass_;
-            render_pass_info.framebuffer = swap_chain_framebuffers_[i];
-            render_pass_info.renderArea.offset = { 0, 0 };
-            render_pass_info.renderArea.extent = swap_chain_extent_;    // Pixels outside this region will have undefined values.
-                                                                        // It should match the size of the attachments for best performance.
-        
-            // define the clear values to use for VK_ATTACHMENT_LOAD_OP_CLEAR
-            // IMPORTANT: order of clear_values should be identical to the order of attachments
-            std::array<VkClearValue, 2> clear_values{};
-            clear_values[0].color = { 0.0f, 0.0f, 0.0f, 1.0f };
-            clear_values[1].depthStencil = { 1.0f, 0 }; // 0.0 is at the near view plane, 1.0 lies at the far view plane.
-                                                        // Initial value should be furthest possible depth, i.e. 1.0
-
-            render_pass_info.clearValueCount = static_cast<uint32_t>(clear_values.size());;
-            render_pass_info.pClearValues = clear_values.data();
+        gpu_frame_timer_.WriteFrameStart(command_buffer, current_frame_);
 
-            vkCmdBeginRenderPass(command_buffers_[i], &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+        VkRenderPassBeginInfo render_pass_info{};
+        render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        render_pass_info.renderPass = render_pass_;
+        render_pass_info.framebuffer = scene_framebuffer_;
+        render_pass_info.renderArea.offset = { 0, 0 };
+        render_pass_info.renderArea.extent = render_extent_;    // Pixels outside this region will have undefined values.
+                                                                // It should match the size of the attachments for best performance,
+                                                                // but with a lower resolution scale we only want to pay for the pixels we actually use.
+    
+        // define the clear values to use for VK_ATTACHMENT_LOAD_OP_CLEAR
+        // IMPORTANT: order of clear_values should be identical to the order of attachments
+        std::array<VkClearValue, 2> clear_values{};
+        clear_values[0].color = { 0.0f, 0.0f, 0.0f, 1.0f };
+        clear_values[1].depthStencil = { 1.0f, 0 }; // 0.0 is at the near view plane, 1.0 lies at the far view plane.
+                                                    // Initial value should be furthest possible depth, i.e. 1.0
 
-            vkCmdBindPipeline(command_buffers_[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_pipeline_);
+        render_pass_info.clearValueCount = static_cast<uint32_t>(clear_values.size());;
+        render_pass_info.pClearValues = clear_values.data();
 
-            // We've now told Vulkan which operations to execute in the graphics pipeline and which attachment to use in the fragment shader,
-            // so all that remains is binding the vertex buffer and drawing the triangle
-            VkBuffer vertex_buffers[] = { vertex_buffer_ };
-            VkDeviceSize offsets[] = { 0 };
+        // VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS: The contents of the subpass come from secondary command buffers only.
+        // We can't record any draw commands into the primary command buffer itself until the subpass ends.
+        vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
 
-            // Bind vertex buffer to bindings
-            vkCmdBindVertexBuffers(command_buffers_[i], 0 /*offset*/, 1 /*num bindings*/,
-                vertex_buffers, offsets /*byte offsets to start reading the data from*/); 
-            vkCmdBindIndexBuffer(command_buffers_[i], index_buffer_, 0 /*offset*/, VK_INDEX_TYPE_UINT32);   // We can only bind one index buffer!
-                                                                                                            // Can't use different indices for each vertex attribute (e.g. for normals)
-                                                                                                            // Also: If we have uint32 indices, we have to adjust the type!
+        if (num_secondary_command_buffers > 0)
+        {
+            vkCmdExecuteCommands(command_buffer, num_secondary_command_buffers, secondary_command_buffers.data());
+        }
 
-            // Bind descriptor set to the descriptors in the shader
-            vkCmdBindDescriptorSets(command_buffers_[i], VK_PIPELINE_BIND_POINT_GRAPHICS, // <- have to specify if we bind to graphics or compute pipeline
-                pipeline_layout_, 0, 1, &descriptor_sets_[i], 0, nullptr);
-            vkCmdDrawIndexed(command_buffers_[i], static_cast<uint32_t>(indices_.size()), 1, 0, 0, 0);
+        vkCmdEndRenderPass(command_buffer);
 
-            //vkCmdDraw(command_buffers_[i], static_cast<uint32_t>(vertices.size()), 1, 0, 0);  // <-- Draws without index buffer
-            vkCmdDrawIndexed(command_buffers_[i], static_cast<uint32_t>(indices_.size()), 1, 0, 0, 0); // <- Draws with index buffer
+        RecordUpscale(command_buffer, image_index);
 
-            vkCmdEndRenderPass(command_buffers_[i]);
+        gpu_frame_timer_.WriteFrameEnd(command_buffer, current_frame_);
 
-            if (vkEndCommandBuffer(command_buffers_[i]) != VK_SUCCESS)
-            {
-                throw std::runtime_error("Failed to record command buffer!");
-            }
+        if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to record command buffer!");
         }
     }
 
-    uint32_t FindMemoryType(uint32_t type_filter, VkMemoryPropertyFlags properties)
+    // Blits the rendered part of the scene color target to the whole swap chain image. With a resolution scale of 1 this is a plain copy.
+    void RecordUpscale(VkCommandBuffer command_buffer, uint32_t image_index)
     {
-        // GPU may offer different types of memory which differ in terms of allowed operations or performance.
-        // This function helps to find the available memory which suits our needs best.
-
-        // First query info about available memory types of the physical device
-        // VkPhysicalDeviceMemoryProperties::memoryHeaps -> distinct memory resources (e.g. dedicated VRAM or swap space in RAM when VRAM is depleted)
-        // VkPhysicalDeviceMemoryProperties::memoryTypes -> types which exist inside the memoryHeaps.
-        VkPhysicalDeviceMemoryProperties mem_properties;
-        vkGetPhysicalDeviceMemoryProperties(physical_device_, &mem_properties);
+        VkImage image = swap_chain_images_[image_index];
+
+        VkImageSubresourceRange subresource_range{};
+        subresource_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        subresource_range.levelCount = 1;
+        subresource_range.layerCount = 1;
+
+        // We overwrite the whole image, so its previous contents don't matter -> VK_IMAGE_LAYOUT_UNDEFINED.
+        // The submission waits for the acquire semaphore in the blit stage, so the transition happens after the image has been acquired.
+        frame_barriers_.AddImageBarrier(image, subresource_range, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            VK_PIPELINE_STAGE_2_BLIT_BIT, VK_ACCESS_2_NONE, VK_PIPELINE_STAGE_2_BLIT_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+        frame_barriers_.Flush(command_buffer);
+
+        // The scene color target has been transitioned to VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL by the render pass.
+        VkImageBlit blit{};
+        blit.srcOffsets[0] = { 0, 0, 0 };
+        blit.srcOffsets[1] = { static_cast<int32_t>(render_extent_.width), static_cast<int32_t>(render_extent_.height), 1 };
+        blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        blit.srcSubresource.mipLevel = 0;
+        blit.srcSubresource.baseArrayLayer = 0;
+        blit.srcSubresource.layerCount = 1;
+        blit.dstOffsets[0] = { 0, 0, 0 };
+        blit.dstOffsets[1] = { static_cast<int32_t>(swap_chain_extent_.width), static_cast<int32_t>(swap_chain_extent_.height), 1 };
+        blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        blit.dstSubresource.mipLevel = 0;
+        blit.dstSubresource.baseArrayLayer = 0;
+        blit.dstSubresource.layerCount = 1;
+
+        vkCmdBlitImage(command_buffer,
+            scene_color_image_, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            1, &blit,
+            upscale_filter_);
+
+        // The copy only ends up in a host visible buffer. Reading it happens frames later, once the timeline tells us the copy is done.
+        if (frame_readback_.IsEnabled() && num_rendered_frames_ % launch_options_.capture_interval == 0)
+        {
+            frame_readback_.RecordCopy(command_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_2_BLIT_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                num_rendered_frames_);
+        }
 
-        // Then find a memory type that is suitable for the buffer itself
-        for (uint32_t i = 0; i < mem_properties.memoryTypeCount; i++)
+        // Offscreen images are neither presented nor read afterwards, the next frame that uses them discards the contents anyway.
+        if (IsHeadless())
         {
-            // type_filer specifies the bit field of memory types that are suitable
-            // -> We simply check if the bit is set for the memory types we want to accept
-            bool is_type_accepted = type_filter & (1 << i);
-            if(is_type_accepted)
-            {
-                // We also have to check for the properties of the memory!
-                // For example, we may want to be able to write to a vertex buffer from the CPU, so it has to support
-                // being mapped to the host.
-                // We may have multiple requested properties, so we have to use a bitwise AND operation to check if ALL properties are
-                // supported.
-                bool are_required_properties_supported = (mem_properties.memoryTypes[i].propertyFlags & properties) == properties;
-                if (are_required_properties_supported)
-                {
-                    return i;
-                }
-            }
+            return;
         }
 
-        // Welp, we're screwed.
-        throw std::runtime_error("failed to find suitable memory type!");
+        // Presentation doesn't happen in any pipeline stage. The semaphore we signal at the end of the submission makes the writes available to it.
+        frame_barriers_.AddImageBarrier(image, subresource_range, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+            VK_PIPELINE_STAGE_2_BLIT_BIT | VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE);
+        frame_barriers_.Flush(command_buffer);
     }
 
-    void CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& out_buffer, VkDeviceMemory& out_buffer_memory)
+    // Scales the swap chain extent by the current resolution scale. Both dimensions stay at least 1 pixel.
+    VkExtent2D GetRenderExtent() const
     {
-        VkBufferCreateInfo buffer_info{};
-        buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-        buffer_info.size = size;
-        buffer_info.usage = usage; // Specify how the buffer is used. Can be multiple with bitwise or.
-        buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;    // Buffers can be owned by specific queue families or shared between multiple queue families.
-                                                                // This buffer will only be used by the graphics queue, so we use exclusive access.
-        buffer_info.flags = 0;  // Used to configure sparse buffer memory (not relevant for us right now)
+        float scale = resolution_scaler_.GetScale();
+        VkExtent2D extent;
+        extent.width = std::max(1u, static_cast<uint32_t>(swap_chain_extent_.width * scale + 0.5f));
+        extent.height = std::max(1u, static_cast<uint32_t>(swap_chain_extent_.height * scale + 0.5f));
+        return extent;
+    }
 
-        if (vkCreateBuffer(logical_device_, &buffer_info, nullptr, &out_buffer) != VK_SUCCESS)
+    // Splits the draws into up to max_num_chunks chunks, which are recorded in parallel by the recording workers.
+    // Each chunk gets its own secondary command buffer, taken from the frame command pool of the chunk. Every chunk is recorded by exactly one thread,
+    // so no two threads ever touch the same pool. Returns the number of secondary command buffers written to out_command_buffers, in draw order.
+    uint32_t RecordDrawChunks(const DrawCall* draw_calls, uint32_t num_draw_calls, uint32_t max_num_chunks, VkCommandBuffer* out_command_buffers)
+    {
+        if (num_draw_calls == 0)
         {
-            throw std::runtime_error("Failed to create vertex buffer");
+            return 0;
         }
 
-        // Buffer was created, but no memory has been allocated yet.
-        // We have to do this ourselves!
-
-        // First query memory requirements.
-        VkMemoryRequirements mem_requirements;
-        vkGetBufferMemoryRequirements(logical_device_, out_buffer, &mem_requirements);
-
-        // Then allocate the memory
-        // NOTE: In a real application, we shouldn't allocate memory for every single resource we create. (inefficient / max num of simultaneous mem allocations is limited)
-        // Instead we should allocate a large chunk of memory and then split it up with the offset parameters by using a custom allocator.
-        // See https://github.com/GPUOpen-LibrariesAndSDKs/VulkanMemoryAllocator for examples
-        VkMemoryAllocateInfo alloc_info{};
-        alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        alloc_info.allocationSize = mem_requirements.size;
-        alloc_info.memoryTypeIndex = FindMemoryType(mem_requirements.memoryTypeBits, properties);
+        // Every secondary command buffer has to bind the whole state again and has some fixed cost on its own.
+        // Tiny chunks aren't worth it, so we don't split lists with few draws.
+        uint32_t num_chunks = (num_draw_calls + MIN_DRAWS_PER_CHUNK - 1) / MIN_DRAWS_PER_CHUNK;
+        num_chunks = std::min(num_chunks, std::min(max_num_chunks, MAX_RECORDING_THREADS));
+        uint32_t draws_per_chunk = (num_draw_calls + num_chunks - 1) / num_chunks;
 
-        if (vkAllocateMemory(logical_device_, &alloc_info, nullptr, &out_buffer_memory) != VK_SUCCESS)
+        recording_workers_.Run(num_chunks, [&](uint32_t chunk_index)
         {
-            throw std::runtime_error("failed to allocate vertex buffer memory!");
-        }
-
-        // Finally associate the allocated memory with the vertex buffer
-        vkBindBufferMemory(logical_device_, out_buffer, out_buffer_memory, 0 /*offset within the memory*/);
-    }
-
-    void CopyBuffer(VkBuffer src, VkBuffer dst, VkDeviceSize size)
-    {
-        // Memory transfer operations are executed using command buffers, just like drawing commands
-        // -> We have to create a temporary command buffer
-        // We may want to create a separate command pool for short-lived buffers so we can leverage some memory allocation optimizations.
-        // For this we'd have to use the VK_COMMAND_POOL_CREATE_TRANSIENT_BIT 
-
-        VkCommandBuffer command_buffer = BeginSingleTimeCommands();
+            uint32_t first_draw = chunk_index * draws_per_chunk;
+            uint32_t end_draw = std::min(first_draw + draws_per_chunk, num_draw_calls);
 
-        VkBufferCopy copy_region{};
-        copy_region.srcOffset = 0; // Optional
-        copy_region.dstOffset = 0; // Optional
-        copy_region.size = size;
-        vkCmdCopyBuffer(command_buffer, src, dst, 1, &copy_region);
+            VkCommandBuffer command_buffer = frame_command_pools_.GetSecondaryCommandBuffer(chunk_index);
+            RecordDrawCalls(command_buffer, draw_calls + first_draw, end_draw - first_draw);
+            out_command_buffers[chunk_index] = command_buffer;
+        });
 
-        EndSingleTimeCommands(command_buffer);
+        return num_chunks;
     }
 
-    void CreateImage(uint32_t width, uint32_t height, uint32_t num_mips, VkSampleCountFlagBits num_samples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties,
-                     VkImage& image, VkDeviceMemory& image_memory)
+    // Records a chunk of draws into a secondary command buffer that is executed inside the render pass.
+    void RecordDrawCalls(VkCommandBuffer command_buffer, const DrawCall* draw_calls, uint32_t num_draw_calls)
     {
-        VkImageCreateInfo image_info{};
-        image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-        image_info.imageType = VK_IMAGE_TYPE_2D;
-        image_info.extent.width = static_cast<uint32_t>(width);
-        image_info.extent.height = static_cast<uint32_t>(height);
-        image_info.extent.depth = 1; // One color value per texel
-        image_info.mipLevels = num_mips;
-        image_info.arrayLayers = 1;  // Single texture, no texture array
-        image_info.format = format;
-        image_info.tiling = tiling; // VK_IMAGE_TILING_LINEAR -> Texels are laid out in row-major order like the tex_data array
-                                    // -> If we want to access texels directly in the memory, we have to use this!
-                                    // VK_IMAGE_TILING_OPTIMAL -> Texels are laid out in an implementation defined order for optimal access
-                                    // -> We use this here, because we use a staging buffer instead of a staging image
-        image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;   // VK_IMAGE_LAYOUT_UNDEFINED -> Not usable by the GPU and the very first transition will discard the texels
-                                                                // VK_IMAGE_LAYOUT_PREINITIALIZED -> Not usable by the GPU, but the first transition will preserve the texels.
-                                                                // Useful if we want to use an image as a staging image, e.g. upload data to it and then transition the image to be
-                                                                // a transfer source while preserving the data.
-                                                                // In our case, we transition the image to be a transfer destination and then copy the texel data to it from a buffer.
-        image_info.usage = usage;    // We want to transfer data to this image and we want to access the image in the shader
-        image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE; // Image is only used by the graphics queue family
-        image_info.samples = num_samples; // Related to multisampling. Only needed if image is used as attachment.
-        image_info.flags = 0; // Optional. Related to sparse images.
+        // Secondary command buffers don't inherit anything from the primary command buffer, except for the render pass state we specify here.
+        // Specifying the framebuffer is optional, but it may allow the driver to optimize.
+        VkCommandBufferInheritanceInfo inheritance_info{};
+        inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        inheritance_info.renderPass = render_pass_;
+        inheritance_info.subpass = 0;
+        inheritance_info.framebuffer = scene_framebuffer_;
+
+        VkCommandBufferBeginInfo begin_info{};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;    // Entirely inside of the render pass
+        begin_info.pInheritanceInfo = &inheritance_info;
 
-        if (vkCreateImage(logical_device_, &image_info, nullptr, &image) != VK_SUCCESS)
+        if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS)
         {
-            throw std::runtime_error("Failed to create image!");
+            throw std::runtime_error("Failed to begin recording secondary command buffer!");
         }
 
-        // Allocate memory for the image - Similar to allocating memory for a buffer
-        VkMemoryRequirements mem_requirements;
-        vkGetImageMemoryRequirements(logical_device_, image, &mem_requirements);
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_pipeline_);
 
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = mem_requirements.size;
-        allocInfo.memoryTypeIndex = FindMemoryType(mem_requirements.memoryTypeBits, properties);
+        // Viewport and scissor are dynamic. Dynamic state isn't inherited either, so every secondary command buffer sets them on its own.
+        VkViewport viewport{};
+        viewport.x = 0.0f;
+        viewport.y = 0.0f;
+        viewport.width = static_cast<float>(render_extent_.width);  // Only the part of the frame buffer we render into at the current resolution scale
+        viewport.height = static_cast<float>(render_extent_.height);
+        viewport.minDepth = 0.0f;   // must be in range [0.0, 1.0]
+        viewport.maxDepth = 1.0f;   // must be in range [0.0, 1.0]
+        vkCmdSetViewport(command_buffer, 0, 1, &viewport);
 
-        if (vkAllocateMemory(logical_device_, &allocInfo, nullptr, &image_memory) != VK_SUCCESS)
+        VkRect2D scissor{};
+        scissor.offset = { 0, 0 };
+        scissor.extent = render_extent_;
+        vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+
+        // We've now told Vulkan which operations to execute in the graphics pipeline and which attachment to use in the fragment shader,
+        // so all that remains is binding the vertex buffer and drawing the triangle
+        VkBuffer vertex_buffers[] = { vertex_buffer_ };
+        VkDeviceSize offsets[] = { 0 };
+
+        // Bind vertex buffer to bindings
+        vkCmdBindVertexBuffers(command_buffer, 0 /*offset*/, 1 /*num bindings*/,
+            vertex_buffers, offsets /*byte offsets to start reading the data from*/); 
+        vkCmdBindIndexBuffer(command_buffer, index_buffer_, 0 /*offset*/, VK_INDEX_TYPE_UINT32);   // We can only bind one index buffer!
+                                                                                                        // Can't use different indices for each vertex attribute (e.g. for normals)
+                                                                                                        // Also: If we have uint32 indices, we have to adjust the type!
+
+        // Bind descriptor set to the descriptors in the shader
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, // <- have to specify if we bind to graphics or compute pipeline
+            pipeline_layout_, 0, 1, &descriptor_sets_[current_frame_], 0, nullptr);
+
+        for (uint32_t i = 0; i < num_draw_calls; i++)
         {
-            throw std::runtime_error("Failed to allocate image memory!");
+            const DrawCall& draw_call = draw_calls[i];
+            vkCmdDrawIndexed(command_buffer, draw_call.index_count, 1, draw_call.first_index, draw_call.vertex_offset, 0);
         }
 
-        vkBindImageMemory(logical_device_, image, image_memory, 0);
+        if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to record secondary command buffer!");
+        }
     }
 
-    void TransitionImageLayout(VkImage image, VkFormat format, VkImageLayout old_layout, VkImageLayout new_layout, uint32_t num_mips)
+    // Records a large synthetic draw list with 1, 2, 4 and 8 threads and prints the average recording time for each.
+    // Nothing is submitted, we only measure the CPU side.
+    void BenchmarkCommandRecording()
     {
-        VkCommandBuffer command_buffer = BeginSingleTimeCommands();
-
-        // One of the most common ways to perform layout transitions is to use an "image memory barrier" (or buffer memory barrier for buffers).
-        // A pipeline barrier like that is generally used to synchronize access to resources, like ensuring that a write to a buffer completes before reading from it,
-        // but it can also be used to transition image layouts and transfer queue family ownership when VK_SHARING_MODE_EXCLUSIVE is used.
+        DrawCall draw_call;
+        draw_call.index_count = meshes_[0].index_count;
+        draw_call.first_index = meshes_[0].first_index;
+        draw_call.vertex_offset = meshes_[0].vertex_offset;
+        std::vector<DrawCall> draw_calls(NUM_BENCHMARK_DRAWS, draw_call);
 
-        VkImageMemoryBarrier barrier{};
-        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barrier.image = image;
+        std::cout << "Recording " << NUM_BENCHMARK_DRAWS << " draws, average of " << NUM_BENCHMARK_ITERATIONS << " iterations:" << std::endl;
 
-        barrier.oldLayout = old_layout; // use VK_IMAGE_LAYOUT_UNDEFINED if we don't care about existing contents of the image
-        barrier.newLayout = new_layout;
-        // NOTE: VK_IMAGE_LAYOUT_GENERAL allows all operations, but is not necessarily the most efficient layout.
-        // For example, this is only needed for cases where we need to both read and write to/from an image
-
-        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;  // If we use the barrier to transfer queue family ownership these fields should be the indices of the queue families
-        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;  // Otherwise set to VK_QUEUE_FAMILY_IGNORED (<- THIS IS NOT THE DEFAULT VALUE! DON'T FORGET!)
-
-        // subresourceRange -> the specific part of the image
-        barrier.subresourceRange.baseArrayLayer = 0; // The image is no array
-        barrier.subresourceRange.baseMipLevel = 0;  
-        barrier.subresourceRange.levelCount = num_mips;
-        barrier.subresourceRange.layerCount = 1;    // -> and only 1 layer
-
-        // Ensure proper subresource aspect is used for depth images
-        if (new_layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+        for (uint32_t num_threads = 1; num_threads <= MAX_RECORDING_THREADS; num_threads *= 2)
         {
-            barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-
-            if (HasStencilComponent(format))
+            double total_ms = 0.0;
+            for (uint32_t iteration = 0; iteration < NUM_BENCHMARK_ITERATIONS + NUM_BENCHMARK_WARMUP_ITERATIONS; iteration++)
             {
-                barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
-            }
-        }
-        else
-        {
-            barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        }
+                // Nothing has been submitted from these pools, so we can reset them right away.
+                frame_command_pools_.BeginFrame(current_frame_);
 
-        // We want to use the barrier as synchronization point
-        // -> We have to specify which operations happen BEFORE the sync point and operations have to wait until AFTER the barrier
-        VkPipelineStageFlags source_stage;
-        VkPipelineStageFlags dest_stage;
+                auto start_time = std::chrono::steady_clock::now();
 
-        // There are three transitions we need to handle:
-        if (old_layout == VK_IMAGE_LAYOUT_UNDEFINED && new_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL)  // Transfer writes that don't need to wait on anything
-        {
-            barrier.srcAccessMask = 0;  // writes don't have to wait on anything -> specify an empty access mask 
-            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                std::array<VkCommandBuffer, MAX_RECORDING_THREADS> command_buffers;
+                RecordDrawChunks(draw_calls.data(), NUM_BENCHMARK_DRAWS, num_threads, command_buffers.data());
 
-            source_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;   // earliest possible pipeline stage for pre-barrier operations
-            dest_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;    // not a "real" stage in the graphics/compute pipeline, but a pseudo stage where transfers happen.
-                                                            // See https://www.khronos.org/registry/vulkan/specs/1.1-extensions/man/html/VkPipelineStageFlagBits.html
-        }
-        else if (old_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)  // Shader reads should wait on transfer writes
-        {
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+                auto end_time = std::chrono::steady_clock::now();
+                if (iteration >= NUM_BENCHMARK_WARMUP_ITERATIONS)  // The first iterations allocate the command buffers and grow the pools
+                {
+                    total_ms += std::chrono::duration<double, std::milli>(end_time - start_time).count();
+                }
+            }
 
-            source_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;  // image will be written in this stage
-            dest_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT; // and then it'll be accessed in the fragment shader pipeline stage
+            // If the machine has fewer cores, some threads record more than one chunk.
+            uint32_t num_used_threads = std::min(num_threads, recording_workers_.GetNumThreads());
+            std::cout << "  " << num_threads << " chunks on " << num_used_threads << " threads: "
+                << total_ms / NUM_BENCHMARK_ITERATIONS << " ms" << std::endl;
         }
-        else if (old_layout == VK_IMAGE_LAYOUT_UNDEFINED && new_layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
-        {
-            barrier.srcAccessMask = 0;
+    }
+
+    void CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, const MemoryTypeRequest& memory_request, DeviceMemoryCategory category, const char* debug_name,
+                      VkBuffer& out_buffer, DeviceAllocationHandle& out_allocation)
+    {
+        VkBufferCreateInfo buffer_info{};
+        buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        buffer_info.size = size;
+        buffer_info.usage = usage; // Specify how the buffer is used. Can be multiple with bitwise or.
+        buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;    // Buffers can be owned by specific queue families or shared between multiple queue families.
+                                                                // This buffer will only be used by the graphics queue, so we use exclusive access.
+        buffer_info.flags = 0;  // Used to configure sparse buffer memory (not relevant for us right now)
 
-            // The depth buffer will be read from to perform depth tests to see if a fragment is visible
-            // It will be written to when a new fragment is drawn.
-            barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        // Creating the buffer alone doesn't allocate any memory, we'd have to query the memory requirements, allocate memory and bind it ourselves.
+        // We shouldn't allocate memory for every single resource we create though. (inefficient / max num of simultaneous mem allocations is limited)
+        // Instead the device memory allocator allocates large chunks of memory and splits them up with the offset parameter of vkBindBufferMemory.
+        // GPU may offer different types of memory which differ in terms of allowed operations or performance.
+        // The memory type selector rates all memory types that are accepted by the buffer and support the required properties,
+        // so we end up with the type which suits our needs best instead of simply the first one that works.
+        // The category and debug name only serve bookkeeping, so we can see where our GPU memory goes.
+        out_allocation = device_memory_.CreateBuffer(buffer_info, memory_request, category, debug_name, out_buffer);
+    }
 
-            // Writing happens in the VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT stage
-            source_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    void CopyBuffer(VkBuffer src, VkBuffer dst, VkDeviceSize size)
+    {
+        // Memory transfer operations are executed using command buffers, just like drawing commands
+        // -> We record into the command buffer of the upload context, which is allocated from a VK_COMMAND_POOL_CREATE_TRANSIENT_BIT pool.
+        // The copy is executed once the upload context is submitted.
+        VkCommandBuffer command_buffer = upload_context_.GetCommandBuffer();
 
-            // Reading happens in the VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT stage 
-            dest_stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-        }
-        else
-        {
-            throw std::invalid_argument("Unsupported layout transition!");
-        }
+        VkBufferCopy copy_region{};
+        copy_region.srcOffset = 0; // Optional
+        copy_region.dstOffset = 0; // Optional
+        copy_region.size = size;
+        vkCmdCopyBuffer(command_buffer, src, dst, 1, &copy_region);
+    }
 
-        // Submit the barrier. (All barriers use the same function!)
-        // Allowed stage values are specified here:
-        // https://www.khronos.org/registry/vulkan/specs/1.0/html/vkspec.html#synchronization-access-types-supported
-        vkCmdPipelineBarrier(
-            command_buffer,
-            source_stage,   // <- Specify in which pipeline stage the operations occur that should happen before the barrier
-            dest_stage,     // <- Specify the pipeline stage in which operations will wait on the barrier, e.g. VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT if
-                            // we want to read the uniform in the fragment shader after the barrier.
-            0,              // <- 0 or VK_DEPENDENCY_BY_REGION_BIT. Latter turns barrier into a per-region condition, i.e. the implementation is allowed to already begin reading parts
-                            // of the resource that was already written so far.
-            0, nullptr,     // <- Reference arrays of pipeline barriers of the three available types: memory barriers
-            0, nullptr,     // buffer memory barriers
-            1, &barrier     // and image memory barriers 
-        );
+    void CreateImage(uint32_t width, uint32_t height, uint32_t num_mips, VkSampleCountFlagBits num_samples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, const MemoryTypeRequest& memory_request,
+                     DeviceMemoryCategory category, const char* debug_name, VkImage& image, DeviceAllocationHandle& image_allocation)
+    {
+        VkImageCreateInfo image_info{};
+        image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        image_info.imageType = VK_IMAGE_TYPE_2D;
+        image_info.extent.width = static_cast<uint32_t>(width);
+        image_info.extent.height = static_cast<uint32_t>(height);
+        image_info.extent.depth = 1; // One color value per texel
+        image_info.mipLevels = num_mips;
+        image_info.arrayLayers = 1;  // Single texture, no texture array
+        image_info.format = format;
+        image_info.tiling = tiling; // VK_IMAGE_TILING_LINEAR -> Texels are laid out in row-major order like the tex_data array
+                                    // -> If we want to access texels directly in the memory, we have to use this!
+                                    // VK_IMAGE_TILING_OPTIMAL -> Texels are laid out in an implementation defined order for optimal access
+                                    // -> We use this here, because we use a staging buffer instead of a staging image
+        image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;   // VK_IMAGE_LAYOUT_UNDEFINED -> Not usable by the GPU and the very first transition will discard the texels
+                                                                // VK_IMAGE_LAYOUT_PREINITIALIZED -> Not usable by the GPU, but the first transition will preserve the texels.
+                                                                // Useful if we want to use an image as a staging image, e.g. upload data to it and then transition the image to be
+                                                                // a transfer source while preserving the data.
+                                                                // In our case, we transition the image to be a transfer destination and then copy the texel data to it from a buffer.
+        image_info.usage = usage;    // We want to transfer data to this image and we want to access the image in the shader
+        image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE; // Image is only used by the graphics queue family
+        image_info.samples = num_samples; // Related to multisampling. Only needed if image is used as attachment.
+        image_info.flags = 0; // Optional. Related to sparse images.
 
-        EndSingleTimeCommands(command_buffer);
+        // Create the image and allocate + bind memory for it - Similar to creating a buffer
+        image_allocation = device_memory_.CreateImage(image_info, memory_request, category, debug_name, image);
     }
 
     void CopyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height)
     {
-        VkCommandBuffer command_buffer = BeginSingleTimeCommands();
+        VkCommandBuffer command_buffer = upload_context_.GetCommandBuffer();
 
         // We need to specify which part of the buffer is going to be copied to which part of the image
         VkBufferImageCopy region{};
@@ -1878,8 +2878,6 @@ private:
             1,
             &region
         );
-
-        EndSingleTimeCommands(command_buffer);
     }
 
     // Queries the physical device for desired formats and returns the first one that's supported.
@@ -1935,8 +2933,29 @@ private:
         VkFormat color_format = swap_chain_image_format_;
 
         // Create multisampled color buffer
-        CreateImage(swap_chain_extent_.width, swap_chain_extent_.height, 1, num_msaa_samples_, color_format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, color_image_, color_image_memory_);
+        CreateImage(swap_chain_extent_.width, swap_chain_extent_.height, 1, num_msaa_samples_, color_format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, TRANSIENT_ATTACHMENT_MEMORY,
+            DeviceMemoryCategory::RenderTarget, "MSAA color target", color_image_, color_image_allocation_);
         color_image_view_ = CreateImageView(color_image_, color_format, VK_IMAGE_ASPECT_COLOR_BIT, 1);
+
+        // The multisampled image is resolved into the scene color target, which is then blitted to the swap chain image.
+        // It has the full size, so changing the resolution scale doesn't require new images. We just render into a smaller part of it.
+        CreateImage(swap_chain_extent_.width, swap_chain_extent_.height, 1, VK_SAMPLE_COUNT_1_BIT, color_format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, DEVICE_LOCAL_MEMORY,
+            DeviceMemoryCategory::RenderTarget, "Scene color target", scene_color_image_, scene_color_image_allocation_);
+        scene_color_image_view_ = CreateImageView(scene_color_image_, color_format, VK_IMAGE_ASPECT_COLOR_BIT, 1);
+
+        // Source and destination of the blit have the same format.
+        VkFormatProperties format_properties;
+        vkGetPhysicalDeviceFormatProperties(physical_device_, color_format, &format_properties);
+        VkFormatFeatureFlags blit_features = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+        if ((format_properties.optimalTilingFeatures & blit_features) != blit_features)
+        {
+            throw std::runtime_error("Swap chain format doesn't support blitting!");
+        }
+
+        // Nearest filtering looks blocky when upscaling, but it's better than nothing.
+        upscale_filter_ = (format_properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+
+        render_extent_ = GetRenderExtent();
     }
 
     void CreateDepthResources()
@@ -1949,8 +2968,9 @@ private:
             depth_format,    // A format that's supported by our physical device
             VK_IMAGE_TILING_OPTIMAL,
             VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, // image usage appropriate for a depth attachment
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-            depth_image_, depth_image_memory_
+            DEVICE_LOCAL_MEMORY,
+            DeviceMemoryCategory::RenderTarget, "Depth target",
+            depth_image_, depth_image_allocation_
         );
 
         depth_image_view_ = CreateImageView(depth_image_, depth_format, VK_IMAGE_ASPECT_DEPTH_BIT, 1);
@@ -1960,8 +2980,19 @@ private:
         // We don't have to explicitly transition the layout of the depth image to a depth attachment because this is done in the render pass.
         // But for the sake of practicing how to do it, we'll do it now anyway :P
         
-        TransitionImageLayout(depth_image_, depth_format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 1);
-        // ^^^ undefined layout can be used as initial layout, because there are no existing depth image contents that matter.
+        // Layout transitions are done by the resource state tracker. We only tell it how we're going to use the image next
+        // and it emits the barrier from whatever it knows about the image. Here that's VK_IMAGE_LAYOUT_UNDEFINED,
+        // which is fine, because there are no existing depth image contents that matter.
+        // Ensure proper subresource aspect is used for depth images
+        VkImageAspectFlags depth_aspect_mask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        if (HasStencilComponent(depth_format))
+        {
+            depth_aspect_mask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+        }
+        resource_states_.RegisterImage(depth_image_, 1, 1, depth_aspect_mask);
+        resource_states_.UseImage(upload_context_.GetGraphicsBarriers(), depth_image_, ACCESS_DEPTH_STENCIL_ATTACHMENT);
+        // ^^^ The render pass does its own transitions from here on, which the tracker doesn't see.
+        // Its initial layout is VK_IMAGE_LAYOUT_UNDEFINED anyway, as the depth buffer is cleared every frame.
 
     }
 
@@ -1984,17 +3015,9 @@ private:
             throw std::runtime_error("Texture image format does not support linear blitting!");
         }
 
-        VkCommandBuffer command_buffer = BeginSingleTimeCommands();
-
-        VkImageMemoryBarrier barrier{};
-        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barrier.image = image;
-        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        barrier.subresourceRange.baseArrayLayer = 0;
-        barrier.subresourceRange.layerCount = 1;
-        barrier.subresourceRange.levelCount = 1;
+        // Blits require a queue with graphics support.
+        VkCommandBuffer command_buffer = upload_context_.GetGraphicsCommandBuffer();
+        BarrierBatcher& barriers = upload_context_.GetGraphicsBarriers();
 
         int32_t mip_width = tex_width;
         int32_t mip_height = tex_height;
@@ -2003,23 +3026,20 @@ private:
         // We could use VK_IMAGE_LAYOUT_GENERAL, but this will be slow.
         // For optimal performance, the source image should be in VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL and the destination image should be in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
         // -> We transition each mip level independently
+        //
+        // We only need one barrier per level though: Nothing samples the texture before the upload is done, so the transitions
+        // to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL are all recorded together after the last blit.
 
         for (uint32_t i = 1; i < num_mips; i++)
         {
             // transition level i - 1 to VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL. 
-            // This transition will wait for level i - 1 to be filled, either from the previous blit command, or from vkCmdCopyBufferToImage. 
+            // This transition will wait for level i - 1 to be filled, either from the previous blit command, or from vkCmdCopyBufferToImage
+            // (which has been made available to the blit stage by the ownership transfer).
+            // Level i is already in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL and the ownership transfer made it available for blits, so the tracker doesn't emit anything for it.
             // The current blit command will wait on this transition.
-            barrier.subresourceRange.baseMipLevel = i - 1;
-            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-
-            vkCmdPipelineBarrier(command_buffer,
-                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
-                0, nullptr,
-                0, nullptr,
-                1, &barrier);
+            resource_states_.UseImage(barriers, image, i - 1, 1, ACCESS_BLIT_SOURCE);
+            resource_states_.UseImage(barriers, image, i, 1, ACCESS_BLIT_DESTINATION);
+            barriers.Flush(command_buffer);
 
             // We use a blit command to generate the mip maps.
             // Blit -> Copy of an image + application of transforms and filters
@@ -2045,27 +3065,12 @@ private:
 
             // Record the blit command
             // srcImage and dstImage are the same because we're blitting between different levels of the same image
-            // TODO: once we use a dedicated transfer queue, this command must be submitted to a queue with graphics capability
             vkCmdBlitImage(command_buffer,
                 image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
                 image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                 1, &blit,
                 VK_FILTER_LINEAR);  // VkFilter to use in the blit. Same options as VkSampler
 
-            // Transition mip level i - 1 to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
-            // Transition waits on the current blit command to finish. 
-            // All sampling operations will wait on this transition to finish
-            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-            barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-            vkCmdPipelineBarrier(command_buffer,
-                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-                0, nullptr,
-                0, nullptr,
-                1, &barrier);
-
             // Update mip extents for next iteration
             if (mip_width > 1)  // Ensure that the extents never become 0 (may happen if image is not square)
             {
@@ -2078,21 +3083,12 @@ private:
             }
         }
 
-        // Finally transition the last mip level from VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
-        // This is necessary since the last mip level is never blitted from (and therefore we didn't do it in the blit loop before)
-        barrier.subresourceRange.baseMipLevel = num_mips - 1;
-        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-        vkCmdPipelineBarrier(command_buffer,
-            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-            0, nullptr,
-            0, nullptr,
-            1, &barrier);
-
-        EndSingleTimeCommands(command_buffer);
+        // Finally transition all mip levels to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
+        // The transitions wait on the blits to finish. All sampling operations will wait on them.
+        // The last mip level is never blitted from, so it's still in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL. The tracker knows that and
+        // emits one barrier for all the other levels and one for the last one.
+        // We don't flush here: The barriers are recorded together with whatever else is pending when the batch is submitted.
+        resource_states_.UseImage(barriers, image, ACCESS_FRAGMENT_SHADER_SAMPLED);
     }
 
     void CreateTextureImage()
@@ -2117,14 +3113,14 @@ private:
         // Add 1 so that we have at least one mip level
 
         // First copy to a staging buffer
+        // NOTE: Unlike buffers, we can't skip the staging copy on unified memory here.
+        // The texture uses VK_IMAGE_TILING_OPTIMAL, i.e. an implementation defined texel layout we can't write to from the CPU.
         VkBuffer staging_buffer;
-        VkDeviceMemory staging_buffer_memory;
-        CreateBuffer(tex_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, staging_buffer, staging_buffer_memory);
+        DeviceAllocationHandle staging_buffer_allocation;
+        CreateBuffer(tex_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, STAGING_MEMORY, DeviceMemoryCategory::Staging, "Texture staging buffer", staging_buffer, staging_buffer_allocation);
 
-        void* data;
-        vkMapMemory(logical_device_, staging_buffer_memory, 0, tex_size, 0, &data);
-        memcpy(data, tex_data, static_cast<size_t>(tex_size));
-        vkUnmapMemory(logical_device_, staging_buffer_memory);
+        // Host visible memory is persistently mapped by the allocator.
+        memcpy(device_memory_.GetMappedData(staging_buffer_allocation), tex_data, static_cast<size_t>(tex_size));
 
         stbi_image_free(tex_data); // We copied the data, so we don't need this anymore.
 
@@ -2138,27 +3134,54 @@ private:
             VK_IMAGE_TILING_OPTIMAL, // VK_IMAGE_TILING_LINEAR -> Texels are laid out in row-major order like the tex_data array
                                      // VK_IMAGE_TILING_OPTIMAL -> Texels are laid out in an implementation defined order for optimal access
             VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,   // We want to copy from/to this image & we want to access it in the shader 
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,    // We want most read-efficient memory type
-            texture_image_, texture_image_memory_);
+            DEVICE_LOCAL_MEMORY,    // We want most read-efficient memory type
+            DeviceMemoryCategory::Texture, TEXTURE_PATH.c_str(),
+            texture_image_, texture_image_allocation_);
         
         // Now copy staging buffer to the texture image
 
         // First transition texture image to VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
-        TransitionImageLayout(texture_image_, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, num_mips_);
-        // ^^^ VK_IMAGE_LAYOUT_UNDEFINED, cause we don't care about the contents before performing the copy operation
+        resource_states_.RegisterImage(texture_image_, num_mips_, 1, VK_IMAGE_ASPECT_COLOR_BIT);
+        resource_states_.UseImage(upload_context_.GetBarriers(), texture_image_, ACCESS_COPY_DESTINATION);
+        // ^^^ The image starts in VK_IMAGE_LAYOUT_UNDEFINED, cause we don't care about the contents before performing the copy operation
 
         // Then execute the buffer to image copy operation
         CopyBufferToImage(staging_buffer, texture_image_, static_cast<uint32_t>(tex_width), static_cast<uint32_t>(tex_height));
 
-        // To be able to start sampling from the texture image in the shader, we need one last transition to prepare it for shader access
-        //TransitionImageLayout(texture_image_, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, num_mips_);
+        // The copy may have happened on the transfer queue, but the mip generation needs the graphics queue.
+        // All mips stay in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, GenerateMipmaps takes it from there.
+        VkImageSubresourceRange texture_range{};
+        texture_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        texture_range.baseMipLevel = 0;
+        texture_range.levelCount = num_mips_;
+        texture_range.baseArrayLayer = 0;
+        texture_range.layerCount = 1;
+        const ResourceAccess mip_generation_access = { VK_PIPELINE_STAGE_2_BLIT_BIT, VK_ACCESS_2_TRANSFER_READ_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL };
+        upload_context_.TransferOwnership(texture_image_, texture_range, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mip_generation_access.layout,
+            mip_generation_access.stage_mask, mip_generation_access.access_mask);
+        resource_states_.SetImageState(texture_image_, mip_generation_access);   // The acquire barrier happened outside of the tracker
 
+        // To be able to start sampling from the texture image in the shader, we need one last transition to prepare it for shader access
         // This final transition is already handled in GenerateMips :)
         GenerateMipmaps(texture_image_, VK_FORMAT_R8G8B8A8_SRGB, tex_width, tex_height, num_mips_);
 
-        // Finally clean up the buffers
-        vkDestroyBuffer(logical_device_, staging_buffer, nullptr);
-        vkFreeMemory(logical_device_, staging_buffer_memory, nullptr);
+        // The commands above are only recorded so far. The staging buffer has to stay alive until the GPU has executed them.
+        upload_context_.DeferUntilComplete([this, staging_buffer_allocation]()
+        {
+            device_memory_.Destroy(staging_buffer_allocation);
+        });
+
+        // The texture already supports transfers because of the mip generation, so the defragmenter may move it around.
+        // When it does, the image view has to be recreated. The descriptor set of each frame is rewritten the next time the frame is recorded.
+        // Frames in flight still sample the old view, so it's retired like the old image.
+        defragmenter_.RegisterImage(texture_image_allocation_, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_ASPECT_COLOR_BIT, [this](VkImage image)
+        {
+            resource_states_.ReplaceHandle(texture_image_, image);
+            texture_image_ = image;
+            deletion_queue_.RetireImageView(texture_image_view_, graphics_timeline_.GetLastSubmittedValue());
+            CreateTextureImageView();
+            std::fill(is_descriptor_set_outdated_.begin(), is_descriptor_set_outdated_.end(), true);
+        });
     }
 
     void CreateTextureImageView()
@@ -2205,7 +3228,7 @@ private:
         // NOTE: The sampler does not reference a VkImage anywhere!
         // It's merely an interface to access colors from a texture.
         // Which image we sample from doesn't matter at all! Cool! :D
-        if (vkCreateSampler(logical_device_, &sampler_info, nullptr, &texture_sampler_) != VK_SUCCESS)
+        if (vkCreateSampler(logical_device_, &sampler_info, allocator_, &texture_sampler_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create texture sampler!");
         }
@@ -2294,17 +3317,61 @@ private:
         }
     }
 
-    void CreateVertexBuffer()
+    void CreateScene()
     {
-        VkDeviceSize buffer_size = sizeof(vertices_[0]) * vertices_.size();
+        Mesh model_mesh;
+        model_mesh.index_count = static_cast<uint32_t>(indices_.size());
+        meshes_.push_back(model_mesh);
+
+        // All objects share the same uniform buffer for now, so they are drawn on top of each other.
+        // That's good enough to measure what recording a lot of draws costs.
+        scene_objects_.resize(launch_options_.num_scene_objects);
+    }
+
+    // Builds the list of draws for this frame from the scene. This is the place to cull objects or to sort the draws.
+    // Runs on the main thread. The list is part of the frame packet, so it stays valid until the render thread is done with the packet.
+    void BuildDrawList(std::vector<DrawCall>& out_draw_calls)
+    {
+        out_draw_calls.clear();     // Keeps the capacity
+        for (const SceneObject& object : scene_objects_)
+        {
+            if (object.is_visible == false)
+            {
+                continue;
+            }
+
+            const Mesh& mesh = meshes_[object.mesh_index];
+            DrawCall draw_call;
+            draw_call.index_count = mesh.index_count;
+            draw_call.first_index = mesh.first_index;
+            draw_call.vertex_offset = mesh.vertex_offset;
+            out_draw_calls.push_back(draw_call);
+        }
+    }
+
+    // Creates a device local buffer and fills it with data.
+    // On unified memory and ReBAR devices the CPU can write device local memory directly, so we simply map the buffer.
+    // Otherwise we have to go through a host visible staging buffer and copy on the GPU.
+    void CreateDeviceLocalBuffer(const void* src_data, VkDeviceSize buffer_size, VkBufferUsageFlags usage, DeviceMemoryCategory category, const char* debug_name,
+                                 VkBuffer& out_buffer, DeviceAllocationHandle& out_allocation)
+    {
+        if (memory_types_.CanWriteDeviceLocalDirectly())
+        {
+            CreateBuffer(buffer_size, usage, DIRECT_UPLOAD_MEMORY, category, debug_name, out_buffer, out_allocation);
+            resource_states_.RegisterBuffer(out_buffer, buffer_size);
+
+            // DIRECT_UPLOAD_MEMORY requires VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, so no flush is needed.
+            memcpy(device_memory_.GetMappedData(out_allocation), src_data, static_cast<size_t>(buffer_size));
+            return;
+        }
 
         // Use host-visible buffer as temporary staging buffer, which is later copied to device local memory.
         // Device local memory is optimal for reading speed on the GPU, but not accessible from the CPU!
         // To copy to device local memory we therefore can't use vkMapMemory.
         // Instead we have to specify the VK_BUFFER_USAGE_TRANSFER_SRC_BIT or VK_BUFFER_USAGE_TRANSFER_DST_BIT properties.
         VkBuffer staging_buffer;
-        VkDeviceMemory staging_buffer_memory;
-        CreateBuffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, staging_buffer, staging_buffer_memory);
+        DeviceAllocationHandle staging_buffer_allocation;
+        CreateBuffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, STAGING_MEMORY, DeviceMemoryCategory::Staging, "Buffer staging buffer", staging_buffer, staging_buffer_allocation);
         // ^^^ Properties
         // VK_BUFFER_USAGE_TRANSFER_SRC_BIT -> Buffer can be used as source in a memory transfer operation.
         // VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT -> We want to write to the vertex buffer from the CPU
@@ -2314,45 +3381,79 @@ private:
         // Alternatively we could also call vkFlushMappedMemoryRanges after writing or
         // vkInvalidateMappedMemoryRanges before reading mapped memory.
 
-        // Map allocated memory into CPU address space, copy over vertices to staging buffer
-        void* data;
-        vkMapMemory(logical_device_, staging_buffer_memory, 0 /*offset*/, buffer_size, 0 /*additional flags. Has to be 0.*/, &data);
-        memcpy(data, vertices_.data(), (size_t) buffer_size);    // No flush required as we set VK_MEMORY_PROPERTY_HOST_COHERENT_BIT.
-        vkUnmapMemory(logical_device_, staging_buffer_memory);
+        // The allocator maps host visible memory into the CPU address space once, so we can simply copy over the data to the staging buffer
+        memcpy(device_memory_.GetMappedData(staging_buffer_allocation), src_data, (size_t) buffer_size);    // No flush required as we set VK_MEMORY_PROPERTY_HOST_COHERENT_BIT.
 
-        CreateBuffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertex_buffer_, vertex_buffer_memory_);
+        CreateBuffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage, DEVICE_LOCAL_MEMORY, category, debug_name, out_buffer, out_allocation);
         // ^^^
         // VK_BUFFER_USAGE_TRANSFER_DST_BIT -> Buffer can be used as destination in a memory transfer operation.
 
-        CopyBuffer(staging_buffer, vertex_buffer_, buffer_size);
+        // A fresh buffer has no previous accesses to wait for, so this doesn't emit a barrier.
+        resource_states_.RegisterBuffer(out_buffer, buffer_size);
+        resource_states_.UseBuffer(upload_context_.GetBarriers(), out_buffer, ACCESS_COPY_DESTINATION);
+
+        CopyBuffer(staging_buffer, out_buffer, buffer_size);
+
+        // Hand the buffer over to the graphics queue, which reads it while rendering.
+        VkPipelineStageFlags2 dst_stage = VK_PIPELINE_STAGE_2_NONE;
+        VkAccessFlags2 dst_access = VK_ACCESS_2_NONE;
+        if (usage & VK_BUFFER_USAGE_VERTEX_BUFFER_BIT)
+        {
+            dst_stage |= VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT;
+            dst_access |= VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT;
+        }
+        if (usage & VK_BUFFER_USAGE_INDEX_BUFFER_BIT)
+        {
+            dst_stage |= VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT;
+            dst_access |= VK_ACCESS_2_INDEX_READ_BIT;
+        }
+        if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT)
+        {
+            dst_stage |= VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT;
+            dst_access |= VK_ACCESS_2_UNIFORM_READ_BIT;
+        }
+        if (dst_stage == VK_PIPELINE_STAGE_2_NONE)
+        {
+            dst_stage = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+            dst_access = VK_ACCESS_2_MEMORY_READ_BIT;
+        }
+        upload_context_.TransferOwnership(out_buffer, dst_stage, dst_access);
+        resource_states_.SetBufferState(out_buffer, { dst_stage, dst_access });
 
         // Once the copy command is done we can clean up the staging buffer
-        vkDestroyBuffer(logical_device_, staging_buffer, nullptr);
-        vkFreeMemory(logical_device_, staging_buffer_memory, nullptr);
+        upload_context_.DeferUntilComplete([this, staging_buffer_allocation]()
+        {
+            device_memory_.Destroy(staging_buffer_allocation);
+        });
+    }
+
+    void CreateVertexBuffer()
+    {
+        VkDeviceSize buffer_size = sizeof(vertices_[0]) * vertices_.size();
+        CreateDeviceLocalBuffer(vertices_.data(), buffer_size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | MOVABLE_BUFFER_USAGE,
+            DeviceMemoryCategory::Geometry, "Vertex buffer", vertex_buffer_, vertex_buffer_allocation_);
+
+        // Geometry lives for the whole session, so it's a prime candidate to be moved around by the defragmenter.
+        // The command buffers are rerecorded once the whole step is committed.
+        defragmenter_.RegisterBuffer(vertex_buffer_allocation_, [this](VkBuffer buffer)
+        {
+            resource_states_.ReplaceHandle(vertex_buffer_, buffer);
+            vertex_buffer_ = buffer;
+        });
     }
 
     void CreateIndexBuffer()
     {
         // Basically same as CreateVertexBuffer, but now we create a buffer for the indices.
         // Notice the VK_BUFFER_USAGE_INDEX_BUFFER_BIT
-         
         VkDeviceSize buffer_size = sizeof(indices_[0]) * indices_.size();
-
-        VkBuffer staging_buffer;
-        VkDeviceMemory staging_buffer_memory;
-        CreateBuffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, staging_buffer, staging_buffer_memory);
-
-        void* data;
-        vkMapMemory(logical_device_, staging_buffer_memory, 0, buffer_size, 0, &data);
-        memcpy(data, indices_.data(), (size_t)buffer_size);
-        vkUnmapMemory(logical_device_, staging_buffer_memory);
-
-        CreateBuffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, index_buffer_, index_buffer_memory_);
-
-        CopyBuffer(staging_buffer, index_buffer_, buffer_size);
-
-        vkDestroyBuffer(logical_device_, staging_buffer, nullptr);
-        vkFreeMemory(logical_device_, staging_buffer_memory, nullptr);
+        CreateDeviceLocalBuffer(indices_.data(), buffer_size, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | MOVABLE_BUFFER_USAGE,
+            DeviceMemoryCategory::Geometry, "Index buffer", index_buffer_, index_buffer_allocation_);
+        defragmenter_.RegisterBuffer(index_buffer_allocation_, [this](VkBuffer buffer)
+        {
+            resource_states_.ReplaceHandle(index_buffer_, buffer);
+            index_buffer_ = buffer;
+        });
     }
 
     void CreateUniformBuffers()
@@ -2360,15 +3461,16 @@ private:
         VkDeviceSize buffer_size = sizeof(UniformBufferObject);
 
         // We should not modify the uniforms of a frame that is in-flight!
-        // -> We need one uniform buffer per swap chain image.
-        uniform_buffers_.resize(swap_chain_images_.size());
-        uniform_buffers_memory_.resize(swap_chain_images_.size());
-        for (size_t i = 0; i < swap_chain_images_.size(); i++)
+        // -> We need one uniform buffer per frame in flight. DrawFrame() waits for the frame before it writes the frame's uniforms again.
+        // One per swap chain image would work as well, but we never have more than GetNumFramesInFlight() frames in flight,
+        // so the additional copies would only waste memory.
+        uniform_buffers_.resize(GetNumFramesInFlight());
+        uniform_buffer_allocations_.resize(GetNumFramesInFlight());
+        for (size_t i = 0; i < GetNumFramesInFlight(); i++)
         {
             // Since the uniform data is updated every frame, a staging buffer would only add unnecessary overhead.
-            CreateBuffer(buffer_size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                uniform_buffers_[i], uniform_buffers_memory_[i]);
+            // If the device can map device local memory (UMA / ReBAR) we prefer that, so the GPU reads the uniforms from VRAM.
+            CreateBuffer(buffer_size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, UNIFORM_MEMORY, DeviceMemoryCategory::Uniform, "Uniform buffer", uniform_buffers_[i], uniform_buffer_allocations_[i]);
         }
     }
 
@@ -2382,17 +3484,17 @@ private:
         
         std::array<VkDescriptorPoolSize, 2> pool_sizes{};
         pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        pool_sizes[0].descriptorCount = static_cast<uint32_t>(swap_chain_images_.size());   // allocate one descriptor for every swap chain image
+        pool_sizes[0].descriptorCount = GetNumFramesInFlight();   // allocate one descriptor for every frame in flight
         pool_sizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        pool_sizes[1].descriptorCount = static_cast<uint32_t>(swap_chain_images_.size());
+        pool_sizes[1].descriptorCount = GetNumFramesInFlight();
 
         VkDescriptorPoolCreateInfo pool_info{};
         pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
         pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());;
         pool_info.pPoolSizes = pool_sizes.data();
-        pool_info.maxSets = static_cast<uint32_t>(swap_chain_images_.size());
+        pool_info.maxSets = GetNumFramesInFlight();
 
-        if (vkCreateDescriptorPool(logical_device_, &pool_info, nullptr, &descriptor_pool_) != VK_SUCCESS)
+        if (vkCreateDescriptorPool(logical_device_, &pool_info, allocator_, &descriptor_pool_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create descriptor pool!");
         }
@@ -2400,88 +3502,104 @@ private:
 
     void CreateDescriptorSets()
     {
-        std::vector<VkDescriptorSetLayout> layouts(swap_chain_images_.size(), descriptor_set_layout_);
+        // The layouts are only needed until the sets are allocated, so we take the memory from the frame arena instead of the heap.
+        ArenaVector<VkDescriptorSetLayout> layouts(GetNumFramesInFlight(), descriptor_set_layout_, GetFrameArena());
         VkDescriptorSetAllocateInfo alloc_info{};
         alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
         alloc_info.descriptorPool = descriptor_pool_;
-        alloc_info.descriptorSetCount = static_cast<uint32_t>(swap_chain_images_.size());
+        alloc_info.descriptorSetCount = GetNumFramesInFlight();
         alloc_info.pSetLayouts = layouts.data();
 
-        // Create one descriptor set for each swap chain image.
-        descriptor_sets_.resize(swap_chain_images_.size());
+        // Create one descriptor set for each frame in flight, pointing to the frame's uniform buffer.
+        descriptor_sets_.resize(GetNumFramesInFlight());
         if (vkAllocateDescriptorSets(logical_device_, &alloc_info, descriptor_sets_.data()) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to allocate descriptor sets!");
         }
 
         // Then populate the descriptors inside of the descriptor sets
-        for (size_t i = 0; i < swap_chain_images_.size(); i++)
+        is_descriptor_set_outdated_.assign(GetNumFramesInFlight(), false);
+        for (size_t i = 0; i < GetNumFramesInFlight(); i++)
         {
-            VkDescriptorBufferInfo buffer_info{};
-            buffer_info.buffer = uniform_buffers_[i];
-            buffer_info.offset = 0;
-            buffer_info.range = sizeof(UniformBufferObject);
-
-            VkDescriptorImageInfo image_info{};
-            image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-            image_info.imageView = texture_image_view_;
-            image_info.sampler = texture_sampler_;
-
-            std::array<VkWriteDescriptorSet, 2> descriptor_writes{};
-
-            descriptor_writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            descriptor_writes[0].dstSet = descriptor_sets_[i];  // the descriptor set to update
-            descriptor_writes[0].dstBinding = 0;    // Binding index
-            descriptor_writes[0].dstArrayElement = 0;   // descriptors can be arrays -> Have to specify the first index
-            descriptor_writes[0].descriptorCount = 1;   // How many descriptors in the array we want to update.
-            descriptor_writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;    // Need to specify the type of descriptor again
-            descriptor_writes[0].pBufferInfo = &buffer_info;    // used for descriptors that refer to buffer data
-            descriptor_writes[0].pImageInfo = nullptr; // used for descriptors that refer to image data
-            descriptor_writes[0].pTexelBufferView = nullptr; // used for descriptors that refer to buffer views
-
-            descriptor_writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            descriptor_writes[1].dstSet = descriptor_sets_[i];
-            descriptor_writes[1].dstBinding = 1;
-            descriptor_writes[1].dstArrayElement = 0;
-            descriptor_writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-            descriptor_writes[1].descriptorCount = 1;
-            descriptor_writes[1].pImageInfo = &image_info;
-
-            vkUpdateDescriptorSets(logical_device_, static_cast<uint32_t>(descriptor_writes.size()), descriptor_writes.data(), 0, nullptr /*can be used to copy descriptors to each other*/);
+            WriteDescriptorSet(i);
         }
-
     }
 
-    void UpdateUniformData(uint32_t current_swap_chain_img_idx)
+    // Points the frame's descriptor set to its uniform buffer and the current texture view.
+    // The GPU must not use the set anymore, i.e. the frame's previous submission has to be complete.
+    void WriteDescriptorSet(size_t frame_index)
     {
-        static auto start_time = std::chrono::high_resolution_clock::now();
-
-        auto current_time = std::chrono::high_resolution_clock::now();
-
-        // Time in sec since rendering started
-        float time = std::chrono::duration<float, std::chrono::seconds::period>(current_time - start_time).count();
+        VkDescriptorBufferInfo buffer_info{};
+        buffer_info.buffer = uniform_buffers_[frame_index];
+        buffer_info.offset = 0;
+        buffer_info.range = sizeof(UniformBufferObject);
+
+        VkDescriptorImageInfo image_info{};
+        image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        image_info.imageView = texture_image_view_;
+        image_info.sampler = texture_sampler_;
+
+        std::array<VkWriteDescriptorSet, 2> descriptor_writes{};
+
+        descriptor_writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[0].dstSet = descriptor_sets_[frame_index];  // the descriptor set to update
+        descriptor_writes[0].dstBinding = 0;    // Binding index
+        descriptor_writes[0].dstArrayElement = 0;   // descriptors can be arrays -> Have to specify the first index
+        descriptor_writes[0].descriptorCount = 1;   // How many descriptors in the array we want to update.
+        descriptor_writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;    // Need to specify the type of descriptor again
+        descriptor_writes[0].pBufferInfo = &buffer_info;    // used for descriptors that refer to buffer data
+        descriptor_writes[0].pImageInfo = nullptr; // used for descriptors that refer to image data
+        descriptor_writes[0].pTexelBufferView = nullptr; // used for descriptors that refer to buffer views
+
+        descriptor_writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[1].dstSet = descriptor_sets_[frame_index];
+        descriptor_writes[1].dstBinding = 1;
+        descriptor_writes[1].dstArrayElement = 0;
+        descriptor_writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptor_writes[1].descriptorCount = 1;
+        descriptor_writes[1].pImageInfo = &image_info;
+
+        vkUpdateDescriptorSets(logical_device_, static_cast<uint32_t>(descriptor_writes.size()), descriptor_writes.data(), 0, nullptr /*can be used to copy descriptors to each other*/);
+        is_descriptor_set_outdated_[frame_index] = false;
+    }
 
-        UniformBufferObject ubo{};
+    // The simulation stage of a frame, runs on the main thread. Everything the render thread needs goes into the packet.
+    void Simulate(double simulation_time, FramePacket& packet)
+    {
+        // Time in sec since rendering started. Advanced by MainLoop(), either by the wall clock or by a fixed timestep.
+        float time = static_cast<float>(simulation_time);
 
         // Rotate around the z-axis
-        ubo.model = glm::rotate(
+        packet.model = glm::rotate(
             glm::mat4(1.0f),    // Existing transform. In this case identity.
             time * glm::radians(90.0f), // Rotation angle -> In this case 90 degrees per second
             glm::vec3(0.0f, 0.0f, 1.0f) // Rotation axis
         );
 
         // Look at the model from above at 45 angle
-        ubo.view = glm::lookAt(
+        packet.view = glm::lookAt(
             glm::vec3(2.0f, 2.0f, 2.0f),    // Eye pos
             glm::vec3(0.0f, 0.0f, 0.0f),    // Center pos
             glm::vec3(0.0f, 0.0f, 1.0f)     // Up direction
         );
 
+        packet.fov_y = glm::radians(45.0f);
+        packet.near_plane = 0.1f;
+        packet.far_plane = 10.0f;
+
+        BuildDrawList(packet.draw_calls);
+    }
+
+    void UpdateUniformData(uint32_t frame_index, const FramePacket& packet)
+    {
+        UniformBufferObject ubo{};
+        ubo.model = packet.model;
+        ubo.view = packet.view;
         ubo.proj = glm::perspective(
-            glm::radians(45.0f),    // FoV
+            packet.fov_y,
             swap_chain_extent_.width / static_cast<float>(swap_chain_extent_.height),  // Aspect ratio.
-            0.1f,   // Near plane
-            10.0f   // Far plane
+            packet.near_plane,
+            packet.far_plane
         );
 
         // GLM was originally designed for OpenGL, where the Y coordinate of the clip coordinates is inverted.
@@ -2492,16 +3610,91 @@ private:
         // Finally copy data into the uniform buffer
         // This is not the most efficient way to pass frequently changing values to a shader.
         // Check out "Push constants" for more info!
-        void* data;
-        vkMapMemory(logical_device_, uniform_buffers_memory_[current_swap_chain_img_idx], 0, sizeof(ubo), 0, &data);
-        memcpy(data, &ubo, sizeof(ubo));
-        vkUnmapMemory(logical_device_, uniform_buffers_memory_[current_swap_chain_img_idx]);
+        // Uniform buffers are persistently mapped, so there's no need to map / unmap them every frame.
+        memcpy(device_memory_.GetMappedData(uniform_buffer_allocations_[frame_index]), &ubo, sizeof(ubo));
+    }
+
+    void UpdateDefragmentation()
+    {
+        if (defragmenter_.ShouldDefragment(DEFRAGMENTATION_THRESHOLD))
+        {
+            defragmenter_.BeginPass(DEFRAGMENTATION_BYTES_PER_STEP);
+        }
+
+        // Blocks emptied by earlier steps can go once the deletion queue has freed their old ranges.
+        defragmenter_.ReleaseEmptiedBlocks();
+
+        if (defragmenter_.IsStepComplete())
+        {
+            // The copies are done, but frames in flight still use the old resources. We don't wait for them: The defragmenter retires
+            // the old resources through the deletion queue, and the owners switch over to the new ones for everything recorded from now on.
+            defragmenter_.CommitStep();
+
+#ifndef NDEBUG
+            if (defragmenter_.IsPassActive() == false)
+            {
+                const DefragmentationStats& stats = defragmenter_.GetStats();
+                std::cout << "Defragmentation: " << stats.num_moves << " moves (" << stats.bytes_moved << " bytes) in " << stats.num_steps << " steps, "
+                    << stats.num_released_blocks << " blocks released. Fragmentation " << stats.before.fragmentation << " -> " << stats.after.fragmentation
+                    << ", blocks " << stats.before.num_blocks << " -> " << stats.after.num_blocks << std::endl;
+            }
+#endif
+        }
+
+        if (defragmenter_.IsPassActive())
+        {
+            // Submitted before this frame's commands, so the copies are done once the frame's timeline value has been reached.
+            defragmenter_.RecordAndSubmitStep();
+        }
+
+        // The previous submission of this frame is complete, so its descriptor set can be pointed to the new texture view now.
+        // The sets of the other frames are still in use, they are rewritten when it's their turn.
+        if (is_descriptor_set_outdated_[current_frame_])
+        {
+            WriteDescriptorSet(current_frame_);
+        }
     }
 
-    void DrawFrame()
+    // Scratch memory for temporary data of the frame that is currently being recorded. Valid until we wait for the frame's timeline value again.
+    LinearArena& GetFrameArena()
     {
+        return frame_arenas_[current_frame_];
+    }
+
+    void DrawFrame(const FramePacket& packet)
+    {
+        // The main thread's part of the frame has happened already, it has brought its times along in the packet.
+        latency_trace_.BeginFrame(packet.frame_number);
+        latency_trace_.Mark(FrameMarker::PollEvents, packet.poll_events_time);
+        latency_trace_.Mark(FrameMarker::SimulationStart, packet.simulation_start_time);
+        latency_trace_.Mark(FrameMarker::SimulationEnd, packet.simulation_end_time);
+
         // Wait for requested frame to be finished
-        vkWaitForFences(logical_device_, 1, &inflight_frame_fences_[current_frame_], VK_TRUE /*wait for all fences until return*/, UINT64_MAX /*disable time out*/);
+        // Each frame remembers the value its submission signals on the graphics timeline. 0 (nothing submitted yet) is complete right away.
+        // If we spend a lot of time here, we're GPU bound.
+        latency_trace_.Mark(FrameMarker::FrameWaitStart);
+        graphics_timeline_.Wait(frame_timeline_values_[current_frame_]);
+        latency_trace_.Mark(FrameMarker::FrameWaitEnd);
+
+        // The frame is complete, so its timestamps are available.
+        CollectGpuFrameTime(current_frame_);
+
+        // The GPU is done with the command buffers of this frame, so we can reset its pools and record new ones.
+        frame_command_pools_.BeginFrame(current_frame_);
+
+        // The frame we're about to record reuses the arena of the frame that just finished. Nothing in there is needed anymore.
+        frame_arenas_[current_frame_].Reset();
+
+        UpdateDefragmentation();
+
+        // Release resources of uploads that have finished in the meantime. This only polls the timeline, it never blocks.
+        upload_context_.Update();
+
+        // Same for objects that have been retired, e.g. by a swap chain recreation.
+        deletion_queue_.Update();
+
+        // Hands finished frame copies to the encoder thread.
+        frame_readback_.Update();
 
         // Drawing a frame involves these operations, which will be executed asynchronously with a single function call:
         //  * Acquire an image from the swap chain
@@ -2517,74 +3710,108 @@ private:
         // => We want to synchronize the queue operations of draw commands and presentation, which makes semaphores the best fit.
     
         uint32_t image_index;   // refers to the VkImage idx in our swap_chain_images_ array
-        VkResult result = vkAcquireNextImageKHR(logical_device_, swap_chain_, UINT64_MAX /*disable time out*/, image_available_semaphores_[current_frame_], VK_NULL_HANDLE, &image_index);
-
-        // Check for window resizes, so we can recreate the swap chain.
-        // VK_ERROR_OUT_OF_DATE_KHR -> Swap chain is incompatible with the surface. Typically happens on window resize, but not guaranteed.
-        // VK_SUBOPTIMAL_KHR -> Some parts of the swap chain are incompatible, but we could theoretically still present to the surface.
-        if(result == VK_ERROR_OUT_OF_DATE_KHR)
+        if (IsHeadless())
         {
-            RecreateSwapChain();
-            return;
+            // Offscreen images are simply used round robin. The wait below makes sure the frame that used the image last is done.
+            image_index = next_offscreen_image_;
+            next_offscreen_image_ = (next_offscreen_image_ + 1) % static_cast<uint32_t>(swap_chain_images_.size());
         }
-        else if(result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
+        else
         {
-            throw std::runtime_error("Failed to acquire swap chain image");
+            // Blocks if all images are queued for presentation, e.g. with FIFO when we're faster than the display.
+            latency_trace_.Mark(FrameMarker::AcquireStart);
+            VkResult result = vkAcquireNextImageKHR(logical_device_, swap_chain_, UINT64_MAX /*disable time out*/, image_available_semaphores_[current_frame_], VK_NULL_HANDLE, &image_index);
+            latency_trace_.Mark(FrameMarker::AcquireEnd);
+
+            // Check for window resizes, so we can recreate the swap chain.
+            // VK_ERROR_OUT_OF_DATE_KHR -> Swap chain is incompatible with the surface. Typically happens on window resize, but not guaranteed.
+            // VK_SUBOPTIMAL_KHR -> Some parts of the swap chain are incompatible, but we could theoretically still present to the surface.
+            if (result == VK_ERROR_OUT_OF_DATE_KHR)
+            {
+                RecreateSwapChain();
+                return;
+            }
+            else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
+            {
+                throw std::runtime_error("Failed to acquire swap chain image");
+            }
         }
 
-        // If MAX_FRAMES_IN_FLIGHT is higher than the number of swap chain images or vkAcquireNextImageKHR returns images out-of-order 
+        // If GetNumFramesInFlight() is higher than the number of swap chain images or vkAcquireNextImageKHR returns images out-of-order 
         // it's possible that we may start rendering to a swap chain image that is already in flight.
         // To avoid this, we need to track for each swap chain image if a frame in flight is currently using it.
-        if (inflight_images_[image_index] != VK_NULL_HANDLE)
-        {
-            vkWaitForFences(logical_device_, 1, &inflight_images_[image_index], VK_TRUE, UINT64_MAX);
-        }
+        // Instead of aliasing the fence of the frame that uses it, we simply remember the timeline value of that frame.
+        graphics_timeline_.Wait(image_timeline_values_[image_index]);
+
+        // The uniforms belong to the frame, not to the image. We've waited for the frame's previous submission above, so they are free.
+        UpdateUniformData(current_frame_, packet);
 
-        // Mark the image as now being in use by this frame
-        inflight_images_[image_index] = inflight_frame_fences_[current_frame_];
+        // Nothing is pre-recorded. Every frame builds a fresh draw list from the scene and records it into command buffers
+        // from the pools we've just reset. We measure that, as it's on the critical path of every frame.
+        auto recording_start_time = std::chrono::steady_clock::now();
+        latency_trace_.Mark(FrameMarker::RecordStart, recording_start_time);
 
-        UpdateUniformData(image_index);
+        // The draw list has already been built by the main thread.
+        uint32_t num_draw_calls = static_cast<uint32_t>(packet.draw_calls.size());
 
-        VkSubmitInfo submit_info{};
-        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        // The resolution scale may have changed with the GPU time of the frame we've collected above.
+        render_extent_ = GetRenderExtent();
 
-        VkSemaphore wait_semaphores[] = { image_available_semaphores_[current_frame_] };  // which semaphores to wait on before execution begins 
-        VkPipelineStageFlags wait_stages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT }; // in which stages of the pipeline to wait
-                                                                                                // We want to wait with writing colors to the image until it's available,
-                                                                                                // so we're specifying the stage of the graphics pipeline that writes to the color attachment
-                                                                                                // => Theoretically the implementation can already start executing our vertex shader etc
-                                                                                                // while the image is not yet available
-                                                                                                // Each entry in the array corresponds to the semaphore with the same index in pWaitSemaphores
-        submit_info.waitSemaphoreCount = 1;
-        submit_info.pWaitSemaphores = wait_semaphores;
-        submit_info.pWaitDstStageMask = wait_stages;
+        VkCommandBuffer command_buffer = frame_command_pools_.GetPrimaryCommandBuffer(0);
+        RecordCommandBuffer(command_buffer, image_index, packet.draw_calls.data(), num_draw_calls);
 
-        // Submit the command buffer that binds the swap chain image we just acquired as color attachment
-        submit_info.commandBufferCount = 1;
-        submit_info.pCommandBuffers = &command_buffers_[image_index];
+        auto recording_end_time = std::chrono::steady_clock::now();
+        latency_trace_.Mark(FrameMarker::RecordEnd, recording_end_time);
+        recording_stats_.Add(std::chrono::duration<double, std::milli>(recording_end_time - recording_start_time).count(), num_draw_calls);
+
+        GpuSemaphoreWait image_available;
+        image_available.semaphore = image_available_semaphores_[current_frame_];  // which semaphore to wait on before execution begins
+        image_available.stage_mask = VK_PIPELINE_STAGE_2_BLIT_BIT;  // in which stages of the pipeline to wait
+                                                                    // We only write to the swap chain image when we blit the scene color target to it,
+                                                                    // so the whole scene can be rendered while the image is not yet available
 
         // Specify which semaphores to signal once the command buffer(s) have finished execution
+        // Presentation only understands binary semaphores, so we signal one in addition to the graphics timeline.
         VkSemaphore signal_semaphores[] = { render_finished_semaphores_[current_frame_] };
-        submit_info.signalSemaphoreCount = 1;
-        submit_info.pSignalSemaphores = signal_semaphores;
-
-        vkResetFences(logical_device_, 1, &inflight_frame_fences_[current_frame_]);  // restore the fence to the unsignaled state 
 
-        if (vkQueueSubmit(graphics_queue_, 1, &submit_info, inflight_frame_fences_[current_frame_]) != VK_SUCCESS)  // Takes an array of VkSubmitInfo structs as argument for efficiency 
-                                                                                                                    // when the workload is much larger
-                                                                                                                    // Last parameter is optional fence that will be
-                                                                                                                    // signaled when command buffers finish execution
+        // Submit the command buffer that binds the swap chain image we just acquired as color attachment.
+        // The returned timeline value replaces the per frame fence: The frame (and the swap chain image) is done once the timeline reaches it.
+        // Offscreen images are neither acquired nor presented, so there are no binary semaphores to wait on or signal.
+        uint32_t num_swap_chain_semaphores = IsHeadless() ? 0 : 1;
+        uint64_t frame_timeline_value = graphics_timeline_.Submit(1, &command_buffer, num_swap_chain_semaphores, &image_available, num_swap_chain_semaphores, signal_semaphores);
+        frame_timeline_values_[current_frame_] = frame_timeline_value;
+        is_frame_measured_[current_frame_] = is_measuring_frames_;
+        frame_numbers_[current_frame_] = packet.frame_number;
+        frame_readback_.SetSubmitted(frame_timeline_value);
+        num_rendered_frames_++;
+        image_timeline_values_[image_index] = frame_timeline_value;  // Mark the image as now being in use by this frame
+
+        // So far the uploads, the defragmentation step and the frame itself have only been queued up. Now they all go to the GPU with a single
+        // vkQueueSubmit2 per queue. This has to happen before presenting, which waits on a semaphore signaled by the frame's submission.
+        latency_trace_.Mark(FrameMarker::SubmitStart);
+        graphics_timeline_.Flush();
+        latency_trace_.Mark(FrameMarker::SubmitEnd);
+
+        if (IsHeadless() == false)
         {
-            throw std::runtime_error("Failed to submit draw command buffer!");
+            latency_trace_.Mark(FrameMarker::PresentStart);
+            PresentImage(image_index);
+            latency_trace_.Mark(FrameMarker::PresentEnd);
         }
 
+        // Advance the frame index
+        current_frame_ = (current_frame_ + 1) % GetNumFramesInFlight();
+    }
+
+    void PresentImage(uint32_t image_index)
+    {
         // Finally submit result back to the swap chain to have it eventually show up on the screen 
         VkPresentInfoKHR present_info{};
         present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 
         // Which semaphores to wait on before presentation can happen
         present_info.waitSemaphoreCount = 1;
-        present_info.pWaitSemaphores = signal_semaphores;
+        present_info.pWaitSemaphores = &render_finished_semaphores_[current_frame_];  // Signaled by the frame's submission
 
         // Specify the swap chains to present images to and the index of the image for each swap chain (will almost always be a single one)
         VkSwapchainKHR swap_chains[] = { swap_chain_ };
@@ -2594,12 +3821,25 @@ private:
         present_info.pResults = nullptr;    // Optional. Allows to specify an array of VkResult values to check for every individual swap chain if presentation was successful
                                             // Not necessary if you're only using a single swap chain, because you can simply use the return value of the present function.
 
+        // The fence is signaled once the presentation engine is done with the present. We need it to retire the swap chain, see CleanUpSwapChain().
+        VkSwapchainPresentFenceInfoEXT present_fence_info{};
+        if (is_swapchain_maintenance1_enabled_)
+        {
+            last_present_fence_ = AcquirePresentFence();
+            present_fence_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_PRESENT_FENCE_INFO_EXT;
+            present_fence_info.swapchainCount = 1;
+            present_fence_info.pFences = &last_present_fence_;
+            present_info.pNext = &present_fence_info;
+        }
+
         // Submits the request to present an image to the swap chain
-        result = vkQueuePresentKHR(present_queue_, &present_info);
+        VkResult result = vkQueuePresentKHR(present_queue_, &present_info);
 
         // Explicitly check for window resize, so we can recreate the swap chain.
         // In this case it's important to do this after present to ensure that the semaphores are in the correct state.
-        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || was_frame_buffer_resized_)
+        // A new present policy needs a new swap chain as well, because the present mode can't be changed on an existing one.
+        bool is_present_policy_outdated = present_policy_ != swap_chain_present_policy_;
+        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || was_frame_buffer_resized_ || is_present_policy_outdated)
         {
             was_frame_buffer_resized_ = false;
             RecreateSwapChain();
@@ -2608,31 +3848,61 @@ private:
         {
             throw std::runtime_error("Failed to present swap chain image to surface");
         }
+    }
+
+    // Returns an unsignaled fence for the next present. Fences of completed presents are reused, there are only a handful in flight.
+    VkFence AcquirePresentFence()
+    {
+        size_t num_pending = 0;
+        for (VkFence fence : pending_present_fences_)
+        {
+            if (vkGetFenceStatus(logical_device_, fence) == VK_SUCCESS)
+            {
+                vkResetFences(logical_device_, 1, &fence);
+                free_present_fences_.push_back(fence);
+            }
+            else
+            {
+                pending_present_fences_[num_pending++] = fence;
+            }
+        }
+        pending_present_fences_.resize(num_pending);
 
-        // Advance the frame index
-        current_frame_ = (++current_frame_) % MAX_FRAMES_IN_FLIGHT;
+        VkFence fence = VK_NULL_HANDLE;
+        if (free_present_fences_.empty())
+        {
+            VkFenceCreateInfo fence_info{};
+            fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            if (vkCreateFence(logical_device_, &fence_info, allocator_, &fence) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create present fence!");
+            }
+        }
+        else
+        {
+            fence = free_present_fences_.back();
+            free_present_fences_.pop_back();
+        }
+
+        pending_present_fences_.push_back(fence);
+        return fence;
     }
 
     void CreateSyncObjects()
     {
-        image_available_semaphores_.resize(MAX_FRAMES_IN_FLIGHT);
-        render_finished_semaphores_.resize(MAX_FRAMES_IN_FLIGHT);
-        inflight_frame_fences_.resize(MAX_FRAMES_IN_FLIGHT);
-        inflight_images_.resize(swap_chain_images_.size(), VK_NULL_HANDLE);
+        // Swap chain images are only handed out as binary semaphores, so we still need those for acquiring and presenting.
+        // Frame pacing is done with the graphics timeline instead of fences.
+        image_available_semaphores_.resize(GetNumFramesInFlight());
+        render_finished_semaphores_.resize(GetNumFramesInFlight());
+        image_timeline_values_.assign(swap_chain_images_.size(), 0);
 
         VkSemaphoreCreateInfo semaphore_info{};
         semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-        VkFenceCreateInfo fence_info{};
-        fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT; // By default we create fences in unsignaled state
-                                                         // -> We'd wait indefinitely because we never submitted the fence before
-
-        for(size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+        for(size_t i = 0; i < GetNumFramesInFlight(); i++)
         {
-            if (vkCreateSemaphore(logical_device_, &semaphore_info, nullptr, &image_available_semaphores_[i]) != VK_SUCCESS ||
-                vkCreateSemaphore(logical_device_, &semaphore_info, nullptr, &render_finished_semaphores_[i]) != VK_SUCCESS ||
-                vkCreateFence(logical_device_, &fence_info, nullptr, &inflight_frame_fences_[i]) != VK_SUCCESS)
+            if (vkCreateSemaphore(logical_device_, &semaphore_info, allocator_, &image_available_semaphores_[i]) != VK_SUCCESS ||
+                vkCreateSemaphore(logical_device_, &semaphore_info, allocator_, &render_finished_semaphores_[i]) != VK_SUCCESS)
             {
 
                 throw std::runtime_error("Failed to create semaphores!");
@@ -2640,12 +3910,20 @@ private:
         }
     }
 
-    static const int MAX_FRAMES_IN_FLIGHT = 2;  // How many frames should be processed concurrently
+    const uint64_t NUM_WARMUP_FRAMES = 16;  // Frames that are ignored by the steady state heap allocation statistics
 
     GLFWwindow* window_ = nullptr;
     const uint32_t SCREEN_WIDTH = 800;
     const uint32_t SCREEN_HEIGHT = 600;
 
+    const uint64_t DEFAULT_NUM_FRAMES = 1000;  // Headless runs and benchmarks without --frames or --duration stop after this many frames
+    const double FIXED_TIMESTEP_SECONDS = 1.0 / 60.0;   // Simulation time per frame in benchmarks
+    const uint32_t LATENCY_TRACE_CAPACITY = 1024;   // Frames kept by the latency trace, older ones are overwritten
+    const double ON_DEMAND_WAIT_TIMEOUT_SECONDS = 1.0;  // Longest sleep while waiting for something to change when rendering on demand
+    const VkFormat OFFSCREEN_IMAGE_FORMAT = VK_FORMAT_B8G8R8A8_SRGB;  // Same as the swap chain format we prefer, supported as color attachment pretty much everywhere
+    std::vector<DeviceAllocationHandle> offscreen_image_allocations_;  // Headless only, backing the images in swap_chain_images_
+    uint32_t next_offscreen_image_ = 0;
+
     const std::string MODEL_PATH = "assets/models/viking_room.obj";
     const std::string TEXTURE_PATH = "assets/textures/viking_room.png";
 
@@ -2661,19 +3939,65 @@ private:
     const bool enable_validation_layers_ = true;
 #endif
 
+    // Driver allocations on the host are routed through our own VkAllocationCallbacks, so we know how much CPU memory the driver uses.
+    // allocator_ is passed as pAllocator to every vkCreate* / vkDestroy* call. nullptr means that the driver uses its own allocator.
+#ifdef NDEBUG
+    const bool enable_host_allocation_tracking_ = false;
+#else
+    const bool enable_host_allocation_tracking_ = true;
+#endif
+    HostAllocationTracker host_allocations_;
+
+    // Dump live / peak device memory per category and all allocations as JSON after startup and before shutdown.
+#ifdef NDEBUG
+    const bool enable_device_memory_stats_ = false;
+#else
+    const bool enable_device_memory_stats_ = true;
+#endif
+    const std::string DEVICE_MEMORY_STATS_STARTUP_PATH = "device_memory_startup.json";
+    const std::string DEVICE_MEMORY_STATS_SHUTDOWN_PATH = "device_memory_shutdown.json";
+    const VkAllocationCallbacks* allocator_ = enable_host_allocation_tracking_ ? host_allocations_.GetCallbacks() : nullptr;
+
     const std::vector<const char*> device_extensions_ = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };    // Availability of a present queue implicitly ensures that swapchains are supported
                                                                                                 // but being explicit is good practice. Also we have to explicitly enable the extension
                                                                                                 // anyway...
 
+    // Memory type requests for the different kinds of resources we create: { required, preferred, avoided }
+    const MemoryTypeRequest DEVICE_LOCAL_MEMORY = { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT };  // Don't waste the BAR on resources the CPU never touches
+    const MemoryTypeRequest TRANSIENT_ATTACHMENT_MEMORY = { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT }; // Tilers may never back this with memory at all
+    const MemoryTypeRequest STAGING_MEMORY = { VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT };
+    const MemoryTypeRequest UNIFORM_MEMORY = { VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0 };
+    const MemoryTypeRequest DIRECT_UPLOAD_MEMORY = { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0, VK_MEMORY_PROPERTY_HOST_CACHED_BIT };
+
+    MemoryTypeSelector memory_types_;   // Cached memory properties of physical_device_
+    DeviceMemoryAllocator device_memory_;
+    DeviceMemoryDefragmenter defragmenter_;
+    UploadContext upload_context_;
+    DeletionQueue deletion_queue_;  // Destroys retired objects once the graphics timeline passed their last use
+    ResourceStateTracker resource_states_;  // Current layout and accesses of the resources we transition
+
+    const float DEFRAGMENTATION_THRESHOLD = 0.5f;  // Start a pass if more than half of the free memory is scattered outside of the largest hole
+    const VkDeviceSize DEFRAGMENTATION_BYTES_PER_STEP = 8ull * 1024ull * 1024ull;  // Copy budget per frame
+    const VkBufferUsageFlags MOVABLE_BUFFER_USAGE = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;   // Required to be moved by the defragmenter
+
     VkQueue graphics_queue_ = VK_NULL_HANDLE;   // We do not have to clean this up manually, clean up of logical device takes care of this.
     VkQueue present_queue_ = VK_NULL_HANDLE;
+    VkQueue transfer_queue_ = VK_NULL_HANDLE;   // Same as graphics_queue_ if the device has no dedicated transfer queue family
     VkSurfaceKHR surface_ = VK_NULL_HANDLE;
 
     VkSwapchainKHR swap_chain_ = VK_NULL_HANDLE;
     std::vector<VkImage> swap_chain_images_; // image handles will be automatically cleaned up by destruction of swap chain.
     VkFormat swap_chain_image_format_;
     VkExtent2D swap_chain_extent_;
-    std::vector<VkImageView> swap_chain_image_views_;   // Will be explicitly created by us -> We have to clean them up!
+    PresentPolicy swap_chain_present_policy_ = PresentPolicy::LowLatency;  // Policy the swap chain has been created with
+
+    bool is_surface_maintenance1_enabled_ = false;      // Instance side requirement of VK_EXT_swapchain_maintenance1
+    bool is_swapchain_maintenance1_enabled_ = false;    // Presents signal fences, see PresentImage()
+    std::vector<VkFence> pending_present_fences_;       // Presents which may still be in progress, across all swap chains
+    std::vector<VkFence> free_present_fences_;
+    VkFence last_present_fence_ = VK_NULL_HANDLE;       // Of the current swap chain. Also in pending_present_fences_.
+    VkPresentModeKHR swap_chain_present_mode_ = VK_PRESENT_MODE_FIFO_KHR;
+    VkExtent2D render_extent_;  // Part of the scene color target we render into this frame, see ResolutionScaler
 
     VkRenderPass render_pass_ = VK_NULL_HANDLE;
 
@@ -2681,53 +4005,202 @@ private:
     VkPipelineLayout pipeline_layout_ = VK_NULL_HANDLE;
     VkPipeline graphics_pipeline_ = VK_NULL_HANDLE;
 
-    std::vector<VkFramebuffer> swap_chain_framebuffers_;
-    VkCommandPool command_pool_ = VK_NULL_HANDLE;
-    std::vector<VkCommandBuffer> command_buffers_;
+    VkFramebuffer scene_framebuffer_ = VK_NULL_HANDLE;     // Doesn't contain any swap chain image, so one is enough
+    FrameCommandPools frame_command_pools_;
+    BarrierBatcher frame_barriers_;     // Barriers recorded into the primary command buffer of the frame
+    static constexpr uint32_t MAX_RECORDING_THREADS = 8;   // Upper bound for the number of chunks the draws are split into, one pool per chunk
+    const uint32_t MIN_DRAWS_PER_CHUNK = 256;
+    WorkerPool recording_workers_{ std::clamp(std::thread::hardware_concurrency(), 1u, MAX_RECORDING_THREADS) - 1 };  // The main thread records as well
+
+    const uint32_t NUM_BENCHMARK_DRAWS = 65536;
+    const uint32_t NUM_BENCHMARK_ITERATIONS = 20;
+    const uint32_t NUM_BENCHMARK_WARMUP_ITERATIONS = 2;
 
     std::vector<VkSemaphore> image_available_semaphores_;
     std::vector<VkSemaphore> render_finished_semaphores_;
-    std::vector<VkFence> inflight_frame_fences_;
-    std::vector<VkFence> inflight_images_;
+    std::array<uint64_t, MAX_FRAMES_IN_FLIGHT> frame_timeline_values_ = {};  // Graphics timeline value of the last submission of each frame in flight
+
+    uint64_t num_rendered_frames_ = 0;
+
+    // Hand-off from the main thread to the render thread. Room for the packet being rendered and the one being built.
+    static constexpr uint32_t NUM_FRAME_PACKETS = 2;
+    HandoffQueue<FramePacket> frame_packets_;
+    std::exception_ptr render_thread_exception_;
+
+    // Owned by the render thread while the frame loop runs
+    std::chrono::steady_clock::time_point last_frame_end_time_;
+    uint64_t num_steady_state_frames_ = 0;   // Statistics to verify that the frame loop doesn't allocate from the general purpose heap once everything is warmed up
+    uint64_t num_frames_with_heap_allocations_ = 0;
+    uint64_t num_steady_state_heap_allocations_ = 0;
+
+    FrameReadback frame_readback_;
+    GpuFrameTimer gpu_frame_timer_;
+    bool is_measuring_frames_ = false;  // Benchmark is past its warm-up
+    std::array<bool, MAX_FRAMES_IN_FLIGHT> is_frame_measured_ = {};    // Whether the GPU time of the frame's last submission counts
+    std::array<uint64_t, MAX_FRAMES_IN_FLIGHT> frame_numbers_ = {};    // Packet of the frame's last submission, to find its record in the latency trace
+    FrameLatencyTrace latency_trace_;
+    FrameTimeStats cpu_frame_times_;
+    FrameTimeStats gpu_frame_times_;
+    std::vector<uint64_t> image_timeline_values_;   // Graphics timeline value of the frame that last rendered to each swap chain image
+
+    GpuTimeline graphics_timeline_;
+    GpuTimeline transfer_timeline_; // Only used with a dedicated transfer queue
 
     std::vector<Vertex> vertices_;
     std::vector<uint32_t> indices_;
+    std::vector<Mesh> meshes_;
+    std::vector<SceneObject> scene_objects_;
+    RecordingStats recording_stats_;
 
     VkBuffer vertex_buffer_;
-    VkDeviceMemory vertex_buffer_memory_;
+    DeviceAllocationHandle vertex_buffer_allocation_ = INVALID_DEVICE_ALLOCATION;
     VkBuffer index_buffer_;
-    VkDeviceMemory index_buffer_memory_;
+    DeviceAllocationHandle index_buffer_allocation_ = INVALID_DEVICE_ALLOCATION;
 
     std::vector<VkBuffer> uniform_buffers_;
-    std::vector<VkDeviceMemory> uniform_buffers_memory_;    // Array, because we need one uniform buffer per swap chain image!
+    std::vector<DeviceAllocationHandle> uniform_buffer_allocations_;    // Array, because we need one uniform buffer per frame in flight!
 
     VkDescriptorPool descriptor_pool_;
-    std::vector<VkDescriptorSet> descriptor_sets_;
+    std::vector<VkDescriptorSet> descriptor_sets_;  // One per frame in flight, indexed by current_frame_
+    std::vector<bool> is_descriptor_set_outdated_;  // Set for all frames when the defragmenter has moved the texture, see WriteDescriptorSet()
 
     uint32_t num_mips_;
     VkImage texture_image_;
-    VkDeviceMemory texture_image_memory_;
+    DeviceAllocationHandle texture_image_allocation_ = INVALID_DEVICE_ALLOCATION;
     VkImageView texture_image_view_;
     VkSampler texture_sampler_;
 
     // Depth attachment
     VkImage depth_image_;    // Only need one, because only one draw operation is executed at a time.
-    VkDeviceMemory depth_image_memory_;
+    DeviceAllocationHandle depth_image_allocation_ = INVALID_DEVICE_ALLOCATION;
     VkImageView depth_image_view_;
 
     // MSAA
     VkSampleCountFlagBits num_msaa_samples_ = VK_SAMPLE_COUNT_1_BIT; // By default we'll be using only one sample per pixel -> no multisampling
     VkImage color_image_;   // offscreen buffer we sample from
-    VkDeviceMemory color_image_memory_;
+    DeviceAllocationHandle color_image_allocation_ = INVALID_DEVICE_ALLOCATION;
     VkImageView color_image_view_;
 
+    // The MSAA color target is resolved into this one. Always has the size of the swap chain, we may only render into a part of it.
+    VkImage scene_color_image_;
+    DeviceAllocationHandle scene_color_image_allocation_ = INVALID_DEVICE_ALLOCATION;
+    VkImageView scene_color_image_view_;
+    VkFilter upscale_filter_ = VK_FILTER_LINEAR;
+    ResolutionScaler resolution_scaler_;
+
     uint32_t current_frame_ = 0;
+    std::array<LinearArena, MAX_FRAMES_IN_FLIGHT> frame_arenas_;   // One per frame in flight, reset once the frame's timeline value has been reached
+    uint32_t num_swap_chain_recreations_ = 0;
+
     bool was_frame_buffer_resized_ = false;
+    PresentPolicy present_policy_ = PresentPolicy::LowLatency;    // Policy of the current packet. The swap chain follows after the next present.
+    uint32_t num_present_policy_changes_ = 0;   // While measuring a benchmark
+    VkExtent2D framebuffer_extent_ = {};    // Size of the window's frame buffer in pixels, as of the last packet
+
+    // Owned by the main thread
+    std::atomic<bool> is_redraw_requested_ = false;     // Set from any thread, see RequestRedraw()
+    bool is_animation_paused_ = false;
+    PresentPolicy requested_present_policy_ = PresentPolicy::LowLatency;   // Cycled with P
+    double animation_time_ = 0.0;   // Seconds the animation has been running, without the pauses
+    std::chrono::steady_clock::time_point last_animation_update_time_;
+
+    LaunchOptions launch_options_;
 };
 
-int main()
+int main(int argc, char** argv)
 {
-    HelloTriangleApplication app;
+    LaunchOptions launch_options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+        if (argument == "--benchmark-recording")
+        {
+            launch_options.benchmark_command_recording = true;
+        }
+        else if (argument == "--scene-objects" && i + 1 < argc)
+        {
+            launch_options.num_scene_objects = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (argument == "--headless")
+        {
+            launch_options.headless = true;
+        }
+        else if (argument == "--frames" && i + 1 < argc)
+        {
+            launch_options.num_frames = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (argument == "--benchmark")
+        {
+            launch_options.benchmark = true;
+        }
+        else if (argument == "--duration" && i + 1 < argc)
+        {
+            launch_options.duration_seconds = std::strtod(argv[++i], nullptr);
+        }
+        else if (argument == "--warmup-frames" && i + 1 < argc)
+        {
+            launch_options.num_warmup_frames = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (argument == "--benchmark-report" && i + 1 < argc)
+        {
+            launch_options.benchmark_report_path = argv[++i];
+        }
+        else if (argument == "--capture" && i + 1 < argc)
+        {
+            launch_options.capture_directory = argv[++i];
+        }
+        else if (argument == "--capture-raw")
+        {
+            launch_options.capture_format = CaptureFormat::Raw;
+        }
+        else if (argument == "--capture-interval" && i + 1 < argc)
+        {
+            launch_options.capture_interval = std::max(1u, static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10)));
+        }
+        else if (argument == "--gpu-budget" && i + 1 < argc)
+        {
+            launch_options.gpu_budget_ms = std::strtod(argv[++i], nullptr);
+        }
+        else if (argument == "--min-resolution-scale" && i + 1 < argc)
+        {
+            launch_options.min_resolution_scale = std::strtof(argv[++i], nullptr);
+        }
+        else if (argument == "--present-policy" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            std::optional<PresentPolicy> present_policy = ParsePresentPolicy(name);
+            if (present_policy.has_value())
+            {
+                launch_options.present_policy = present_policy.value();
+            }
+            else
+            {
+                std::cerr << "Ignoring unknown present policy: " << name << std::endl;
+            }
+        }
+        else if (argument == "--latency-trace" && i + 1 < argc)
+        {
+            launch_options.latency_trace_path = argv[++i];
+        }
+        else if (argument == "--on-demand")
+        {
+            launch_options.render_on_demand = true;
+        }
+        else if (argument == "--no-render-thread")
+        {
+            launch_options.use_render_thread = false;
+        }
+        else if (argument == "--frames-in-flight" && i + 1 < argc)
+        {
+            launch_options.num_frames_in_flight = std::clamp(static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10)), 1u, HelloTriangleApplication::MAX_FRAMES_IN_FLIGHT);
+        }
+        else
+        {
+            std::cerr << "Ignoring unknown argument: " << argument << std::endl;
+        }
+    }
+
+    HelloTriangleApplication app(launch_options);
 
     try
     {
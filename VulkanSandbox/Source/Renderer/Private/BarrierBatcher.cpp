@@ -0,0 +1,74 @@
+#include "BarrierBatcher.h"
+
+void BarrierBatcher::AddMemoryBarrier(VkPipelineStageFlags2 src_stage_mask, VkAccessFlags2 src_access_mask, VkPipelineStageFlags2 dst_stage_mask, VkAccessFlags2 dst_access_mask)
+{
+    VkMemoryBarrier2& barrier = memory_barriers_.emplace_back();
+    barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+    barrier.srcStageMask = src_stage_mask;
+    barrier.srcAccessMask = src_access_mask;
+    barrier.dstStageMask = dst_stage_mask;
+    barrier.dstAccessMask = dst_access_mask;
+}
+
+void BarrierBatcher::AddBufferBarrier(VkBuffer buffer, VkPipelineStageFlags2 src_stage_mask, VkAccessFlags2 src_access_mask, VkPipelineStageFlags2 dst_stage_mask, VkAccessFlags2 dst_access_mask,
+                                      uint32_t src_queue_family_index, uint32_t dst_queue_family_index, VkDeviceSize offset, VkDeviceSize size)
+{
+    VkBufferMemoryBarrier2& barrier = buffer_barriers_.emplace_back();
+    barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
+    barrier.srcStageMask = src_stage_mask;
+    barrier.srcAccessMask = src_access_mask;
+    barrier.dstStageMask = dst_stage_mask;
+    barrier.dstAccessMask = dst_access_mask;
+    barrier.srcQueueFamilyIndex = src_queue_family_index;
+    barrier.dstQueueFamilyIndex = dst_queue_family_index;
+    barrier.buffer = buffer;
+    barrier.offset = offset;
+    barrier.size = size;
+}
+
+void BarrierBatcher::AddImageBarrier(VkImage image, const VkImageSubresourceRange& subresource_range, VkImageLayout old_layout, VkImageLayout new_layout,
+                                     VkPipelineStageFlags2 src_stage_mask, VkAccessFlags2 src_access_mask, VkPipelineStageFlags2 dst_stage_mask, VkAccessFlags2 dst_access_mask,
+                                     uint32_t src_queue_family_index, uint32_t dst_queue_family_index)
+{
+    VkImageMemoryBarrier2& barrier = image_barriers_.emplace_back();
+    barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+    barrier.srcStageMask = src_stage_mask;
+    barrier.srcAccessMask = src_access_mask;
+    barrier.dstStageMask = dst_stage_mask;
+    barrier.dstAccessMask = dst_access_mask;
+    barrier.oldLayout = old_layout;
+    barrier.newLayout = new_layout;
+    barrier.srcQueueFamilyIndex = src_queue_family_index;
+    barrier.dstQueueFamilyIndex = dst_queue_family_index;
+    barrier.image = image;
+    barrier.subresourceRange = subresource_range;
+}
+
+void BarrierBatcher::Flush(VkCommandBuffer command_buffer)
+{
+    if (IsEmpty())
+    {
+        return;
+    }
+
+    VkDependencyInfo dependency_info{};
+    dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependency_info.memoryBarrierCount = static_cast<uint32_t>(memory_barriers_.size());
+    dependency_info.pMemoryBarriers = memory_barriers_.data();
+    dependency_info.bufferMemoryBarrierCount = static_cast<uint32_t>(buffer_barriers_.size());
+    dependency_info.pBufferMemoryBarriers = buffer_barriers_.data();
+    dependency_info.imageMemoryBarrierCount = static_cast<uint32_t>(image_barriers_.size());
+    dependency_info.pImageMemoryBarriers = image_barriers_.data();
+
+    vkCmdPipelineBarrier2(command_buffer, &dependency_info);
+
+    num_flushed_barriers_ += memory_barriers_.size() + buffer_barriers_.size() + image_barriers_.size();
+    num_flushes_++;
+
+    memory_barriers_.clear();
+    buffer_barriers_.clear();
+    image_barriers_.clear();
+}
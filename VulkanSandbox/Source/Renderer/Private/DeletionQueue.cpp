@@ -0,0 +1,200 @@
+#include "DeletionQueue.h"
+
+namespace
+{
+    // Non-dispatchable handles are pointers on 64 bit platforms and uint64_t everywhere else.
+    template<typename Handle>
+    uint64_t ToHandleValue(Handle handle)
+    {
+        if constexpr (std::is_pointer_v<Handle>)
+        {
+            return reinterpret_cast<uint64_t>(handle);
+        }
+        else
+        {
+            return static_cast<uint64_t>(handle);
+        }
+    }
+
+    template<typename Handle>
+    Handle FromHandleValue(uint64_t value)
+    {
+        if constexpr (std::is_pointer_v<Handle>)
+        {
+            return reinterpret_cast<Handle>(value);
+        }
+        else
+        {
+            return static_cast<Handle>(value);
+        }
+    }
+}
+
+void DeletionQueue::Init(VkDevice device, const VkAllocationCallbacks* allocator, DeviceMemoryAllocator* device_memory, GpuTimeline* timeline)
+{
+    device_ = device;
+    allocator_ = allocator;
+    device_memory_ = device_memory;
+    timeline_ = timeline;
+}
+
+void DeletionQueue::Shutdown()
+{
+    for (const RetiredObject& object : retired_objects_)
+    {
+        DestroyObject(object);
+    }
+
+    retired_objects_.clear();
+}
+
+void DeletionQueue::RetireAllocation(DeviceAllocationHandle allocation, uint64_t timeline_value)
+{
+    Retire(ObjectType::Allocation, allocation, timeline_value);
+}
+
+void DeletionQueue::RetireBuffer(VkBuffer buffer, uint64_t timeline_value)
+{
+    Retire(ObjectType::Buffer, buffer, timeline_value);
+}
+
+void DeletionQueue::RetireImage(VkImage image, uint64_t timeline_value)
+{
+    Retire(ObjectType::Image, image, timeline_value);
+}
+
+void DeletionQueue::RetireMemoryRange(uint32_t block_index, VkDeviceSize offset, VkDeviceSize size, uint64_t timeline_value)
+{
+    RetiredObject object;
+    object.type = ObjectType::MemoryRange;
+    object.handle = block_index;
+    object.timeline_value = timeline_value;
+    object.offset = offset;
+    object.size = size;
+    retired_objects_.push_back(object);
+}
+
+void DeletionQueue::RetireImageView(VkImageView image_view, uint64_t timeline_value)
+{
+    Retire(ObjectType::ImageView, image_view, timeline_value);
+}
+
+void DeletionQueue::RetireFramebuffer(VkFramebuffer framebuffer, uint64_t timeline_value)
+{
+    Retire(ObjectType::Framebuffer, framebuffer, timeline_value);
+}
+
+void DeletionQueue::RetirePipeline(VkPipeline pipeline, uint64_t timeline_value)
+{
+    Retire(ObjectType::Pipeline, pipeline, timeline_value);
+}
+
+void DeletionQueue::RetirePipelineLayout(VkPipelineLayout pipeline_layout, uint64_t timeline_value)
+{
+    Retire(ObjectType::PipelineLayout, pipeline_layout, timeline_value);
+}
+
+void DeletionQueue::RetireRenderPass(VkRenderPass render_pass, uint64_t timeline_value)
+{
+    Retire(ObjectType::RenderPass, render_pass, timeline_value);
+}
+
+void DeletionQueue::RetireDescriptorPool(VkDescriptorPool descriptor_pool, uint64_t timeline_value)
+{
+    Retire(ObjectType::DescriptorPool, descriptor_pool, timeline_value);
+}
+
+void DeletionQueue::RetireSwapchain(VkSwapchainKHR swapchain, uint64_t timeline_value)
+{
+    Retire(ObjectType::Swapchain, swapchain, timeline_value);
+}
+
+void DeletionQueue::RetireSwapchain(VkSwapchainKHR swapchain, VkFence last_present_fence)
+{
+    RetiredObject object;
+    object.type = ObjectType::Swapchain;
+    object.handle = ToHandleValue(swapchain);
+    object.fence = last_present_fence;
+    retired_objects_.push_back(object);
+}
+
+void DeletionQueue::Update()
+{
+    if (retired_objects_.empty())
+    {
+        return;
+    }
+
+    // Objects aren't necessarily retired in timeline order, so we check all of them. There are only ever a handful.
+    uint64_t completed_value = timeline_->GetCompletedValue();
+
+    size_t num_remaining = 0;
+    for (const RetiredObject& object : retired_objects_)
+    {
+        bool is_unused = object.fence != VK_NULL_HANDLE ? vkGetFenceStatus(device_, object.fence) == VK_SUCCESS : object.timeline_value <= completed_value;
+        if (is_unused)
+        {
+            DestroyObject(object);
+        }
+        else
+        {
+            retired_objects_[num_remaining++] = object;
+        }
+    }
+
+    retired_objects_.resize(num_remaining);
+}
+
+template<typename Handle>
+void DeletionQueue::Retire(ObjectType type, Handle handle, uint64_t timeline_value)
+{
+    RetiredObject object;
+    object.type = type;
+    object.handle = ToHandleValue(handle);
+    object.timeline_value = timeline_value;
+    retired_objects_.push_back(object);
+}
+
+void DeletionQueue::DestroyObject(const RetiredObject& object)
+{
+    switch (object.type)
+    {
+    case ObjectType::Allocation:
+        device_memory_->Destroy(static_cast<DeviceAllocationHandle>(object.handle));
+        break;
+    case ObjectType::Buffer:
+        vkDestroyBuffer(device_, FromHandleValue<VkBuffer>(object.handle), allocator_);
+        break;
+    case ObjectType::Image:
+        vkDestroyImage(device_, FromHandleValue<VkImage>(object.handle), allocator_);
+        break;
+    case ObjectType::MemoryRange:
+        device_memory_->FreeRetiredRange(static_cast<uint32_t>(object.handle), object.offset, object.size);
+        break;
+    case ObjectType::ImageView:
+        vkDestroyImageView(device_, FromHandleValue<VkImageView>(object.handle), allocator_);
+        break;
+    case ObjectType::Framebuffer:
+        vkDestroyFramebuffer(device_, FromHandleValue<VkFramebuffer>(object.handle), allocator_);
+        break;
+    case ObjectType::Pipeline:
+        vkDestroyPipeline(device_, FromHandleValue<VkPipeline>(object.handle), allocator_);
+        break;
+    case ObjectType::PipelineLayout:
+        vkDestroyPipelineLayout(device_, FromHandleValue<VkPipelineLayout>(object.handle), allocator_);
+        break;
+    case ObjectType::RenderPass:
+        vkDestroyRenderPass(device_, FromHandleValue<VkRenderPass>(object.handle), allocator_);
+        break;
+    case ObjectType::DescriptorPool:
+        vkDestroyDescriptorPool(device_, FromHandleValue<VkDescriptorPool>(object.handle), allocator_);
+        break;
+    case ObjectType::Swapchain:
+        vkDestroySwapchainKHR(device_, FromHandleValue<VkSwapchainKHR>(object.handle), allocator_);
+        if (object.fence != VK_NULL_HANDLE)
+        {
+            vkDestroyFence(device_, object.fence, allocator_);
+        }
+        break;
+    }
+}
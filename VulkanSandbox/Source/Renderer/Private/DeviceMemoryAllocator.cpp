@@ -0,0 +1,522 @@
+#include "DeviceMemoryAllocator.h"
+
+namespace
+{
+    VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment)
+    {
+        // Vulkan guarantees that alignments are powers of two
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+}
+
+void DeviceMemoryAllocator::Init(VkDevice device, const VkAllocationCallbacks* allocator, const MemoryTypeSelector* memory_types)
+{
+    device_ = device;
+    allocator_ = allocator;
+    memory_types_ = memory_types;
+}
+
+void DeviceMemoryAllocator::Shutdown()
+{
+    for (const DeviceAllocation& allocation : allocations_)
+    {
+        if (allocation.is_alive)
+        {
+            throw std::runtime_error("Device memory allocator is shut down while there are still allocations alive!");
+        }
+    }
+
+    ReleaseEmptyBlocks();
+    blocks_.clear();
+    allocations_.clear();
+    free_allocation_handles_.clear();
+}
+
+DeviceAllocationHandle DeviceMemoryAllocator::CreateBuffer(const VkBufferCreateInfo& buffer_info, const MemoryTypeRequest& memory_request, DeviceMemoryCategory category, const char* name, VkBuffer& out_buffer)
+{
+    if (vkCreateBuffer(device_, &buffer_info, allocator_, &out_buffer) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create buffer!");
+    }
+
+    // Buffer was created, but no memory has been allocated yet. Find a spot in one of our blocks.
+    VkMemoryRequirements mem_requirements;
+    vkGetBufferMemoryRequirements(device_, out_buffer, &mem_requirements);
+
+    DeviceAllocationHandle handle = CreateAllocation();
+    DeviceAllocation& allocation = allocations_[handle];
+    AllocateMemory(allocation, mem_requirements, memory_request, false);
+
+    allocation.buffer = out_buffer;
+    allocation.buffer_info = buffer_info;
+    allocation.buffer_info.pNext = nullptr;
+    allocation.buffer_info.pQueueFamilyIndices = nullptr;
+    allocation.category = category;
+    allocation.name = (name != nullptr) ? name : "";
+    TrackAllocation(allocation);
+
+    // Finally associate the allocated memory with the buffer. Multiple resources share one VkDeviceMemory, so the offset matters now.
+    vkBindBufferMemory(device_, out_buffer, allocation.memory, allocation.offset);
+    SetDebugName(VK_OBJECT_TYPE_BUFFER, reinterpret_cast<uint64_t>(out_buffer), name);
+
+    return handle;
+}
+
+DeviceAllocationHandle DeviceMemoryAllocator::CreateImage(const VkImageCreateInfo& image_info, const MemoryTypeRequest& memory_request, DeviceMemoryCategory category, const char* name, VkImage& out_image)
+{
+    if (vkCreateImage(device_, &image_info, allocator_, &out_image) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create image!");
+    }
+
+    VkMemoryRequirements mem_requirements;
+    vkGetImageMemoryRequirements(device_, out_image, &mem_requirements);
+
+    DeviceAllocationHandle handle = CreateAllocation();
+    DeviceAllocation& allocation = allocations_[handle];
+    AllocateMemory(allocation, mem_requirements, memory_request, image_info.tiling == VK_IMAGE_TILING_OPTIMAL);
+
+    allocation.image = out_image;
+    allocation.image_info = image_info;
+    allocation.image_info.pNext = nullptr;
+    allocation.image_info.pQueueFamilyIndices = nullptr;
+    allocation.category = category;
+    allocation.name = (name != nullptr) ? name : "";
+    TrackAllocation(allocation);
+
+    vkBindImageMemory(device_, out_image, allocation.memory, allocation.offset);
+    SetDebugName(VK_OBJECT_TYPE_IMAGE, reinterpret_cast<uint64_t>(out_image), name);
+
+    return handle;
+}
+
+void DeviceMemoryAllocator::Destroy(DeviceAllocationHandle handle)
+{
+    if (handle == INVALID_DEVICE_ALLOCATION)
+    {
+        return;
+    }
+
+    DeviceAllocation& allocation = allocations_[handle];
+
+    // The resource has to be destroyed before the memory it's bound to is freed.
+    if (allocation.buffer != VK_NULL_HANDLE)
+    {
+        vkDestroyBuffer(device_, allocation.buffer, allocator_);
+    }
+
+    if (allocation.image != VK_NULL_HANDLE)
+    {
+        vkDestroyImage(device_, allocation.image, allocator_);
+    }
+
+    UntrackAllocation(allocation);
+    FreeMemory(allocation);
+
+    allocation = DeviceAllocation{};
+    free_allocation_handles_.push_back(handle);
+}
+
+DeviceAllocationHandle DeviceMemoryAllocator::CreateAllocation()
+{
+    DeviceAllocationHandle handle;
+    if (free_allocation_handles_.empty() == false)
+    {
+        handle = free_allocation_handles_.back();
+        free_allocation_handles_.pop_back();
+    }
+    else
+    {
+        handle = static_cast<DeviceAllocationHandle>(allocations_.size());
+        allocations_.emplace_back();
+    }
+
+    allocations_[handle].is_alive = true;
+    return handle;
+}
+
+void DeviceMemoryAllocator::AllocateMemory(DeviceAllocation& allocation, const VkMemoryRequirements& requirements, const MemoryTypeRequest& memory_request, bool is_optimal_image)
+{
+    uint32_t memory_type_index = memory_types_->FindMemoryType(requirements.memoryTypeBits, memory_request);
+    VkMemoryPropertyFlags property_flags = memory_types_->GetPropertyFlags(memory_type_index);
+    allocation.memory_type_index = memory_type_index;
+    allocation.size = requirements.size;
+
+    // Large resources get their own VkDeviceMemory. Putting them into a block would waste most of the block.
+    // Lazily allocated memory (transient attachments on tilers) may never be backed by physical memory at all, so it doesn't make sense to pool it either.
+    bool is_dedicated = requirements.size > GetPreferredBlockSize(memory_type_index) / 2
+        || (property_flags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) != 0;
+
+    if (is_dedicated == false)
+    {
+        for (uint32_t block_index = 0; block_index < blocks_.size(); block_index++)
+        {
+            const MemoryBlock& block = blocks_[block_index];
+            if (block.memory == VK_NULL_HANDLE || block.memory_type_index != memory_type_index || block.is_for_optimal_images != is_optimal_image)
+            {
+                continue;
+            }
+
+            if (TryAllocateFromBlock(block_index, requirements.size, requirements.alignment, allocation.offset))
+            {
+                allocation.block_index = block_index;
+                break;
+            }
+        }
+
+        if (allocation.block_index == UINT32_MAX)
+        {
+            uint32_t block_index = CreateBlock(memory_type_index, is_optimal_image);
+            if (TryAllocateFromBlock(block_index, requirements.size, requirements.alignment, allocation.offset) == false)
+            {
+                throw std::runtime_error("Failed to sub-allocate from new memory block!");
+            }
+            allocation.block_index = block_index;
+        }
+
+        const MemoryBlock& block = blocks_[allocation.block_index];
+        allocation.memory = block.memory;
+        allocation.mapped_data = block.mapped_data != nullptr ? static_cast<char*>(block.mapped_data) + allocation.offset : nullptr;
+        return;
+    }
+
+    VkMemoryAllocateInfo alloc_info{};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = requirements.size;
+    alloc_info.memoryTypeIndex = memory_type_index;
+
+    if (vkAllocateMemory(device_, &alloc_info, allocator_, &allocation.memory) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to allocate dedicated device memory!");
+    }
+
+    allocation.offset = 0;
+    allocation.block_index = UINT32_MAX;
+
+    if ((property_flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0)
+    {
+        vkMapMemory(device_, allocation.memory, 0, VK_WHOLE_SIZE, 0, &allocation.mapped_data);
+    }
+}
+
+void DeviceMemoryAllocator::FreeMemory(DeviceAllocation& allocation)
+{
+    num_frees_++;
+
+    if (allocation.block_index == UINT32_MAX)
+    {
+        // Freeing implicitly unmaps the memory
+        vkFreeMemory(device_, allocation.memory, allocator_);
+        return;
+    }
+
+    FreeToBlock(allocation.block_index, allocation.offset, allocation.size);
+}
+
+bool DeviceMemoryAllocator::TryAllocateFromBlock(uint32_t block_index, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& out_offset)
+{
+    MemoryBlock& block = blocks_[block_index];
+
+    // Best fit: Use the smallest free range that can hold the allocation, so large ranges stay available for large allocations.
+    size_t best_range_index = SIZE_MAX;
+    VkDeviceSize best_range_size = UINT64_MAX;
+    for (size_t i = 0; i < block.free_ranges.size(); i++)
+    {
+        const FreeRange& range = block.free_ranges[i];
+        VkDeviceSize aligned_offset = AlignUp(range.offset, alignment);
+        if (aligned_offset + size > range.offset + range.size)
+        {
+            continue;
+        }
+
+        if (range.size < best_range_size)
+        {
+            best_range_index = i;
+            best_range_size = range.size;
+        }
+    }
+
+    if (best_range_index == SIZE_MAX)
+    {
+        return false;
+    }
+
+    // Split the free range into the alignment padding in front of the allocation and the remainder behind it.
+    FreeRange range = block.free_ranges[best_range_index];
+    VkDeviceSize aligned_offset = AlignUp(range.offset, alignment);
+    FreeRange front = { range.offset, aligned_offset - range.offset };
+    FreeRange back = { aligned_offset + size, range.offset + range.size - (aligned_offset + size) };
+
+    block.free_ranges.erase(block.free_ranges.begin() + best_range_index);
+    if (back.size > 0)
+    {
+        block.free_ranges.insert(block.free_ranges.begin() + best_range_index, back);
+    }
+    if (front.size > 0)
+    {
+        block.free_ranges.insert(block.free_ranges.begin() + best_range_index, front);
+    }
+
+    block.used_bytes += size;
+    block.num_allocations++;
+    out_offset = aligned_offset;
+    return true;
+}
+
+void DeviceMemoryAllocator::FreeToBlock(uint32_t block_index, VkDeviceSize offset, VkDeviceSize size)
+{
+    MemoryBlock& block = blocks_[block_index];
+    block.used_bytes -= size;
+    block.num_allocations--;
+
+    // Insert sorted by offset, then merge with the neighbors if they touch.
+    auto it = std::lower_bound(block.free_ranges.begin(), block.free_ranges.end(), offset,
+        [](const FreeRange& range, VkDeviceSize value) { return range.offset < value; });
+    it = block.free_ranges.insert(it, FreeRange{ offset, size });
+
+    auto next = it + 1;
+    if (next != block.free_ranges.end() && it->offset + it->size == next->offset)
+    {
+        it->size += next->size;
+        block.free_ranges.erase(next);
+    }
+
+    if (it != block.free_ranges.begin())
+    {
+        auto previous = it - 1;
+        if (previous->offset + previous->size == it->offset)
+        {
+            previous->size += it->size;
+            block.free_ranges.erase(it);
+        }
+    }
+}
+
+void DeviceMemoryAllocator::FreeRetiredRange(uint32_t block_index, VkDeviceSize offset, VkDeviceSize size)
+{
+    blocks_[block_index].num_retiring_allocations--;
+    FreeToBlock(block_index, offset, size);
+}
+
+uint32_t DeviceMemoryAllocator::CreateBlock(uint32_t memory_type_index, bool is_for_optimal_images)
+{
+    MemoryBlock block;
+    block.size = GetPreferredBlockSize(memory_type_index);
+    block.memory_type_index = memory_type_index;
+    block.is_for_optimal_images = is_for_optimal_images;
+    block.free_ranges.push_back(FreeRange{ 0, block.size });
+
+    VkMemoryAllocateInfo alloc_info{};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = block.size;
+    alloc_info.memoryTypeIndex = memory_type_index;
+
+    if (vkAllocateMemory(device_, &alloc_info, allocator_, &block.memory) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to allocate device memory block!");
+    }
+
+    // Host visible blocks are mapped once and stay mapped. Mapping is not free and a VkDeviceMemory can only be mapped once at a time,
+    // which would be a problem as soon as two sub-allocations of the same block want to be mapped.
+    if ((memory_types_->GetPropertyFlags(memory_type_index) & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0)
+    {
+        vkMapMemory(device_, block.memory, 0, VK_WHOLE_SIZE, 0, &block.mapped_data);
+    }
+
+    // Reuse the slot of a released block if there is one
+    for (uint32_t i = 0; i < blocks_.size(); i++)
+    {
+        if (blocks_[i].memory == VK_NULL_HANDLE)
+        {
+            blocks_[i] = std::move(block);
+            return i;
+        }
+    }
+
+    blocks_.push_back(std::move(block));
+    return static_cast<uint32_t>(blocks_.size() - 1);
+}
+
+VkDeviceSize DeviceMemoryAllocator::GetPreferredBlockSize(uint32_t memory_type_index) const
+{
+    // Small heaps (e.g. the 256 MiB BAR) would be eaten up by a few blocks, so we use smaller blocks there.
+    const VkPhysicalDeviceMemoryProperties& memory_properties = memory_types_->GetMemoryProperties();
+    VkDeviceSize heap_size = memory_properties.memoryHeaps[memory_properties.memoryTypes[memory_type_index].heapIndex].size;
+    if (heap_size <= SMALL_HEAP_SIZE)
+    {
+        return AlignUp(heap_size / 8, 32);
+    }
+
+    return DEFAULT_BLOCK_SIZE;
+}
+
+uint32_t DeviceMemoryAllocator::ReleaseEmptyBlocks()
+{
+    uint32_t num_released_blocks = 0;
+    for (MemoryBlock& block : blocks_)
+    {
+        if (block.memory != VK_NULL_HANDLE && block.num_allocations == 0)
+        {
+            vkFreeMemory(device_, block.memory, allocator_);
+            block = MemoryBlock{};
+            num_released_blocks++;
+        }
+    }
+
+    return num_released_blocks;
+}
+
+DeviceMemoryStats DeviceMemoryAllocator::GetStats() const
+{
+    DeviceMemoryStats stats;
+    VkDeviceSize free_bytes = 0;
+
+    for (const MemoryBlock& block : blocks_)
+    {
+        if (block.memory == VK_NULL_HANDLE)
+        {
+            continue;
+        }
+
+        stats.num_blocks++;
+        stats.num_empty_blocks += block.num_allocations == 0 ? 1 : 0;
+        stats.block_bytes += block.size;
+        stats.used_bytes += block.used_bytes;
+        stats.num_free_ranges += static_cast<uint32_t>(block.free_ranges.size());
+
+        for (const FreeRange& range : block.free_ranges)
+        {
+            free_bytes += range.size;
+            stats.largest_free_range = std::max(stats.largest_free_range, range.size);
+        }
+    }
+
+    for (const DeviceAllocation& allocation : allocations_)
+    {
+        if (allocation.is_alive == false)
+        {
+            continue;
+        }
+
+        stats.num_allocations++;
+        if (allocation.block_index == UINT32_MAX)
+        {
+            stats.num_dedicated_allocations++;
+            stats.dedicated_bytes += allocation.size;
+        }
+    }
+
+    if (free_bytes > 0)
+    {
+        stats.fragmentation = 1.0f - static_cast<float>(stats.largest_free_range) / static_cast<float>(free_bytes);
+    }
+
+    return stats;
+}
+
+void DeviceMemoryAllocator::SetDebugName(VkObjectType object_type, uint64_t object_handle, const char* name) const
+{
+    if (set_debug_name_ == nullptr)
+    {
+        return;
+    }
+
+    VkDebugUtilsObjectNameInfoEXT name_info{};
+    name_info.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT;
+    name_info.objectType = object_type;
+    name_info.objectHandle = object_handle;
+    name_info.pObjectName = name;
+    set_debug_name_(device_, &name_info);
+}
+
+void DeviceMemoryAllocator::TrackAllocation(const DeviceAllocation& allocation)
+{
+    DeviceMemoryCategoryStats& stats = category_stats_[static_cast<size_t>(allocation.category)];
+    stats.live_bytes += allocation.size;
+    stats.peak_bytes = std::max(stats.peak_bytes, stats.live_bytes);
+    stats.num_live_allocations++;
+    stats.num_total_allocations++;
+}
+
+void DeviceMemoryAllocator::UntrackAllocation(const DeviceAllocation& allocation)
+{
+    DeviceMemoryCategoryStats& stats = category_stats_[static_cast<size_t>(allocation.category)];
+    stats.live_bytes -= allocation.size;
+    stats.num_live_allocations--;
+}
+
+void DeviceMemoryAllocator::TrackMove(const DeviceAllocation& allocation, VkDeviceSize old_size)
+{
+    // The size may differ, e.g. because of a different alignment in the destination block. The number of allocations stays the same,
+    // otherwise every defragmentation step would show up as churn.
+    DeviceMemoryCategoryStats& stats = category_stats_[static_cast<size_t>(allocation.category)];
+    stats.live_bytes = stats.live_bytes - old_size + allocation.size;
+    stats.peak_bytes = std::max(stats.peak_bytes, stats.live_bytes);
+}
+
+const char* DeviceMemoryAllocator::GetCategoryName(DeviceMemoryCategory category)
+{
+    switch (category)
+    {
+    case DeviceMemoryCategory::Geometry: return "geometry";
+    case DeviceMemoryCategory::Texture: return "texture";
+    case DeviceMemoryCategory::RenderTarget: return "render_target";
+    case DeviceMemoryCategory::Uniform: return "uniform";
+    case DeviceMemoryCategory::Staging: return "staging";
+    default: return "unknown";
+    }
+}
+
+void DeviceMemoryAllocator::WriteStatsJson(std::ostream& stream) const
+{
+    // Debug names are chosen by us, but may contain file paths -> escape backslashes and quotes.
+    auto write_string = [&stream](const std::string& value)
+    {
+        stream << '"';
+        for (char c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                stream << '\\';
+            }
+            stream << c;
+        }
+        stream << '"';
+    };
+
+    DeviceMemoryStats stats = GetStats();
+    stream << "{\n";
+    stream << "  \"blocks\": { \"count\": " << stats.num_blocks << ", \"empty\": " << stats.num_empty_blocks
+        << ", \"bytes\": " << stats.block_bytes << ", \"used_bytes\": " << stats.used_bytes
+        << ", \"largest_free_range\": " << stats.largest_free_range << ", \"fragmentation\": " << stats.fragmentation << " },\n";
+    stream << "  \"dedicated\": { \"count\": " << stats.num_dedicated_allocations << ", \"bytes\": " << stats.dedicated_bytes << " },\n";
+
+    stream << "  \"categories\": {\n";
+    for (size_t i = 0; i < static_cast<size_t>(DeviceMemoryCategory::Count); i++)
+    {
+        const DeviceMemoryCategoryStats& category_stats = category_stats_[i];
+        stream << "    \"" << GetCategoryName(static_cast<DeviceMemoryCategory>(i)) << "\": { \"live_bytes\": " << category_stats.live_bytes
+            << ", \"peak_bytes\": " << category_stats.peak_bytes << ", \"live_allocations\": " << category_stats.num_live_allocations
+            << ", \"total_allocations\": " << category_stats.num_total_allocations << " }"
+            << (i + 1 < static_cast<size_t>(DeviceMemoryCategory::Count) ? ",\n" : "\n");
+    }
+    stream << "  },\n";
+
+    stream << "  \"allocations\": [";
+    bool is_first = true;
+    for (const DeviceAllocation& allocation : allocations_)
+    {
+        if (allocation.is_alive == false)
+        {
+            continue;
+        }
+
+        stream << (is_first ? "\n" : ",\n") << "    { \"name\": ";
+        write_string(allocation.name);
+        stream << ", \"category\": \"" << GetCategoryName(allocation.category) << "\", \"size\": " << allocation.size
+            << ", \"memory_type\": " << allocation.memory_type_index << ", \"dedicated\": " << (allocation.block_index == UINT32_MAX ? "true" : "false") << " }";
+        is_first = false;
+    }
+    stream << "\n  ]\n";
+    stream << "}\n";
+}
@@ -0,0 +1,529 @@
+#include "DeviceMemoryDefragmenter.h"
+
+void DeviceMemoryDefragmenter::Init(VkDevice device, const VkAllocationCallbacks* allocator, DeviceMemoryAllocator* device_memory, uint32_t queue_family_index, GpuTimeline* timeline,
+    DeletionQueue* deletion_queue)
+{
+    device_ = device;
+    allocator_ = allocator;
+    device_memory_ = device_memory;
+    timeline_ = timeline;
+    deletion_queue_ = deletion_queue;
+
+    // We only ever have one step in flight, so one command buffer which is rerecorded for each step is enough.
+    VkCommandPoolCreateInfo pool_info{};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.queueFamilyIndex = queue_family_index;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+
+    if (vkCreateCommandPool(device_, &pool_info, allocator_, &command_pool_) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create defragmentation command pool!");
+    }
+
+    VkCommandBufferAllocateInfo alloc_info{};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = command_pool_;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = 1;
+
+    if (vkAllocateCommandBuffers(device_, &alloc_info, &command_buffer_) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to allocate defragmentation command buffer!");
+    }
+}
+
+void DeviceMemoryDefragmenter::Shutdown()
+{
+    // Throw away a step that has not been committed yet. The old resources are still valid, so we only have to get rid of the copies.
+    if (IsStepPending())
+    {
+        timeline_->Wait(step_timeline_value_);
+        for (const Move& move : pending_moves_)
+        {
+            vkDestroyBuffer(device_, move.dst_buffer, allocator_);
+            vkDestroyImage(device_, move.dst_image, allocator_);
+            device_memory_->FreeToBlock(move.dst_block_index, move.dst_offset, move.size);
+        }
+        pending_moves_.clear();
+    }
+
+    vkDestroyCommandPool(device_, command_pool_, allocator_);
+    movables_.clear();
+    emptied_blocks_.clear();
+}
+
+void DeviceMemoryDefragmenter::RegisterBuffer(DeviceAllocationHandle handle, std::function<void(VkBuffer)> on_moved)
+{
+    const VkBufferUsageFlags required_usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if ((device_memory_->GetAllocation(handle).buffer_info.usage & required_usage) != required_usage)
+    {
+        throw std::runtime_error("Movable buffers need to support being a transfer source and destination!");
+    }
+
+    MovableResource resource;
+    resource.handle = handle;
+    resource.on_buffer_moved = std::move(on_moved);
+    movables_.push_back(std::move(resource));
+}
+
+void DeviceMemoryDefragmenter::RegisterImage(DeviceAllocationHandle handle, VkImageLayout layout, VkImageAspectFlags aspect_mask, std::function<void(VkImage)> on_moved)
+{
+    const VkImageUsageFlags required_usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    if ((device_memory_->GetAllocation(handle).image_info.usage & required_usage) != required_usage)
+    {
+        throw std::runtime_error("Movable images need to support being a transfer source and destination!");
+    }
+
+    MovableResource resource;
+    resource.handle = handle;
+    resource.layout = layout;
+    resource.aspect_mask = aspect_mask;
+    resource.on_image_moved = std::move(on_moved);
+    movables_.push_back(std::move(resource));
+}
+
+void DeviceMemoryDefragmenter::Unregister(DeviceAllocationHandle handle)
+{
+    auto pending_move = std::find_if(pending_moves_.begin(), pending_moves_.end(), [handle](const Move& move) { return move.handle == handle; });
+    if (pending_move != pending_moves_.end())
+    {
+        // The GPU may still be copying from / to the resource. Rare enough that we can afford to simply wait for it.
+        timeline_->Wait(step_timeline_value_);
+        vkDestroyBuffer(device_, pending_move->dst_buffer, allocator_);
+        vkDestroyImage(device_, pending_move->dst_image, allocator_);
+        device_memory_->FreeToBlock(pending_move->dst_block_index, pending_move->dst_offset, pending_move->size);
+        pending_moves_.erase(pending_move);
+    }
+
+    movables_.erase(std::remove_if(movables_.begin(), movables_.end(), [handle](const MovableResource& resource) { return resource.handle == handle; }), movables_.end());
+}
+
+bool DeviceMemoryDefragmenter::ShouldDefragment(float fragmentation_threshold) const
+{
+    if (is_pass_active_ || device_memory_->GetNumFrees() == num_frees_at_last_pass_)
+    {
+        // Nothing has been freed since the last pass, so there's nothing new to gain.
+        return false;
+    }
+
+    DeviceMemoryStats stats = device_memory_->GetStats();
+    return stats.num_blocks > 1 && stats.fragmentation > fragmentation_threshold;
+}
+
+void DeviceMemoryDefragmenter::BeginPass(VkDeviceSize max_bytes_per_step)
+{
+    is_pass_active_ = true;
+    max_bytes_per_step_ = max_bytes_per_step;
+    blocks_to_skip_.clear();
+
+    stats_ = DefragmentationStats{};
+    stats_.before = device_memory_->GetStats();
+    stats_.after = stats_.before;
+}
+
+void DeviceMemoryDefragmenter::EndPass()
+{
+    is_pass_active_ = false;
+    num_frees_at_last_pass_ = device_memory_->GetNumFrees();
+    stats_.after = device_memory_->GetStats();
+}
+
+const DeviceMemoryDefragmenter::MovableResource* DeviceMemoryDefragmenter::FindMovable(DeviceAllocationHandle handle) const
+{
+    for (const MovableResource& resource : movables_)
+    {
+        if (resource.handle == handle)
+        {
+            return &resource;
+        }
+    }
+
+    return nullptr;
+}
+
+uint32_t DeviceMemoryDefragmenter::FindSourceBlock() const
+{
+    const std::vector<DeviceMemoryAllocator::MemoryBlock>& blocks = device_memory_->blocks_;
+
+    // The sparsest block is the cheapest one to empty.
+    uint32_t best_block_index = UINT32_MAX;
+    for (uint32_t i = 0; i < blocks.size(); i++)
+    {
+        const DeviceMemoryAllocator::MemoryBlock& block = blocks[i];
+        bool should_skip = std::find(blocks_to_skip_.begin(), blocks_to_skip_.end(), i) != blocks_to_skip_.end();
+        bool has_live_allocations = block.num_allocations > block.num_retiring_allocations;
+        if (block.memory == VK_NULL_HANDLE || has_live_allocations == false || should_skip)
+        {
+            continue;
+        }
+
+        // There has to be at least one other block of the same kind we can move the resources to.
+        bool has_other_block = false;
+        for (uint32_t j = 0; j < blocks.size(); j++)
+        {
+            if (j != i && blocks[j].memory != VK_NULL_HANDLE && blocks[j].memory_type_index == block.memory_type_index
+                && blocks[j].is_for_optimal_images == block.is_for_optimal_images)
+            {
+                has_other_block = true;
+                break;
+            }
+        }
+
+        if (has_other_block && (best_block_index == UINT32_MAX || block.used_bytes < blocks[best_block_index].used_bytes))
+        {
+            best_block_index = i;
+        }
+    }
+
+    return best_block_index;
+}
+
+bool DeviceMemoryDefragmenter::TryPlanMove(const MovableResource& resource, uint32_t src_block_index, Move& out_move)
+{
+    const DeviceAllocation& allocation = device_memory_->GetAllocation(resource.handle);
+    const std::vector<DeviceMemoryAllocator::MemoryBlock>& blocks = device_memory_->blocks_;
+    const DeviceMemoryAllocator::MemoryBlock& src_block = blocks[src_block_index];
+
+    // Create an identical resource which will live at the new location.
+    VkMemoryRequirements mem_requirements;
+    if (allocation.buffer != VK_NULL_HANDLE)
+    {
+        if (vkCreateBuffer(device_, &allocation.buffer_info, allocator_, &out_move.dst_buffer) != VK_SUCCESS)
+        {
+            return false;
+        }
+        vkGetBufferMemoryRequirements(device_, out_move.dst_buffer, &mem_requirements);
+    }
+    else
+    {
+        if (vkCreateImage(device_, &allocation.image_info, allocator_, &out_move.dst_image) != VK_SUCCESS)
+        {
+            return false;
+        }
+        vkGetImageMemoryRequirements(device_, out_move.dst_image, &mem_requirements);
+    }
+
+    // Candidates are all other non-empty blocks of the same kind, densest first. They are either denser than the source block,
+    // because we always empty the sparsest one, or they stay alive anyway. So we never move resources back and forth between two blocks.
+    // Moving into an empty block would be pointless, we want to get rid of those. Same for blocks that only wait for their retiring ranges.
+    std::vector<uint32_t> candidates;
+    for (uint32_t i = 0; i < blocks.size(); i++)
+    {
+        if (i != src_block_index && blocks[i].memory != VK_NULL_HANDLE && blocks[i].num_allocations > blocks[i].num_retiring_allocations
+            && blocks[i].memory_type_index == src_block.memory_type_index
+            && blocks[i].is_for_optimal_images == src_block.is_for_optimal_images)
+        {
+            candidates.push_back(i);
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [&blocks](uint32_t a, uint32_t b) { return blocks[a].used_bytes > blocks[b].used_bytes; });
+
+    for (uint32_t block_index : candidates)
+    {
+        if (device_memory_->TryAllocateFromBlock(block_index, mem_requirements.size, mem_requirements.alignment, out_move.dst_offset))
+        {
+            out_move.handle = resource.handle;
+            out_move.dst_block_index = block_index;
+            out_move.size = mem_requirements.size;
+
+            if (out_move.dst_buffer != VK_NULL_HANDLE)
+            {
+                vkBindBufferMemory(device_, out_move.dst_buffer, blocks[block_index].memory, out_move.dst_offset);
+            }
+            else
+            {
+                vkBindImageMemory(device_, out_move.dst_image, blocks[block_index].memory, out_move.dst_offset);
+            }
+
+            return true;
+        }
+    }
+
+    // Doesn't fit anywhere else
+    vkDestroyBuffer(device_, out_move.dst_buffer, allocator_);
+    vkDestroyImage(device_, out_move.dst_image, allocator_);
+    out_move = Move{};
+    return false;
+}
+
+void DeviceMemoryDefragmenter::RecordAndSubmitStep()
+{
+    if (is_pass_active_ == false || IsStepPending())
+    {
+        return;
+    }
+
+    // Collect moves until we've reached our budget for this step
+    VkDeviceSize num_bytes_in_step = 0;
+    while (num_bytes_in_step < max_bytes_per_step_)
+    {
+        uint32_t src_block_index = FindSourceBlock();
+        if (src_block_index == UINT32_MAX)
+        {
+            break;
+        }
+
+        // A block can only be released if ALL of its allocations can be moved. Don't waste any copies on blocks that will stay alive anyway.
+        bool can_empty_block = true;
+        std::vector<const MovableResource*> resources_to_move;
+        for (DeviceAllocationHandle handle = 0; handle < device_memory_->allocations_.size(); handle++)
+        {
+            const DeviceAllocation& allocation = device_memory_->allocations_[handle];
+            if (allocation.is_alive == false || allocation.block_index != src_block_index)
+            {
+                continue;
+            }
+
+            const MovableResource* resource = FindMovable(handle);
+            if (resource == nullptr)
+            {
+                can_empty_block = false;
+                break;
+            }
+
+            bool is_already_pending = std::find_if(pending_moves_.begin(), pending_moves_.end(), [handle](const Move& move) { return move.handle == handle; }) != pending_moves_.end();
+            if (is_already_pending == false)
+            {
+                resources_to_move.push_back(resource);
+            }
+        }
+
+        if (can_empty_block == false)
+        {
+            blocks_to_skip_.push_back(src_block_index);
+            continue;
+        }
+
+        if (resources_to_move.empty())
+        {
+            // Everything that's left in this block is already part of this step.
+            break;
+        }
+
+        for (const MovableResource* resource : resources_to_move)
+        {
+            Move move;
+            if (TryPlanMove(*resource, src_block_index, move) == false)
+            {
+                // The other blocks are too full. Moves that have already been planned still make the other blocks denser, so we keep them.
+                blocks_to_skip_.push_back(src_block_index);
+                break;
+            }
+
+            pending_moves_.push_back(move);
+            num_bytes_in_step += move.size;
+            if (num_bytes_in_step >= max_bytes_per_step_)
+            {
+                break;
+            }
+        }
+    }
+
+    if (pending_moves_.empty())
+    {
+        // Nothing left to do
+        EndPass();
+        return;
+    }
+
+    // Record all copies into a single command buffer.
+    vkResetCommandBuffer(command_buffer_, 0);
+
+    VkCommandBufferBeginInfo begin_info{};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(command_buffer_, &begin_info);
+
+    // All images of the step are transitioned with a single barrier before and after the copies.
+    for (const Move& move : pending_moves_)
+    {
+        if (move.dst_image != VK_NULL_HANDLE)
+        {
+            AddImageCopyBarriers(*FindMovable(move.handle), move, true);
+        }
+    }
+    barriers_.Flush(command_buffer_);
+
+    for (const Move& move : pending_moves_)
+    {
+        if (move.dst_buffer != VK_NULL_HANDLE)
+        {
+            RecordBufferCopy(command_buffer_, move);
+        }
+        else
+        {
+            RecordImageCopy(command_buffer_, move);
+        }
+    }
+
+    for (const Move& move : pending_moves_)
+    {
+        if (move.dst_image != VK_NULL_HANDLE)
+        {
+            AddImageCopyBarriers(*FindMovable(move.handle), move, false);
+        }
+    }
+
+    // Make the copied data visible to everything that will use the new resources later on.
+    barriers_.AddMemoryBarrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_READ_BIT);
+    barriers_.Flush(command_buffer_);
+
+    vkEndCommandBuffer(command_buffer_);
+
+    step_timeline_value_ = timeline_->Submit(1, &command_buffer_);
+}
+
+void DeviceMemoryDefragmenter::RecordBufferCopy(VkCommandBuffer command_buffer, const Move& move)
+{
+    const DeviceAllocation& allocation = device_memory_->GetAllocation(move.handle);
+
+    VkBufferCopy copy_region{};
+    copy_region.size = allocation.buffer_info.size;
+    vkCmdCopyBuffer(command_buffer, allocation.buffer, move.dst_buffer, 1, &copy_region);
+}
+
+void DeviceMemoryDefragmenter::AddImageCopyBarriers(const MovableResource& resource, const Move& move, bool is_before_copy)
+{
+    const DeviceAllocation& allocation = device_memory_->GetAllocation(move.handle);
+    const VkImageCreateInfo& image_info = allocation.image_info;
+
+    VkImageSubresourceRange subresource_range{};
+    subresource_range.aspectMask = resource.aspect_mask;
+    subresource_range.baseMipLevel = 0;
+    subresource_range.levelCount = image_info.mipLevels;
+    subresource_range.baseArrayLayer = 0;
+    subresource_range.layerCount = image_info.arrayLayers;
+
+    if (is_before_copy)
+    {
+        // Old image: current layout -> transfer source. Frames that are still in flight may be reading from it, so we wait for all prior commands.
+        barriers_.AddImageBarrier(allocation.image, subresource_range, resource.layout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_WRITE_BIT, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+
+        // New image: contents don't matter yet -> transfer destination.
+        barriers_.AddImageBarrier(move.dst_image, subresource_range, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+    }
+    else
+    {
+        // Both images go back to the layout the owner expects. The old one is still used until the move is committed.
+        barriers_.AddImageBarrier(allocation.image, subresource_range, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, resource.layout,
+            VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_NONE, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_READ_BIT);
+
+        barriers_.AddImageBarrier(move.dst_image, subresource_range, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, resource.layout,
+            VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_READ_BIT);
+    }
+}
+
+void DeviceMemoryDefragmenter::RecordImageCopy(VkCommandBuffer command_buffer, const Move& move)
+{
+    const DeviceAllocation& allocation = device_memory_->GetAllocation(move.handle);
+    const VkImageCreateInfo& image_info = allocation.image_info;
+    VkImageAspectFlags aspect_mask = FindMovable(move.handle)->aspect_mask;
+
+    // Copy every mip level
+    std::vector<VkImageCopy> regions(image_info.mipLevels);
+    for (uint32_t mip = 0; mip < image_info.mipLevels; mip++)
+    {
+        VkImageCopy& region = regions[mip];
+        region.srcSubresource.aspectMask = aspect_mask;
+        region.srcSubresource.mipLevel = mip;
+        region.srcSubresource.baseArrayLayer = 0;
+        region.srcSubresource.layerCount = image_info.arrayLayers;
+        region.dstSubresource = region.srcSubresource;
+        region.extent.width = std::max(1u, image_info.extent.width >> mip);
+        region.extent.height = std::max(1u, image_info.extent.height >> mip);
+        region.extent.depth = std::max(1u, image_info.extent.depth >> mip);
+    }
+
+    vkCmdCopyImage(command_buffer, allocation.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, move.dst_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        static_cast<uint32_t>(regions.size()), regions.data());
+}
+
+bool DeviceMemoryDefragmenter::IsStepComplete() const
+{
+    return IsStepPending() && timeline_->IsComplete(step_timeline_value_);
+}
+
+uint32_t DeviceMemoryDefragmenter::CommitStep()
+{
+    if (IsStepComplete() == false)
+    {
+        return 0;
+    }
+
+    // Frames in flight may still read from the old resources. Everything submitted from now on uses the new ones.
+    uint64_t last_use_timeline_value = timeline_->GetLastSubmittedValue();
+
+    uint32_t num_moves = 0;
+    for (const Move& move : pending_moves_)
+    {
+        DeviceAllocation& allocation = device_memory_->allocations_[move.handle];
+        const MovableResource* resource = FindMovable(move.handle);
+
+        // Give the old range back once the GPU is done with it. Until then it can't be reused, and its block can't be released.
+        // This doesn't count as a free for ShouldDefragment(), we don't want to trigger ourselves.
+        device_memory_->blocks_[allocation.block_index].num_retiring_allocations++;
+        deletion_queue_->RetireMemoryRange(allocation.block_index, allocation.offset, allocation.size, last_use_timeline_value);
+        if (std::find(emptied_blocks_.begin(), emptied_blocks_.end(), allocation.block_index) == emptied_blocks_.end())
+        {
+            emptied_blocks_.push_back(allocation.block_index);
+        }
+
+        const DeviceMemoryAllocator::MemoryBlock& dst_block = device_memory_->blocks_[move.dst_block_index];
+        VkDeviceSize old_size = allocation.size;
+        allocation.block_index = move.dst_block_index;
+        allocation.memory = dst_block.memory;
+        allocation.offset = move.dst_offset;
+        allocation.size = move.size;
+        device_memory_->TrackMove(allocation, old_size);
+        allocation.mapped_data = dst_block.mapped_data != nullptr ? static_cast<char*>(dst_block.mapped_data) + move.dst_offset : nullptr;
+
+        // Let the owner switch over to the new resource, e.g. recreate image views. The old one is destroyed with its range.
+        if (move.dst_buffer != VK_NULL_HANDLE)
+        {
+            VkBuffer old_buffer = allocation.buffer;
+            allocation.buffer = move.dst_buffer;
+            device_memory_->SetDebugName(VK_OBJECT_TYPE_BUFFER, reinterpret_cast<uint64_t>(move.dst_buffer), allocation.name.c_str());
+            resource->on_buffer_moved(move.dst_buffer);
+            deletion_queue_->RetireBuffer(old_buffer, last_use_timeline_value);
+        }
+        else
+        {
+            VkImage old_image = allocation.image;
+            allocation.image = move.dst_image;
+            device_memory_->SetDebugName(VK_OBJECT_TYPE_IMAGE, reinterpret_cast<uint64_t>(move.dst_image), allocation.name.c_str());
+            resource->on_image_moved(move.dst_image);
+            deletion_queue_->RetireImage(old_image, last_use_timeline_value);
+        }
+
+        stats_.bytes_moved += move.size;
+        num_moves++;
+    }
+
+    pending_moves_.clear();
+
+    stats_.num_moves += num_moves;
+    stats_.num_steps++;
+    stats_.after = device_memory_->GetStats();
+
+    return num_moves;
+}
+
+void DeviceMemoryDefragmenter::ReleaseEmptiedBlocks()
+{
+    std::vector<DeviceMemoryAllocator::MemoryBlock>& blocks = device_memory_->blocks_;
+    bool has_empty_block = std::any_of(emptied_blocks_.begin(), emptied_blocks_.end(), [&blocks](uint32_t i) { return blocks[i].num_allocations == 0; });
+    if (has_empty_block == false)
+    {
+        return;
+    }
+
+    stats_.num_released_blocks += device_memory_->ReleaseEmptyBlocks();
+    stats_.after = device_memory_->GetStats();
+
+    // Released blocks are done. Blocks that got new allocations while their ranges were retiring stay alive, we stop tracking them as well.
+    emptied_blocks_.erase(std::remove_if(emptied_blocks_.begin(), emptied_blocks_.end(),
+        [&blocks](uint32_t i) { return blocks[i].memory == VK_NULL_HANDLE || blocks[i].num_retiring_allocations == 0; }), emptied_blocks_.end());
+}
@@ -0,0 +1,87 @@
+#include "FrameCommandPools.h"
+
+void FrameCommandPools::Init(VkDevice device, const VkAllocationCallbacks* allocator, uint32_t queue_family_index, uint32_t num_frames, uint32_t num_threads)
+{
+    device_ = device;
+    allocator_ = allocator;
+    num_threads_ = num_threads;
+
+    // The command buffers only live for a single frame -> VK_COMMAND_POOL_CREATE_TRANSIENT_BIT.
+    // We don't set VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, because we always reset the whole pool. Some drivers can use a simpler allocator then.
+    VkCommandPoolCreateInfo pool_info{};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.queueFamilyIndex = queue_family_index;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+    pools_.resize(num_frames * num_threads);
+    for (ThreadPool& pool : pools_)
+    {
+        if (vkCreateCommandPool(device_, &pool_info, allocator_, &pool.command_pool) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create frame command pool!");
+        }
+    }
+}
+
+void FrameCommandPools::Shutdown()
+{
+    for (ThreadPool& pool : pools_)
+    {
+        vkDestroyCommandPool(device_, pool.command_pool, allocator_);  // Also frees the command buffers
+    }
+
+    pools_.clear();
+}
+
+void FrameCommandPools::BeginFrame(uint32_t frame_index)
+{
+    current_frame_ = frame_index;
+
+    for (uint32_t thread_index = 0; thread_index < num_threads_; thread_index++)
+    {
+        ThreadPool& pool = pools_[current_frame_ * num_threads_ + thread_index];
+
+        // Puts all command buffers of the pool back into the initial state. We keep the memory (no VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT),
+        // the next frame most likely needs about the same amount.
+        vkResetCommandPool(device_, pool.command_pool, 0);
+        pool.num_used_command_buffers[VK_COMMAND_BUFFER_LEVEL_PRIMARY] = 0;
+        pool.num_used_command_buffers[VK_COMMAND_BUFFER_LEVEL_SECONDARY] = 0;
+    }
+}
+
+VkCommandBuffer FrameCommandPools::GetPrimaryCommandBuffer(uint32_t thread_index)
+{
+    return GetCommandBuffer(thread_index, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+}
+
+VkCommandBuffer FrameCommandPools::GetSecondaryCommandBuffer(uint32_t thread_index)
+{
+    return GetCommandBuffer(thread_index, VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+}
+
+VkCommandBuffer FrameCommandPools::GetCommandBuffer(uint32_t thread_index, VkCommandBufferLevel level)
+{
+    ThreadPool& pool = pools_[current_frame_ * num_threads_ + thread_index];
+    std::vector<VkCommandBuffer>& command_buffers = pool.command_buffers[level];
+    uint32_t& num_used = pool.num_used_command_buffers[level];
+
+    // Only allocate if this frame needs more command buffers than any frame before.
+    if (num_used == command_buffers.size())
+    {
+        VkCommandBufferAllocateInfo alloc_info{};
+        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        alloc_info.commandPool = pool.command_pool;
+        alloc_info.level = level;
+        alloc_info.commandBufferCount = 1;
+
+        VkCommandBuffer command_buffer;
+        if (vkAllocateCommandBuffers(device_, &alloc_info, &command_buffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allocate frame command buffer!");
+        }
+
+        command_buffers.push_back(command_buffer);
+    }
+
+    return command_buffers[num_used++];
+}
@@ -0,0 +1,346 @@
+#include "FrameReadback.h"
+
+#include <cstdio>
+#include <filesystem>
+
+#include <stb/stb_image_write.h>
+
+namespace
+{
+    const MemoryTypeRequest READBACK_MEMORY = { VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT };  // Reading uncached memory is painfully slow
+
+    bool IsBgraFormat(VkFormat format)
+    {
+        return format == VK_FORMAT_B8G8R8A8_SRGB || format == VK_FORMAT_B8G8R8A8_UNORM;
+    }
+
+    bool IsRgbaFormat(VkFormat format)
+    {
+        return format == VK_FORMAT_R8G8B8A8_SRGB || format == VK_FORMAT_R8G8B8A8_UNORM;
+    }
+
+    void ValidateFormat(VkFormat format)
+    {
+        if (IsBgraFormat(format) == false && IsRgbaFormat(format) == false)
+        {
+            throw std::runtime_error("Frame capture only supports 8 bit RGBA and BGRA formats!");
+        }
+    }
+}
+
+void FrameReadback::Init(DeviceMemoryAllocator* device_memory, GpuTimeline* timeline, VkExtent2D extent, VkFormat format, uint32_t num_buffers,
+                         const std::string& output_directory, CaptureFormat capture_format)
+{
+    ValidateFormat(format);
+
+    device_memory_ = device_memory;
+    timeline_ = timeline;
+    num_buffers_ = num_buffers;
+    output_directory_ = output_directory;
+    capture_format_ = capture_format;
+
+    std::filesystem::create_directories(output_directory_);
+
+    CreateSlots(extent, format, num_buffers_);
+
+    is_shutting_down_ = false;
+    worker_ = std::thread([this]() { WorkerLoop(); });
+}
+
+void FrameReadback::CreateSlots(VkExtent2D extent, VkFormat format, uint32_t num_buffers)
+{
+    extent_ = extent;
+    format_ = format;
+
+    VkBufferCreateInfo buffer_info{};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = static_cast<VkDeviceSize>(extent_.width) * extent_.height * 4;
+    buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    // Allocate outside of the lock, the worker doesn't know about the new slots until they're in slots_.
+    std::vector<std::unique_ptr<Slot>> new_slots(num_buffers);
+    for (std::unique_ptr<Slot>& slot : new_slots)
+    {
+        slot = std::make_unique<Slot>();
+        slot->allocation = device_memory_->CreateBuffer(buffer_info, READBACK_MEMORY, DeviceMemoryCategory::Staging, "Frame readback buffer", slot->buffer);
+        slot->mapped_data = static_cast<const uint8_t*>(device_memory_->GetMappedData(slot->allocation));
+        slot->extent = extent_;
+        slot->format = format_;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::unique_ptr<Slot>& slot : new_slots)
+    {
+        slots_.push_back(std::move(slot));
+    }
+    encode_queue_.reserve(slots_.size());
+}
+
+void FrameReadback::Resize(VkExtent2D extent, VkFormat format)
+{
+    if (IsEnabled() == false || (extent.width == extent_.width && extent.height == extent_.height && format == format_))
+    {
+        return;
+    }
+
+    ValidateFormat(format);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (std::unique_ptr<Slot>& slot : slots_)
+        {
+            num_retired_slots_ += slot->is_retired ? 0 : 1;
+            slot->is_retired = true;
+        }
+    }
+
+    CreateSlots(extent, format, num_buffers_);
+
+    // Free ones can go right away.
+    DestroyRetiredSlots();
+}
+
+void FrameReadback::DestroyRetiredSlots()
+{
+    if (num_retired_slots_ == 0)
+    {
+        return;
+    }
+
+    // A free slot is neither used by the GPU (its copy has completed before it went to the worker) nor by the worker anymore.
+    std::vector<std::unique_ptr<Slot>> slots_to_destroy;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < slots_.size();)
+        {
+            if (slots_[i]->is_retired && slots_[i]->state == SlotState::Free)
+            {
+                slots_to_destroy.push_back(std::move(slots_[i]));
+                slots_.erase(slots_.begin() + i);
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+
+    for (std::unique_ptr<Slot>& slot : slots_to_destroy)
+    {
+        device_memory_->Destroy(slot->allocation);
+    }
+    num_retired_slots_ -= static_cast<uint32_t>(slots_to_destroy.size());
+}
+
+void FrameReadback::Shutdown()
+{
+    if (IsEnabled() == false)
+    {
+        return;
+    }
+
+    // Copies that were recorded but never submitted won't happen anymore.
+    uint64_t last_copy_value = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (std::unique_ptr<Slot>& slot : slots_)
+        {
+            if (slot->state == SlotState::Recorded)
+            {
+                slot->state = SlotState::Free;
+            }
+            else if (slot->state == SlotState::Copying)
+            {
+                last_copy_value = std::max(last_copy_value, slot->timeline_value);
+            }
+        }
+    }
+
+    timeline_->Wait(last_copy_value);
+    Update();
+
+    // The worker writes everything that's queued before it exits.
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        is_shutting_down_ = true;
+    }
+    job_available_.notify_all();
+    worker_.join();
+
+    for (std::unique_ptr<Slot>& slot : slots_)
+    {
+        device_memory_->Destroy(slot->allocation);
+    }
+    slots_.clear();
+    encode_queue_.clear();
+    num_retired_slots_ = 0;
+}
+
+bool FrameReadback::RecordCopy(VkCommandBuffer command_buffer, VkImage image, VkImageLayout current_layout, VkPipelineStageFlags2 src_stage_mask, VkAccessFlags2 src_access_mask,
+                               uint64_t frame_number)
+{
+    Slot* free_slot = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (std::unique_ptr<Slot>& slot : slots_)
+        {
+            if (slot->state == SlotState::Free && slot->is_retired == false)
+            {
+                free_slot = slot.get();
+                free_slot->state = SlotState::Recorded;
+                break;
+            }
+        }
+    }
+
+    if (free_slot == nullptr)
+    {
+        num_dropped_frames_++;
+        return false;
+    }
+
+    free_slot->frame_number = frame_number;
+
+    VkImageSubresourceRange subresource_range{};
+    subresource_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    subresource_range.levelCount = 1;
+    subresource_range.layerCount = 1;
+
+    // The image has just been written, e.g. by the blit to the swap chain image.
+    barriers_.AddImageBarrier(image, subresource_range, current_layout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        src_stage_mask, src_access_mask, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+    barriers_.Flush(command_buffer);
+
+    VkBufferImageCopy region{};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;     // Tightly packed
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = { 0, 0, 0 };
+    region.imageExtent = { free_slot->extent.width, free_slot->extent.height, 1 };
+    vkCmdCopyImageToBuffer(command_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, free_slot->buffer, 1, &region);
+
+    // Give the image back in the layout we got it in. The caller may record further barriers on the image, e.g. for presentation.
+    // Those are only ordered after this transition if their source stages overlap with our destination stages -> VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT.
+    if (current_layout != VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL)
+    {
+        barriers_.AddImageBarrier(image, subresource_range, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, current_layout,
+            VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_NONE, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_NONE);
+    }
+
+    // Waiting for the timeline doesn't make the copied data visible to the host by itself, this barrier does.
+    barriers_.AddBufferBarrier(free_slot->buffer, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+    barriers_.Flush(command_buffer);
+
+    return true;
+}
+
+void FrameReadback::SetSubmitted(uint64_t timeline_value)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::unique_ptr<Slot>& slot : slots_)
+    {
+        if (slot->state == SlotState::Recorded)
+        {
+            slot->state = SlotState::Copying;
+            slot->timeline_value = timeline_value;
+        }
+    }
+}
+
+void FrameReadback::Update()
+{
+    bool has_new_jobs = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (std::unique_ptr<Slot>& slot : slots_)
+        {
+            if (slot->state == SlotState::Copying && timeline_->IsComplete(slot->timeline_value))
+            {
+                slot->state = SlotState::Encoding;
+                encode_queue_.push_back(slot.get());
+                num_captured_frames_++;
+                has_new_jobs = true;
+            }
+        }
+    }
+
+    if (has_new_jobs)
+    {
+        job_available_.notify_one();
+    }
+
+    DestroyRetiredSlots();
+}
+
+void FrameReadback::WorkerLoop()
+{
+    while (true)
+    {
+        Slot* slot = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            job_available_.wait(lock, [this]() { return is_shutting_down_ || encode_queue_.empty() == false; });
+
+            if (encode_queue_.empty())
+            {
+                return;     // Shutting down and nothing left to write
+            }
+
+            slot = encode_queue_.front();
+            encode_queue_.erase(encode_queue_.begin());
+        }
+
+        // The slot belongs to us while it's in the Encoding state, so we can read it without holding the lock.
+        // It isn't destroyed before it's free, even if it has been retired in the meantime.
+        EncodeFrame(*slot);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        slot->state = SlotState::Free;
+    }
+}
+
+void FrameReadback::EncodeFrame(const Slot& slot)
+{
+    // e.g. frame_000042.png
+    char file_name[64];
+    std::snprintf(file_name, sizeof(file_name), "frame_%06llu.%s", static_cast<unsigned long long>(slot.frame_number),
+        capture_format_ == CaptureFormat::Png ? "png" : "raw");
+    std::string path = output_directory_ + "/" + file_name;
+
+    size_t num_bytes = static_cast<size_t>(slot.extent.width) * slot.extent.height * 4;
+
+    if (capture_format_ == CaptureFormat::Raw)
+    {
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(slot.mapped_data), num_bytes);
+        if (!file)
+        {
+            std::cerr << "Failed to write captured frame: " << path << std::endl;
+        }
+        return;
+    }
+
+    const uint8_t* rgba_data = slot.mapped_data;
+    if (IsBgraFormat(slot.format))
+    {
+        rgba_scratch_.resize(num_bytes);
+        for (size_t i = 0; i < num_bytes; i += 4)
+        {
+            rgba_scratch_[i + 0] = slot.mapped_data[i + 2];
+            rgba_scratch_[i + 1] = slot.mapped_data[i + 1];
+            rgba_scratch_[i + 2] = slot.mapped_data[i + 0];
+            rgba_scratch_[i + 3] = 255;     // The swap chain is opaque, alpha isn't meaningful
+        }
+        rgba_data = rgba_scratch_.data();
+    }
+
+    if (stbi_write_png(path.c_str(), static_cast<int>(slot.extent.width), static_cast<int>(slot.extent.height), 4, rgba_data, static_cast<int>(slot.extent.width) * 4) == 0)
+    {
+        std::cerr << "Failed to write captured frame: " << path << std::endl;
+    }
+}
@@ -0,0 +1,78 @@
+#include "GpuFrameTimer.h"
+
+void GpuFrameTimer::Init(VkDevice device, const VkAllocationCallbacks* allocator, bool is_supported, float timestamp_period_ns, uint32_t num_frames)
+{
+    device_ = device;
+    allocator_ = allocator;
+    timestamp_period_ns_ = timestamp_period_ns;
+    has_pending_result_.assign(num_frames, false);
+
+    if (is_supported == false)
+    {
+        return;
+    }
+
+    // Two queries per frame: start and end.
+    VkQueryPoolCreateInfo pool_info{};
+    pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    pool_info.queryCount = num_frames * 2;
+
+    if (vkCreateQueryPool(device_, &pool_info, allocator_, &query_pool_) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create timestamp query pool!");
+    }
+}
+
+void GpuFrameTimer::Shutdown()
+{
+    vkDestroyQueryPool(device_, query_pool_, allocator_);
+    query_pool_ = VK_NULL_HANDLE;
+}
+
+void GpuFrameTimer::WriteFrameStart(VkCommandBuffer command_buffer, uint32_t frame_index)
+{
+    if (IsSupported() == false)
+    {
+        return;
+    }
+
+    // Queries have to be reset before they can be written again. The previous results of this frame have been read already.
+    vkCmdResetQueryPool(command_buffer, query_pool_, frame_index * 2, 2);
+
+    // NONE as the stage: The timestamp is written as soon as all previous commands have reached the top of the pipe.
+    vkCmdWriteTimestamp2(command_buffer, VK_PIPELINE_STAGE_2_NONE, query_pool_, frame_index * 2);
+}
+
+void GpuFrameTimer::WriteFrameEnd(VkCommandBuffer command_buffer, uint32_t frame_index)
+{
+    if (IsSupported() == false)
+    {
+        return;
+    }
+
+    // Written once all previous commands have completed every stage.
+    vkCmdWriteTimestamp2(command_buffer, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, query_pool_, frame_index * 2 + 1);
+    has_pending_result_[frame_index] = true;
+}
+
+bool GpuFrameTimer::ReadFrameTimestamps(uint32_t frame_index, uint64_t& out_start_ns, uint64_t& out_end_ns)
+{
+    if (IsSupported() == false || has_pending_result_[frame_index] == false)
+    {
+        return false;
+    }
+
+    has_pending_result_[frame_index] = false;
+
+    // The submission is complete, so the results are available and we don't need VK_QUERY_RESULT_WAIT_BIT.
+    uint64_t timestamps[2] = {};
+    if (vkGetQueryPoolResults(device_, query_pool_, frame_index * 2, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+    {
+        return false;
+    }
+
+    out_start_ns = static_cast<uint64_t>(static_cast<double>(timestamps[0]) * timestamp_period_ns_);
+    out_end_ns = out_start_ns + static_cast<uint64_t>(static_cast<double>(timestamps[1] - timestamps[0]) * timestamp_period_ns_);  // Converting the difference keeps the duration exact
+    return true;
+}
@@ -0,0 +1,164 @@
+#include "GpuTimeline.h"
+
+void GpuTimeline::Init(VkDevice device, const VkAllocationCallbacks* allocator, VkQueue queue)
+{
+    device_ = device;
+    allocator_ = allocator;
+    queue_ = queue;
+
+    // Timeline semaphores are created like binary ones, the type is specified in the pNext chain.
+    VkSemaphoreTypeCreateInfo type_info{};
+    type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    type_info.initialValue = 0; // Nothing has been submitted yet -> 0 is complete right from the start
+
+    VkSemaphoreCreateInfo semaphore_info{};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = &type_info;
+
+    if (vkCreateSemaphore(device_, &semaphore_info, allocator_, &semaphore_) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create timeline semaphore!");
+    }
+}
+
+void GpuTimeline::Shutdown()
+{
+    vkDestroySemaphore(device_, semaphore_, allocator_);
+    semaphore_ = VK_NULL_HANDLE;
+}
+
+uint64_t GpuTimeline::Submit(uint32_t num_command_buffers, const VkCommandBuffer* command_buffers,
+                             uint32_t num_waits, const GpuSemaphoreWait* waits,
+                             uint32_t num_binary_signals, const VkSemaphore* binary_signals)
+{
+    PendingSubmission submission;
+    submission.first_wait = static_cast<uint32_t>(pending_waits_.size());
+    submission.num_waits = num_waits;
+    submission.first_command_buffer = static_cast<uint32_t>(pending_command_buffers_.size());
+    submission.num_command_buffers = num_command_buffers;
+    submission.first_signal = static_cast<uint32_t>(pending_signals_.size());
+    submission.num_signals = num_binary_signals + 1;
+
+    // With synchronization2 every semaphore carries its own value and stage mask, no extra VkTimelineSemaphoreSubmitInfo needed.
+    for (uint32_t i = 0; i < num_waits; i++)
+    {
+        VkSemaphoreSubmitInfo wait_info{};
+        wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+        wait_info.semaphore = waits[i].semaphore;
+        wait_info.value = waits[i].value;
+        wait_info.stageMask = waits[i].stage_mask;
+        pending_waits_.push_back(wait_info);
+    }
+
+    for (uint32_t i = 0; i < num_command_buffers; i++)
+    {
+        VkCommandBufferSubmitInfo command_buffer_info{};
+        command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
+        command_buffer_info.commandBuffer = command_buffers[i];
+        pending_command_buffers_.push_back(command_buffer_info);
+    }
+
+    // Our own timeline semaphore comes first, followed by the binary semaphores. Their values are ignored.
+    // Signal once all commands of the submission are done.
+    uint64_t signal_value = last_submitted_value_ + 1;
+
+    VkSemaphoreSubmitInfo signal_info{};
+    signal_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+    signal_info.semaphore = semaphore_;
+    signal_info.value = signal_value;
+    signal_info.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+    pending_signals_.push_back(signal_info);
+
+    for (uint32_t i = 0; i < num_binary_signals; i++)
+    {
+        signal_info.semaphore = binary_signals[i];
+        signal_info.value = 0;
+        pending_signals_.push_back(signal_info);
+    }
+
+    pending_submissions_.push_back(submission);
+    num_submissions_++;
+
+    last_submitted_value_ = signal_value;
+    return signal_value;
+}
+
+void GpuTimeline::Flush()
+{
+    if (upstream_ != nullptr)
+    {
+        upstream_->Flush();
+    }
+
+    if (pending_submissions_.empty())
+    {
+        return;
+    }
+
+    // The arrays don't change anymore, so now we can point into them.
+    // Submissions within one vkQueueSubmit2 start in order, just like separate calls, so the timeline values are still signaled in order.
+    submit_infos_.clear();
+    for (const PendingSubmission& submission : pending_submissions_)
+    {
+        VkSubmitInfo2 submit_info{};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
+        submit_info.waitSemaphoreInfoCount = submission.num_waits;
+        submit_info.pWaitSemaphoreInfos = pending_waits_.data() + submission.first_wait;
+        submit_info.commandBufferInfoCount = submission.num_command_buffers;
+        submit_info.pCommandBufferInfos = pending_command_buffers_.data() + submission.first_command_buffer;
+        submit_info.signalSemaphoreInfoCount = submission.num_signals;
+        submit_info.pSignalSemaphoreInfos = pending_signals_.data() + submission.first_signal;
+        submit_infos_.push_back(submit_info);
+    }
+
+    if (vkQueueSubmit2(queue_, static_cast<uint32_t>(submit_infos_.size()), submit_infos_.data(), VK_NULL_HANDLE) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to submit command buffers!");
+    }
+
+    num_queue_submits_++;
+    last_flushed_value_ = last_submitted_value_;
+
+    pending_submissions_.clear();
+    pending_waits_.clear();
+    pending_command_buffers_.clear();
+    pending_signals_.clear();
+}
+
+uint64_t GpuTimeline::GetCompletedValue() const
+{
+    vkGetSemaphoreCounterValue(device_, semaphore_, &completed_value_);
+    return completed_value_;
+}
+
+bool GpuTimeline::IsComplete(uint64_t value) const
+{
+    return value <= completed_value_ || value <= GetCompletedValue();
+}
+
+void GpuTimeline::Wait(uint64_t value)
+{
+    if (IsComplete(value))
+    {
+        return;
+    }
+
+    if (value > last_flushed_value_)
+    {
+        Flush();
+    }
+
+    VkSemaphoreWaitInfo wait_info{};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &semaphore_;
+    wait_info.pValues = &value;
+
+    if (vkWaitSemaphores(device_, &wait_info, UINT64_MAX) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to wait for timeline semaphore!");
+    }
+
+    completed_value_ = std::max(completed_value_, value);
+}
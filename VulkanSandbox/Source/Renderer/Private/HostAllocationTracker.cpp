@@ -0,0 +1,286 @@
+#include "HostAllocationTracker.h"
+
+#include <cstring>
+#include <iomanip>
+
+namespace
+{
+    // Every allocation we hand out to the driver is prefixed with this header.
+    // The driver only gives us the pointer back on free / realloc, so everything we need to know about the allocation has to live here.
+    struct alignas(16) AllocationHeader
+    {
+        void* base;     // What malloc returned. The user pointer is aligned, so this may be somewhere before the header.
+        size_t size;    // Size that was requested by the driver
+        HostAllocationTag tag;
+        VkSystemAllocationScope scope;
+    };
+
+    constexpr size_t MIN_ALIGNMENT = alignof(std::max_align_t);
+
+    AllocationHeader* GetHeader(void* memory)
+    {
+        return reinterpret_cast<AllocationHeader*>(static_cast<char*>(memory) - sizeof(AllocationHeader));
+    }
+
+    size_t GetScopeIndex(VkSystemAllocationScope scope)
+    {
+        size_t index = static_cast<size_t>(scope);
+        return index <= VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE ? index : 0;   // Guard against scopes added by future extensions
+    }
+
+    // Allocates size bytes with the given alignment, prefixed with the header. Doesn't touch any statistics.
+    void* AllocateWithHeader(size_t size, size_t alignment, HostAllocationTag tag, VkSystemAllocationScope scope)
+    {
+        // The driver may request any power of two alignment. malloc only guarantees alignof(max_align_t), so we over-allocate
+        // and align the pointer ourselves. The header sits directly in front of the pointer we return.
+        alignment = std::max(alignment, MIN_ALIGNMENT);
+        size_t total_size = sizeof(AllocationHeader) + size + alignment;
+
+        void* base = std::malloc(total_size);
+        if (base == nullptr)
+        {
+            return nullptr;
+        }
+
+        uintptr_t first_usable_address = reinterpret_cast<uintptr_t>(base) + sizeof(AllocationHeader);
+        uintptr_t aligned_address = (first_usable_address + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1);
+        void* memory = reinterpret_cast<void*>(aligned_address);
+
+        AllocationHeader* header = GetHeader(memory);
+        header->base = base;
+        header->size = size;
+        header->tag = tag;
+        header->scope = scope;
+
+        return memory;
+    }
+
+    void UpdatePeak(std::atomic<uint64_t>& peak, uint64_t value)
+    {
+        uint64_t current_peak = peak.load(std::memory_order_relaxed);
+        while (value > current_peak && peak.compare_exchange_weak(current_peak, value, std::memory_order_relaxed) == false)
+        {
+        }
+    }
+}
+
+HostAllocationTracker::HostAllocationTracker()
+{
+    callbacks_.pUserData = this;
+    callbacks_.pfnAllocation = &HostAllocationTracker::Allocate;
+    callbacks_.pfnReallocation = &HostAllocationTracker::Reallocate;
+    callbacks_.pfnFree = &HostAllocationTracker::Free;
+    callbacks_.pfnInternalAllocation = &HostAllocationTracker::InternalAllocationNotification;
+    callbacks_.pfnInternalFree = &HostAllocationTracker::InternalFreeNotification;
+}
+
+const HostAllocationStats& HostAllocationTracker::GetStats(HostAllocationTag tag, VkSystemAllocationScope scope) const
+{
+    return stats_[static_cast<size_t>(tag)][GetScopeIndex(scope)];
+}
+
+uint64_t HostAllocationTracker::GetInternalLiveBytes(VkSystemAllocationScope scope) const
+{
+    return internal_live_bytes_[GetScopeIndex(scope)].load(std::memory_order_relaxed);
+}
+
+HostAllocationStats& HostAllocationTracker::GetStatsMutable(HostAllocationTag tag, VkSystemAllocationScope scope)
+{
+    return stats_[static_cast<size_t>(tag)][GetScopeIndex(scope)];
+}
+
+void* HostAllocationTracker::AllocateTracked(size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+    HostAllocationTag tag = GetTag();
+    void* memory = AllocateWithHeader(size, alignment, tag, scope);
+    if (memory == nullptr)
+    {
+        // Vulkan expects us to return nullptr, the driver will then fail with VK_ERROR_OUT_OF_HOST_MEMORY.
+        return nullptr;
+    }
+
+    HostAllocationStats& stats = GetStatsMutable(tag, scope);
+    stats.num_allocations.fetch_add(1, std::memory_order_relaxed);
+    stats.allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    uint64_t live_bytes = stats.live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+    UpdatePeak(stats.peak_live_bytes, live_bytes);
+
+    return memory;
+}
+
+void* HostAllocationTracker::ReallocateTracked(void* original, size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+    HostAllocationTag tag = GetTag();
+    void* memory = AllocateWithHeader(size, alignment, tag, scope);
+    if (memory == nullptr)
+    {
+        // The original allocation has to stay untouched if we fail.
+        return nullptr;
+    }
+
+    AllocationHeader* original_header = GetHeader(original);
+    std::memcpy(memory, original, std::min(size, original_header->size));
+
+    // A reallocation is neither a new allocation nor a free, otherwise it would show up three times in the churn.
+    // The bytes move from the tag the original was made in to the current one.
+    HostAllocationStats& original_stats = GetStatsMutable(original_header->tag, original_header->scope);
+    original_stats.live_bytes.fetch_sub(original_header->size, std::memory_order_relaxed);
+
+    HostAllocationStats& stats = GetStatsMutable(tag, scope);
+    stats.num_reallocations.fetch_add(1, std::memory_order_relaxed);
+    uint64_t live_bytes = stats.live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+    UpdatePeak(stats.peak_live_bytes, live_bytes);
+
+    std::free(original_header->base);
+    return memory;
+}
+
+void HostAllocationTracker::FreeTracked(void* memory)
+{
+    AllocationHeader* header = GetHeader(memory);
+
+    // Attribute the free to the tag the allocation was made in, otherwise live bytes of the tags would drift apart.
+    HostAllocationStats& stats = GetStatsMutable(header->tag, header->scope);
+    stats.num_frees.fetch_add(1, std::memory_order_relaxed);
+    stats.live_bytes.fetch_sub(header->size, std::memory_order_relaxed);
+
+    std::free(header->base);
+}
+
+void* VKAPI_PTR HostAllocationTracker::Allocate(void* user_data, size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+    HostAllocationTracker* tracker = static_cast<HostAllocationTracker*>(user_data);
+    return tracker->AllocateTracked(size, alignment, scope);
+}
+
+void* VKAPI_PTR HostAllocationTracker::Reallocate(void* user_data, void* original, size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+    HostAllocationTracker* tracker = static_cast<HostAllocationTracker*>(user_data);
+
+    // Semantics are the same as realloc:
+    // original == nullptr -> behave like pfnAllocation
+    // size == 0 -> behave like pfnFree
+    if (original == nullptr)
+    {
+        return tracker->AllocateTracked(size, alignment, scope);
+    }
+
+    if (size == 0)
+    {
+        tracker->FreeTracked(original);
+        return nullptr;
+    }
+
+    return tracker->ReallocateTracked(original, size, alignment, scope);
+}
+
+void VKAPI_PTR HostAllocationTracker::Free(void* user_data, void* memory)
+{
+    // Freeing a nullptr is valid and has to be a no-op.
+    if (memory == nullptr)
+    {
+        return;
+    }
+
+    HostAllocationTracker* tracker = static_cast<HostAllocationTracker*>(user_data);
+    tracker->FreeTracked(memory);
+}
+
+void VKAPI_PTR HostAllocationTracker::InternalAllocationNotification(void* user_data, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope)
+{
+    // The driver made an allocation itself (so far the only type is VK_INTERNAL_ALLOCATION_TYPE_EXECUTABLE, e.g. JIT compiled shader code)
+    // and merely informs us about it. The matching free only tells us size and scope, so we can't know which tag the allocation was made in.
+    // -> The tag only counts the allocations, live bytes are kept per scope.
+    HostAllocationTracker* tracker = static_cast<HostAllocationTracker*>(user_data);
+    HostAllocationStats& stats = tracker->GetStatsMutable(tracker->GetTag(), scope);
+    stats.num_internal_allocations.fetch_add(1, std::memory_order_relaxed);
+    stats.internal_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    tracker->internal_live_bytes_[GetScopeIndex(scope)].fetch_add(size, std::memory_order_relaxed);
+}
+
+void VKAPI_PTR HostAllocationTracker::InternalFreeNotification(void* user_data, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope)
+{
+    HostAllocationTracker* tracker = static_cast<HostAllocationTracker*>(user_data);
+    tracker->internal_live_bytes_[GetScopeIndex(scope)].fetch_sub(size, std::memory_order_relaxed);
+}
+
+void HostAllocationTracker::PrintReport(std::ostream& stream, HostAllocationTag tag) const
+{
+    stream << "Driver host allocations [" << GetTagName(tag) << "]" << std::endl;
+    stream << std::left << std::setw(10) << "  scope"
+        << std::right << std::setw(10) << "allocs"
+        << std::setw(10) << "reallocs"
+        << std::setw(10) << "frees"
+        << std::setw(14) << "allocated"
+        << std::setw(14) << "live"
+        << std::setw(14) << "peak live"
+        << std::setw(14) << "internal" << std::endl;
+
+    bool has_any_activity = false;
+    for (size_t scope_index = 0; scope_index < NUM_SCOPES; scope_index++)
+    {
+        VkSystemAllocationScope scope = static_cast<VkSystemAllocationScope>(scope_index);
+        const HostAllocationStats& stats = GetStats(tag, scope);
+        if (stats.num_allocations == 0 && stats.num_reallocations == 0 && stats.num_internal_allocations == 0)
+        {
+            continue;
+        }
+
+        has_any_activity = true;
+        stream << std::left << "  " << std::setw(8) << GetScopeName(scope)
+            << std::right << std::setw(10) << stats.num_allocations.load()
+            << std::setw(10) << stats.num_reallocations.load()
+            << std::setw(10) << stats.num_frees.load()
+            << std::setw(14) << stats.allocated_bytes.load()
+            << std::setw(14) << stats.live_bytes.load()
+            << std::setw(14) << stats.peak_live_bytes.load()
+            << std::setw(14) << stats.internal_allocated_bytes.load() << std::endl;
+    }
+
+    if (has_any_activity == false)
+    {
+        stream << "  (no allocations)" << std::endl;
+    }
+}
+
+void HostAllocationTracker::PrintReport(std::ostream& stream) const
+{
+    for (size_t tag_index = 0; tag_index < NUM_TAGS; tag_index++)
+    {
+        PrintReport(stream, static_cast<HostAllocationTag>(tag_index));
+    }
+
+    // Internal allocations don't belong to a tag once they've been freed, so their live bytes get a line of their own.
+    stream << "Driver internal allocations, live bytes:";
+    for (size_t scope_index = 0; scope_index < NUM_SCOPES; scope_index++)
+    {
+        VkSystemAllocationScope scope = static_cast<VkSystemAllocationScope>(scope_index);
+        stream << " " << GetScopeName(scope) << " " << GetInternalLiveBytes(scope);
+    }
+    stream << std::endl;
+}
+
+const char* HostAllocationTracker::GetTagName(HostAllocationTag tag)
+{
+    switch (tag)
+    {
+    case HostAllocationTag::Startup: return "startup";
+    case HostAllocationTag::SteadyState: return "steady state";
+    case HostAllocationTag::SwapChainRecreation: return "swap chain recreation";
+    case HostAllocationTag::Shutdown: return "shutdown";
+    default: return "unknown";
+    }
+}
+
+const char* HostAllocationTracker::GetScopeName(VkSystemAllocationScope scope)
+{
+    switch (scope)
+    {
+    case VK_SYSTEM_ALLOCATION_SCOPE_COMMAND: return "command";
+    case VK_SYSTEM_ALLOCATION_SCOPE_OBJECT: return "object";
+    case VK_SYSTEM_ALLOCATION_SCOPE_CACHE: return "cache";
+    case VK_SYSTEM_ALLOCATION_SCOPE_DEVICE: return "device";
+    case VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE: return "instance";
+    default: return "unknown";
+    }
+}
@@ -0,0 +1,125 @@
+#include "MemoryTypeSelector.h"
+
+void MemoryTypeSelector::Init(VkPhysicalDevice physical_device)
+{
+    // VkPhysicalDeviceMemoryProperties::memoryHeaps -> distinct memory resources (e.g. dedicated VRAM or swap space in RAM when VRAM is depleted)
+    // VkPhysicalDeviceMemoryProperties::memoryTypes -> types which exist inside the memoryHeaps.
+    // These never change for a physical device, so querying them once is enough.
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties_);
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(physical_device, &device_properties);
+
+    // Check if every device local heap can also be mapped by the host.
+    // That's the definition of unified memory we care about: There is no separate VRAM we'd have to copy to.
+    bool are_all_device_local_types_host_visible = true;
+    bool has_host_writable_device_local_type = false;
+    has_resizable_bar_ = false;
+
+    for (uint32_t i = 0; i < memory_properties_.memoryTypeCount; i++)
+    {
+        const VkMemoryType& memory_type = memory_properties_.memoryTypes[i];
+        if ((memory_type.propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) == 0)
+        {
+            continue;
+        }
+
+        const VkMemoryPropertyFlags host_write_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        bool is_host_writable = (memory_type.propertyFlags & host_write_flags) == host_write_flags;
+        if (is_host_writable == false)
+        {
+            are_all_device_local_types_host_visible = false;
+            continue;
+        }
+
+        has_host_writable_device_local_type = true;
+
+        // A DEVICE_LOCAL | HOST_VISIBLE type on a discrete GPU is only really useful if the heap is bigger than the legacy BAR window.
+        if (memory_properties_.memoryHeaps[memory_type.heapIndex].size > LEGACY_BAR_SIZE)
+        {
+            has_resizable_bar_ = true;
+        }
+    }
+
+    bool is_integrated_device = device_properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU
+        || device_properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU;
+
+    is_unified_memory_ = has_host_writable_device_local_type && (is_integrated_device || are_all_device_local_types_host_visible);
+
+    if (is_unified_memory_)
+    {
+        // UMA is the more specific description, so we don't report ReBAR additionally.
+        has_resizable_bar_ = false;
+    }
+}
+
+uint32_t MemoryTypeSelector::FindMemoryType(uint32_t type_filter, const MemoryTypeRequest& request) const
+{
+    // GPU may offer different types of memory which differ in terms of allowed operations or performance.
+    // Instead of returning the first memory type that matches, we rate every acceptable memory type and take the best one.
+    int best_score = INT_MIN;
+    uint32_t best_index = UINT32_MAX;
+
+    for (uint32_t i = 0; i < memory_properties_.memoryTypeCount; i++)
+    {
+        // type_filer specifies the bit field of memory types that are suitable
+        // -> We simply check if the bit is set for the memory types we want to accept
+        bool is_type_accepted = type_filter & (1 << i);
+        if (is_type_accepted == false)
+        {
+            continue;
+        }
+
+        // We may have multiple required properties, so we have to use a bitwise AND operation to check if ALL properties are supported.
+        bool are_required_properties_supported = (memory_properties_.memoryTypes[i].propertyFlags & request.required) == request.required;
+        if (are_required_properties_supported == false)
+        {
+            continue;
+        }
+
+        int score = ScoreMemoryType(i, request);
+        if (score > best_score)
+        {
+            best_score = score;
+            best_index = i;
+        }
+    }
+
+    if (best_index == UINT32_MAX)
+    {
+        // Welp, we're screwed.
+        throw std::runtime_error("failed to find suitable memory type!");
+    }
+
+    return best_index;
+}
+
+int MemoryTypeSelector::ScoreMemoryType(uint32_t memory_type_index, const MemoryTypeRequest& request) const
+{
+    VkMemoryPropertyFlags flags = memory_properties_.memoryTypes[memory_type_index].propertyFlags;
+
+    // Every preferred property counts more than an avoided one costs, so that e.g. "prefer DEVICE_LOCAL, avoid HOST_CACHED"
+    // still ends up in VRAM if the only device local type happens to be cached.
+    int score = 2 * std::popcount(flags & request.preferred) - std::popcount(flags & request.avoided);
+
+    // Properties nobody asked for are a (tiny) waste. E.g. HOST_CACHED or LAZILY_ALLOCATED memory that we don't need.
+    VkMemoryPropertyFlags unrequested = flags & ~(request.required | request.preferred | request.avoided);
+    score = score * 4 - std::popcount(unrequested);
+
+    return score;
+}
+
+const char* MemoryTypeSelector::GetMemoryModelName() const
+{
+    if (is_unified_memory_)
+    {
+        return "unified memory";
+    }
+
+    if (has_resizable_bar_)
+    {
+        return "discrete memory with resizable BAR";
+    }
+
+    return "discrete memory";
+}
@@ -0,0 +1,115 @@
+#include "PresentPolicy.h"
+
+namespace
+{
+    const char* PRESENT_POLICY_NAMES[] = { "low-latency", "max-throughput", "vsync", "power-saving" };
+    static_assert(std::size(PRESENT_POLICY_NAMES) == static_cast<size_t>(PresentPolicy::Count), "Every present policy needs a name");
+
+    // Present modes in order of preference. FIFO is always available, so it's the last resort of every policy.
+    std::vector<VkPresentModeKHR> GetPreferredPresentModes(PresentPolicy policy)
+    {
+        switch (policy)
+        {
+        case PresentPolicy::LowLatency:
+            return { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_KHR };
+        case PresentPolicy::MaxThroughput:
+            // MAILBOX doesn't tear, but some implementations still throttle to the display there.
+            return { VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR, VK_PRESENT_MODE_FIFO_KHR };
+        case PresentPolicy::VSync:
+        case PresentPolicy::PowerSaving:
+        default:
+            return { VK_PRESENT_MODE_FIFO_KHR };
+        }
+    }
+
+    // Number of images on top of the minimum the surface needs.
+    uint32_t GetNumAdditionalImages(PresentPolicy policy, VkPresentModeKHR present_mode)
+    {
+        switch (policy)
+        {
+        case PresentPolicy::LowLatency:
+            // MAILBOX needs a spare image to replace the queued one. With FIFO every additional image is another frame of latency.
+            return present_mode == VK_PRESENT_MODE_MAILBOX_KHR ? 1 : 0;
+        case PresentPolicy::MaxThroughput:
+            // The GPU should never have to wait until the display gives an image back.
+            return 2;
+        case PresentPolicy::VSync:
+            return 1;   // Minimum + 1 is recommended to avoid GPU stalls.
+        case PresentPolicy::PowerSaving:
+        default:
+            return 0;
+        }
+    }
+}
+
+SwapChainConfig ChooseSwapChainConfig(PresentPolicy policy, const VkSurfaceCapabilitiesKHR& capabilities,
+                                      const std::vector<VkPresentModeKHR>& available_present_modes, uint32_t num_frames_in_flight)
+{
+    // VK_PRESENT_MODE_IMMEDIATE_KHR - Submitted images are transferred to screen right away => Possible tearing.
+    // VK_PRESENT_MODE_FIFO_KHR - Swap chain is fifo queue. Images are taken from queue on display refresh. If queue is full the program has to wait -> Similar to vsync! Guaranteed to be available.
+    // VK_PRESENT_MODE_FIFO_RELAXED_KHR - Similar to VK_PRESENT_MODE_FIFO_KHR, but if swap chain is empty the next rendered image will be shown instantly -> Possible tearing.
+    // VK_PRESENT_MODE_MAILBOX_KHR - Similar to VK_PRESENT_MODE_FIFO_KHR, but if queue is full the application just replaces the already queued images. Can be used for triple buffering.
+    SwapChainConfig config;
+    for (VkPresentModeKHR preferred_present_mode : GetPreferredPresentModes(policy))
+    {
+        if (std::find(available_present_modes.begin(), available_present_modes.end(), preferred_present_mode) != available_present_modes.end())
+        {
+            config.present_mode = preferred_present_mode;
+            break;
+        }
+    }
+
+    config.min_image_count = capabilities.minImageCount + GetNumAdditionalImages(policy, config.present_mode);
+
+    // With fewer images than frames in flight the additional frames would only wait for an image in vkAcquireNextImageKHR.
+    config.min_image_count = std::max(config.min_image_count, num_frames_in_flight);
+
+    // Ensure we don't exceed the supported max image count in the swap chain.
+    bool is_max_image_count_specified = capabilities.maxImageCount > 0;  // maxImageCount == 0 means that there is no maximum set by the device!
+    if (is_max_image_count_specified && config.min_image_count > capabilities.maxImageCount)
+    {
+        config.min_image_count = capabilities.maxImageCount;
+    }
+
+    return config;
+}
+
+PresentPolicy GetNextPresentPolicy(PresentPolicy policy)
+{
+    return static_cast<PresentPolicy>((static_cast<uint32_t>(policy) + 1) % static_cast<uint32_t>(PresentPolicy::Count));
+}
+
+const char* GetPresentPolicyName(PresentPolicy policy)
+{
+    return PRESENT_POLICY_NAMES[static_cast<size_t>(policy)];
+}
+
+std::optional<PresentPolicy> ParsePresentPolicy(const std::string& name)
+{
+    for (size_t i = 0; i < std::size(PRESENT_POLICY_NAMES); i++)
+    {
+        if (name == PRESENT_POLICY_NAMES[i])
+        {
+            return static_cast<PresentPolicy>(i);
+        }
+    }
+
+    return std::nullopt;
+}
+
+const char* GetPresentModeName(VkPresentModeKHR present_mode)
+{
+    switch (present_mode)
+    {
+    case VK_PRESENT_MODE_IMMEDIATE_KHR:
+        return "immediate";
+    case VK_PRESENT_MODE_MAILBOX_KHR:
+        return "mailbox";
+    case VK_PRESENT_MODE_FIFO_KHR:
+        return "fifo";
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+        return "fifo-relaxed";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,68 @@
+#include "ResolutionScaler.h"
+
+#include <cmath>
+
+namespace
+{
+    const double AVERAGE_WEIGHT = 0.1;          // Weight of a new frame time in the moving average
+    const double SCALE_DOWN_THRESHOLD = 1.0;    // Scale down once the average is above budget * threshold...
+    const double SCALE_UP_THRESHOLD = 0.85;     // ...and scale up once it's below budget * threshold
+    const float MAX_SCALE_DECREASE = 0.75f;     // Factors limiting a single step. Scaling up is more careful, overshooting costs frames.
+    const float MAX_SCALE_INCREASE = 1.1f;
+    const float SCALE_GRANULARITY = 0.05f;
+}
+
+void ResolutionScaler::Init(double target_gpu_ms, float min_scale, uint32_t num_settle_frames)
+{
+    target_gpu_ms_ = target_gpu_ms;
+    min_scale_ = std::clamp(min_scale, SCALE_GRANULARITY, 1.0f);
+    num_settle_frames_ = num_settle_frames;
+
+    scale_ = 1.0f;
+    has_average_ = false;
+    num_frames_to_ignore_ = 0;
+    num_scale_changes_ = 0;
+}
+
+void ResolutionScaler::AddGpuFrameTime(double gpu_ms)
+{
+    if (IsEnabled() == false)
+    {
+        return;
+    }
+
+    if (num_frames_to_ignore_ > 0)
+    {
+        num_frames_to_ignore_--;
+        return;
+    }
+
+    average_gpu_ms_ = has_average_ ? average_gpu_ms_ + AVERAGE_WEIGHT * (gpu_ms - average_gpu_ms_) : gpu_ms;
+    has_average_ = true;
+
+    bool is_over_budget = average_gpu_ms_ > target_gpu_ms_ * SCALE_DOWN_THRESHOLD;
+    bool is_clearly_under_budget = average_gpu_ms_ < target_gpu_ms_ * SCALE_UP_THRESHOLD;
+    if ((is_over_budget && scale_ > min_scale_) == false && (is_clearly_under_budget && scale_ < 1.0f) == false)
+    {
+        return;
+    }
+
+    // Aim for the middle of the dead band, so the next frames neither scale back up nor down right away.
+    double aimed_gpu_ms = target_gpu_ms_ * (SCALE_DOWN_THRESHOLD + SCALE_UP_THRESHOLD) * 0.5;
+    float factor = static_cast<float>(std::sqrt(aimed_gpu_ms / std::max(average_gpu_ms_, 0.001)));
+    factor = std::clamp(factor, MAX_SCALE_DECREASE, MAX_SCALE_INCREASE);
+
+    float new_scale = std::round(scale_ * factor / SCALE_GRANULARITY) * SCALE_GRANULARITY;
+    new_scale = std::clamp(new_scale, min_scale_, 1.0f);
+    if (new_scale == scale_)
+    {
+        return;
+    }
+
+    // The frames in flight still use the old scale. Until the first frame with the new scale is measured, the average continues with the cost we expect.
+    average_gpu_ms_ *= (new_scale * new_scale) / (scale_ * scale_);
+    num_frames_to_ignore_ = num_settle_frames_;
+
+    scale_ = new_scale;
+    num_scale_changes_++;
+}
@@ -0,0 +1,330 @@
+#include "ResourceStateTracker.h"
+
+namespace
+{
+    constexpr VkAccessFlags2 WRITE_ACCESS_MASK = VK_ACCESS_2_SHADER_WRITE_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+        VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_HOST_WRITE_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+    bool IsWrite(const ResourceAccess& access)
+    {
+        return (access.access_mask & WRITE_ACCESS_MASK) != 0;
+    }
+}
+
+void ResourceStateTracker::RegisterImage(VkImage image, uint32_t num_mips, uint32_t num_layers, VkImageAspectFlags aspect_mask, VkImageLayout initial_layout)
+{
+    ImageState& image_state = images_[image];
+    image_state.num_mips = num_mips;
+    image_state.num_layers = num_layers;
+    image_state.aspect_mask = aspect_mask;
+
+    State initial_state;
+    initial_state.layout = initial_layout;
+    image_state.subresources.assign(num_mips * num_layers, initial_state);
+}
+
+void ResourceStateTracker::RegisterBuffer(VkBuffer buffer, VkDeviceSize size)
+{
+    BufferState& buffer_state = buffers_[buffer];
+    buffer_state.size = size;
+
+    BufferRange whole_buffer;
+    whole_buffer.offset = 0;
+    whole_buffer.size = size;
+    buffer_state.ranges.assign(1, whole_buffer);
+}
+
+void ResourceStateTracker::Unregister(VkImage image)
+{
+    images_.erase(image);
+}
+
+void ResourceStateTracker::Unregister(VkBuffer buffer)
+{
+    buffers_.erase(buffer);
+}
+
+void ResourceStateTracker::ReplaceHandle(VkImage old_image, VkImage new_image)
+{
+    ImageState image_state = std::move(GetImageState(old_image));
+    images_.erase(old_image);
+    images_[new_image] = std::move(image_state);
+}
+
+void ResourceStateTracker::ReplaceHandle(VkBuffer old_buffer, VkBuffer new_buffer)
+{
+    BufferState buffer_state = std::move(GetBufferState(old_buffer));
+    buffers_.erase(old_buffer);
+    buffers_[new_buffer] = std::move(buffer_state);
+}
+
+void ResourceStateTracker::UseImage(BarrierBatcher& barriers, VkImage image, const ResourceAccess& access)
+{
+    UseImage(barriers, image, 0, GetImageState(image).num_mips, access);
+}
+
+void ResourceStateTracker::UseImage(BarrierBatcher& barriers, VkImage image, uint32_t base_mip, uint32_t num_mips, const ResourceAccess& access)
+{
+    ImageState& image_state = GetImageState(image);
+    if (base_mip + num_mips > image_state.num_mips)
+    {
+        throw std::out_of_range("Mip levels out of range of the tracked image!");
+    }
+
+    for (uint32_t layer = 0; layer < image_state.num_layers; layer++)
+    {
+        State* layer_states = &image_state.subresources[layer * image_state.num_mips];
+
+        // Mip levels that require the same barrier are transitioned together.
+        uint32_t mip = base_mip;
+        while (mip < base_mip + num_mips)
+        {
+            Transition transition = ComputeTransition(layer_states[mip], access, true);
+
+            uint32_t end_mip = mip + 1;
+            while (end_mip < base_mip + num_mips && ComputeTransition(layer_states[end_mip], access, true) == transition)
+            {
+                end_mip++;
+            }
+
+            if (transition.needs_barrier)
+            {
+                VkImageSubresourceRange subresource_range{};
+                subresource_range.aspectMask = image_state.aspect_mask;
+                subresource_range.baseMipLevel = mip;
+                subresource_range.levelCount = end_mip - mip;
+                subresource_range.baseArrayLayer = layer;
+                subresource_range.layerCount = 1;
+
+                barriers.AddImageBarrier(image, subresource_range, transition.old_layout, access.layout,
+                    transition.src_stage_mask, transition.src_access_mask, access.stage_mask, access.access_mask);
+                num_barriers_++;
+            }
+            else
+            {
+                num_accesses_without_barrier_++;
+            }
+
+            for (uint32_t i = mip; i < end_mip; i++)
+            {
+                ApplyAccess(layer_states[i], access, true, transition.needs_barrier);
+            }
+
+            mip = end_mip;
+        }
+    }
+}
+
+void ResourceStateTracker::UseBuffer(BarrierBatcher& barriers, VkBuffer buffer, const ResourceAccess& access, VkDeviceSize offset, VkDeviceSize size)
+{
+    BufferState& buffer_state = GetBufferState(buffer);
+    VkDeviceSize end = (size == VK_WHOLE_SIZE) ? buffer_state.size : offset + size;
+    if (offset >= end || end > buffer_state.size)
+    {
+        throw std::out_of_range("Range out of bounds of the tracked buffer!");
+    }
+
+    // Split the ranges so that the accessed part of the buffer consists of whole ranges.
+    size_t first_range = SplitBufferRange(buffer_state, offset);
+    size_t end_range = (end < buffer_state.size) ? SplitBufferRange(buffer_state, end) : buffer_state.ranges.size();
+
+    size_t range_index = first_range;
+    while (range_index < end_range)
+    {
+        Transition transition = ComputeTransition(buffer_state.ranges[range_index].state, access, false);
+
+        // Neighboring ranges which need the same barrier share it.
+        size_t end_index = range_index + 1;
+        while (end_index < end_range && ComputeTransition(buffer_state.ranges[end_index].state, access, false) == transition)
+        {
+            end_index++;
+        }
+
+        if (transition.needs_barrier)
+        {
+            VkDeviceSize barrier_offset = buffer_state.ranges[range_index].offset;
+            VkDeviceSize barrier_size = buffer_state.ranges[end_index - 1].offset + buffer_state.ranges[end_index - 1].size - barrier_offset;
+            barriers.AddBufferBarrier(buffer, transition.src_stage_mask, transition.src_access_mask, access.stage_mask, access.access_mask,
+                VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, barrier_offset, barrier_size);
+            num_barriers_++;
+        }
+        else
+        {
+            num_accesses_without_barrier_++;
+        }
+
+        for (size_t i = range_index; i < end_index; i++)
+        {
+            ApplyAccess(buffer_state.ranges[i].state, access, false, transition.needs_barrier);
+        }
+
+        range_index = end_index;
+    }
+
+    MergeBufferRanges(buffer_state);
+}
+
+void ResourceStateTracker::SetImageState(VkImage image, const ResourceAccess& access)
+{
+    ImageState& image_state = GetImageState(image);
+    std::fill(image_state.subresources.begin(), image_state.subresources.end(), MakeSynchronizedState(access));
+}
+
+void ResourceStateTracker::SetBufferState(VkBuffer buffer, const ResourceAccess& access)
+{
+    BufferState& buffer_state = GetBufferState(buffer);
+
+    BufferRange whole_buffer;
+    whole_buffer.offset = 0;
+    whole_buffer.size = buffer_state.size;
+    whole_buffer.state = MakeSynchronizedState(access);
+    whole_buffer.state.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    buffer_state.ranges.assign(1, whole_buffer);
+}
+
+ResourceStateTracker::Transition ResourceStateTracker::ComputeTransition(const State& state, const ResourceAccess& access, bool has_layout)
+{
+    Transition transition;
+    transition.old_layout = state.layout;
+
+    bool is_layout_change = has_layout && state.layout != access.layout;
+
+    // The last write (or layout transition) has already been made visible to this access by an earlier barrier.
+    bool is_visible = (access.stage_mask & ~state.visible_stages) == 0 && (access.access_mask & ~state.visible_access) == 0;
+
+    if (is_layout_change || IsWrite(access))
+    {
+        // Layout transitions and writes must not overtake any previous access (write-after-read, write-after-write).
+        // The only exception is a write right after a barrier whose destination scope already includes it.
+        bool is_write_ordered = state.write_stages == VK_PIPELINE_STAGE_2_NONE || (state.write_access == VK_ACCESS_2_NONE && is_visible);
+        transition.needs_barrier = is_layout_change || state.read_stages != VK_PIPELINE_STAGE_2_NONE || is_write_ordered == false;
+        transition.src_stage_mask = state.write_stages | state.read_stages;
+        transition.src_access_mask = state.write_access;
+    }
+    else
+    {
+        // Read-after-write. Read-after-read doesn't need any synchronization.
+        transition.needs_barrier = state.write_stages != VK_PIPELINE_STAGE_2_NONE && is_visible == false;
+        transition.src_stage_mask = state.write_stages;
+        transition.src_access_mask = state.write_access;
+    }
+
+    if (transition.needs_barrier == false)
+    {
+        // Don't let irrelevant differences prevent merging neighbors.
+        transition = Transition();
+    }
+
+    return transition;
+}
+
+void ResourceStateTracker::ApplyAccess(State& state, const ResourceAccess& access, bool has_layout, bool had_barrier)
+{
+    bool is_layout_change = has_layout && state.layout != access.layout;
+
+    if (IsWrite(access))
+    {
+        // Nobody has seen this write yet.
+        state.write_stages = access.stage_mask;
+        state.write_access = access.access_mask;
+        state.read_stages = VK_PIPELINE_STAGE_2_NONE;
+        state.visible_stages = VK_PIPELINE_STAGE_2_NONE;
+        state.visible_access = VK_ACCESS_2_NONE;
+    }
+    else if (is_layout_change)
+    {
+        // The layout transition is a write that is only visible to the stages of the barrier. Other stages still have to wait for it.
+        state = MakeSynchronizedState(access);
+    }
+    else
+    {
+        if (had_barrier)
+        {
+            state.visible_stages |= access.stage_mask;
+            state.visible_access |= access.access_mask;
+        }
+        state.read_stages |= access.stage_mask;
+    }
+
+    if (has_layout)
+    {
+        state.layout = access.layout;
+    }
+}
+
+ResourceStateTracker::State ResourceStateTracker::MakeSynchronizedState(const ResourceAccess& access)
+{
+    // As if a barrier with the access as destination scope has just been executed.
+    State state;
+    state.layout = access.layout;
+    state.write_stages = access.stage_mask;
+    state.write_access = VK_ACCESS_2_NONE;
+    state.read_stages = IsWrite(access) ? VK_PIPELINE_STAGE_2_NONE : access.stage_mask;
+    state.visible_stages = access.stage_mask;
+    state.visible_access = access.access_mask;
+    return state;
+}
+
+ResourceStateTracker::ImageState& ResourceStateTracker::GetImageState(VkImage image)
+{
+    auto it = images_.find(image);
+    if (it == images_.end())
+    {
+        throw std::invalid_argument("Image is not tracked!");
+    }
+
+    return it->second;
+}
+
+ResourceStateTracker::BufferState& ResourceStateTracker::GetBufferState(VkBuffer buffer)
+{
+    auto it = buffers_.find(buffer);
+    if (it == buffers_.end())
+    {
+        throw std::invalid_argument("Buffer is not tracked!");
+    }
+
+    return it->second;
+}
+
+size_t ResourceStateTracker::SplitBufferRange(BufferState& buffer_state, VkDeviceSize offset)
+{
+    std::vector<BufferRange>& ranges = buffer_state.ranges;
+
+    // Find the range that contains the offset
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), offset, [](VkDeviceSize value, const BufferRange& range) { return value < range.offset; });
+    size_t index = static_cast<size_t>(it - ranges.begin()) - 1;
+
+    BufferRange& range = ranges[index];
+    if (range.offset == offset)
+    {
+        return index;
+    }
+
+    BufferRange second_part = range;
+    second_part.offset = offset;
+    second_part.size = range.offset + range.size - offset;
+    range.size = offset - range.offset;
+    ranges.insert(ranges.begin() + index + 1, second_part);
+    return index + 1;
+}
+
+void ResourceStateTracker::MergeBufferRanges(BufferState& buffer_state)
+{
+    std::vector<BufferRange>& ranges = buffer_state.ranges;
+
+    size_t num_merged = 0;
+    for (size_t i = 1; i < ranges.size(); i++)
+    {
+        if (ranges[i].state == ranges[num_merged].state)
+        {
+            ranges[num_merged].size += ranges[i].size;
+        }
+        else
+        {
+            ranges[++num_merged] = ranges[i];
+        }
+    }
+
+    ranges.resize(num_merged + 1);
+}
@@ -0,0 +1,280 @@
+#include "UploadContext.h"
+
+namespace
+{
+    VkCommandPool CreateUploadCommandPool(VkDevice device, const VkAllocationCallbacks* allocator, uint32_t queue_family_index)
+    {
+        // Upload command buffers are recorded once and thrown away after execution -> TRANSIENT.
+        // We reuse them for later batches, so they have to be resettable individually.
+        VkCommandPoolCreateInfo pool_info{};
+        pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        pool_info.queueFamilyIndex = queue_family_index;
+        pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+
+        VkCommandPool command_pool;
+        if (vkCreateCommandPool(device, &pool_info, allocator, &command_pool) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create upload command pool!");
+        }
+
+        return command_pool;
+    }
+
+    VkCommandBuffer AllocateUploadCommandBuffer(VkDevice device, VkCommandPool command_pool)
+    {
+        VkCommandBufferAllocateInfo alloc_info{};
+        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        alloc_info.commandPool = command_pool;
+        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        alloc_info.commandBufferCount = 1;
+
+        VkCommandBuffer command_buffer;
+        if (vkAllocateCommandBuffers(device, &alloc_info, &command_buffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allocate upload command buffer!");
+        }
+
+        return command_buffer;
+    }
+}
+
+void UploadContext::Init(VkDevice device, const VkAllocationCallbacks* allocator, uint32_t transfer_queue_family_index, GpuTimeline* transfer_timeline,
+                         uint32_t graphics_queue_family_index, GpuTimeline* graphics_timeline)
+{
+    device_ = device;
+    allocator_ = allocator;
+    transfer_queue_family_index_ = transfer_queue_family_index;
+    graphics_queue_family_index_ = graphics_queue_family_index;
+    transfer_timeline_ = transfer_timeline;
+    graphics_timeline_ = graphics_timeline;
+
+    command_pool_ = CreateUploadCommandPool(device_, allocator_, transfer_queue_family_index_);
+
+    // Command pools are bound to a queue family, so the acquire side needs an own pool.
+    if (HasDedicatedTransferQueue())
+    {
+        graphics_command_pool_ = CreateUploadCommandPool(device_, allocator_, graphics_queue_family_index_);
+    }
+}
+
+void UploadContext::Shutdown()
+{
+    Wait(Submit());
+
+    // Destroying the pools also frees the command buffers
+    vkDestroyCommandPool(device_, command_pool_, allocator_);
+    vkDestroyCommandPool(device_, graphics_command_pool_, allocator_);
+
+    batches_.clear();
+    free_batches_.clear();
+    in_flight_batches_.clear();
+}
+
+VkCommandBuffer UploadContext::GetCommandBuffer()
+{
+    BeginBatch();
+
+    VkCommandBuffer command_buffer = batches_[recording_batch_].command_buffer;
+    barriers_.Flush(command_buffer);
+    return command_buffer;
+}
+
+VkCommandBuffer UploadContext::GetGraphicsCommandBuffer()
+{
+    BeginBatch();
+
+    const Batch& batch = batches_[recording_batch_];
+    VkCommandBuffer command_buffer = HasDedicatedTransferQueue() ? batch.graphics_command_buffer : batch.command_buffer;
+    GetGraphicsBarriers().Flush(command_buffer);
+    return command_buffer;
+}
+
+void UploadContext::TransferOwnership(VkBuffer buffer, VkPipelineStageFlags2 dst_stage_mask, VkAccessFlags2 dst_access_mask)
+{
+    BeginBatch();
+
+    if (HasDedicatedTransferQueue() == false)
+    {
+        // Same queue family -> No ownership to transfer, we only have to make the copied data visible to the following reads.
+        barriers_.AddBufferBarrier(buffer, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, dst_stage_mask, dst_access_mask);
+        return;
+    }
+
+    // Release: Makes the copies available. The destination masks are ignored on this side, the visibility operation happens on acquire.
+    barriers_.AddBufferBarrier(buffer, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+        transfer_queue_family_index_, graphics_queue_family_index_);
+
+    // Acquire: Has to match the release barrier exactly. The source masks are ignored on this side, the timeline wait already orders us after the release.
+    graphics_barriers_.AddBufferBarrier(buffer, VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE, dst_stage_mask, dst_access_mask,
+        transfer_queue_family_index_, graphics_queue_family_index_);
+}
+
+void UploadContext::TransferOwnership(VkImage image, const VkImageSubresourceRange& subresource_range, VkImageLayout old_layout, VkImageLayout new_layout,
+                                      VkPipelineStageFlags2 dst_stage_mask, VkAccessFlags2 dst_access_mask)
+{
+    BeginBatch();
+
+    if (HasDedicatedTransferQueue() == false)
+    {
+        barriers_.AddImageBarrier(image, subresource_range, old_layout, new_layout,
+            VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, dst_stage_mask, dst_access_mask);
+        return;
+    }
+
+    // Both barriers specify the same layout transition. It's only executed once, between release and acquire.
+    barriers_.AddImageBarrier(image, subresource_range, old_layout, new_layout,
+        VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+        transfer_queue_family_index_, graphics_queue_family_index_);
+
+    graphics_barriers_.AddImageBarrier(image, subresource_range, old_layout, new_layout,
+        VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE, dst_stage_mask, dst_access_mask,
+        transfer_queue_family_index_, graphics_queue_family_index_);
+}
+
+void UploadContext::DeferUntilComplete(std::function<void()> callback)
+{
+    // Make sure there is a batch the callback can be attached to.
+    BeginBatch();
+    batches_[recording_batch_].on_complete.push_back(std::move(callback));
+}
+
+UploadBatchId UploadContext::Submit()
+{
+    if (recording_batch_ == UINT32_MAX)
+    {
+        return last_submitted_id_;
+    }
+
+    Batch& batch = batches_[recording_batch_];
+    barriers_.Flush(batch.command_buffer);
+    if (vkEndCommandBuffer(batch.command_buffer) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to record upload command buffer!");
+    }
+
+    if (HasDedicatedTransferQueue())
+    {
+        graphics_barriers_.Flush(batch.graphics_command_buffer);
+        if (vkEndCommandBuffer(batch.graphics_command_buffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to record upload command buffer!");
+        }
+
+        // The copies run on the transfer queue and advance the transfer timeline once they're done...
+        GpuSemaphoreWait transfer_complete;
+        transfer_complete.semaphore = transfer_timeline_->GetSemaphore();
+        transfer_complete.value = transfer_timeline_->Submit(1, &batch.command_buffer);
+
+        // ...and the acquire barriers on the graphics queue wait for it. Everything we submit to the graphics queue afterwards is ordered after
+        // the acquire barriers, so the frames don't have to know about the transfer timeline.
+        // The acquired resources may be used by any stage, so we have to wait before all of them.
+        transfer_complete.stage_mask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+
+        // The graphics submission finishes last, so its value tells us when the whole batch is done.
+        batch.id = graphics_timeline_->Submit(1, &batch.graphics_command_buffer, 1, &transfer_complete);
+    }
+    else
+    {
+        // Instead of waiting for the queue to be idle, we remember the timeline value which tells us when exactly this batch is done.
+        // That way we don't block at all if we don't need the results right away.
+        batch.id = graphics_timeline_->Submit(1, &batch.command_buffer);
+    }
+
+    last_submitted_id_ = batch.id;
+    in_flight_batches_.push_back(recording_batch_);
+    recording_batch_ = UINT32_MAX;
+
+    return batch.id;
+}
+
+bool UploadContext::IsComplete(UploadBatchId batch_id)
+{
+    return graphics_timeline_->IsComplete(batch_id);
+}
+
+void UploadContext::Wait(UploadBatchId batch_id)
+{
+    graphics_timeline_->Wait(batch_id);
+    Update();
+}
+
+void UploadContext::Flush()
+{
+    Wait(Submit());
+}
+
+void UploadContext::Update()
+{
+    // Batches are submitted to the same queue in order, so they also complete in order.
+    while (in_flight_batches_.empty() == false && graphics_timeline_->IsComplete(batches_[in_flight_batches_.front()].id))
+    {
+        // Remove the batch from the list first, its callbacks may record and submit new uploads.
+        uint32_t batch_index = in_flight_batches_.front();
+        in_flight_batches_.erase(in_flight_batches_.begin());
+        RetireBatch(batch_index);
+    }
+}
+
+void UploadContext::BeginBatch()
+{
+    if (recording_batch_ != UINT32_MAX)
+    {
+        return;
+    }
+
+    recording_batch_ = AcquireBatch();
+    const Batch& batch = batches_[recording_batch_];
+
+    VkCommandBufferBeginInfo begin_info{};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    // Beginning implicitly resets the command buffers, because the pools have VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT set.
+    if (vkBeginCommandBuffer(batch.command_buffer, &begin_info) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to begin recording upload command buffer!");
+    }
+
+    // We always record both halves. An empty graphics command buffer is cheap and keeps the timelines of both queues in lockstep.
+    if (HasDedicatedTransferQueue() && vkBeginCommandBuffer(batch.graphics_command_buffer, &begin_info) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to begin recording upload command buffer!");
+    }
+}
+
+uint32_t UploadContext::AcquireBatch()
+{
+    if (free_batches_.empty() == false)
+    {
+        uint32_t batch_index = free_batches_.back();
+        free_batches_.pop_back();
+        return batch_index;
+    }
+
+    Batch batch;
+    batch.command_buffer = AllocateUploadCommandBuffer(device_, command_pool_);
+
+    if (HasDedicatedTransferQueue())
+    {
+        batch.graphics_command_buffer = AllocateUploadCommandBuffer(device_, graphics_command_pool_);
+    }
+
+    batches_.push_back(std::move(batch));
+    return static_cast<uint32_t>(batches_.size() - 1);
+}
+
+void UploadContext::RetireBatch(uint32_t batch_index)
+{
+    Batch& batch = batches_[batch_index];
+
+    // Callbacks may record new uploads, which can reallocate batches_ -> move them out first.
+    std::vector<std::function<void()>> on_complete = std::move(batch.on_complete);
+    batch.on_complete.clear();
+
+    free_batches_.push_back(batch_index);
+
+    for (std::function<void()>& callback : on_complete)
+    {
+        callback();
+    }
+}
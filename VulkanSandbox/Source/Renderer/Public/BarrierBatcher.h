@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+// Collects memory, buffer and image barriers and records all of them with a single vkCmdPipelineBarrier2 (synchronization2).
+//
+// Every vkCmdPipelineBarrier is a potential drain of the pipeline, so it pays off to issue as few of them as possible.
+// Instead of recording a barrier right away, we add it here and flush right before the first command that depends on it.
+// Barriers that are flushed together are executed together, so independent transitions (e.g. of different resources or mips) share one drain.
+//
+// With synchronization2 every barrier carries its own stage masks, so merging barriers doesn't widen the scope of any of them.
+// We also get the more precise stages, e.g. VK_PIPELINE_STAGE_2_COPY_BIT and VK_PIPELINE_STAGE_2_BLIT_BIT instead of VK_PIPELINE_STAGE_TRANSFER_BIT.
+//
+// The arrays are cleared but never shrink, so after warm-up adding barriers doesn't allocate.
+class BarrierBatcher
+{
+public:
+    void AddMemoryBarrier(VkPipelineStageFlags2 src_stage_mask, VkAccessFlags2 src_access_mask, VkPipelineStageFlags2 dst_stage_mask, VkAccessFlags2 dst_access_mask);
+
+    // The queue family indices are only needed for ownership transfers, otherwise VK_QUEUE_FAMILY_IGNORED.
+    void AddBufferBarrier(VkBuffer buffer, VkPipelineStageFlags2 src_stage_mask, VkAccessFlags2 src_access_mask, VkPipelineStageFlags2 dst_stage_mask, VkAccessFlags2 dst_access_mask,
+                          uint32_t src_queue_family_index = VK_QUEUE_FAMILY_IGNORED, uint32_t dst_queue_family_index = VK_QUEUE_FAMILY_IGNORED,
+                          VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+
+    void AddImageBarrier(VkImage image, const VkImageSubresourceRange& subresource_range, VkImageLayout old_layout, VkImageLayout new_layout,
+                         VkPipelineStageFlags2 src_stage_mask, VkAccessFlags2 src_access_mask, VkPipelineStageFlags2 dst_stage_mask, VkAccessFlags2 dst_access_mask,
+                         uint32_t src_queue_family_index = VK_QUEUE_FAMILY_IGNORED, uint32_t dst_queue_family_index = VK_QUEUE_FAMILY_IGNORED);
+
+    // Records all pending barriers into the command buffer. Does nothing if there are none.
+    void Flush(VkCommandBuffer command_buffer);
+
+    bool IsEmpty() const { return memory_barriers_.empty() && buffer_barriers_.empty() && image_barriers_.empty(); }
+
+    // Number of barriers and vkCmdPipelineBarrier2 calls recorded so far. Handy to see how much batching saves.
+    uint64_t GetNumFlushedBarriers() const { return num_flushed_barriers_; }
+    uint64_t GetNumFlushes() const { return num_flushes_; }
+
+private:
+    std::vector<VkMemoryBarrier2> memory_barriers_;
+    std::vector<VkBufferMemoryBarrier2> buffer_barriers_;
+    std::vector<VkImageMemoryBarrier2> image_barriers_;
+
+    uint64_t num_flushed_barriers_ = 0;
+    uint64_t num_flushes_ = 0;
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include "DeviceMemoryAllocator.h"
+#include "GpuTimeline.h"
+
+// Destroys Vulkan objects once the GPU is done with them, instead of waiting for the whole device to become idle.
+//
+// Whoever retires an object passes the timeline value of the last submission that may use it, usually GpuTimeline::GetLastSubmittedValue().
+// Update() destroys everything whose value has been reached. It only polls the timeline, so it never blocks.
+// That way e.g. the swap chain dependent objects of a window resize are destroyed a few frames later, while the GPU keeps on rendering.
+// Presentation isn't covered by the timeline, so a swap chain can also be tied to its last present fence instead.
+class DeletionQueue
+{
+public:
+    void Init(VkDevice device, const VkAllocationCallbacks* allocator, DeviceMemoryAllocator* device_memory, GpuTimeline* timeline);
+
+    // Destroys everything that's left. The GPU must not use any of the objects anymore, e.g. after waiting for the timeline.
+    void Shutdown();
+
+    void RetireAllocation(DeviceAllocationHandle allocation, uint64_t timeline_value);  // Destroys the buffer or image together with its memory
+    void RetireBuffer(VkBuffer buffer, uint64_t timeline_value);    // Only the buffer, e.g. the old one of a move. Its memory is retired separately.
+    void RetireImage(VkImage image, uint64_t timeline_value);
+    void RetireMemoryRange(uint32_t block_index, VkDeviceSize offset, VkDeviceSize size, uint64_t timeline_value);  // Gives the range back to its block
+    void RetireImageView(VkImageView image_view, uint64_t timeline_value);
+    void RetireFramebuffer(VkFramebuffer framebuffer, uint64_t timeline_value);
+    void RetirePipeline(VkPipeline pipeline, uint64_t timeline_value);
+    void RetirePipelineLayout(VkPipelineLayout pipeline_layout, uint64_t timeline_value);
+    void RetireRenderPass(VkRenderPass render_pass, uint64_t timeline_value);
+    void RetireDescriptorPool(VkDescriptorPool descriptor_pool, uint64_t timeline_value);   // Also frees the descriptor sets
+    void RetireSwapchain(VkSwapchainKHR swapchain, uint64_t timeline_value);
+    void RetireSwapchain(VkSwapchainKHR swapchain, VkFence last_present_fence);  // Takes over the fence, both are destroyed once it's signaled
+
+    // Destroys all objects whose timeline value has been reached.
+    void Update();
+
+    size_t GetNumPendingObjects() const { return retired_objects_.size(); }
+
+private:
+    enum class ObjectType : uint8_t
+    {
+        Allocation,
+        Buffer,
+        Image,
+        MemoryRange,
+        ImageView,
+        Framebuffer,
+        Pipeline,
+        PipelineLayout,
+        RenderPass,
+        DescriptorPool,
+        Swapchain
+    };
+
+    struct RetiredObject
+    {
+        ObjectType type = ObjectType::Allocation;
+        uint64_t handle = 0;    // Vulkan handle, DeviceAllocationHandle or block index
+        uint64_t timeline_value = 0;
+        VkDeviceSize offset = 0;    // Only used by memory ranges
+        VkDeviceSize size = 0;
+        VkFence fence = VK_NULL_HANDLE;     // If set, we wait for the fence instead of the timeline value
+    };
+
+    template<typename Handle>
+    void Retire(ObjectType type, Handle handle, uint64_t timeline_value);
+
+    void DestroyObject(const RetiredObject& object);
+
+    VkDevice device_ = VK_NULL_HANDLE;
+    const VkAllocationCallbacks* allocator_ = nullptr;
+    DeviceMemoryAllocator* device_memory_ = nullptr;
+    GpuTimeline* timeline_ = nullptr;
+
+    std::vector<RetiredObject> retired_objects_;
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+
+#include <vulkan/vulkan.h>
+
+#include "MemoryTypeSelector.h"
+
+// Handle to an allocation of the DeviceMemoryAllocator.
+// The handle stays valid while the allocation is moved around by the defragmenter, the memory / offset behind it may change though.
+using DeviceAllocationHandle = uint32_t;
+static constexpr DeviceAllocationHandle INVALID_DEVICE_ALLOCATION = UINT32_MAX;
+
+// What a resource is used for. Lets us see where our GPU memory goes and spot regressions, e.g. between two versions of our assets.
+enum class DeviceMemoryCategory : uint32_t
+{
+    Geometry = 0,   // Vertex and index buffers
+    Texture,
+    RenderTarget,   // Color, depth and other attachments
+    Uniform,
+    Staging,        // Temporary upload / readback buffers
+    Count
+};
+
+struct DeviceMemoryCategoryStats
+{
+    VkDeviceSize live_bytes = 0;
+    VkDeviceSize peak_bytes = 0;
+    uint32_t num_live_allocations = 0;
+    uint64_t num_total_allocations = 0;    // All allocations ever made -> shows churn
+};
+
+struct DeviceAllocation
+{
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void* mapped_data = nullptr;    // Host visible memory is persistently mapped. Already points to offset.
+    uint32_t memory_type_index = 0;
+    uint32_t block_index = UINT32_MAX;  // UINT32_MAX -> dedicated allocation, which owns its VkDeviceMemory
+
+    // The resource that is bound to this allocation. We keep the create info around, so the defragmenter can create an identical resource at another location.
+    // pNext and pQueueFamilyIndices are not stored, i.e. only exclusive resources without extension structs can be moved.
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VkImage image = VK_NULL_HANDLE;
+    VkBufferCreateInfo buffer_info{};
+    VkImageCreateInfo image_info{};
+
+    DeviceMemoryCategory category = DeviceMemoryCategory::Geometry;
+    std::string name;   // Debug name, also set on the Vulkan object if debug utils are available
+
+    bool is_alive = false;
+};
+
+struct DeviceMemoryStats
+{
+    uint32_t num_blocks = 0;
+    uint32_t num_empty_blocks = 0;
+    uint32_t num_allocations = 0;   // Sub-allocations and dedicated allocations
+    uint32_t num_dedicated_allocations = 0;
+    VkDeviceSize block_bytes = 0;   // Size of all blocks
+    VkDeviceSize used_bytes = 0;    // Bytes of blocks that are used by sub-allocations
+    VkDeviceSize dedicated_bytes = 0;
+    uint32_t num_free_ranges = 0;
+    VkDeviceSize largest_free_range = 0;
+
+    // 0 -> all free memory inside blocks is one contiguous range, close to 1 -> free memory is scattered into many small holes.
+    float fragmentation = 0.0f;
+};
+
+// Sub-allocates buffers and images from large VkDeviceMemory blocks, instead of calling vkAllocateMemory for every single resource.
+// vkAllocateMemory is slow and the number of simultaneous allocations is limited (maxMemoryAllocationCount may be as low as 4096).
+// See https://developer.nvidia.com/vulkan-memory-management
+//
+// Blocks only ever contain either buffers (and linear images) or optimal tiled images,
+// so we don't have to care about bufferImageGranularity between neighboring sub-allocations.
+// Free space of a block is kept as a list of free ranges sorted by offset. Neighboring ranges are merged on free.
+class DeviceMemoryAllocator
+{
+public:
+    void Init(VkDevice device, const VkAllocationCallbacks* allocator, const MemoryTypeSelector* memory_types);
+
+    // Destroys all blocks. All resources have to be destroyed at this point.
+    void Shutdown();
+
+    // Optional. If set, every resource gets its debug name assigned, so it shows up in validation messages and graphics debuggers.
+    void SetDebugNameFunction(PFN_vkSetDebugUtilsObjectNameEXT set_debug_name) { set_debug_name_ = set_debug_name; }
+
+    // Creates the resource, allocates memory for it and binds the memory. Throws on failure.
+    DeviceAllocationHandle CreateBuffer(const VkBufferCreateInfo& buffer_info, const MemoryTypeRequest& memory_request, DeviceMemoryCategory category, const char* name, VkBuffer& out_buffer);
+    DeviceAllocationHandle CreateImage(const VkImageCreateInfo& image_info, const MemoryTypeRequest& memory_request, DeviceMemoryCategory category, const char* name, VkImage& out_image);
+
+    // Destroys the resource which is bound to the allocation and frees the memory.
+    // Empty blocks are kept around to be reused, call ReleaseEmptyBlocks() to give the memory back to the driver.
+    void Destroy(DeviceAllocationHandle handle);
+
+    const DeviceAllocation& GetAllocation(DeviceAllocationHandle handle) const { return allocations_[handle]; }
+    void* GetMappedData(DeviceAllocationHandle handle) const { return allocations_[handle].mapped_data; }
+
+    // Frees all blocks which don't contain any allocations.
+    uint32_t ReleaseEmptyBlocks();
+
+    DeviceMemoryStats GetStats() const;
+    const DeviceMemoryCategoryStats& GetCategoryStats(DeviceMemoryCategory category) const { return category_stats_[static_cast<size_t>(category)]; }
+
+    // Writes block statistics, the totals per category and a list of all live allocations as JSON.
+    void WriteStatsJson(std::ostream& stream) const;
+
+    static const char* GetCategoryName(DeviceMemoryCategory category);
+
+    // Increases whenever memory is freed. Used to decide whether it's worth to look for fragmentation again.
+    uint64_t GetNumFrees() const { return num_frees_; }
+
+private:
+    friend class DeviceMemoryDefragmenter;
+    friend class DeletionQueue;
+
+    struct FreeRange
+    {
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+    };
+
+    struct MemoryBlock
+    {
+        VkDeviceMemory memory = VK_NULL_HANDLE;   // VK_NULL_HANDLE -> block was released, slot can be reused
+        VkDeviceSize size = 0;
+        VkDeviceSize used_bytes = 0;
+        uint32_t memory_type_index = 0;
+        bool is_for_optimal_images = false;
+        void* mapped_data = nullptr;
+        uint32_t num_allocations = 0;
+        uint32_t num_retiring_allocations = 0;  // Old ranges of moved resources. Still counted as allocations until the GPU is done with them.
+        std::vector<FreeRange> free_ranges;
+    };
+
+    DeviceAllocationHandle CreateAllocation();
+    void AllocateMemory(DeviceAllocation& allocation, const VkMemoryRequirements& requirements, const MemoryTypeRequest& memory_request, bool is_optimal_image);
+    void FreeMemory(DeviceAllocation& allocation);
+    void SetDebugName(VkObjectType object_type, uint64_t object_handle, const char* name) const;
+
+    // Keep the category statistics up to date
+    void TrackAllocation(const DeviceAllocation& allocation);
+    void UntrackAllocation(const DeviceAllocation& allocation);
+    void TrackMove(const DeviceAllocation& allocation, VkDeviceSize old_size);   // The defragmenter moved the allocation, it's not a new one
+
+    // Tries to carve size bytes with the given alignment out of the block. Uses the smallest free range which fits (best fit).
+    bool TryAllocateFromBlock(uint32_t block_index, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& out_offset);
+    void FreeToBlock(uint32_t block_index, VkDeviceSize offset, VkDeviceSize size);
+    void FreeRetiredRange(uint32_t block_index, VkDeviceSize offset, VkDeviceSize size);   // Called by the DeletionQueue
+    uint32_t CreateBlock(uint32_t memory_type_index, bool is_for_optimal_images);
+    VkDeviceSize GetPreferredBlockSize(uint32_t memory_type_index) const;
+
+    VkDevice device_ = VK_NULL_HANDLE;
+    const VkAllocationCallbacks* allocator_ = nullptr;
+    const MemoryTypeSelector* memory_types_ = nullptr;
+    PFN_vkSetDebugUtilsObjectNameEXT set_debug_name_ = nullptr;
+
+    std::vector<MemoryBlock> blocks_;
+    std::vector<DeviceAllocation> allocations_;
+    std::vector<DeviceAllocationHandle> free_allocation_handles_;
+    uint64_t num_frees_ = 0;
+    DeviceMemoryCategoryStats category_stats_[static_cast<size_t>(DeviceMemoryCategory::Count)];
+
+    static constexpr VkDeviceSize DEFAULT_BLOCK_SIZE = 64ull * 1024ull * 1024ull;
+    static constexpr VkDeviceSize SMALL_HEAP_SIZE = 1024ull * 1024ull * 1024ull;
+};
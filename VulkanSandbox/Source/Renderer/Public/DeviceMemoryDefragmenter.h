@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include "BarrierBatcher.h"
+#include "DeletionQueue.h"
+#include "DeviceMemoryAllocator.h"
+#include "GpuTimeline.h"
+
+struct DefragmentationStats
+{
+    DeviceMemoryStats before;   // Snapshot when the pass was started
+    DeviceMemoryStats after;    // Snapshot after the last committed step
+    uint32_t num_steps = 0;
+    uint32_t num_moves = 0;
+    VkDeviceSize bytes_moved = 0;
+    uint32_t num_released_blocks = 0;
+};
+
+// Incrementally compacts the blocks of a DeviceMemoryAllocator.
+// Long running sessions which stream resources in and out leave blocks with lots of small holes. New allocations then don't fit anymore
+// and we end up creating new blocks, although there'd be enough free memory in total.
+//
+// The defragmenter empties the sparsest blocks by moving their resources into the denser blocks, so the emptied blocks can be released.
+// A move creates an identical resource at the new location and copies the contents on the GPU. To avoid frame spikes we only move
+// a limited amount of bytes per step, so a whole pass is spread over several frames:
+//  1. RecordAndSubmitStep() records the copies of the next batch of moves into an own command buffer and submits it to the timeline's queue.
+//  2. Once IsStepComplete() returns true, CommitStep() hands the new resources to their owners (so they can update descriptors, views,
+//     command buffers, ...). Frames in flight may still use the old resources, so they and their memory go through the deletion queue.
+//  3. ReleaseEmptiedBlocks() gives the emptied blocks back to the driver, once the deletion queue has freed their old ranges.
+//
+// Only resources that have been registered are moved. Everything else (e.g. persistently mapped buffers the CPU writes to) stays where it is.
+class DeviceMemoryDefragmenter
+{
+public:
+    void Init(VkDevice device, const VkAllocationCallbacks* allocator, DeviceMemoryAllocator* device_memory, uint32_t queue_family_index, GpuTimeline* timeline,
+        DeletionQueue* deletion_queue);
+    void Shutdown();
+
+    // Registers a buffer as movable. The buffer needs VK_BUFFER_USAGE_TRANSFER_SRC_BIT and VK_BUFFER_USAGE_TRANSFER_DST_BIT.
+    // on_moved is called with the new buffer when a move is committed. Submissions from then on have to use the new buffer.
+    // The old one is retired with the timeline's last submitted value.
+    void RegisterBuffer(DeviceAllocationHandle handle, std::function<void(VkBuffer)> on_moved);
+
+    // Registers an image as movable. The image needs VK_IMAGE_USAGE_TRANSFER_SRC_BIT and VK_IMAGE_USAGE_TRANSFER_DST_BIT
+    // and has to be in the given layout whenever the defragmenter might copy it.
+    void RegisterImage(DeviceAllocationHandle handle, VkImageLayout layout, VkImageAspectFlags aspect_mask, std::function<void(VkImage)> on_moved);
+
+    // Has to be called before the allocation is destroyed.
+    void Unregister(DeviceAllocationHandle handle);
+
+    // True if the allocator had to free memory since the last pass and the free memory is scattered enough.
+    bool ShouldDefragment(float fragmentation_threshold) const;
+
+    void BeginPass(VkDeviceSize max_bytes_per_step);
+    bool IsPassActive() const { return is_pass_active_; }
+
+    // Picks the next batch of moves and submits the copies. Ends the pass if there is nothing left to move.
+    void RecordAndSubmitStep();
+    bool IsStepPending() const { return pending_moves_.empty() == false; }
+    bool IsStepComplete() const;
+
+    // Returns the number of committed moves.
+    uint32_t CommitStep();
+
+    // Releases the blocks emptied by committed moves whose old ranges have been freed by the deletion queue in the meantime.
+    // Cheap if there's nothing to release, so it can be called every frame.
+    void ReleaseEmptiedBlocks();
+
+    const DefragmentationStats& GetStats() const { return stats_; }
+
+private:
+    struct MovableResource
+    {
+        DeviceAllocationHandle handle = INVALID_DEVICE_ALLOCATION;
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        VkImageAspectFlags aspect_mask = 0;
+        std::function<void(VkBuffer)> on_buffer_moved;
+        std::function<void(VkImage)> on_image_moved;
+    };
+
+    struct Move
+    {
+        DeviceAllocationHandle handle = INVALID_DEVICE_ALLOCATION;
+        uint32_t dst_block_index = UINT32_MAX;
+        VkDeviceSize dst_offset = 0;
+        VkDeviceSize size = 0;
+        VkBuffer dst_buffer = VK_NULL_HANDLE;
+        VkImage dst_image = VK_NULL_HANDLE;
+    };
+
+    // Returns the index of the block we want to empty next, UINT32_MAX if there's none.
+    uint32_t FindSourceBlock() const;
+    bool TryPlanMove(const MovableResource& resource, uint32_t src_block_index, Move& out_move);
+    void RecordBufferCopy(VkCommandBuffer command_buffer, const Move& move);
+    void RecordImageCopy(VkCommandBuffer command_buffer, const Move& move);
+    void AddImageCopyBarriers(const MovableResource& resource, const Move& move, bool is_before_copy);
+    const MovableResource* FindMovable(DeviceAllocationHandle handle) const;
+    void EndPass();
+
+    VkDevice device_ = VK_NULL_HANDLE;
+    const VkAllocationCallbacks* allocator_ = nullptr;
+    DeviceMemoryAllocator* device_memory_ = nullptr;
+    GpuTimeline* timeline_ = nullptr;
+    DeletionQueue* deletion_queue_ = nullptr;
+    VkCommandPool command_pool_ = VK_NULL_HANDLE;
+    VkCommandBuffer command_buffer_ = VK_NULL_HANDLE;
+    uint64_t step_timeline_value_ = 0;  // Signaled once the copies of the pending step are done
+    BarrierBatcher barriers_;   // The layout transitions of all images of a step are recorded together
+
+    std::vector<MovableResource> movables_;
+    std::vector<Move> pending_moves_;
+    std::vector<uint32_t> blocks_to_skip_;  // Blocks we've given up on in this pass, e.g. because they contain resources we can't move
+    std::vector<uint32_t> emptied_blocks_;  // Blocks that only contain retiring ranges, see ReleaseEmptiedBlocks()
+
+    bool is_pass_active_ = false;
+    VkDeviceSize max_bytes_per_step_ = 0;
+    uint64_t num_frees_at_last_pass_ = 0;
+    DefragmentationStats stats_;
+};
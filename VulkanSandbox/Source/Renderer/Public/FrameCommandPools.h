@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+// Command pools for command buffers that are recorded anew every frame.
+// There is one pool per frame in flight and recording thread. Command pools are not thread safe, so every thread needs its own one.
+//
+// Instead of freeing command buffers one by one, BeginFrame() resets all pools of a frame at once with vkResetCommandPool.
+// That's a lot cheaper and lets the driver recycle the pool memory as a whole. The command buffers themselves are kept and handed out again,
+// so after the first few frames we don't allocate any command buffers anymore.
+class FrameCommandPools
+{
+public:
+    void Init(VkDevice device, const VkAllocationCallbacks* allocator, uint32_t queue_family_index, uint32_t num_frames, uint32_t num_threads);
+    void Shutdown();
+
+    // Resets all pools of the frame. May only be called once the GPU has finished the previous submission of that frame.
+    void BeginFrame(uint32_t frame_index);
+
+    // Returns a command buffer of the current frame, ready to be recorded. Valid until the frame's pools are reset again.
+    // Each thread has to pass its own thread index.
+    VkCommandBuffer GetPrimaryCommandBuffer(uint32_t thread_index);
+    VkCommandBuffer GetSecondaryCommandBuffer(uint32_t thread_index);
+
+    uint32_t GetNumThreads() const { return num_threads_; }
+
+private:
+    struct ThreadPool
+    {
+        VkCommandPool command_pool = VK_NULL_HANDLE;
+        std::vector<VkCommandBuffer> command_buffers[2];  // Indexed by VkCommandBufferLevel
+        uint32_t num_used_command_buffers[2] = {};
+    };
+
+    VkCommandBuffer GetCommandBuffer(uint32_t thread_index, VkCommandBufferLevel level);
+
+    VkDevice device_ = VK_NULL_HANDLE;
+    const VkAllocationCallbacks* allocator_ = nullptr;
+    uint32_t num_threads_ = 0;
+    uint32_t current_frame_ = 0;
+
+    std::vector<ThreadPool> pools_; // num_frames * num_threads, pools of the same frame are next to each other
+};
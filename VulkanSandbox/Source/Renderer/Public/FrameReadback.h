@@ -0,0 +1,113 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <vulkan/vulkan.h>
+
+#include "BarrierBatcher.h"
+#include "DeviceMemoryAllocator.h"
+#include "GpuTimeline.h"
+
+enum class CaptureFormat : uint8_t
+{
+    Png,
+    Raw     // The texels as they are, e.g. BGRA. Cheap to write, but large.
+};
+
+// Copies rendered frames back to the CPU and writes them to disk, without ever waiting for the GPU on the render thread.
+//
+// There is a ring of host visible buffers. Capturing a frame:
+//  1. RecordCopy() records a copy of the image into a free buffer, as part of the frame's command buffer.
+//  2. SetSubmitted() remembers the timeline value of the frame's submission.
+//  3. Update() polls the timeline and hands buffers whose copy is done to a worker thread.
+//  4. The worker thread encodes the frame (PNG or raw) and writes it to disk. Afterwards the buffer is free again.
+// If all buffers are still busy, e.g. because encoding can't keep up, the frame is dropped instead of stalling.
+//
+// NOTE: The buffers are allocated from memory that is host coherent, so we don't need to invalidate anything before reading.
+class FrameReadback
+{
+public:
+    void Init(DeviceMemoryAllocator* device_memory, GpuTimeline* timeline, VkExtent2D extent, VkFormat format, uint32_t num_buffers,
+              const std::string& output_directory, CaptureFormat capture_format);
+
+    // Waits for all captures that are still in flight and writes them, then destroys the buffers.
+    void Shutdown();
+
+    // The swap chain has been recreated. Does nothing if neither size nor format have changed. Otherwise new buffers are created right away
+    // and the old ones are retired: Captures in flight still finish, each old buffer is destroyed by Update() once it's free. Never blocks.
+    void Resize(VkExtent2D extent, VkFormat format);
+
+    bool IsEnabled() const { return slots_.empty() == false; }
+
+    // The image has to be in current_layout and is returned to it afterwards. src_stage_mask and src_access_mask describe the last write to the image,
+    // the copy waits for it. Returns false if the frame was dropped, because there was no free buffer.
+    bool RecordCopy(VkCommandBuffer command_buffer, VkImage image, VkImageLayout current_layout, VkPipelineStageFlags2 src_stage_mask, VkAccessFlags2 src_access_mask,
+                    uint64_t frame_number);
+
+    // Has to be called after each submission that may contain copies.
+    void SetSubmitted(uint64_t timeline_value);
+
+    // Only polls the timeline, it never blocks. Also destroys retired buffers that aren't used anymore.
+    void Update();
+
+    uint64_t GetNumCapturedFrames() const { return num_captured_frames_; }
+    uint64_t GetNumDroppedFrames() const { return num_dropped_frames_; }
+
+private:
+    enum class SlotState : uint8_t
+    {
+        Free,
+        Recorded,   // Copy is recorded, but not submitted yet
+        Copying,    // Waiting for the GPU
+        Encoding    // Owned by the worker thread
+    };
+
+    struct Slot
+    {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        DeviceAllocationHandle allocation = INVALID_DEVICE_ALLOCATION;
+        const uint8_t* mapped_data = nullptr;  // Fetched on the render thread, the worker must not touch the allocator
+        VkExtent2D extent = {};     // Of the swap chain the slot has been created for. Slots of an old swap chain may still be encoded after a resize.
+        VkFormat format = VK_FORMAT_UNDEFINED;
+        SlotState state = SlotState::Free;
+        bool is_retired = false;    // Belongs to an old swap chain. Destroyed as soon as it's free.
+        uint64_t timeline_value = 0;
+        uint64_t frame_number = 0;
+    };
+
+    void CreateSlots(VkExtent2D extent, VkFormat format, uint32_t num_buffers);
+    void DestroyRetiredSlots();
+    void WorkerLoop();
+    void EncodeFrame(const Slot& slot);
+
+    DeviceMemoryAllocator* device_memory_ = nullptr;
+    GpuTimeline* timeline_ = nullptr;
+    VkExtent2D extent_ = {};    // Of the current slots
+    VkFormat format_ = VK_FORMAT_UNDEFINED;
+    uint32_t num_buffers_ = 0;
+    uint32_t num_retired_slots_ = 0;    // Render thread only. Lets Update() skip looking for retired slots if there are none.
+    std::string output_directory_;
+    CaptureFormat capture_format_ = CaptureFormat::Png;
+
+    BarrierBatcher barriers_;
+
+    // Slots live on the heap, so the worker can keep using a slot while the render thread adds or removes others.
+    // The vector itself is only changed by the render thread, while holding mutex_.
+    std::vector<std::unique_ptr<Slot>> slots_;
+
+    // Everything below is shared with the worker thread and protected by mutex_, including the state of the slots.
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable job_available_;
+    std::vector<Slot*> encode_queue_;       // Oldest first
+    bool is_shutting_down_ = false;
+
+    std::vector<uint8_t> rgba_scratch_;     // Worker only. PNG wants RGBA, but swap chain formats are usually BGRA.
+
+    uint64_t num_captured_frames_ = 0;
+    uint64_t num_dropped_frames_ = 0;
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+// Measures how long the GPU takes for each frame with two timestamp queries around the frame's commands.
+// There is a pair of queries per frame in flight. Results are read once the frame's submission is complete, so reading never blocks.
+//
+// Timestamps have to be supported by the graphics queue (timestampValidBits > 0). If they aren't, pass is_supported = false and all calls do nothing.
+class GpuFrameTimer
+{
+public:
+    void Init(VkDevice device, const VkAllocationCallbacks* allocator, bool is_supported, float timestamp_period_ns, uint32_t num_frames);
+    void Shutdown();
+
+    bool IsSupported() const { return query_pool_ != VK_NULL_HANDLE; }
+
+    // Have to be recorded outside of a render pass, at the very beginning and end of the frame's command buffer.
+    void WriteFrameStart(VkCommandBuffer command_buffer, uint32_t frame_index);
+    void WriteFrameEnd(VkCommandBuffer command_buffer, uint32_t frame_index);
+
+    // Returns false if the frame hasn't written timestamps since the last read. May only be called once its submission is complete.
+    // Both timestamps are in ns, but in the GPU's own clock. Only their difference, the GPU time of the frame, is meaningful on its own.
+    bool ReadFrameTimestamps(uint32_t frame_index, uint64_t& out_start_ns, uint64_t& out_end_ns);
+
+private:
+    VkDevice device_ = VK_NULL_HANDLE;
+    const VkAllocationCallbacks* allocator_ = nullptr;
+    VkQueryPool query_pool_ = VK_NULL_HANDLE;
+    double timestamp_period_ns_ = 1.0;  // Nanoseconds per timestamp tick
+
+    std::vector<bool> has_pending_result_; // Per frame in flight
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+// A semaphore the submission has to wait on. value is ignored for binary semaphores.
+struct GpuSemaphoreWait
+{
+    VkSemaphore semaphore = VK_NULL_HANDLE;
+    uint64_t value = 0;
+    VkPipelineStageFlags2 stage_mask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+};
+
+// Tracks all work submitted to one queue with a single timeline semaphore (Vulkan 1.2).
+// Unlike a binary semaphore or a fence, a timeline semaphore holds a 64 bit counter. Every submission through Submit() signals the next
+// higher value, so "is the work of submission N done?" simply becomes "is the counter >= N?".
+// Frames, uploads and the defragmenter all remember the value of their submission and can ask for it later, without any fence of their own.
+//
+// Submit() doesn't call into the driver. The submissions of a frame are gathered and Flush() hands all of them to the queue
+// with a single vkQueueSubmit2. Every call into the queue has a fixed cost, on software renderers like lavapipe even a considerable one.
+// Waiting for a value that hasn't been flushed yet flushes first, so nobody waits for work the GPU doesn't know about.
+//
+// NOTE: Signal values have to increase strictly per semaphore. All submissions to the queue therefore have to go through the same timeline.
+class GpuTimeline
+{
+public:
+    void Init(VkDevice device, const VkAllocationCallbacks* allocator, VkQueue queue);
+    void Shutdown();
+
+    VkQueue GetQueue() const { return queue_; }
+    VkSemaphore GetSemaphore() const { return semaphore_; }
+
+    // Submissions of this timeline may wait on the given one, e.g. the graphics queue on the transfer queue.
+    // Flushing this timeline flushes the other one first. Otherwise we could wait on the CPU for work that waits for a submission that was never made.
+    void SetUpstream(GpuTimeline* upstream) { upstream_ = upstream; }
+
+    // Queues the command buffers for submission and returns the value that is signaled once they're done.
+    // Binary semaphores (e.g. for presentation) can be signaled in addition. Anything that waits on them has to be submitted after Flush().
+    uint64_t Submit(uint32_t num_command_buffers, const VkCommandBuffer* command_buffers,
+                    uint32_t num_waits = 0, const GpuSemaphoreWait* waits = nullptr,
+                    uint32_t num_binary_signals = 0, const VkSemaphore* binary_signals = nullptr);
+
+    // Hands all queued submissions to the queue at once.
+    void Flush();
+
+    // The value of the most recent submission. Everything submitted so far is done once the counter reaches it.
+    uint64_t GetLastSubmittedValue() const { return last_submitted_value_; }
+
+    // Queries the counter. Values that are known to be complete are cached, so polling old values doesn't call into the driver.
+    uint64_t GetCompletedValue() const;
+    bool IsComplete(uint64_t value) const;
+
+    // Blocks until the counter reached the value. Value 0 is always complete.
+    void Wait(uint64_t value);
+    void WaitIdle() { Wait(last_submitted_value_); }
+
+    // Number of submissions and of vkQueueSubmit2 calls they were batched into
+    uint64_t GetNumSubmissions() const { return num_submissions_; }
+    uint64_t GetNumQueueSubmits() const { return num_queue_submits_; }
+
+private:
+    // Offsets into the pending arrays below. We can't store pointers, the arrays may still grow until we flush.
+    struct PendingSubmission
+    {
+        uint32_t first_wait = 0;
+        uint32_t num_waits = 0;
+        uint32_t first_command_buffer = 0;
+        uint32_t num_command_buffers = 0;
+        uint32_t first_signal = 0;
+        uint32_t num_signals = 0;
+    };
+
+    VkDevice device_ = VK_NULL_HANDLE;
+    const VkAllocationCallbacks* allocator_ = nullptr;
+    VkQueue queue_ = VK_NULL_HANDLE;
+    VkSemaphore semaphore_ = VK_NULL_HANDLE;
+    GpuTimeline* upstream_ = nullptr;
+
+    uint64_t last_submitted_value_ = 0;
+    uint64_t last_flushed_value_ = 0;
+    mutable uint64_t completed_value_ = 0;
+
+    // Cleared on every flush, but keep their capacity. After the first few frames submitting doesn't allocate anymore.
+    std::vector<PendingSubmission> pending_submissions_;
+    std::vector<VkSemaphoreSubmitInfo> pending_waits_;
+    std::vector<VkCommandBufferSubmitInfo> pending_command_buffers_;
+    std::vector<VkSemaphoreSubmitInfo> pending_signals_;
+    std::vector<VkSubmitInfo2> submit_infos_;
+
+    uint64_t num_submissions_ = 0;
+    uint64_t num_queue_submits_ = 0;
+};
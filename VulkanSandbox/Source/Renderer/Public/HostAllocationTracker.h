@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <ostream>
+
+#include <vulkan/vulkan.h>
+
+// Tags which are attached to every driver allocation, so we can tell in which phase of the application an allocation was made.
+// Each tag acts as an own "arena" in the statistics. Allocations are always attributed to the tag they were made in,
+// even if they are freed later on. E.g. a swap chain allocation that is released during shutdown still shows up under SwapChainRecreation.
+enum class HostAllocationTag : uint32_t
+{
+    Startup = 0,
+    SteadyState,
+    SwapChainRecreation,
+    Shutdown,
+    Count
+};
+
+// Statistics of one (tag, VkSystemAllocationScope) combination.
+// All counters are atomic, because the driver may call the allocation callbacks from any thread.
+struct HostAllocationStats
+{
+    std::atomic<uint64_t> num_allocations = 0;
+    std::atomic<uint64_t> num_reallocations = 0;  // Not counted as allocation and free as well
+    std::atomic<uint64_t> num_frees = 0;
+    std::atomic<uint64_t> allocated_bytes = 0;  // Sum of all bytes ever allocated -> shows churn
+    std::atomic<uint64_t> live_bytes = 0;       // Bytes that are currently allocated
+    std::atomic<uint64_t> peak_live_bytes = 0;
+
+    std::atomic<uint64_t> num_internal_allocations = 0; // Allocations the driver made itself and only notified us about (e.g. executable memory)
+    std::atomic<uint64_t> internal_allocated_bytes = 0; // Live bytes of those are tracked per scope only, see HostAllocationTracker::GetInternalLiveBytes()
+};
+
+// Implementation of VkAllocationCallbacks which forwards to the C runtime heap, but keeps track of bytes and counts
+// per VkSystemAllocationScope and per HostAllocationTag.
+// By default the driver allocates its CPU side memory however it wants, so we have no idea how much memory e.g. a pipeline
+// or a swap chain costs on the host. Passing these callbacks as pAllocator to every vkCreate* / vkDestroy* call gives us that insight.
+// Important: Objects have to be destroyed with the same allocator they were created with!
+class HostAllocationTracker
+{
+public:
+    HostAllocationTracker();
+
+    HostAllocationTracker(const HostAllocationTracker&) = delete;
+    HostAllocationTracker& operator=(const HostAllocationTracker&) = delete;
+
+    const VkAllocationCallbacks* GetCallbacks() const { return &callbacks_; }
+
+    // Every allocation from now on is attributed to the given tag.
+    void SetTag(HostAllocationTag tag) { current_tag_.store(tag, std::memory_order_relaxed); }
+    HostAllocationTag GetTag() const { return current_tag_.load(std::memory_order_relaxed); }
+
+    const HostAllocationStats& GetStats(HostAllocationTag tag, VkSystemAllocationScope scope) const;
+
+    // Internal allocations can't be attributed to a tag when they're freed, so their live bytes are only tracked per scope.
+    uint64_t GetInternalLiveBytes(VkSystemAllocationScope scope) const;
+
+    // Prints a table of all scopes with any activity for the given tag.
+    void PrintReport(std::ostream& stream, HostAllocationTag tag) const;
+
+    // Prints the tables of all tags.
+    void PrintReport(std::ostream& stream) const;
+
+    static const char* GetTagName(HostAllocationTag tag);
+    static const char* GetScopeName(VkSystemAllocationScope scope);
+
+private:
+    // The VkAllocationCallbacks entry points. pUserData points to the tracker.
+    static void* VKAPI_PTR Allocate(void* user_data, size_t size, size_t alignment, VkSystemAllocationScope scope);
+    static void* VKAPI_PTR Reallocate(void* user_data, void* original, size_t size, size_t alignment, VkSystemAllocationScope scope);
+    static void VKAPI_PTR Free(void* user_data, void* memory);
+    static void VKAPI_PTR InternalAllocationNotification(void* user_data, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope);
+    static void VKAPI_PTR InternalFreeNotification(void* user_data, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope);
+
+    void* AllocateTracked(size_t size, size_t alignment, VkSystemAllocationScope scope);
+    void* ReallocateTracked(void* original, size_t size, size_t alignment, VkSystemAllocationScope scope);
+    void FreeTracked(void* memory);
+
+    HostAllocationStats& GetStatsMutable(HostAllocationTag tag, VkSystemAllocationScope scope);
+
+    // VK_SYSTEM_ALLOCATION_SCOPE_COMMAND ... VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE
+    static constexpr size_t NUM_SCOPES = 5;
+    static constexpr size_t NUM_TAGS = static_cast<size_t>(HostAllocationTag::Count);
+
+    VkAllocationCallbacks callbacks_{};
+    std::atomic<HostAllocationTag> current_tag_ = HostAllocationTag::Startup;
+    HostAllocationStats stats_[NUM_TAGS][NUM_SCOPES];
+    std::atomic<uint64_t> internal_live_bytes_[NUM_SCOPES] = {};
+};
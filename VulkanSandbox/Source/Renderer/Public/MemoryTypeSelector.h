@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+// Describes which memory properties a resource needs, which ones would be nice to have and which ones we'd rather not waste on it.
+// Example: A vertex buffer requires DEVICE_LOCAL, but should avoid HOST_VISIBLE on a discrete GPU, because the host visible part
+// of VRAM (the "BAR") may be tiny and is better spent on resources the CPU actually writes to.
+struct MemoryTypeRequest
+{
+    VkMemoryPropertyFlags required = 0;
+    VkMemoryPropertyFlags preferred = 0;
+    VkMemoryPropertyFlags avoided = 0;
+};
+
+// Caches the memory properties of the physical device and picks the best memory type for a request.
+// Also detects whether the CPU can write to device local memory directly, which is the case for
+// * unified memory architectures (integrated GPUs, software rasterizers like lavapipe) -> all memory is system RAM anyway
+// * discrete GPUs with resizable BAR (ReBAR / SAM) -> the whole VRAM is mapped into the CPU address space
+// In both cases copying through a staging buffer is pure overhead.
+class MemoryTypeSelector
+{
+public:
+    void Init(VkPhysicalDevice physical_device);
+
+    // Returns the index of the memory type that is accepted by type_filter, supports all required properties and scores best otherwise.
+    // Throws if there is no memory type that supports the required properties.
+    uint32_t FindMemoryType(uint32_t type_filter, const MemoryTypeRequest& request) const;
+
+    const VkPhysicalDeviceMemoryProperties& GetMemoryProperties() const { return memory_properties_; }
+    VkMemoryPropertyFlags GetPropertyFlags(uint32_t memory_type_index) const { return memory_properties_.memoryTypes[memory_type_index].propertyFlags; }
+
+    bool IsUnifiedMemory() const { return is_unified_memory_; }
+    bool HasResizableBar() const { return has_resizable_bar_; }
+
+    // True if device local memory can be mapped and written from the CPU without any staging copy.
+    bool CanWriteDeviceLocalDirectly() const { return is_unified_memory_ || has_resizable_bar_; }
+
+    // Human readable description of the detected memory model, e.g. for logging.
+    const char* GetMemoryModelName() const;
+
+private:
+    int ScoreMemoryType(uint32_t memory_type_index, const MemoryTypeRequest& request) const;
+
+    VkPhysicalDeviceMemoryProperties memory_properties_{};
+    bool is_unified_memory_ = false;
+    bool has_resizable_bar_ = false;
+
+    // Without ReBAR, discrete GPUs usually only expose a 256 MiB window of VRAM to the CPU.
+    // Anything larger than that indicates that the whole heap is host visible.
+    static constexpr VkDeviceSize LEGACY_BAR_SIZE = 256ull * 1024ull * 1024ull;
+};
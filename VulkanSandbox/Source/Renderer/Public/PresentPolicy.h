@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+
+#include <vulkan/vulkan.h>
+
+// What we optimize the presentation for. Decides the present mode and the number of swap chain images.
+// Not every present mode is supported everywhere (only FIFO is guaranteed), so each policy has a list of fallbacks.
+enum class PresentPolicy : uint8_t
+{
+    LowLatency,     // Show the newest frame without tearing. MAILBOX if possible.
+    MaxThroughput,  // Never wait for the display, tearing is fine. IMMEDIATE if possible. For benchmarks.
+    VSync,          // Every frame is shown, the frame rate is capped by the display. FIFO.
+    PowerSaving,    // Like VSync, but with as few images as possible. The CPU and GPU sleep while waiting for the display.
+    Count
+};
+
+// Present mode and minimum number of images we ask the swap chain for.
+struct SwapChainConfig
+{
+    VkPresentModeKHR present_mode = VK_PRESENT_MODE_FIFO_KHR;
+    uint32_t min_image_count = 0;
+};
+
+// Picks the first present mode of the policy that's available and the image count that goes with it.
+// The image count is at least num_frames_in_flight and respects the limits of the surface.
+SwapChainConfig ChooseSwapChainConfig(PresentPolicy policy, const VkSurfaceCapabilitiesKHR& capabilities,
+                                      const std::vector<VkPresentModeKHR>& available_present_modes, uint32_t num_frames_in_flight);
+
+// The policy after this one, to cycle through all of them at runtime.
+PresentPolicy GetNextPresentPolicy(PresentPolicy policy);
+
+// Names as used on the command line, e.g. "low-latency".
+const char* GetPresentPolicyName(PresentPolicy policy);
+std::optional<PresentPolicy> ParsePresentPolicy(const std::string& name);
+
+const char* GetPresentModeName(VkPresentModeKHR present_mode);
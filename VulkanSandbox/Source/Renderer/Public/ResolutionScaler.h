@@ -0,0 +1,40 @@
+#pragma once
+
+// Picks the scale of the render resolution each frame, so that the GPU time of a frame stays within a budget.
+// The scene is rendered into a part of a full size target and then upscaled to the swap chain image, so changing the scale is free.
+//
+// Fill rate bound frames (weak GPUs, software rasterizers) cost roughly the number of pixels, i.e. scale^2.
+// From the measured GPU time we therefore estimate the scale that would hit the budget. To keep it from oscillating:
+//  * The frame times are smoothed with an exponential moving average.
+//  * There's a dead band around the budget. We only scale down once we're over budget and only scale up once we're clearly below it.
+//  * After a change we ignore the next few frames. Those have been recorded with the old scale, so they don't tell us anything about the new one.
+//  * The scale is quantized, so small corrections don't move the render area every frame.
+//  * A single step never changes the scale too much, especially not upwards.
+class ResolutionScaler
+{
+public:
+    // target_gpu_ms <= 0 disables scaling, the scale stays at 1.
+    // num_settle_frames should be at least the number of frames in flight.
+    void Init(double target_gpu_ms, float min_scale, uint32_t num_settle_frames);
+
+    bool IsEnabled() const { return target_gpu_ms_ > 0.0; }
+
+    // Feeds the GPU time of a completed frame. May change the scale.
+    void AddGpuFrameTime(double gpu_ms);
+
+    // Scale of both width and height, in [min_scale, 1].
+    float GetScale() const { return scale_; }
+
+    uint32_t GetNumScaleChanges() const { return num_scale_changes_; }
+
+private:
+    double target_gpu_ms_ = 0.0;
+    float min_scale_ = 1.0f;
+    uint32_t num_settle_frames_ = 0;
+
+    float scale_ = 1.0f;
+    double average_gpu_ms_ = 0.0;
+    bool has_average_ = false;
+    uint32_t num_frames_to_ignore_ = 0;
+    uint32_t num_scale_changes_ = 0;
+};
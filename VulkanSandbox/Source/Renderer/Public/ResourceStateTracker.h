@@ -0,0 +1,127 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include "BarrierBatcher.h"
+
+// Describes how a command is going to use a resource: in which stages, with which kind of access and - for images - in which layout.
+struct ResourceAccess
+{
+    VkPipelineStageFlags2 stage_mask = VK_PIPELINE_STAGE_2_NONE;
+    VkAccessFlags2 access_mask = VK_ACCESS_2_NONE;
+    VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;   // Ignored for buffers
+};
+
+// The accesses we use all the time
+constexpr ResourceAccess ACCESS_COPY_SOURCE = { VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL };
+constexpr ResourceAccess ACCESS_COPY_DESTINATION = { VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL };
+constexpr ResourceAccess ACCESS_BLIT_SOURCE = { VK_PIPELINE_STAGE_2_BLIT_BIT, VK_ACCESS_2_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL };
+constexpr ResourceAccess ACCESS_BLIT_DESTINATION = { VK_PIPELINE_STAGE_2_BLIT_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL };
+constexpr ResourceAccess ACCESS_FRAGMENT_SHADER_SAMPLED = { VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+constexpr ResourceAccess ACCESS_DEPTH_STENCIL_ATTACHMENT = { VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+    VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL };
+constexpr ResourceAccess ACCESS_COLOR_ATTACHMENT = { VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+    VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+constexpr ResourceAccess ACCESS_VERTEX_BUFFER = { VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT, VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT };
+constexpr ResourceAccess ACCESS_INDEX_BUFFER = { VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT, VK_ACCESS_2_INDEX_READ_BIT };
+constexpr ResourceAccess ACCESS_UNIFORM_BUFFER = { VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_UNIFORM_READ_BIT };
+
+// Remembers the current layout and the last accesses of every image subresource (mip level + array layer) and buffer range.
+//
+// Instead of spelling out a barrier with the old and new layout, stages and access masks, we tell the tracker how we are going to use a resource next.
+// It knows what happened before and adds the minimal barrier to a BarrierBatcher - or none at all:
+//  * Reads after reads in the same layout don't need a barrier.
+//  * Reads only wait for the last write if it isn't visible to them yet.
+//  * Writes and layout transitions wait for all previous reads and writes.
+//  * Consecutive mip levels with the same state are transitioned with a single barrier.
+//
+// The tracker only knows about commands that go through it. Synchronization that happens elsewhere (queue ownership transfers,
+// render pass layout transitions, other queues) has to be told with Set*State().
+class ResourceStateTracker
+{
+public:
+    // Images start in initial_layout and buffers without any previous access.
+    void RegisterImage(VkImage image, uint32_t num_mips, uint32_t num_layers, VkImageAspectFlags aspect_mask, VkImageLayout initial_layout = VK_IMAGE_LAYOUT_UNDEFINED);
+    void RegisterBuffer(VkBuffer buffer, VkDeviceSize size);
+    void Unregister(VkImage image);
+    void Unregister(VkBuffer buffer);
+
+    // The resource has been replaced by a copy in another place (see DeviceMemoryDefragmenter). The state carries over.
+    void ReplaceHandle(VkImage old_image, VkImage new_image);
+    void ReplaceHandle(VkBuffer old_buffer, VkBuffer new_buffer);
+
+    // Adds the barriers that are required before the resource may be accessed as described. The batcher has to be flushed before the access is recorded.
+    void UseImage(BarrierBatcher& barriers, VkImage image, const ResourceAccess& access);
+    void UseImage(BarrierBatcher& barriers, VkImage image, uint32_t base_mip, uint32_t num_mips, const ResourceAccess& access);   // All layers of the mip levels
+    void UseBuffer(BarrierBatcher& barriers, VkBuffer buffer, const ResourceAccess& access, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+
+    // Tells the tracker that the resource has been synchronized for the access without its help, e.g. by the acquire barrier of an ownership transfer.
+    void SetImageState(VkImage image, const ResourceAccess& access);
+    void SetBufferState(VkBuffer buffer, const ResourceAccess& access);
+
+    // How many barriers we've emitted and how often an access didn't need one.
+    uint64_t GetNumBarriers() const { return num_barriers_; }
+    uint64_t GetNumAccessesWithoutBarrier() const { return num_accesses_without_barrier_; }
+
+private:
+    struct State
+    {
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        VkPipelineStageFlags2 write_stages = VK_PIPELINE_STAGE_2_NONE; // Stages of the last write or layout transition, later accesses have to be ordered after them
+        VkAccessFlags2 write_access = VK_ACCESS_2_NONE;                // Writes that still have to be made available. NONE after a layout transition.
+        VkPipelineStageFlags2 read_stages = VK_PIPELINE_STAGE_2_NONE;  // Reads since the last write. The next write or layout transition has to wait for them.
+        VkPipelineStageFlags2 visible_stages = VK_PIPELINE_STAGE_2_NONE;   // Stages and accesses which already see the last write
+        VkAccessFlags2 visible_access = VK_ACCESS_2_NONE;
+
+        bool operator==(const State& other) const = default;
+    };
+
+    // The barrier that is required before an access, if any.
+    struct Transition
+    {
+        bool needs_barrier = false;
+        VkPipelineStageFlags2 src_stage_mask = VK_PIPELINE_STAGE_2_NONE;
+        VkAccessFlags2 src_access_mask = VK_ACCESS_2_NONE;
+        VkImageLayout old_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+        bool operator==(const Transition& other) const = default;
+    };
+
+    struct ImageState
+    {
+        uint32_t num_mips = 0;
+        uint32_t num_layers = 0;
+        VkImageAspectFlags aspect_mask = 0;
+        std::vector<State> subresources;    // Indexed by layer * num_mips + mip
+    };
+
+    struct BufferRange
+    {
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+        State state;
+    };
+
+    struct BufferState
+    {
+        VkDeviceSize size = 0;
+        std::vector<BufferRange> ranges;    // Sorted by offset, non-overlapping and covering the whole buffer
+    };
+
+    static Transition ComputeTransition(const State& state, const ResourceAccess& access, bool has_layout);
+    static void ApplyAccess(State& state, const ResourceAccess& access, bool has_layout, bool had_barrier);
+    static State MakeSynchronizedState(const ResourceAccess& access);
+
+    ImageState& GetImageState(VkImage image);
+    BufferState& GetBufferState(VkBuffer buffer);
+
+    // Makes sure that a range starts at offset. Returns the index of that range.
+    static size_t SplitBufferRange(BufferState& buffer_state, VkDeviceSize offset);
+    static void MergeBufferRanges(BufferState& buffer_state);
+
+    std::unordered_map<VkImage, ImageState> images_;
+    std::unordered_map<VkBuffer, BufferState> buffers_;
+
+    uint64_t num_barriers_ = 0;
+    uint64_t num_accesses_without_barrier_ = 0;
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include "BarrierBatcher.h"
+#include "GpuTimeline.h"
+
+// Value of the graphics timeline which is signaled once the batch has been executed completely.
+using UploadBatchId = uint64_t;
+
+// Records transfers and barriers of many uploads into one command buffer, so that loading N assets costs one submission
+// and one queue round-trip instead of one for every single copy or layout transition.
+//
+// Usage:
+//  1. Record copies into GetCommandBuffer() and graphics-only work (e.g. blits) into GetGraphicsCommandBuffer().
+//     The first call after a submission starts a new batch.
+//  2. Hand every uploaded resource over to the graphics queue with TransferOwnership().
+//  3. Resources that are only needed until the GPU is done (e.g. staging buffers) are released via DeferUntilComplete().
+//  4. Submit() ends the batch and submits it. It returns the graphics timeline value of the batch, which we can poll with IsComplete() or block on with Wait().
+//  5. Update() retires all batches the GPU has finished and runs their deferred callbacks. Call it once per frame.
+//
+// If the device has a dedicated transfer queue family, copies are executed there, so streaming can overlap rendering.
+// Resources created with VK_SHARING_MODE_EXCLUSIVE belong to one queue family at a time, so each batch consists of two command buffers:
+//  * The transfer command buffer with the copies, ending with a "release" barrier for every uploaded resource.
+//  * The graphics command buffer, starting with the matching "acquire" barriers. It waits for the transfer submission on the transfer timeline.
+// Without a dedicated transfer queue both are the same command buffer and the ownership transfer collapses to a regular barrier.
+//
+// Barriers aren't recorded right away. They are collected in a BarrierBatcher per command buffer and flushed with a single vkCmdPipelineBarrier2
+// as soon as the command buffer is retrieved again to record more commands, or when the batch is submitted.
+// E.g. the release barriers of all resources uploaded in a row end up in one barrier call.
+//
+// Finished command buffers are reused for later batches, so after startup we don't create any Vulkan objects anymore.
+class UploadContext
+{
+public:
+    // Without a dedicated transfer queue both timelines are the same.
+    void Init(VkDevice device, const VkAllocationCallbacks* allocator, uint32_t transfer_queue_family_index, GpuTimeline* transfer_timeline,
+              uint32_t graphics_queue_family_index, GpuTimeline* graphics_timeline);
+
+    // Waits for all batches in flight and runs their callbacks. A batch that's still being recorded is submitted first.
+    void Shutdown();
+
+    bool HasDedicatedTransferQueue() const { return transfer_queue_family_index_ != graphics_queue_family_index_; }
+
+    // Returns the command buffer for copies of the batch that's currently being recorded. Starts a new batch if necessary.
+    // Pending barriers of the command buffer are flushed first, as the caller is about to record commands which may depend on them.
+    VkCommandBuffer GetCommandBuffer();
+
+    // Returns the command buffer which is executed on the graphics queue after all copies of the batch. Flushes its pending barriers as well.
+    VkCommandBuffer GetGraphicsCommandBuffer();
+
+    // Barriers to be recorded into the copy / graphics command buffer. Without a dedicated transfer queue both are the same.
+    BarrierBatcher& GetBarriers() { return barriers_; }
+    BarrierBatcher& GetGraphicsBarriers() { return HasDedicatedTransferQueue() ? graphics_barriers_ : barriers_; }
+
+    // Makes the results of all previously recorded copies to the resource available to the graphics queue.
+    // dst_stage_mask and dst_access_mask describe how the graphics queue accesses the resource afterwards.
+    void TransferOwnership(VkBuffer buffer, VkPipelineStageFlags2 dst_stage_mask, VkAccessFlags2 dst_access_mask);
+
+    // Same for images. The layout transition from old_layout to new_layout happens as part of the ownership transfer.
+    void TransferOwnership(VkImage image, const VkImageSubresourceRange& subresource_range, VkImageLayout old_layout, VkImageLayout new_layout,
+                           VkPipelineStageFlags2 dst_stage_mask, VkAccessFlags2 dst_access_mask);
+
+    // Calls the function once the current batch has been executed by the GPU.
+    void DeferUntilComplete(std::function<void()> callback);
+
+    // Submits the current batch. If nothing has been recorded since the last submission, the id of the last batch is returned.
+    UploadBatchId Submit();
+
+    bool IsComplete(UploadBatchId batch_id);
+    void Wait(UploadBatchId batch_id);
+
+    // Submits the current batch and waits until it's done. Convenient during startup, but stalls just like vkQueueWaitIdle.
+    void Flush();
+
+    // Polls the graphics timeline and retires all finished batches.
+    void Update();
+
+private:
+    struct Batch
+    {
+        VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+        VkCommandBuffer graphics_command_buffer = VK_NULL_HANDLE;   // Only used with a dedicated transfer queue
+        UploadBatchId id = 0;
+        std::vector<std::function<void()>> on_complete;
+    };
+
+    void BeginBatch();
+    uint32_t AcquireBatch();
+    void RetireBatch(uint32_t batch_index);
+
+    VkDevice device_ = VK_NULL_HANDLE;
+    const VkAllocationCallbacks* allocator_ = nullptr;
+    uint32_t transfer_queue_family_index_ = 0;
+    uint32_t graphics_queue_family_index_ = 0;
+    GpuTimeline* transfer_timeline_ = nullptr;
+    GpuTimeline* graphics_timeline_ = nullptr;
+    VkCommandPool command_pool_ = VK_NULL_HANDLE;
+    VkCommandPool graphics_command_pool_ = VK_NULL_HANDLE;  // Only used with a dedicated transfer queue
+    BarrierBatcher barriers_;
+    BarrierBatcher graphics_barriers_;  // Only used with a dedicated transfer queue
+
+    std::vector<Batch> batches_;
+    std::vector<uint32_t> free_batches_;
+    std::vector<uint32_t> in_flight_batches_;   // In submission order, so they also complete in this order
+    uint32_t recording_batch_ = UINT32_MAX;
+
+    UploadBatchId last_submitted_id_ = 0;
+};